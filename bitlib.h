@@ -225,6 +225,24 @@ inline unsigned int test_and_set_bit_field(void *ptr, bitoffset offset, unsigned
     return (former_val >> offset) & 1;
 }
 
+/* Clear a bit and return its former value.  Since we only need one atomic operation to do that,
+ * and none at all if the bit is already clear, this is cheaper than test_and_set_bit_field(ptr,
+ * offset, 0), and doesn't steal the cache line from other processors for nothing.
+ */
+
+inline unsigned int test_and_clear_bit_field(void *ptr, bitoffset offset)
+{
+    unsigned int * iptr;
+
+    iptr = (unsigned int *) ptr;
+    iptr += offset/(sizeof(unsigned int) * 8);
+    offset %= sizeof(unsigned int) * 8;
+
+    if (! ((*(volatile unsigned int *) iptr >> offset) & 1)) return 0;
+
+    return (__bitlib_sync_and(iptr, ~ (1 << offset)) >> offset) & 1;
+}
+
 /* spinlock on a bit and return 1 if we had to spin, 0 otherwise
  *
  * Be careful - this function can spin forever if you're not careful!
@@ -9,9 +9,11 @@
 #
 # Filename format for standard chess is kWkB-option.xml, where W is a
 # list of white pieces and B is a list of black pieces, both from the
-# set qrnbp, and the optional option are:
+# set qrnbp, and the optional options (which can be combined, i.e,
+# kqkq-whitewins-naive.xml) are:
 #     'basic' or 'whitewins' to obtain bitbases instead of DTM
 #     'naive', 'naive2', 'simple', or 'compact' to obtain alternate indices
+#     'msb' to put side-to-move in the most significant bit of the index
 #     'propNUM' to generate using proptables with the specified size in MB
 #     '4x4' to restrict to a 4x4 board
 #     '2x8' to restrict to a 2x8 board
@@ -143,11 +145,11 @@ sub write_cntl_file {
     my ($cntl_filename) = @_;
 
     my $indices = "-naive|-naive2|-simple|-compact";
-    my $opts = "-basic|-whitewins|-prop(\\d+)|-4x4|-2x8|$indices";
+    my $opts = "-basic|-whitewins|-prop(\\d+)|-4x4|-2x8|-msb|$indices";
 
     die "Invalid control filename $cntl_filename\n"
-	unless ($cntl_filename =~ m/^k([qrbnp]*)(k)([qrbnp.]*)($opts)*.xml$/
-		or $cntl_filename =~ m/^([kqrbnp]*)(v)([kqrbnp.]*)($opts)*.xml$/);
+	unless ($cntl_filename =~ m/^k([qrbnp]*)(k)([qrbnp.]*)((?:$opts)*).xml$/
+		or $cntl_filename =~ m/^([kqrbnp]*)(v)([kqrbnp.]*)((?:$opts)*).xml$/);
 
     my ($white_pieces, $black_pieces) = ($1, $3);
     $suicide = ($2 eq 'v');
@@ -201,7 +203,9 @@ sub write_cntl_file {
     printnl '   <basic/>' if ($option =~ /-basic/);
     printnl '   <flag type="white-wins"/>' if ($option =~ /-whitewins/);
 
-    if ($index ne "") {
+    if ($option =~ /-msb/) {
+	printnl '   <index type="' . ($index ne "" ? $index : "combinadic5") . '" side-to-move="msb"/>';
+    } elsif ($index ne "") {
 	printnl "   <index type=\"$index\"/>";
     }
 
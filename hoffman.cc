@@ -113,12 +113,17 @@
 #include <deque>
 #include <vector>
 #include <set>
+#include <unordered_set>
+#include <unordered_map>
+#include <list>
+#include <bitset>
 
 #include <thread>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <type_traits>
+#include <tuple>
 
 #include <chrono>
 
@@ -136,6 +141,7 @@
 
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/device/file_descriptor.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/filter/symmetric.hpp>
@@ -155,6 +161,7 @@ namespace io = boost::iostreams;
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <limits.h>		/* for INT_MIN */
 #include <unistd.h>		/* for write(), lseek(), gethostname() */
 #include <time.h>		/* for putting timestamps on the output tablebases */
 #include <fcntl.h>		/* for O_RDONLY */
@@ -167,6 +174,9 @@ namespace io = boost::iostreams;
 #include <sys/time.h>		/* for reporting resource utilization */
 #include <sys/resource.h>
 
+#include <sys/stat.h>		/* for fstat() */
+#include <sys/wait.h>		/* for waitpid() */
+
 #include <errno.h>		/* for errno and strerror() */
 
 #ifdef HAVE_LIBREADLINE
@@ -176,12 +186,18 @@ namespace io = boost::iostreams;
 
 #include "zlib.h"
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>		/* io_uring (optional) for temporary file I/O */
+#endif
+
 #include "bitlib.h"
 
 #ifdef USE_NALIMOV
 
 extern "C" {
     int EGTBProbe(int wtm, unsigned char board[64], int sqEnP, int *score);
+    int EGTBIndex(int wtm, unsigned char board[64], int sqEnP, int *tb, int *side, unsigned long long *index);
+    int EGTBProbeIndex(int tb, int side, unsigned long long index, int *score);
 
     int IInitializeTb(char *pszPath);
 
@@ -256,6 +272,53 @@ struct dereference<std::shared_ptr<T>> {
 template <class T>
 class synchronized : public T, public std::mutex { };
 
+/* C++11 has no parallel algorithms, so here's a parallel sort.  Sort num_threads pieces
+ * concurrently, then merge them together pairwise, each level of merges also running concurrently.
+ */
+
+template <typename Iterator, typename Compare>
+void parallel_sort(Iterator begin, Iterator end, Compare comp)
+{
+    size_t size = end - begin;
+    size_t pieces = std::min<size_t>(num_threads, size / 1024 + 1);
+    std::vector<Iterator> bounds;
+    std::vector<std::thread> threads;
+
+    if (pieces <= 1) {
+	std::sort(begin, end, comp);
+	return;
+    }
+
+    for (size_t i = 0; i <= pieces; i ++) {
+	bounds.push_back(begin + size * i / pieces);
+    }
+
+    for (size_t i = 0; i < pieces; i ++) {
+	threads.emplace_back([&bounds, i, comp] { std::sort(bounds[i], bounds[i+1], comp); });
+    }
+    for (auto & thread : threads) thread.join();
+
+    /* bounds[] has one more entry than there are sorted ranges */
+
+    while (bounds.size() > 2) {
+	std::vector<Iterator> merged_bounds;
+
+	threads.clear();
+
+	for (size_t i = 0; i + 2 < bounds.size(); i += 2) {
+	    threads.emplace_back([&bounds, i, comp] { std::inplace_merge(bounds[i], bounds[i+1], bounds[i+2], comp); });
+	}
+	for (auto & thread : threads) thread.join();
+
+	for (size_t i = 0; i < bounds.size(); i += 2) {
+	    merged_bounds.push_back(bounds[i]);
+	}
+	if (merged_bounds.back() != end) merged_bounds.push_back(end);
+
+	bounds.swap(merged_bounds);
+    }
+}
+
 /* Class 'bimap' is used for converting from strings in the XML to integer flags, but sometimes we
  * need to convert a flag back to a string.  The crazy "using" statement is a C++11-ism to inherit
  * the constructor.
@@ -649,6 +712,7 @@ struct translation_result;
 
 class tablebase_t;
 class local_position_t;
+class SparseFuturevectors;
 
 /* XXX initialize local_position meaningfully so we can drop a lot of these friends */
 
@@ -948,6 +1012,11 @@ bimap<Glib::ustring, Index, casefold_compare> index_types =
      {"combinadic3", Index::Combinadic3}, {"combinadic4", Index::Combinadic4},
      {"pawngen", Index::Combinadic4}, {"combinadic5", Index::Combinadic5}};
 
+enum class StmPlacement { LSB, MSB };
+
+bimap<Glib::ustring, StmPlacement, casefold_compare> stm_placements =
+    {{"lsb", StmPlacement::LSB}, {"msb", StmPlacement::MSB}};
+
 enum class FuturebaseType { Capture, Promotion, CapturePromotion, Normal, Pawngen };
 
 bimap<Glib::ustring, FuturebaseType, casefold_compare> futurebase_types =
@@ -993,12 +1062,14 @@ struct piece {
     int *permutations;
 
     /* For each square on the board and piece in the futurebase, record the first piece in the
-     * corresponding local semilegal group.  Unlike the previous variables, this one isn't
-     * initialized when the instance is created, but rather in compute_extra_and_missing_pieces()
-     * when a futurebase is being translated.
+     * corresponding local semilegal group, and a bitvector of all the local pieces with the same
+     * color and type.  Unlike the previous variables, these aren't initialized when the instance is
+     * created, but rather in compute_extra_and_missing_pieces() when a futurebase is being
+     * translated.
      */
 
     int matching_local_semilegal_group[64];
+    uint32_t matching_local_pieces;
 
     piece(PieceColor color, PieceType type, uint64_t legal_squares = ALL_ONES_BITVECTOR)
 	: color(color), piece_type(type), legal_squares(legal_squares) {}
@@ -1017,6 +1088,34 @@ unsigned long eval_to_uint64(xmlpp::Node *node, std::string xpath);
 class index_encoding;
 struct pawngen;
 
+std::atomic<uint64_t> next_cache_id(0);
+
+/* A file descriptor that's closed when its owner is destroyed.  Tablebases get moved around (into
+ * the futurebases vector, for one), so this moves the descriptor along with them, leaving nothing
+ * for the tablebase it was moved from to close.
+ */
+
+class owned_fd {
+    int fd = -1;
+
+ public:
+    owned_fd(void) { }
+    owned_fd(const owned_fd &) = delete;
+    owned_fd(owned_fd && other) : fd(other.fd) { other.fd = -1; }
+
+    owned_fd & operator=(int new_fd) {
+	if (fd >= 0) close(fd);
+	fd = new_fd;
+	return *this;
+    }
+
+    ~owned_fd() {
+	if (fd >= 0) close(fd);
+    }
+
+    operator int() const { return fd; }
+};
+
 class tablebase_t {
 public:
     /* I want an xmlpp::DomParser instance variable, to hold the tablebase's associated XML
@@ -1053,6 +1152,9 @@ public:
     struct format format;
 
     index_t fetch_entry(index_t index);
+    index_t read_chunk(index_t index, char * entries);
+    void decode_nalimov_chunk(index_t start);
+    void decode_syzygy_chunk(index_t start);
     int get_DTM(index_t index);
     int get_DTC(index_t index);
     bool get_flag(index_t index);
@@ -1078,6 +1180,38 @@ public:
     Glib::ustring filename;
     std::unique_ptr<io::filtering_istream> instream;
 
+    /* protects next_read_index and instream while reading chunks (see read_chunk()).  It's a
+     * pointer so that tablebases can still be moved, and it's per tablebase so that reading one
+     * futurebase doesn't hold up reading the others.
+     */
+    std::unique_ptr<std::mutex> read_lock{new std::mutex};
+
+    /* for futurebases in the seekable format (see write_tablebase_to_file()) */
+    int block_size = 0;
+    owned_fd block_fd;
+    std::vector<uint64_t> block_offsets;
+    void read_block_table(void);
+    void read_block(index_t block, char * entries);
+
+    /* identifies the tablebase's chunks in the block cache (see fetch_entry()) */
+    uint64_t cache_id = next_cache_id ++;
+
+    /* for futurebases being back propagated (see fetch_entry()) */
+    std::shared_ptr<class read_ahead_queue> read_ahead;
+    void start_read_ahead(void);
+    void stop_read_ahead(void);
+
+    /* for futurebases being back propagated (see compute_relevant_indices()) */
+    struct index_digit {
+	index_t place;
+	index_t radix;
+	std::vector<bool> allowed;
+    };
+    std::vector<index_digit> relevant_digits;
+    std::vector<bool> relevant_chunks;
+    bool index_is_relevant(index_t index) const;
+    index_t next_relevant_chunk(index_t index) const;
+
     FuturebaseType futurebase_type;
     index_t next_read_index;
     off_t offset;
@@ -1099,12 +1233,47 @@ public:
 
     bool encode_stm;
 
+    /* Side-to-move, if it's encoded, is either the least significant digit of the index or the
+     * most significant, which splits the tablebase into a white-to-move half followed by a
+     * black-to-move half.  stm_place is what side-to-move is worth in the index: 1 for LSB, half
+     * of num_indices for MSB, and 0 if side-to-move isn't encoded at all.
+     *
+     * add_stm() takes an index without side-to-move (what the index encoding computes, plus
+     * pawngen) and puts side-to-move in; remove_stm() takes it back out.  stm_stride() is what a
+     * unit of the former is worth in the latter.
+     */
+
+    StmPlacement stm_placement = StmPlacement::LSB;
+    index_t stm_place;
+
+    index_t stm_stride(void) const {
+	return (stm_place == 1) ? 2 : 1;
+    }
+
+    index_t add_stm(index_t index, PieceColor side_to_move) const {
+	return index * stm_stride() + ((side_to_move == PieceColor::White) ? 0 : stm_place);
+    }
+
+    index_t remove_stm(index_t index) const {
+	if (stm_place == 1) return index >> 1;
+	return ((stm_place != 0) && (index >= stm_place)) ? index - stm_place : index;
+    }
+
+    PieceColor index_stm(index_t index) const {
+	if (stm_place == 1) return (index & 1) ? PieceColor::Black : PieceColor::White;
+	return ((stm_place != 0) && (index >= stm_place)) ? PieceColor::Black : PieceColor::White;
+    }
+
     std::map<PieceColor, int> prune_enable;
     int stalemate_prune_type;		/* only RESTRICTION_NONE (0) or RESTRICTION_CONCEDE (2) allowed */
     PieceColor stalemate_prune_color;
 
-    char *futurevectors;
-    int futurevector_bits;
+    /* See SparseFuturevectors */
+
+    SparseFuturevectors *futurevectors;
+    int futurevector_bits;		/* the longer of the two */
+    int white_futurevector_bits;
+    int black_futurevector_bits;
 
     bool is_color_symmetric(void);
 
@@ -1797,18 +1966,16 @@ int black_pawns_required = 0;
 
 /* pawn_position - tracks a single placement of pawns on the board, without other pieces
  *
- * Will be used to form into two std::sets that track valid_pawn_positions and
- * invalid_pawn_positions, ordered by the default operators.  operator<, in particular, is somewhat
- * slow.  The valid_pawn_positions will be sorted into two std::vectors, pawn_positions_by_position
- * (ordered by pawn_position_fast_compare) and pawn_positions_by_index (ordered by the standard
- * operators).
+ * enumerate_pawn_positions() collects all of them into two std::unordered_sets, and then sorts
+ * the valid ones with the default operators.  operator<, in particular, is somewhat slow.  The valid
+ * positions end up in a std::vector, pawn_positions_by_index (ordered by the standard operators),
+ * and are hashed into pawn_positions_by_position, a pawn_position_index_table.
  */
 
 class pawn_position {
 
     friend bool operator< (const pawn_position & LHS, const pawn_position & RHS);
     friend bool operator== (const pawn_position & LHS, const pawn_position & RHS);
-    friend bool pawn_position_fast_compare (const pawn_position & LHS, const pawn_position & RHS);
 
     int total_white_pawns = 0;
     int total_black_pawns = 0;
@@ -2036,54 +2203,99 @@ bool operator!= (const pawn_position & LHS, const pawn_position & RHS)
     return !(LHS == RHS);
 }
 
-bool pawn_position_fast_compare (const pawn_position & LHS, const pawn_position & RHS)
-{
-    if (LHS.white_pawns != RHS.white_pawns) {
-	return LHS.white_pawns < RHS.white_pawns;
-    } else if (LHS.black_pawns != RHS.black_pawns) {
-	return LHS.black_pawns < RHS.black_pawns;
-    } else {
-	return LHS.en_passant_square < RHS.en_passant_square;
+/* Every encode of a pawngen position, including every back-move, has to map its pawns back to a
+ * pawngen index, so we build an open addressing hash table for it once the positions are known.
+ * Each slot holds the whole key along with the index, so a lookup usually costs just the one cache
+ * miss on its slot.  The table is kept no more than half full, and linear probing finds the key or
+ * an empty slot (index -1) soon after.
+ */
+
+class pawn_position_index_table {
+
+    struct slot {
+	uint64_t white_pawns;
+	uint64_t black_pawns;
+	int32_t en_passant_square;
+	int32_t index;
+    };
+
+    std::vector<slot> slots;
+    uint64_t mask = 0;
+
+    static uint64_t hash(uint64_t white_pawns, uint64_t black_pawns, int32_t en_passant_square) {
+	uint64_t hash = (white_pawns * 0x9E3779B97F4A7C15ULL)
+	    ^ (black_pawns * 0xBF58476D1CE4E5B9ULL)
+	    ^ (static_cast<uint64_t>(static_cast<uint32_t>(en_passant_square)) * 0x94D049BB133111EBULL);
+	hash ^= hash >> 31;
+	hash *= 0xD6E8FEB86659FD93ULL;
+	return hash ^ (hash >> 32);
     }
-}
 
-/* Recursively compute all possible pawn positions that can arise from a starting position.
- *
- * Pawns can always be captured by a piece.  They can always move forward and can always capture
- * each other.  They can only queen if required to, and can only capture a piece if allowed to.
- *
- * The two std::sets here are global variables, but are only used when a tablebase's indexing
- * function is being computed.  The resulting information is stored in tablebase_t's std::vector
- * pawn_positions.  These std::sets are then clear()ed, so they can be used again to compute another
- * tablebase's indexing function.
- */
+public:
+
+    void build(const std::vector<pawn_position> & positions) {
+	size_t size = 16;
+	while (size < 2 * positions.size()) size <<= 1;
+	mask = size - 1;
+	slots.assign(size, slot{0, 0, 0, -1});
 
-std::set<pawn_position> valid_pawn_positions;
-std::set<pawn_position> invalid_pawn_positions;
+	for (auto & pp : positions) {
+	    uint64_t i = hash(pp.white_pawns, pp.black_pawns, pp.en_passant_square) & mask;
+	    while (slots[i].index != -1) i = (i + 1) & mask;
+	    slots[i] = slot{pp.white_pawns, pp.black_pawns, pp.en_passant_square, pp.index};
+	}
+    }
+
+    /* Returns -1 if the position isn't in the table */
+
+    int find(const pawn_position & pp) const {
+	if (slots.empty()) return -1;
+	for (uint64_t i = hash(pp.white_pawns, pp.black_pawns, pp.en_passant_square) & mask; ; i = (i + 1) & mask) {
+	    const slot & s = slots[i];
+	    if (s.index == -1) return -1;
+	    if ((s.white_pawns == pp.white_pawns) && (s.black_pawns == pp.black_pawns)
+		&& (s.en_passant_square == pp.en_passant_square)) return s.index;
+	}
+    }
+};
 
 struct pawngen {
     uint64_t initial_white_pawns;
     uint64_t initial_black_pawns;
-    std::vector<pawn_position> pawn_positions_by_position;
     std::vector<pawn_position> pawn_positions_by_index;
+    pawn_position_index_table pawn_positions_by_position;
 
     off_t offset;  /* Offset in file for pre-computed tables */
     int start;     /* Starting pawngen index in this tablebase */
     int count;     /* Number of pawngen indices in this tablebase */
 };
 
-void process_pawn_position(class pawn_position position)
-{
-    std::pair<std::set<pawn_position>::iterator,bool> ret;
+/* Compute all possible pawn positions that can arise from a starting position.
+ *
+ * Pawns can always be captured by a piece.  They can always move forward and can always capture
+ * each other.  They can only queen if required to, and can only capture a piece if allowed to.
+ *
+ * expand_pawn_position() computes the positions one move away from a given position, and
+ * search_pawn_positions() recursively searches from there.  The positions already seen are kept
+ * in two std::unordered_sets, valid_positions and invalid_positions, hashed and compared only on
+ * their pawns and en passant square, so once we've seen a placement of pawns, we don't search it
+ * again, even if we've reached it with a different number of captures or promotions left.  That
+ * makes the result depend on the order of the search, so it's done depth first in the same order
+ * that earlier versions of this program used, to keep the pawngen indices of existing tablebases
+ * valid.  It's only the sort of the valid positions by operator< (which is slow) that gets done
+ * in parallel, by enumerate_pawn_positions().
+ */
 
-    if (position.valid()) {
-	ret = valid_pawn_positions.insert(position);
-    } else {
-	ret = invalid_pawn_positions.insert(position);
+struct pawn_position_hash {
+    size_t operator() (const pawn_position & pp) const {
+	uint64_t hash = (pp.white_pawns * 0x9E3779B97F4A7C15ULL) ^ (pp.black_pawns * 0xBF58476D1CE4E5B9ULL)
+	    ^ (static_cast<uint64_t>(static_cast<uint32_t>(pp.en_passant_square)) * 0x94D049BB133111EBULL);
+	return hash ^ (hash >> 32);
     }
+};
 
-    if (! ret.second) return;
-
+void expand_pawn_position(const pawn_position & position, std::vector<pawn_position> & successors)
+{
     for (int square=0; square < 64; square ++) {
 
 	/* White pawns */
@@ -2094,13 +2306,13 @@ void process_pawn_position(class pawn_position position)
 	    /* Remove pawn (captured by piece), and reuse position2 with pawn removed */
 	    position2.remove_white_pawn(square);
 	    position2.en_passant_square = ILLEGAL_POSITION;
-	    process_pawn_position(position2);
+	    successors.push_back(position2);
 
 	    /* Queen it if queens are required */
 	    if (square >= 48 && position2.white_queens_required) {
 		pawn_position position3 = position2;
 		position3.white_queens_required --;
-		process_pawn_position(position3);
+		successors.push_back(position3);
 	    }
 
 	    if (square < 48) {
@@ -2109,7 +2321,7 @@ void process_pawn_position(class pawn_position position)
 		    pawn_position position3 = position2;
 
 		    position3.add_white_pawn(square + 8);
-		    process_pawn_position(position3);
+		    successors.push_back(position3);
 		}
 
 		/* Left pawn capture */
@@ -2118,13 +2330,13 @@ void process_pawn_position(class pawn_position position)
 			pawn_position position3 = position2;
 			position3.remove_black_pawn(square + 8 - 1);
 			position3.add_white_pawn(square + 8 - 1);
-			process_pawn_position(position3);
+			successors.push_back(position3);
 		    } else if (position2.white_pawn_captures_black_piece_allowed
 			       && !position2.white_pawn_at(square + 8 - 1)) {
 			pawn_position position3 = position2;
 			position3.add_white_pawn(square + 8 - 1);
 			position3.white_pawn_captures_black_piece_allowed --;
-			process_pawn_position(position3);
+			successors.push_back(position3);
 		    }
 		}
 
@@ -2134,13 +2346,13 @@ void process_pawn_position(class pawn_position position)
 			pawn_position position3 = position2;
 			position3.remove_black_pawn(square + 8 + 1);
 			position3.add_white_pawn(square + 8 + 1);
-			process_pawn_position(position3);
+			successors.push_back(position3);
 		    } else if (position2.white_pawn_captures_black_piece_allowed
 			       && !position2.white_pawn_at(square + 8 + 1)) {
 			pawn_position position3 = position2;
 			position3.add_white_pawn(square + 8 + 1);
 			position3.white_pawn_captures_black_piece_allowed --;
-			process_pawn_position(position3);
+			successors.push_back(position3);
 		    }
 		}
 	    }
@@ -2152,7 +2364,7 @@ void process_pawn_position(class pawn_position position)
 			|| ((square != 15) && (position2.black_pawn_at(square + 16 + 1)))) {
 			position2.add_white_pawn(square + 16);
 			position2.en_passant_square = square + 8;
-			process_pawn_position(position2);
+			successors.push_back(position2);
 		    }
 		}
 	    }
@@ -2164,31 +2376,31 @@ void process_pawn_position(class pawn_position position)
 	    pawn_position position2 = position;
 	    position2.remove_black_pawn(square);
 	    position2.en_passant_square = ILLEGAL_POSITION;
-	    process_pawn_position(position2);
+	    successors.push_back(position2);
 
 	    if (square < 16 && position2.black_queens_required) {
 		pawn_position position3 = position2;
 		position3.black_queens_required --;
-		process_pawn_position(position3);
+		successors.push_back(position3);
 	    }
 	    if (square >= 16) {
 		if (! position2.pawn_at(square - 8)) {
 		    pawn_position position3 = position2;
 		    position3.add_black_pawn(square - 8);
-		    process_pawn_position(position3);
+		    successors.push_back(position3);
 		}
 		if ((square % 8) != 0) {
 		    if (position2.white_pawn_at(square - 8 - 1)) {
 			pawn_position position3 = position2;
 			position3.remove_white_pawn(square - 8 - 1);
 			position3.add_black_pawn(square - 8 - 1);
-			process_pawn_position(position3);
+			successors.push_back(position3);
 		    } else if (position2.black_pawn_captures_white_piece_allowed
 			       && !position2.black_pawn_at(square - 8 - 1)) {
 			pawn_position position3 = position2;
 			position3.add_black_pawn(square - 8 - 1);
 			position3.black_pawn_captures_white_piece_allowed --;
-			process_pawn_position(position3);
+			successors.push_back(position3);
 		    }
 		}
 		if ((square % 8) != 7) {
@@ -2196,13 +2408,13 @@ void process_pawn_position(class pawn_position position)
 			pawn_position position3 = position2;
 			position3.remove_white_pawn(square - 8 + 1);
 			position3.add_black_pawn(square - 8 + 1);
-			process_pawn_position(position3);
+			successors.push_back(position3);
 		    } else if (position2.black_pawn_captures_white_piece_allowed
 			       && !position2.black_pawn_at(square - 8 + 1)) {
 			pawn_position position3 = position2;
 			position3.add_black_pawn(square - 8 + 1);
 			position3.black_pawn_captures_white_piece_allowed --;
-			process_pawn_position(position3);
+			successors.push_back(position3);
 		    }
 		}
 	    }
@@ -2212,7 +2424,7 @@ void process_pawn_position(class pawn_position position)
 			|| ((square != 55) && (position2.white_pawn_at(square - 16 + 1)))) {
 			position2.add_black_pawn(square - 16);
 			position2.en_passant_square = square - 8;
-			process_pawn_position(position2);
+			successors.push_back(position2);
 		    }
 		}
 	    }
@@ -2220,6 +2432,41 @@ void process_pawn_position(class pawn_position position)
     }
 }
 
+typedef std::unordered_set<pawn_position, pawn_position_hash> pawn_position_set;
+
+void search_pawn_positions(const pawn_position & position,
+			   pawn_position_set & valid_positions, pawn_position_set & invalid_positions)
+{
+    std::vector<pawn_position> successors;
+
+    if (position.valid()) {
+	if (! valid_positions.insert(position).second) return;
+    } else {
+	if (! invalid_positions.insert(position).second) return;
+    }
+
+    expand_pawn_position(position, successors);
+
+    for (auto & successor : successors) {
+	search_pawn_positions(successor, valid_positions, invalid_positions);
+    }
+}
+
+std::vector<pawn_position> enumerate_pawn_positions(const pawn_position & initial_position)
+{
+    pawn_position_set valid_positions;
+    pawn_position_set invalid_positions;
+
+    search_pawn_positions(initial_position, valid_positions, invalid_positions);
+
+    std::vector<pawn_position> sorted_positions(valid_positions.begin(), valid_positions.end());
+
+    parallel_sort(sorted_positions.begin(), sorted_positions.end(),
+		  [] (const pawn_position & LHS, const pawn_position & RHS) { return LHS < RHS; });
+
+    return sorted_positions;
+}
+
 void tablebase_t::parse_pawngen_element(xmlpp::Node * xml)
 {
     xmlpp::Element * xml_element = dynamic_cast<xmlpp::Element *>(xml);
@@ -2278,7 +2525,7 @@ void tablebase_t::parse_pawngen_element(xmlpp::Node * xml)
 	initial_position.white_pawn_captures_black_piece_allowed = eval_to_number_or_zero(xml, "@white-captures-allowed");
 	initial_position.black_pawn_captures_white_piece_allowed = eval_to_number_or_zero(xml, "@black-captures-allowed");
 
-	process_pawn_position(initial_position);
+	std::vector<pawn_position> valid_pawn_positions = enumerate_pawn_positions(initial_position);
 
 	pawngen->pawn_positions_by_index.resize(valid_pawn_positions.size());
 
@@ -2287,15 +2534,11 @@ void tablebase_t::parse_pawngen_element(xmlpp::Node * xml)
 	int first_white_pawn = num_pieces;
 	int first_black_pawn = num_pieces + white_pawns_required;
 
-	for (auto it = valid_pawn_positions.begin(); it != valid_pawn_positions.end(); it ++) {
+	for (auto & pp : valid_pawn_positions) {
 
 	    int white_pawn = first_white_pawn;
 	    int black_pawn = first_black_pawn;
 
-	    /* std::set doesn't allow its objects to be modified once inserted */
-
-	    pawn_position pp = *it;
-
 	    for (int square = 0; square < 64; square ++) {
 		if (pp.white_pawn_at(square)) {
 		    pp.position[white_pawn] = square;
@@ -2317,7 +2560,6 @@ void tablebase_t::parse_pawngen_element(xmlpp::Node * xml)
 
 	    pp.index = index;
 	    pawngen->pawn_positions_by_index[index] = pp;
-	    // pawngen->pawn_positions_by_position[index] = pp;
 
 	    index ++;
 	}
@@ -2325,9 +2567,6 @@ void tablebase_t::parse_pawngen_element(xmlpp::Node * xml)
 	xml_element->set_attribute("legal-white-squares", boost::lexical_cast<std::string>(legal_white_squares));
 	xml_element->set_attribute("legal-black-squares", boost::lexical_cast<std::string>(legal_black_squares));
 
-	valid_pawn_positions.clear();
-	invalid_pawn_positions.clear();
-
     } else {
 
 	legal_white_squares = eval_to_uint64(xml, "@legal-white-squares");
@@ -2363,68 +2602,79 @@ void tablebase_t::finalize_pawngen_initialization(void)
 	pawngen->count = pawngen->pawn_positions_by_index.size() - pawngen->start;
     }
 
-    pawngen->pawn_positions_by_position.resize(pawngen->pawn_positions_by_index.size());
+    /* Hash the positions so we can find the index of a position */
 
-    /* Figure which pawn positions arise from moving each pawn one step backwards, and save the
-     * corresponding change in index in delta_pawngen_index.
-     */
+    pawngen->pawn_positions_by_position.build(pawngen->pawn_positions_by_index);
 
-    for (unsigned int index = 0; index < pawngen->pawn_positions_by_index.size(); index ++) {
-	for (int piece = 0; piece < num_pieces; piece ++) {
-	    pawngen->pawn_positions_by_index[index].prev_position[piece] = ILLEGAL_POSITION;
-	    pawngen->pawn_positions_by_index[index].delta_pawngen_index[piece] = 0;
-	    pawngen->pawn_positions_by_index[index].prev_position2[piece] = ILLEGAL_POSITION;
-	    pawngen->pawn_positions_by_index[index].delta_pawngen_index2[piece] = 0;
-	    if (pieces[piece].piece_type == PieceType::Pawn) {
-		pawn_position prev_pp = pawngen->pawn_positions_by_index[index];
-		uint8_t prev_position;
-		if (pieces[piece].color == PieceColor::White) {
-		    prev_position = prev_pp.position[piece] - 8;
-		    prev_pp.remove_white_pawn(prev_pp.position[piece]);
-		    prev_pp.add_white_pawn(prev_position);
-		} else {
-		    prev_position = prev_pp.position[piece] + 8;
-		    prev_pp.remove_black_pawn(prev_pp.position[piece]);
-		    prev_pp.add_black_pawn(prev_position);
-		}
-		auto it = std::find(pawngen->pawn_positions_by_index.begin(),
-				    pawngen->pawn_positions_by_index.end(),
-				    prev_pp);
-		if (it != pawngen->pawn_positions_by_index.end()) {
-		    pawngen->pawn_positions_by_index[index].prev_position[piece] = prev_position;
-		    pawngen->pawn_positions_by_index[index].delta_pawngen_index[piece]
-			= it->index - pawngen->pawn_positions_by_index[index].index;
-		}
+    auto find_index = [this] (const pawn_position & pp) -> int {
+	return pawngen->pawn_positions_by_position.find(pp);
+    };
 
-		if (((pieces[piece].color == PieceColor::White) && (ROW(prev_position) == 2))
-		    || ((pieces[piece].color == PieceColor::Black) && (ROW(prev_position) == 5))) {
+    /* Figure which pawn positions arise from moving each pawn one step backwards, and save the
+     * corresponding change in index in delta_pawngen_index.  Each thread takes every
+     * num_threads'th index.
+     */
 
+    auto find_previous_positions = [this, find_index] (unsigned int first_index) {
+
+	for (unsigned int index = first_index; index < pawngen->pawn_positions_by_index.size(); index += num_threads) {
+	    for (int piece = 0; piece < num_pieces; piece ++) {
+		pawngen->pawn_positions_by_index[index].prev_position[piece] = ILLEGAL_POSITION;
+		pawngen->pawn_positions_by_index[index].delta_pawngen_index[piece] = 0;
+		pawngen->pawn_positions_by_index[index].prev_position2[piece] = ILLEGAL_POSITION;
+		pawngen->pawn_positions_by_index[index].delta_pawngen_index2[piece] = 0;
+		if (pieces[piece].piece_type == PieceType::Pawn) {
+		    pawn_position prev_pp = pawngen->pawn_positions_by_index[index];
+		    uint8_t prev_position;
 		    if (pieces[piece].color == PieceColor::White) {
-			prev_pp.remove_white_pawn(prev_position);
-			prev_position -= 8;
+			prev_position = prev_pp.position[piece] - 8;
+			prev_pp.remove_white_pawn(prev_pp.position[piece]);
 			prev_pp.add_white_pawn(prev_position);
 		    } else {
-			prev_pp.remove_black_pawn(prev_position);
-			prev_position += 8;
+			prev_position = prev_pp.position[piece] + 8;
+			prev_pp.remove_black_pawn(prev_pp.position[piece]);
 			prev_pp.add_black_pawn(prev_position);
 		    }
+		    int prev_index = find_index(prev_pp);
+		    if (prev_index != -1) {
+			pawngen->pawn_positions_by_index[index].prev_position[piece] = prev_position;
+			pawngen->pawn_positions_by_index[index].delta_pawngen_index[piece]
+			    = prev_index - pawngen->pawn_positions_by_index[index].index;
+		    }
+
+		    if (((pieces[piece].color == PieceColor::White) && (ROW(prev_position) == 2))
+			|| ((pieces[piece].color == PieceColor::Black) && (ROW(prev_position) == 5))) {
+
+			if (pieces[piece].color == PieceColor::White) {
+			    prev_pp.remove_white_pawn(prev_position);
+			    prev_position -= 8;
+			    prev_pp.add_white_pawn(prev_position);
+			} else {
+			    prev_pp.remove_black_pawn(prev_position);
+			    prev_position += 8;
+			    prev_pp.add_black_pawn(prev_position);
+			}
 
-		    auto it = std::find(pawngen->pawn_positions_by_index.begin(),
-					pawngen->pawn_positions_by_index.end(),
-					prev_pp);
-		    if (it != pawngen->pawn_positions_by_index.end()) {
-			pawngen->pawn_positions_by_index[index].prev_position2[piece] = prev_position;
-			pawngen->pawn_positions_by_index[index].delta_pawngen_index2[piece]
-			    = it->index - pawngen->pawn_positions_by_index[index].index;
+			int prev_index = find_index(prev_pp);
+			if (prev_index != -1) {
+			    pawngen->pawn_positions_by_index[index].prev_position2[piece] = prev_position;
+			    pawngen->pawn_positions_by_index[index].delta_pawngen_index2[piece]
+				= prev_index - pawngen->pawn_positions_by_index[index].index;
+			}
 		    }
 		}
 	    }
 	}
-	pawngen->pawn_positions_by_position[index] = pawngen->pawn_positions_by_index[index];
-    }
+    };
+
+    std::thread t[num_threads];
 
-    std::sort(pawngen->pawn_positions_by_position.begin(), pawngen->pawn_positions_by_position.end(),
-	      pawn_position_fast_compare);
+    for (unsigned int thread = 0; thread < num_threads; thread ++) {
+	t[thread] = std::thread(find_previous_positions, thread);
+    }
+    for (unsigned int thread = 0; thread < num_threads; thread ++) {
+	t[thread].join();
+    }
 }
 
 
@@ -2719,6 +2969,19 @@ bool check_king_legality(int kingA, int kingB) {
     return false;
 }
 
+/* Most of the encodings store en passant capturable pawns on the first rank, since pawns can never
+ * actually be there.  This converts such an encoded square back to where the pawn really is.
+ */
+
+int unencode_en_passant_square(const tablebase_t *tb, const int piece, const int square)
+{
+    if ((tb->pieces[piece].piece_type == PieceType::Pawn) && (square < 8)) {
+	return rowcol2square((tb->pieces[piece].color == PieceColor::White) ? 3 : 4, square);
+    } else {
+	return square;
+    }
+}
+
 class index_encoding {
 public:
     virtual index_t position_to_index(const tablebase_t *tb, local_position_t *pos) = 0;
@@ -2731,6 +2994,19 @@ public:
 	pos->decoded = false;
     }
 
+    /* Used to skip over futurebase indices that can't back propagate (see compute_relevant_indices).
+     *
+     * If 'piece' is encoded as a single mixed radix digit of the index, set 'place' and 'radix' to
+     * describe that digit, mark in 'allowed' every value of the digit that could put the piece on
+     * one of 'squares', and return true.  Encodings that mix pieces together (encoding groups of
+     * identical pieces, for example) just return false, and we read the whole futurebase.
+     */
+
+    virtual bool piece_digit(const tablebase_t * tb, const int piece, const uint64_t squares,
+			     index_t *place, index_t *radix, std::vector<bool> &allowed) {
+	return false;
+    }
+
     /* 'size' is the number of indices generated the index encoding, which is different from the
      * number of indices in the tablebase, because 'size' excludes side-to-move and pawngen.
      */
@@ -2847,6 +3123,45 @@ public:
 	return true;
     }
 
+    bool piece_digit(const tablebase_t * tb, const int piece, const uint64_t squares,
+		     index_t *place, index_t *radix, std::vector<bool> &allowed)
+    {
+	int shift_count = 0;
+
+	if (tb->pawngen && (tb->pieces[piece].piece_type == PieceType::Pawn)) return false;
+
+	for (int piece2 = 0; piece2 < piece; piece2 ++) {
+	    if (tb->pawngen && (tb->pieces[piece2].piece_type == PieceType::Pawn)) continue;
+	    if ((piece2 == tb->white_king) && (tb->symmetry == 2)) shift_count += 5;
+	    else if ((piece2 == tb->white_king) && (tb->symmetry == 4)) shift_count += 4;
+	    else shift_count += 6;
+	}
+
+	*place = index_t(1) << shift_count;
+
+	if ((piece == tb->white_king) && (tb->symmetry == 2)) *radix = 32;
+	else if ((piece == tb->white_king) && (tb->symmetry == 4)) *radix = 16;
+	else *radix = 64;
+
+	allowed.assign(*radix, false);
+
+	for (int digit = 0; digit < int(*radix); digit ++) {
+	    int square;
+
+	    if ((piece == tb->white_king) && (tb->symmetry == 2)) {
+		square = rowcol2square(digit & 7, (digit >> 3) & 3);
+	    } else if ((piece == tb->white_king) && (tb->symmetry == 4)) {
+		square = rowcol2square(digit & 3, (digit >> 2) & 3);
+	    } else {
+		square = unencode_en_passant_square(tb, piece, digit);
+	    }
+
+	    if (squares & BITVECTOR(square)) allowed[digit] = true;
+	}
+
+	return true;
+    }
+
     naive_index(const tablebase_t *tb)
     {
 	int encoded_pieces = 0;
@@ -3175,6 +3490,27 @@ public:
 	return true;
     }
 
+    bool piece_digit(const tablebase_t * tb, const int piece, const uint64_t squares,
+		     index_t *place, index_t *radix, std::vector<bool> &allowed)
+    {
+	/* Piece 0 is the most significant digit */
+
+	*place = 1;
+	for (int piece2 = piece + 1; piece2 < tb->num_pieces; piece2 ++) {
+	    *place *= total_legal_positions[piece2];
+	}
+
+	*radix = total_legal_positions[piece];
+	allowed.assign(*radix, false);
+
+	for (int digit = 0; digit < total_legal_positions[piece]; digit ++) {
+	    int square = unencode_en_passant_square(tb, piece, piece_position[piece][digit]);
+	    if (squares & BITVECTOR(square)) allowed[digit] = true;
+	}
+
+	return true;
+    }
+
     simple_index(const tablebase_t *tb)
     {
 	size = 1;
@@ -3598,7 +3934,7 @@ public:
  *
  * 'combinadic5' differs from 'combinadic4' in that it positions the king table according to the
  * location of the white king in the piece list, as opposed to always putting the king table in the
- * least significant bits (after the side-to-move bit in the LSB).
+ * least significant bits (after the side-to-move bit, if it's in the LSB).
  */
 
 int choose(int n, int k) {
@@ -3624,6 +3960,11 @@ class combinadic_index : public index_encoding
     uint8_t black_king_position[64*64];
     index_t king_index[64][64];
     index_t king_multiplier;
+    index_t king_positions = 0;
+
+    /* The place value of pieces that aren't in an encoding group with anything else */
+
+    index_t piece_multiplier[MAX_PIECES];
 
     int total_legal_positions[MAX_PIECES] = {};
     int total_legal_piece_values[MAX_PIECES];
@@ -3925,6 +4266,57 @@ public:
 	return true;
     }
 
+    bool piece_digit(const tablebase_t * tb, const int piece, const uint64_t squares,
+		     index_t *place, index_t *radix, std::vector<bool> &allowed)
+    {
+	/* The kings are encoded together as a single digit */
+
+	if ((piece == tb->white_king) || (piece == tb->black_king)) {
+
+	    *place = king_multiplier;
+	    *radix = king_positions;
+	    allowed.assign(*radix, false);
+
+	    for (index_t digit = 0; digit < king_positions; digit ++) {
+		int square = (piece == tb->white_king) ? white_king_position[digit] : black_king_position[digit];
+		if (squares & BITVECTOR(square)) allowed[digit] = true;
+	    }
+
+	    return true;
+	}
+
+	if (tb->pawngen && (tb->pieces[piece].piece_type == PieceType::Pawn)) return false;
+
+	/* A combinadic encoding group packs all of its pieces into one number */
+
+	if ((prev_piece_in_encoding_group[piece] != -1) || (next_piece_in_encoding_group[piece] != -1)) {
+	    return false;
+	}
+
+	/* Overlapping pieces might have reduced the piece's value by up to one for each of them */
+
+	int max_decrement = 0;
+
+	for (int piece2 = last_overlapping_piece[piece]; piece2 != -1; piece2 = last_overlapping_piece[piece2]) {
+	    max_decrement ++;
+	}
+
+	*place = piece_multiplier[piece];
+	*radix = total_legal_piece_values[piece];
+	allowed.assign(*radix, false);
+
+	for (int value = 0; value < total_legal_positions[piece]; value ++) {
+	    int square = unencode_en_passant_square(tb, piece, piece_position[piece][value]);
+	    if (squares & BITVECTOR(square)) {
+		for (int digit = std::max(0, value - max_decrement); digit <= value; digit ++) {
+		    if (digit < int(*radix)) allowed[digit] = true;
+		}
+	    }
+	}
+
+	return true;
+    }
+
     /* XXX This argument isn't 'const' because it might modify semilegal ranges. */
 
     combinadic_index(tablebase_t *tb)
@@ -4059,6 +4451,7 @@ public:
 		}
 
 		king_multiplier = size;
+		king_positions = king_position;
 		size *= king_position;
 
 		continue;
@@ -4068,6 +4461,8 @@ public:
 
 	    if (tb->pawngen && (tb->pieces[piece].piece_type == PieceType::Pawn)) continue;
 
+	    piece_multiplier[piece] = size;
+
 	    if (prev_piece_in_encoding_group[piece] == -1) {
 		piece_in_set = 1;
 	    } else if (prev_piece_in_encoding_group[piece] == piece-1) {
@@ -4232,9 +4627,7 @@ index_t normalized_position_to_index(const tablebase_t *tb, local_position_t *po
 	}
 	pawns.en_passant_square = position->en_passant_square;
 
-	auto it = std::lower_bound(tb->pawngen->pawn_positions_by_position.begin(),
-				   tb->pawngen->pawn_positions_by_position.end(),
-				   pawns, pawn_position_fast_compare);
+	int pawngen_index = tb->pawngen->pawn_positions_by_position.find(pawns);
 
 	/* In the course of normal program operation, we should never generate invalid pawn
 	 * positions, but it can happen during testing with check_1000_positions().  So invalid pawn
@@ -4243,25 +4636,20 @@ index_t normalized_position_to_index(const tablebase_t *tb, local_position_t *po
 	 * XXX throw errors more aggressively here during actual program operation
 	 */
 
-	if (it == tb->pawngen->pawn_positions_by_position.end()) {
+	if (pawngen_index == -1) {
 	    return INVALID_INDEX;
-	} else if (*it != pawns) {
-	    return INVALID_INDEX;
-	} else if ((it->index < tb->pawngen->start) || (it->index >= tb->pawngen->start + tb->pawngen->count)) {
+	} else if ((pawngen_index < tb->pawngen->start) || (pawngen_index >= tb->pawngen->start + tb->pawngen->count)) {
 	    return INVALID_INDEX;
 	} else {
-	    index += tb->encoding->size * (it->index - tb->pawngen->start);
+	    index += tb->encoding->size * (pawngen_index - tb->pawngen->start);
 	}
 
     }
 
-    /* Now encode side-to-move (if needed).  Other code, like index_to_side_to_move(), assumes that
-     * side-to-move is the index's LSB.
-     */
+    /* Now encode side-to-move (if needed), in whichever end of the index it goes */
 
     if (tb->encode_stm) {
-	index <<= 1;
-	index += (position->side_to_move == PieceColor::White) ? 0 : 1;
+	index = tb->add_stm(index, position->side_to_move);
     }
 
     /* Multiplicity - number of non-identical positions that this index corresponds to.  We want to
@@ -4362,16 +4750,16 @@ bool index_to_local_position(const tablebase_t *tb, index_t index, int reflectio
     position->unreflected_valid = false;
     position->decoded = true;
 
-    /* Side-to-move, if present, is always LSB.  Branch prediction can probably get this right
-     * during initialization and futurebase back-prop, but this code is likely to trigger a pipeline
-     * stall during intratable passes, when the LSB changes seemingly at random, unless the position
-     * favors one player over another, in which case one value of side-to-move will dominate each
-     * pass.
+    /* Side-to-move, if present, is either the LSB or the MSB.  Branch prediction can probably get
+     * this right during initialization and futurebase back-prop, but in LSB mode this code is
+     * likely to trigger a pipeline stall during intratable passes, when the LSB changes seemingly
+     * at random, unless the position favors one player over another, in which case one value of
+     * side-to-move will dominate each pass.  In MSB mode, it only changes once.
      */
 
     if (tb->encode_stm) {
-	position->side_to_move = (index % 2 == 0) ? PieceColor::White : PieceColor::Black;
-	index >>= 1;
+	position->side_to_move = tb->index_stm(index);
+	index = tb->remove_stm(index);
     } else {
 	position->side_to_move = PieceColor::White;
     }
@@ -4621,11 +5009,7 @@ index_t num_indices(tablebase_t * tb)
 PieceColor index_to_side_to_move(tablebase_t *tb, index_t index)
 {
     if (tb->encode_stm) {
-	if (index & 1) {
-	    return PieceColor::Black;
-	} else {
-	    return PieceColor::White;
-	}
+	return tb->index_stm(index);
     } else {
 	return PieceColor::White;
     }
@@ -4734,8 +5118,14 @@ void local_position_t::flip_side_to_move(void)
 {
     side_to_move = ~ side_to_move;
 
+    /* LSB or MSB, this adds stm_place going to black-to-move and subtracts it going back */
+
     if (decoded && valid && tb->encode_stm) {
-	index ^= 1;
+	if (side_to_move == PieceColor::Black) {
+	    index += tb->stm_place;
+	} else {
+	    index -= tb->stm_place;
+	}
     } else {
 	decoded = false;
     }
@@ -4791,8 +5181,12 @@ void local_position_t::move_piece(int piece, int destination_square) {
 	if (pp.prev_position[piece] == destination_square) {
 	    pawngen_index += pp.delta_pawngen_index[piece];
 	    pawngen_base_index += pp.delta_pawngen_index[piece] * tb->encoding->size;
-	    index += pp.delta_pawngen_index[piece] * tb->encoding->size * (tb->encode_stm ? 2 : 1);
-	    if (index >= tb->num_indices) {
+	    index += pp.delta_pawngen_index[piece] * tb->encoding->size * tb->stm_stride();
+
+	    /* Check the pawngen index, not the index, since with side-to-move in the MSB, running
+	     * off the end of the white-to-move half lands us in the black-to-move half.
+	     */
+	    if ((pawngen_index < tb->pawngen->start) || (pawngen_index >= tb->pawngen->start + tb->pawngen->count)) {
 		decoded = false;
 	    }
 	} else {
@@ -5212,6 +5606,12 @@ void tablebase_t::parse_XML(std::istream *instream)
 	}
     }
 
+    /* Side-to-move goes in the index's LSB unless we're told otherwise */
+
+    if (index_node->get_attribute_value("side-to-move") != "") {
+	stm_placement = stm_placements.at(index_node->get_attribute_value("side-to-move"));
+    }
+
     /* Extract index symmetry (if it was specified) */
 
     symmetry = eval_to_number_or_zero(index_node, "@symmetry");
@@ -5778,6 +6178,14 @@ void tablebase_t::finalize_initialization(void)
 	num_indices *= pawngen->count;
     }
 
+    if (! encode_stm) {
+	stm_place = 0;
+    } else if (stm_placement == StmPlacement::MSB) {
+	stm_place = num_indices / 2;
+    } else {
+	stm_place = 1;
+    }
+
 }
 
 /* This function is used when parsing a control file for generation */
@@ -6481,9 +6889,9 @@ tablebase_t::tablebase_t(Glib::ustring filename) : filename(filename), offset(0)
 	 * A side effect of this is that if you specify both the .nbw and .nbb files in separate
 	 * futurebase elements, Hoffman complains that multiple futurebases handle the same moves.
 	 *
-	 * XXX add a <side-to-move> element to the DTD that either indicates that the tablebase only
-	 * contains one color to move, i.e, <side-to-move color="white"/>, or indicates where in the
-	 * index ordering the side-to-move flag goes (currently it's always LSB).
+	 * XXX add a <side-to-move> element to the DTD that indicates that the tablebase only
+	 * contains one color to move, i.e, <side-to-move color="white"/>.  (Where in the index the
+	 * side-to-move flag goes is the 'side-to-move' attribute on <index>.)
 	 */
 
 	boost::filesystem::path p{filename};
@@ -6752,6 +7160,12 @@ tablebase_t::tablebase_t(Glib::ustring filename) : filename(filename), offset(0)
     next_read_index = 0;
 
     finalize_initialization();
+
+    block_size = eval_to_number_or_zero(xml->get_root_node(), "/tablebase/@block-size");
+
+    if (block_size != 0) {
+	read_block_table();
+    }
 }
 
 /* compute_extra_and_missing_pieces()
@@ -6764,6 +7178,8 @@ tablebase_t::tablebase_t(Glib::ustring filename) : filename(filename), offset(0)
  * - for each piece/square pair in the futurebase, we compute the corresponding semilegal group in
  *   the local tablebase, and store a pointer to the first piece in it
  *
+ * - for each piece in the futurebase, a bitvector of the local pieces it could be
+ *
  * - if there is a single extra piece in the futurebase, store its piece number
  *
  * - if there are one or two missing pieces that don't appear in the futurebase, store the piece
@@ -6793,6 +7209,8 @@ void compute_extra_and_missing_pieces(tablebase_t *tb, tablebase_t &futurebase)
 	    futurebase.pieces[future_piece].matching_local_semilegal_group[square] = -1;
 	}
 
+	futurebase.pieces[future_piece].matching_local_pieces = 0;
+
 	for (piece = 0; piece < tb->num_pieces; piece ++) {
 	    if ((tb->pieces[piece].piece_type == futurebase.pieces[future_piece].piece_type)
 		&& ((!futurebase.invert_colors &&
@@ -6800,6 +7218,8 @@ void compute_extra_and_missing_pieces(tablebase_t *tb, tablebase_t &futurebase)
 		    || (futurebase.invert_colors &&
 			(tb->pieces[piece].color != futurebase.pieces[future_piece].color)))) {
 
+		futurebase.pieces[future_piece].matching_local_pieces |= (1 << piece);
+
 		/* Have we found a unassigned matching pair of localbase/futurebase pieces? */
 		if (!(local_piece_vector & (1 << piece))
 		    && !(future_piece_vector & (1 << future_piece))) {
@@ -7290,7 +7710,9 @@ void invert_colors_of_global_position(global_position_t *global)
  * returned as the missing piece(s).
  *
  * To speed this function, we precomputed missing and extra pieces along with
- * piece-and-square-to-piece and piece-to-piece mapping tables.
+ * piece-and-square-to-piece and piece-to-piece mapping tables (see
+ * compute_extra_and_missing_pieces()), so that all that's left to do for each position is table
+ * lookups and bit twiddling.
  *
  * In addition to back-progagation, this function is also used while probing a set of tablebases to
  * see which one of them matches a given position.
@@ -7346,7 +7768,13 @@ translation_result translate_foreign_position_to_local_position(tablebase_t *for
     local_position->side_to_move = foreign_position->side_to_move;
     if (invert_colors) local_position->flip_side_to_move();
 
-    /* First, see if we can slot foreign pieces into the local tablebase on semilegal squares. */
+    /* First, see if we can slot foreign pieces into the local tablebase on semilegal squares.
+     *
+     * Color inversion flips both the pieces and the side to move, so a local piece belongs to the
+     * side to move exactly when the foreign piece it came from does.
+     */
+
+    uint32_t unplaced_pieces = (1 << local_tb->num_pieces) - 1;
 
     for (foreign_piece = 0; foreign_piece < foreign_tb->num_pieces; foreign_piece ++) {
 
@@ -7357,8 +7785,9 @@ translation_result translate_foreign_position_to_local_position(tablebase_t *for
 	for (local_piece = foreign_tb->pieces[foreign_piece].matching_local_semilegal_group[sq];
 	     local_piece != -1; local_piece = local_tb->pieces[local_piece].next_piece_in_semilegal_group) {
 
-	    if (local_position->piece_position[local_piece] == ILLEGAL_POSITION) {
+	    if (unplaced_pieces & (1 << local_piece)) {
 		local_position->piece_position[local_piece] = sq;
+		unplaced_pieces &= ~(1 << local_piece);
 		break;
 	    }
 	}
@@ -7375,48 +7804,46 @@ translation_result translate_foreign_position_to_local_position(tablebase_t *for
 	    }
 	    result.extra_piece = foreign_piece;
 	    extra_sq = sq;
+	} else {
+	    local_position->board_vector |= BITVECTOR(sq);
+	    if (foreign_tb->pieces[foreign_piece].color == foreign_position->side_to_move)
+		local_position->PTM_vector |= BITVECTOR(sq);
 	}
 
     }
 
-    /* Make sure all the local pieces but one or two have been accounted for, see if the extra piece
-     * is actually a restricted piece, and set up our bitboard vectors.
+    /* Make sure all the local pieces but one or two have been accounted for, and see if the extra
+     * piece is actually a restricted piece.
      */
 
-    for (local_piece = 0; local_piece < local_tb->num_pieces; local_piece ++) {
-	if (local_position->piece_position[local_piece] != ILLEGAL_POSITION) {
+    while (unplaced_pieces) {
 
-	    local_position->board_vector |= BITVECTOR(local_position->piece_position[local_piece]);
-	    if (local_tb->pieces[local_piece].color == local_position->side_to_move)
-		local_position->PTM_vector |= BITVECTOR(local_position->piece_position[local_piece]);
+	local_piece = ffs(unplaced_pieces) - 1;
+	unplaced_pieces &= unplaced_pieces - 1;
 
-	} else {
+	if ((result.extra_piece != NONE)
+	    && (foreign_tb->pieces[result.extra_piece].matching_local_pieces & (1 << local_piece))) {
 
-	    if ((result.extra_piece != NONE)
-		&& (local_tb->pieces[local_piece].piece_type == foreign_tb->pieces[result.extra_piece].piece_type)
-		&& ((!invert_colors
-		     && (local_tb->pieces[local_piece].color == foreign_tb->pieces[result.extra_piece].color))
-		    || (invert_colors
-			&& (local_tb->pieces[local_piece].color != foreign_tb->pieces[result.extra_piece].color)))) {
+	    local_position->piece_position[local_piece] = extra_sq;
+	    local_position->board_vector |= BITVECTOR(extra_sq);
+	    if (foreign_tb->pieces[result.extra_piece].color == foreign_position->side_to_move)
+		local_position->PTM_vector |= BITVECTOR(extra_sq);
 
-		local_position->piece_position[local_piece] = extra_sq;
-		result.restricted_piece = local_piece;
-		result.extra_piece = NONE;
+	    result.restricted_piece = local_piece;
+	    result.extra_piece = NONE;
 
-	    } else if (result.missing_piece1 == NONE) {
+	} else if (result.missing_piece1 == NONE) {
+	    result.missing_piece1 = local_piece;
+	} else if (result.missing_piece2 == NONE) {
+	    if (local_tb->pieces[local_piece].piece_type == PieceType::Pawn) {
+		result.missing_piece2 = result.missing_piece1;
 		result.missing_piece1 = local_piece;
-	    } else if (result.missing_piece2 == NONE) {
-		if (local_tb->pieces[local_piece].piece_type == PieceType::Pawn) {
-		    result.missing_piece2 = result.missing_piece1;
-		    result.missing_piece1 = local_piece;
-		} else {
-		    result.missing_piece2 = local_piece;
-		}
 	    } else {
-		/* More than two missing pieces in translation */
-		return invalid_translation;
+		result.missing_piece2 = local_piece;
 	    }
-
+	} else {
+	    /* More than two missing pieces in translation */
+	    return invalid_translation;
 	}
     }
 
@@ -7962,33 +8389,308 @@ static_assert((futurebase_stride & (futurebase_stride - 1)) == 0,
 static_assert(futurebase_stride >= 8,
 	      "futurebase_stride must be at least eight");
 
-thread_local tablebase_t * cached_tb = nullptr;
-thread_local char * cached_entries = nullptr;
-thread_local index_t cached_index;
-
-index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
-{
-    /* Nalimov or Syzygy tablebase?  Just return the index for the next block, in a thread-safe manner.
-     *
-     * XXX move this counting code to back_propagate_futurebase_thread(), and just implement
-     * a caching scheme (maybe LRU like Nalimov) here.
-     *
-     * XXX eventually read the Nalimov format directly
-     */
+/* Read-ahead for back propagation
+ *
+ * Back propagation reads each futurebase from beginning to end, a chunk of futurebase_stride
+ * entries at a time, but only one thread at a time can be decompressing a gzip stream, so our
+ * backprop threads would spend a lot of their time waiting on each other in read_chunk().  Instead,
+ * while a futurebase is being back propagated, decompressor threads read ahead into a bounded queue
+ * of decoded chunks, and fetch_entry() just pops the next one off the queue, handing back its old
+ * buffer for reuse.  A gzip stream has to be decompressed in order, so it only gets one
+ * decompressor; a seekable tablebase's blocks can be decompressed in any order, so it gets several.
+ * The chunks come out in whatever order they were finished, which back propagation doesn't care
+ * about.
+ */
 
-    if ((format.bits == -1) || (format.bits == -2)) {
-	static std::mutex lock;
-	std::lock_guard<std::mutex> _(lock);
+const unsigned int read_ahead_chunks_per_thread = 2;
 
-	index_t index = next_read_index;
+class read_ahead_queue {
 
-	next_read_index += futurebase_stride;
+    tablebase_t * tb;
+    size_t chunk_size;
+    size_t capacity;
 
-	return index;
+    std::mutex lock;
+    std::condition_variable chunk_ready;
+    std::condition_variable space_ready;
+    std::deque<std::pair<index_t, char *>> chunks;
+    std::vector<char *> free_buffers;
+    unsigned int running_decompressors;
+    bool stopping = false;
+    std::vector<std::thread> decompressors;
+
+    void decompressor_thread(void) {
+
+	while (1) {
+	    char * buffer;
+
+	    {
+		std::lock_guard<std::mutex> _(lock);
+		if (free_buffers.empty()) {
+		    buffer = new char[chunk_size];
+		} else {
+		    buffer = free_buffers.back();
+		    free_buffers.pop_back();
+		}
+	    }
+
+	    index_t index = tb->read_chunk(INVALID_INDEX, buffer);
+
+	    std::unique_lock<std::mutex> l(lock);
+
+	    space_ready.wait(l, [this] { return stopping || (chunks.size() < capacity); });
+
+	    if (stopping || (index >= tb->num_indices)) {
+		free_buffers.push_back(buffer);
+		break;
+	    }
+
+	    chunks.emplace_back(index, buffer);
+	    chunk_ready.notify_one();
+	}
+
+	/* Still holding the lock here */
+
+	running_decompressors --;
+	chunk_ready.notify_all();
+    }
+
+public:
+
+    static unsigned int decompressors_needed(const tablebase_t * tb) {
+	return (tb->block_size != 0) ? std::max(1U, num_threads / 2) : 1;
+    }
+
+    read_ahead_queue(tablebase_t * tb) : tb(tb) {
+	chunk_size = tb->format.bits * futurebase_stride / 8;
+	capacity = read_ahead_chunks_per_thread * num_threads;
+	running_decompressors = decompressors_needed(tb);
+
+	for (unsigned int i = 0; i < running_decompressors; i ++) {
+	    decompressors.emplace_back(&read_ahead_queue::decompressor_thread, this);
+	}
+    }
+
+    ~read_ahead_queue() {
+	{
+	    std::lock_guard<std::mutex> _(lock);
+	    stopping = true;
+	}
+	space_ready.notify_all();
+
+	for (auto & thread : decompressors) thread.join();
+
+	for (auto & chunk : chunks) delete [] chunk.second;
+	for (auto buffer : free_buffers) delete [] buffer;
+    }
+
+    /* Swap 'buffer' for the next decoded chunk and return its starting index, or num_indices once
+     * the whole tablebase has been read.
+     */
+
+    index_t pop(char * & buffer) {
+	std::unique_lock<std::mutex> l(lock);
+
+	chunk_ready.wait(l, [this] { return ! chunks.empty() || (running_decompressors == 0); });
+
+	if (chunks.empty()) return tb->num_indices;
+
+	index_t index = chunks.front().first;
+
+	free_buffers.push_back(buffer);
+	buffer = chunks.front().second;
+	chunks.pop_front();
+
+	space_ready.notify_one();
+
+	return index;
+    }
+};
+
+/* Block cache
+ *
+ * Probing, or anything else that reads a tablebase at random rather than from beginning to end,
+ * used to get a single chunk per thread, which got thrown away as soon as the thread looked at a
+ * different tablebase.  Now those reads go through a process-wide cache of decoded chunks, keyed
+ * by tablebase and chunk number, that all the threads share.  It's split into shards, each with
+ * its own lock and least recently used list, so the threads aren't all fighting over one lock.
+ * Chunks are handed out as shared_ptrs, so evicting a chunk that some thread is still reading is
+ * harmless.
+ *
+ * Sequential reads during back propagation don't use it, since we'll never look at those chunks
+ * again.
+ *
+ * The memory budget is set with --block-cache; zero disables the cache.
+ */
+
+size_t block_cache_MBs = 256;
+
+class block_cache_t {
+
+public:
+
+    typedef std::shared_ptr<std::vector<char>> block;
+
+private:
+
+    typedef std::pair<uint64_t, index_t> key;
+
+    struct key_hash {
+	size_t operator()(const key & k) const {
+	    return std::hash<uint64_t>()((k.first * 0x9e3779b97f4a7c15ULL) ^ k.second);
+	}
+    };
+
+    struct shard {
+	std::mutex lock;
+	std::list<std::pair<key, block>> lru;		/* most recently used at the front */
+	std::unordered_map<key, std::list<std::pair<key, block>>::iterator, key_hash> map;
+	size_t bytes = 0;
+    };
+
+    static const unsigned int num_shards = 16;
+
+    shard shards[num_shards];
+
+    shard & shard_for(const key & k) {
+	return shards[key_hash()(k) % num_shards];
+    }
+
+public:
+
+    block lookup(uint64_t cache_id, index_t chunk) {
+	key k(cache_id, chunk);
+	shard & s = shard_for(k);
+	std::lock_guard<std::mutex> _(s.lock);
+
+	auto it = s.map.find(k);
+	if (it == s.map.end()) return nullptr;
+
+	s.lru.splice(s.lru.begin(), s.lru, it->second);
+	return it->second->second;
+    }
+
+    /* If another thread got the same chunk in first, we return its copy instead. */
+
+    block insert(uint64_t cache_id, index_t chunk, block b) {
+	key k(cache_id, chunk);
+	shard & s = shard_for(k);
+	size_t budget = (block_cache_MBs << 20) / num_shards;
+
+	if (budget == 0) return b;
+
+	std::lock_guard<std::mutex> _(s.lock);
+
+	auto it = s.map.find(k);
+	if (it != s.map.end()) {
+	    s.lru.splice(s.lru.begin(), s.lru, it->second);
+	    return it->second->second;
+	}
+
+	s.lru.emplace_front(k, b);
+	s.map[k] = s.lru.begin();
+	s.bytes += b->size();
+
+	while ((s.bytes > budget) && (s.lru.size() > 1)) {
+	    s.bytes -= s.lru.back().second->size();
+	    s.map.erase(s.lru.back().first);
+	    s.lru.pop_back();
+	}
+
+	return b;
+    }
+};
+
+block_cache_t block_cache;
+
+/* Each thread has its own buffer for the chunk it's back propagating (cached_entries), and holds
+ * onto the last block it got from the block cache (cached_block).  current_entries points to
+ * whichever one get_DTM() and friends should read from.
+ */
+
+thread_local tablebase_t * cached_tb = nullptr;
+thread_local char * cached_entries = nullptr;
+thread_local index_t cached_index;
+
+thread_local block_cache_t::block cached_block;
+thread_local uint64_t cached_block_id;
+thread_local index_t cached_block_index;
+
+thread_local char * current_entries = nullptr;
+
+index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
+{
+    /* Nalimov or Syzygy tablebase?  Return the index for the next block, in a thread-safe manner,
+     * and probe the whole block in one go (see decode_nalimov_chunk() and decode_syzygy_chunk()).
+     *
+     * XXX move this counting code to back_propagate_futurebase_thread(), and just implement
+     * a caching scheme (maybe LRU like Nalimov) here.
+     */
+
+    if ((format.bits == -1) || (format.bits == -2)) {
+
+	{
+	    std::lock_guard<std::mutex> _(*read_lock);
+
+	    index = next_relevant_chunk(next_read_index);
+
+	    next_read_index = index + futurebase_stride;
+	}
+
+	if ((format.bits == -1) && (index < num_indices)) {
+	    decode_nalimov_chunk(index);
+	}
+
+	if ((format.bits == -2) && (index < num_indices)) {
+	    decode_syzygy_chunk(index);
+	}
+
+	return index;
+    }
+
+    if (instream == nullptr) {
+	fatal("fetch_entry() called on a non-preloaded tablebase\n");
+	terminate();
+    }
+
+    /* Round down to stride boundary */
+
+    if (index != INVALID_INDEX) index &= ~(futurebase_stride - 1);
+
+    /* Are we still on the chunk we're back propagating? */
+
+    if ((cached_tb == this) && (index == cached_index)) {
+	current_entries = cached_entries;
+	return cached_index;
+    }
+
+    /* Random access reads go through the block cache.  Either we've still got the block from last
+     * time, somebody's already read it, or we read it ourselves and offer it to everyone else.
+     */
+
+    if (index != INVALID_INDEX) {
+
+	if (! cached_block || (cached_block_id != cache_id) || (cached_block_index != index)) {
+
+	    cached_block = block_cache.lookup(cache_id, index / futurebase_stride);
+
+	    if (! cached_block) {
+		std::shared_ptr<std::vector<char>> block(new std::vector<char>(format.bits * futurebase_stride / 8));
+		read_chunk(index, block->data());
+		cached_block = block_cache.insert(cache_id, index / futurebase_stride, block);
+	    }
+
+	    cached_block_id = cache_id;
+	    cached_block_index = index;
+	}
+
+	current_entries = cached_block->data();
+
+	return index;
     }
 
-    /* If we're switching tablebases, discard old cache.  No locking required since we're working on
-     * thread_local variables.
+    /* Sequential reads during back propagation.  If we're switching tablebases, discard the old
+     * buffer.  No locking required since we're working on thread_local variables.
      */
 
     if (cached_tb && (cached_tb != this)) {
@@ -7999,40 +8701,61 @@ index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
 
     if (! cached_tb) {
 
-	/* If cache is non existant, build it */
-
-	if (instream == nullptr) {
-	    fatal("fetch_entry() called on a non-preloaded tablebase\n");
-	    terminate();
-	}
-
 	cached_tb = this;
 
 	/* The calculation here is that format.bits bytes is enough space for 8 entries. */
 
 	cached_entries = new char[format.bits * futurebase_stride / 8];
+    }
 
-    } else if ((index & ~(futurebase_stride - 1)) == cached_index) {
+    /* During back propagation, the read-ahead threads have already decompressed the next chunk */
 
-	/* We've got the requested index in the cache */
+    if (read_ahead) {
+	index = read_ahead->pop(cached_entries);
+    } else {
+	index = read_chunk(index, cached_entries);
+    }
 
-	return cached_index;
+    cached_index = index;
+    current_entries = cached_entries;
 
-    }
+    return index;
+}
 
-    /* Round down to stride boundary */
+/* Read the futurebase_stride entries starting at 'index' (or at the next sequential chunk, if
+ * 'index' is INVALID_INDEX) into 'entries', and return the starting index.
+ */
 
-    if (index != INVALID_INDEX) index &= ~(futurebase_stride - 1);
+index_t tablebase_t::read_chunk(index_t index, char * entries)
+{
+    /* Seekable tablebases don't need the shared stream at all, so the threads can decompress their
+     * blocks concurrently.  Only picking the next sequential block needs a lock.
+     */
+
+    if (block_size != 0) {
+
+	if (index == INVALID_INDEX) {
+	    std::lock_guard<std::mutex> _(*read_lock);
+
+	    index = next_relevant_chunk(next_read_index);
+	    if (index >= num_indices) return index;
+	    next_read_index = index + futurebase_stride;
+	}
+
+	read_block(index / futurebase_stride, entries);
+
+	return index;
+    }
 
     /* Mutex lock to protect the remainder of this function.  Only one thread should be accessing
-     * tablebase variable next_read_index or calling zlib.
+     * tablebase variable next_read_index or calling zlib on this tablebase's stream.
      */
 
-    static std::mutex cache_lock;
-    std::lock_guard<std::mutex> _(cache_lock);
+    std::lock_guard<std::mutex> _(*read_lock);
 
     if (index == INVALID_INDEX) {
-	index = next_read_index;
+	index = next_relevant_chunk(next_read_index);
+	if (index >= num_indices) return index;
     }
 
     if (index != next_read_index) {
@@ -8041,19 +8764,19 @@ index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
     }
 
     if (next_read_index + futurebase_stride <= num_indices) {
-	instream->read(cached_entries, format.bits * futurebase_stride / 8);
+	instream->read(entries, format.bits * futurebase_stride / 8);
 	next_read_index += futurebase_stride;
     } else {
 	/* short read at end of file */
 	int bytes_to_read = format.bits * (num_indices - next_read_index) / 8;
 	if ((format.bits * (num_indices - next_read_index)) % 8 != 0) bytes_to_read ++;
-	instream->read(cached_entries, bytes_to_read);
+	instream->read(entries, bytes_to_read);
 	next_read_index = num_indices;
     }
 
     // XXX put this error handling back in
 #if 0
-    if (zlib_read(file, cached_entries, format.bits * futurebase_stride / 8) != format.bits * futurebase_stride / 8) {
+    if (zlib_read(file, entries, format.bits * futurebase_stride / 8) != format.bits * futurebase_stride / 8) {
 	/* Might get a short read at the end of a tablebase, otherwise complain */
 
 	if (next_read_index + futurebase_stride <= num_indices) {
@@ -8062,249 +8785,533 @@ index_t tablebase_t::fetch_entry(index_t index = INVALID_INDEX)
     }
 #endif
 
-
-    cached_index = index;
-
     return index;
 }
 
-/* To retrieve fields in the tablebase, we call fetch_entry() to both get the index into
- * cached_entries and return the starting index, which is subtracted to get an index offset into
- * cached_entries.
- */
-
-bool global_PNTM_in_check(global_position_t *position);
+/* Could this index possibly back propagate into the current tablebase? */
 
-int tablebase_t::get_DTM(index_t index)
+bool tablebase_t::index_is_relevant(index_t index) const
 {
-    if (format.bits == -1) {
-	/* Nalimov's code is thread-safe for queries, if compiled with -DSMP */
-	/* throw std::runtime_error("NYI: Nalimov format"); */
-
-	global_position_t global;
-	int score;
+    if (relevant_digits.empty()) return true;
 
-	if (index_to_global_position(this, index, &global)) {
-	    if (global_PNTM_in_check(&global)) {
+    for (auto & digit : relevant_digits) {
+	if (digit.allowed[(index / digit.place) % digit.radix]) return true;
+    }
 
-		/* I've learned the hard way not to probe a Nalimov tablebase for an illegal position... */
-		return 1;
+    return false;
+}
 
-	    } else {
+/* Starting at the chunk boundary 'index', find the first chunk that has anything in it worth back
+ * propagating, or num_indices if there isn't one.
+ */
 
-		/* Nor does Nalimov like it if the en passant pawn can't actually be captured by
-		 * another pawn.
-		 */
+index_t tablebase_t::next_relevant_chunk(index_t index) const
+{
+    if (relevant_chunks.empty()) return index;
 
-		if ((global.en_passant_square != ILLEGAL_POSITION)
-		    && ((global.board[global.en_passant_square - 9] != 'P')
-			|| (global.en_passant_square == 40)
-			|| (global.side_to_move == PieceColor::Black))
-		    && ((global.board[global.en_passant_square - 7] != 'P')
-			|| (global.en_passant_square == 47)
-			|| (global.side_to_move == PieceColor::Black))
-		    && ((global.board[global.en_passant_square + 7] != 'p')
-			|| (global.en_passant_square == 16)
-			|| (global.side_to_move == PieceColor::White))
-		    && ((global.board[global.en_passant_square + 9] != 'p')
-			|| (global.en_passant_square == 23)
-			|| (global.side_to_move == PieceColor::White))) {
-
-		    global.en_passant_square = ILLEGAL_POSITION;
-		}
-
-		if (EGTBProbe(global.side_to_move == PieceColor::White, global.board,
-			      global.en_passant_square == ILLEGAL_POSITION ? -1 : global.en_passant_square, &score) == 1) {
-		    if (score > 0) {
-			return ((65536-4)/2)-score+2;
-		    } else if (score < 0) {
-			return -(((65536-4)/2)+score)-1;
-		    } else {
-			return 0;
-		    }
-		} else {
-		    /* Nalimov says illegal */
-		    throw std::runtime_error("Nalimov says illegal");
-		}
-	    }
-	}
+    while ((index < num_indices) && ! relevant_chunks[index / futurebase_stride]) {
+	index += futurebase_stride;
     }
 
-    index -= fetch_entry(index);
-
-    /* Normally, we encode signed DTM fields, but single bit DTM fields are an exception, as we
-     * always wish to encode 1 (PNTM in check) since these positions should not be backproped.  So
-     * single bit fields encode unsigned as 0 and 1, instead of 0 and -1.
-     */
-
-    if (format.dtm_bits == 1) {
-	return get_unsigned_int_field(cached_entries, format.dtm_offset + index * format.bits, format.dtm_bits);
-    } else {
-	return get_int_field(cached_entries, format.dtm_offset + index * format.bits, format.dtm_bits);
-    }
+    return index;
 }
 
-int tablebase_t::get_DTC(index_t index)
+void tablebase_t::start_read_ahead(void)
 {
-    /* XXX add some code here to probe Syzygy rtbz tablebases */
-
-    index -= fetch_entry(index);
-
-    /* Normally, we encode signed DTC fields, but single bit DTC fields are an exception, as we
-     * always wish to encode 1 (PNTM in check) since these positions should not be backproped.  So
-     * single bit fields encode unsigned as 0 and 1, instead of 0 and -1.
-     */
+    /* Nalimov and Syzygy tablebases aren't read through fetch_entry() */
 
-    if (format.dtc_bits == 1) {
-	return get_unsigned_int_field(cached_entries, format.dtc_offset + index * format.bits, format.dtc_bits);
-    } else {
-	return get_int_field(cached_entries, format.dtc_offset + index * format.bits, format.dtc_bits);
+    if (format.bits > 0) {
+	read_ahead.reset(new read_ahead_queue(this));
     }
 }
 
-bool tablebase_t::get_flag(index_t index)
+void tablebase_t::stop_read_ahead(void)
 {
-    index -= fetch_entry(index);
-    return get_bit_field(cached_entries, format.flag_offset + index * format.bits);
+    read_ahead.reset();
 }
 
-bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position);
+/* A seekable tablebase starts with a gzip member holding the XML header and the pawngen data, and
+ * the block table follows it, so we have to inflate that member to find out where it ends.
+ */
 
-Basic tablebase_t::get_basic(index_t index)
+off_t gzip_member_length(int fd)
 {
-    if (format.bits == -2) {
-
-	static std::mutex initialization_guard;
-
-	/* Initialize the Syzygy library, if needed.  We wait until this
-	 * point in the code to ensure that all of the filenames have been
-	 * parsed into the syzygy_search_path.
-	 *
-	 * XXX could move this code elsewhere and avoid the need for the mutex.
-	 */
-
-	{
-	    std::lock_guard<std::mutex> _(initialization_guard);
+    z_stream stream;
+    Bytef input[default_device_buffer_size];
+    Bytef output[default_device_buffer_size];
+    off_t offset = 0;
 
-	    if (! syzygy_library_initialized) {
-#ifndef _WIN32
-		std::string syzygy_path = boost::algorithm::join(syzygy_search_path, ":");
-#else
-		std::string syzygy_path = boost::algorithm::join(syzygy_search_path, ";");
-#endif
+    memset(&stream, 0, sizeof(stream));
 
-		tb_init(syzygy_path.c_str());
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+	throw std::runtime_error("Can't initialize zlib");
+    }
 
-		syzygy_library_initialized = true;
+    while (1) {
+	if (stream.avail_in == 0) {
+	    ssize_t len = pread(fd, input, sizeof(input), offset);
+	    if (len <= 0) {
+		inflateEnd(&stream);
+		throw std::runtime_error("Truncated tablebase header");
 	    }
+	    stream.next_in = input;
+	    stream.avail_in = len;
+	    offset += len;
 	}
 
-	/* Syzygy query code is thread-safe */
+	stream.next_out = output;
+	stream.avail_out = sizeof(output);
 
-	local_position_t pos(this);
+	int result = inflate(&stream, Z_NO_FLUSH);
 
-	if (! index_to_local_position(this, index, 0, &pos)) {
-	    throw std::runtime_error("index_to_local_position failed in Syzygy base lookup");
+	if (result == Z_STREAM_END) {
+	    offset -= stream.avail_in;
+	    inflateEnd(&stream);
+	    return offset;
+	} else if ((result != Z_OK) && (result != Z_BUF_ERROR)) {
+	    inflateEnd(&stream);
+	    throw std::runtime_error("Corrupt tablebase header");
 	}
+    }
+}
 
-	if (PNTM_in_check(this, &pos)) {
+/* We read seekable tablebases with pread() on a file descriptor of our own, so any number of
+ * threads can read blocks at once.  The block table is little-endian (see
+ * write_tablebase_to_file()).
+ */
 
-	    /* I've learned the hard way not to probe a Nalimov tablebase for an illegal
-	     * position.  I'm not sure about Syzygy tablebases, but treat them the same way.
-	     */
+void tablebase_t::read_block_table(void)
+{
+    if (block_size != futurebase_stride) {
+	throw std::runtime_error("Unsupported block size " + boost::lexical_cast<std::string>(block_size));
+    }
 
-	    return Basic::Illegal;
-	}
+    block_fd = open(filename.c_str(), O_RDONLY);
 
-	uint64_t white = 0;
-	uint64_t black = 0;
+    if (block_fd == -1) {
+	throw std::runtime_error(std::string("Can't open file: ") + strerror(errno));
+    }
 
-	uint64_t kings = 0;
-	uint64_t queens = 0;
-	uint64_t rooks = 0;
-	uint64_t bishops = 0;
-	uint64_t knights = 0;
-	uint64_t pawns = 0;
+    off_t table_offset = gzip_member_length(block_fd);
 
-	for (int piece = 0; piece < num_pieces; piece ++) {
+    block_offsets.resize((num_indices + block_size - 1) / block_size + 1);
 
-	    switch (pieces[piece].piece_type) {
-	    case PieceType::King:
-		kings |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Queen:
-		queens |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Rook:
-		rooks |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Bishop:
-		bishops |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Knight:
-		knights |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    case PieceType::Pawn:
-		pawns |= BITVECTOR(pos.piece_position[piece]);
-		break;
-	    }
+    std::vector<unsigned char> table(block_offsets.size() * 8);
 
-	    if (pieces[piece].color == PieceColor::White) {
-		white |= BITVECTOR(pos.piece_position[piece]);
-	    } else {
-		black |= BITVECTOR(pos.piece_position[piece]);
-	    }
+    if (pread(block_fd, table.data(), table.size(), table_offset) != static_cast<ssize_t>(table.size())) {
+	throw std::runtime_error("Truncated block table");
+    }
+
+    for (size_t block = 0; block < block_offsets.size(); block ++) {
+	block_offsets[block] = 0;
+	for (int byte = 7; byte >= 0; byte --) {
+	    block_offsets[block] = (block_offsets[block] << 8) | table[8 * block + byte];
 	}
+    }
+}
 
-	/* Nor does Nalimov like it if the en passant pawn can't actually be captured by
-	 * another pawn.  Again, treat Syzygy the same way.
-	 */
+void tablebase_t::read_block(index_t block, char * entries)
+{
+    thread_local std::vector<Bytef> compressed;
+    uLongf size = format.bits * futurebase_stride / 8;
 
-	if ((pos.en_passant_square != ILLEGAL_POSITION)
-	    && (((pawns & white & BITVECTOR(pos.en_passant_square - 9)) == 0)
-		|| (pos.en_passant_square == 40)
-		|| (pos.side_to_move == PieceColor::Black))
-	    && (((pawns & white & BITVECTOR(pos.en_passant_square - 7)) == 0)
-		|| (pos.en_passant_square == 47)
-		|| (pos.side_to_move == PieceColor::Black))
-	    && (((pawns & black & BITVECTOR(pos.en_passant_square + 7)) == 0)
-		|| (pos.en_passant_square == 16)
-		|| (pos.side_to_move == PieceColor::White))
-	    && (((pawns & black & BITVECTOR(pos.en_passant_square + 9)) == 0)
-		|| (pos.en_passant_square == 23)
-		|| (pos.side_to_move == PieceColor::White))) {
-	    
-	    pos.en_passant_square = ILLEGAL_POSITION;
-	}
-
-	unsigned result = tb_probe_wdl(white, black,
-				       kings, queens, rooks, bishops, knights, pawns,
-				       0, 0, (pos.en_passant_square == ILLEGAL_POSITION) ? 0 : pos.en_passant_square,
-				       (pos.side_to_move == PieceColor::White));
-
-	/* XXX add a Hoffman XML option to respect the 50 move rule, then we can handle BLESSED_LOSS
-	 * and CURSED_WIN properly.
-	 */
+    compressed.resize(block_offsets[block + 1] - block_offsets[block]);
 
-	switch (result) {
-	case TB_LOSS:
-	    return Basic::PNTMwins;
-	case TB_BLESSED_LOSS:
-	case TB_CURSED_WIN:
-	case TB_DRAW:
-	    return Basic::Draw;
-	case TB_WIN:
-	    return Basic::PTMwins;
-	case TB_RESULT_FAILED:
-	    return Basic::Unknown;
-	default:
-	    throw std::runtime_error("Syzygy base returns unknown result code");
+    if (pread(block_fd, compressed.data(), compressed.size(), block_offsets[block]) != static_cast<ssize_t>(compressed.size())) {
+	fatal("Can't read block %" PRIindex " of '%s': %s\n", block, filename.c_str(), strerror(errno));
+	terminate();
+    }
+
+    if (uncompress(reinterpret_cast<Bytef *>(entries), &size, compressed.data(), compressed.size()) != Z_OK) {
+	fatal("Corrupt block %" PRIindex " in '%s'\n", block, filename.c_str());
+	terminate();
+    }
+}
+
+/* Nalimov tablebases
+ *
+ * Nalimov's code only goes one way, from a position to an index in his files, so we can't walk
+ * through his files and translate the entries into our index order.  What we can do is decode a
+ * whole chunk of our indices at once: convert each one to a position, figure out where it lives in
+ * Nalimov's files, sort them, and then probe them in file order.  That way each of his compressed
+ * blocks gets decompressed once and read straight through, instead of getting bounced in and out of
+ * his cache in whatever order our index happens to visit it.
+ *
+ * Nalimov's code is thread-safe for queries, if compiled with -DSMP
+ */
+
+struct nalimov_probe {
+    int tb;
+    int side;
+    unsigned long long index;
+    index_t offset;		/* into the chunk we're decoding */
+
+    bool operator<(const nalimov_probe & other) const {
+	return std::tie(tb, side, index) < std::tie(other.tb, other.side, other.index);
+    }
+};
+
+const int nalimov_illegal = INT_MIN;
+
+bool global_PNTM_in_check(global_position_t *position);
+
+/* Figure out where 'index' lives in the Nalimov tablebase and return true, or return false if it's
+ * a position we shouldn't probe, with its DTM in 'dtm'.
+ */
+
+bool locate_nalimov_position(tablebase_t * tb, index_t index, nalimov_probe * probe, int * dtm)
+{
+    global_position_t global;
+
+    if (! index_to_global_position(tb, index, &global) || global_PNTM_in_check(&global)) {
+
+	/* I've learned the hard way not to probe a Nalimov tablebase for an illegal position... */
+	*dtm = 1;
+	return false;
+    }
+
+    /* Nor does Nalimov like it if the en passant pawn can't actually be captured by another pawn. */
+
+    if ((global.en_passant_square != ILLEGAL_POSITION)
+	&& ((global.board[global.en_passant_square - 9] != 'P')
+	    || (global.en_passant_square == 40)
+	    || (global.side_to_move == PieceColor::Black))
+	&& ((global.board[global.en_passant_square - 7] != 'P')
+	    || (global.en_passant_square == 47)
+	    || (global.side_to_move == PieceColor::Black))
+	&& ((global.board[global.en_passant_square + 7] != 'p')
+	    || (global.en_passant_square == 16)
+	    || (global.side_to_move == PieceColor::White))
+	&& ((global.board[global.en_passant_square + 9] != 'p')
+	    || (global.en_passant_square == 23)
+	    || (global.side_to_move == PieceColor::White))) {
+
+	global.en_passant_square = ILLEGAL_POSITION;
+    }
+
+    if (EGTBIndex(global.side_to_move == PieceColor::White, global.board,
+		  global.en_passant_square == ILLEGAL_POSITION ? -1 : global.en_passant_square,
+		  &probe->tb, &probe->side, &probe->index) != 1) {
+	*dtm = nalimov_illegal;
+	return false;
+    }
+
+    return true;
+}
+
+/* Probe Nalimov and convert his score to our DTM, or nalimov_illegal if he says it's illegal */
+
+int probe_nalimov(const nalimov_probe & probe)
+{
+    int score;
+
+    if (EGTBProbeIndex(probe.tb, probe.side, probe.index, &score) != 1) {
+	return nalimov_illegal;
+    }
+
+    if (score > 0) {
+	return ((65536-4)/2)-score+2;
+    } else if (score < 0) {
+	return -(((65536-4)/2)+score)-1;
+    } else {
+	return 0;
+    }
+}
+
+thread_local tablebase_t * nalimov_tb = nullptr;
+thread_local index_t nalimov_index;
+thread_local std::vector<int> nalimov_dtms;
+
+void tablebase_t::decode_nalimov_chunk(index_t start)
+{
+    thread_local std::vector<nalimov_probe> probes;
+    index_t count = std::min<index_t>(futurebase_stride, num_indices - start);
+
+    nalimov_tb = this;
+    nalimov_index = start;
+    nalimov_dtms.assign(count, 1);
+
+    probes.clear();
+
+    for (index_t offset = 0; offset < count; offset ++) {
+	nalimov_probe probe;
+
+	/* back_propagate_futurebase_thread() won't ask about these */
+
+	if (! index_is_relevant(start + offset)) continue;
+
+	if (locate_nalimov_position(this, start + offset, &probe, &nalimov_dtms[offset])) {
+	    probe.offset = offset;
+	    probes.push_back(probe);
+	}
+    }
+
+    std::sort(probes.begin(), probes.end());
+
+    for (auto & probe : probes) {
+	nalimov_dtms[probe.offset] = probe_nalimov(probe);
+    }
+}
+
+/* To retrieve fields in the tablebase, we call fetch_entry() to both point current_entries at the
+ * right chunk and return the starting index, which is subtracted to get an index offset into
+ * current_entries.
+ */
+
+int tablebase_t::get_DTM(index_t index)
+{
+    if (format.bits == -1) {
+
+	int dtm;
+
+	/* Back propagation reads come out of the chunk that fetch_entry() decoded; anything else
+	 * gets probed on its own.
+	 */
+
+	if ((nalimov_tb == this) && (index >= nalimov_index) && (index - nalimov_index < nalimov_dtms.size())) {
+	    dtm = nalimov_dtms[index - nalimov_index];
+	} else {
+	    nalimov_probe probe;
+
+	    if (locate_nalimov_position(this, index, &probe, &dtm)) {
+		dtm = probe_nalimov(probe);
+	    }
+	}
+
+	if (dtm == nalimov_illegal) {
+	    throw std::runtime_error("Nalimov says illegal");
+	}
+
+	return dtm;
+    }
+
+    index -= fetch_entry(index);
+
+    /* Normally, we encode signed DTM fields, but single bit DTM fields are an exception, as we
+     * always wish to encode 1 (PNTM in check) since these positions should not be backproped.  So
+     * single bit fields encode unsigned as 0 and 1, instead of 0 and -1.
+     */
+
+    if (format.dtm_bits == 1) {
+	return get_unsigned_int_field(current_entries, format.dtm_offset + index * format.bits, format.dtm_bits);
+    } else {
+	return get_int_field(current_entries, format.dtm_offset + index * format.bits, format.dtm_bits);
+    }
+}
+
+int tablebase_t::get_DTC(index_t index)
+{
+    /* XXX add some code here to probe Syzygy rtbz tablebases */
+
+    index -= fetch_entry(index);
+
+    /* Normally, we encode signed DTC fields, but single bit DTC fields are an exception, as we
+     * always wish to encode 1 (PNTM in check) since these positions should not be backproped.  So
+     * single bit fields encode unsigned as 0 and 1, instead of 0 and -1.
+     */
+
+    if (format.dtc_bits == 1) {
+	return get_unsigned_int_field(current_entries, format.dtc_offset + index * format.bits, format.dtc_bits);
+    } else {
+	return get_int_field(current_entries, format.dtc_offset + index * format.bits, format.dtc_bits);
+    }
+}
+
+bool tablebase_t::get_flag(index_t index)
+{
+    index -= fetch_entry(index);
+    return get_bit_field(current_entries, format.flag_offset + index * format.bits);
+}
+
+bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position);
+
+/* Syzygy tablebases
+ *
+ * The Syzygy WDL files can't be streamed into our index order.  Their indexing only goes from
+ * positions to indices, and they don't store a usable value for positions where a capture is the
+ * best move, so the probe code has to search the captures into the smaller tables anyway.  What we
+ * can avoid is probing the same position over and over.  Back propagation looks at each futurebase
+ * position once per reflection, so fetch_entry() probes each relevant position in the chunk once,
+ * and get_basic() reads the results from there.
+ */
+
+void init_syzygy_library(void)
+{
+    static std::mutex initialization_guard;
+
+    /* Initialize the Syzygy library, if needed.  We wait until this
+     * point in the code to ensure that all of the filenames have been
+     * parsed into the syzygy_search_path.
+     *
+     * XXX could move this code elsewhere and avoid the need for the mutex.
+     */
+
+    std::lock_guard<std::mutex> _(initialization_guard);
+
+    if (! syzygy_library_initialized) {
+#ifndef _WIN32
+	std::string syzygy_path = boost::algorithm::join(syzygy_search_path, ":");
+#else
+	std::string syzygy_path = boost::algorithm::join(syzygy_search_path, ";");
+#endif
+
+	tb_init(syzygy_path.c_str());
+
+	syzygy_library_initialized = true;
+    }
+}
+
+Basic probe_syzygy(tablebase_t * tb, index_t index)
+{
+    /* Syzygy query code is thread-safe */
+
+    local_position_t pos(tb);
+
+    if (! index_to_local_position(tb, index, 0, &pos)) {
+	throw std::runtime_error("index_to_local_position failed in Syzygy base lookup");
+    }
+
+    if (PNTM_in_check(tb, &pos)) {
+
+	/* I've learned the hard way not to probe a Nalimov tablebase for an illegal
+	 * position.  I'm not sure about Syzygy tablebases, but treat them the same way.
+	 */
+
+	return Basic::Illegal;
+    }
+
+    uint64_t white = 0;
+    uint64_t black = 0;
+
+    uint64_t kings = 0;
+    uint64_t queens = 0;
+    uint64_t rooks = 0;
+    uint64_t bishops = 0;
+    uint64_t knights = 0;
+    uint64_t pawns = 0;
+
+    for (int piece = 0; piece < tb->num_pieces; piece ++) {
+
+	switch (tb->pieces[piece].piece_type) {
+	case PieceType::King:
+	    kings |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Queen:
+	    queens |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Rook:
+	    rooks |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Bishop:
+	    bishops |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Knight:
+	    knights |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	case PieceType::Pawn:
+	    pawns |= BITVECTOR(pos.piece_position[piece]);
+	    break;
+	}
+
+	if (tb->pieces[piece].color == PieceColor::White) {
+	    white |= BITVECTOR(pos.piece_position[piece]);
+	} else {
+	    black |= BITVECTOR(pos.piece_position[piece]);
 	}
+    }
+
+    /* Nor does Nalimov like it if the en passant pawn can't actually be captured by
+     * another pawn.  Again, treat Syzygy the same way.
+     */
+
+    if ((pos.en_passant_square != ILLEGAL_POSITION)
+	&& (((pawns & white & BITVECTOR(pos.en_passant_square - 9)) == 0)
+	    || (pos.en_passant_square == 40)
+	    || (pos.side_to_move == PieceColor::Black))
+	&& (((pawns & white & BITVECTOR(pos.en_passant_square - 7)) == 0)
+	    || (pos.en_passant_square == 47)
+	    || (pos.side_to_move == PieceColor::Black))
+	&& (((pawns & black & BITVECTOR(pos.en_passant_square + 7)) == 0)
+	    || (pos.en_passant_square == 16)
+	    || (pos.side_to_move == PieceColor::White))
+	&& (((pawns & black & BITVECTOR(pos.en_passant_square + 9)) == 0)
+	    || (pos.en_passant_square == 23)
+	    || (pos.side_to_move == PieceColor::White))) {
+
+	pos.en_passant_square = ILLEGAL_POSITION;
+    }
+
+    unsigned result = tb_probe_wdl(white, black,
+				   kings, queens, rooks, bishops, knights, pawns,
+				   0, 0, (pos.en_passant_square == ILLEGAL_POSITION) ? 0 : pos.en_passant_square,
+				   (pos.side_to_move == PieceColor::White));
+
+    /* XXX add a Hoffman XML option to respect the 50 move rule, then we can handle BLESSED_LOSS
+     * and CURSED_WIN properly.
+     */
+
+    switch (result) {
+    case TB_LOSS:
+	return Basic::PNTMwins;
+    case TB_BLESSED_LOSS:
+    case TB_CURSED_WIN:
+    case TB_DRAW:
+	return Basic::Draw;
+    case TB_WIN:
+	return Basic::PTMwins;
+    case TB_RESULT_FAILED:
+	return Basic::Unknown;
+    default:
+	throw std::runtime_error("Syzygy base returns unknown result code");
+    }
+}
+
+thread_local tablebase_t * syzygy_tb = nullptr;
+thread_local index_t syzygy_index;
+thread_local std::vector<Basic> syzygy_basics;
+
+void tablebase_t::decode_syzygy_chunk(index_t start)
+{
+    index_t count = std::min<index_t>(futurebase_stride, num_indices - start);
+    local_position_t pos(this);
+
+    init_syzygy_library();
+
+    syzygy_tb = this;
+    syzygy_index = start;
+
+    /* Anything we don't probe here is left Unknown, and get_basic() will probe it if asked */
+
+    syzygy_basics.assign(count, Basic::Unknown);
 
+    for (index_t offset = 0; offset < count; offset ++) {
+
+	/* back_propagate_futurebase_thread() won't ask about these */
+
+	if (! index_is_relevant(start + offset)) continue;
+
+	if (index_to_local_position(this, start + offset, 0, &pos)) {
+	    syzygy_basics[offset] = probe_syzygy(this, start + offset);
+	}
+    }
+}
+
+Basic tablebase_t::get_basic(index_t index)
+{
+    if (format.bits == -2) {
+
+	if ((syzygy_tb == this) && (index >= syzygy_index) && (index - syzygy_index < syzygy_basics.size())
+	    && (syzygy_basics[index - syzygy_index] != Basic::Unknown)) {
+	    return syzygy_basics[index - syzygy_index];
+	}
+
+	init_syzygy_library();
+
+	return probe_syzygy(this, index);
     }
 
     index -= fetch_entry(index);
-    return static_cast<Basic>(get_unsigned_int_field(cached_entries, format.basic_offset + index * format.bits, 2));
+    return static_cast<Basic>(get_unsigned_int_field(current_entries, format.basic_offset + index * format.bits, 2));
 }
 
 
@@ -8532,43 +9539,7 @@ class EntriesTable {
 
 	bits = 8 * sizeof(entry_t);
 
-	/* Compute the moves available to each side and use this to size the movecnt field */
-
-	unsigned int max_white_moves = 0;
-	unsigned int max_black_moves = 0;
-
-	for (int piece = 0; piece < current_tb->num_pieces; piece ++) {
-	    unsigned int *max_moves = (current_tb->pieces[piece].color == PieceColor::White) ? &max_white_moves : &max_black_moves;
-	    switch (current_tb->pieces[piece].piece_type) {
-	    case PieceType::King:
-	    case PieceType::Knight:
-		*max_moves += 8; break;
-	    case PieceType::Queen:
-		*max_moves += 28; break;
-	    case PieceType::Rook:
-	    case PieceType::Bishop:
-		*max_moves += 14; break;
-	    case PieceType::Pawn:
-		*max_moves += 12; break;
-	    }
-	}
-
-	/* We double the calculated move counts if the tablebase has 8-way symmetry because then we
-	 * have to deal with multiplicity - some of the positions double up into individual indices
-	 * and some do not.  The doubled positions have twice as many moves as the others.  We don't
-	 * worry about this for 4-way or 2-way symmetry because then all of the positions double (or
-	 * quadruple).
-	 */
-
-	if (current_tb->symmetry == 8) {
-	    max_white_moves *= 2;
-	    max_black_moves *= 2;
-	}
-
-	info("%d maximum white moves; %d maximum black moves\n", max_white_moves, max_black_moves);
-
-	for (movecnt_bits = 3; (max_white_moves > MOVECNT_MAX)
-		 || (max_black_moves > MOVECNT_MAX); movecnt_bits ++);
+	movecnt_bits = movecnt_bits_needed(true);
 
 	movecnt_bitmask = (1 << movecnt_bits) - 1;
 
@@ -8623,42 +9594,94 @@ class EntriesTable {
     }
 
  public:
-    EntriesTable(void) {
 
-	ComputeBitfields();
-
-	threads = 1;
-    }
-
-    /* DiskEntriesTable will want to delete some files, so this destructor has to be virtual. */
-
-    virtual ~EntriesTable() { }
-
-    /* The main thing we want to do with an EntriesTable is to access the entries!  These functions
-     * read entries (operator[]), set entries non-synchronously (used during initialization when
-     * only one thread will access each entry) and modify the entries synchronously (used during
-     * propagation passes when multiple threads may access an entry simultaneously).  They are
-     * virtual because DiskEntriesTable may need to access the disk in order to produce an entry.
+    /* Compute the moves available to each side and use this to size the movecnt field.  This is
+     * static so that choose_memory_configuration() can size a CompactMemoryEntriesTable before it's
+     * built.
      */
 
-    virtual const nonatomic_entry operator[](const index_t index) = 0;
-
-    virtual void set(const index_t index, const nonatomic_entry & value) = 0;
-
-    virtual bool compare_exchange_weak(const index_t index, nonatomic_entry & expected, const nonatomic_entry & desired) = 0;
+    static unsigned int movecnt_bits_needed(bool verbose) {
 
-    /* Sets the number of threads accessing the table.
-     *
-     * Used by the disk-based version of this class to figure out how many threads it has to wait
-     * for before it advances the buffer in the disk file.  If we have less than this number of
-     * threads, the code will stall indefinately waiting for the remaining, non-existant threads.
-     *
-     * XXX the very existence of this function is a kludge
-     */
+	unsigned int max_white_moves = 0;
+	unsigned int max_black_moves = 0;
 
-    void set_threads(uint8_t threads) {
-	this->threads = threads;
-    }
+	for (int piece = 0; piece < current_tb->num_pieces; piece ++) {
+	    unsigned int *max_moves = (current_tb->pieces[piece].color == PieceColor::White) ? &max_white_moves : &max_black_moves;
+	    switch (current_tb->pieces[piece].piece_type) {
+	    case PieceType::King:
+	    case PieceType::Knight:
+		*max_moves += 8; break;
+	    case PieceType::Queen:
+		*max_moves += 28; break;
+	    case PieceType::Rook:
+	    case PieceType::Bishop:
+		*max_moves += 14; break;
+	    case PieceType::Pawn:
+		*max_moves += 12; break;
+	    }
+	}
+
+	/* We double the calculated move counts if the tablebase has 8-way symmetry because then we
+	 * have to deal with multiplicity - some of the positions double up into individual indices
+	 * and some do not.  The doubled positions have twice as many moves as the others.  We don't
+	 * worry about this for 4-way or 2-way symmetry because then all of the positions double (or
+	 * quadruple).
+	 */
+
+	if (current_tb->symmetry == 8) {
+	    max_white_moves *= 2;
+	    max_black_moves *= 2;
+	}
+
+	if (verbose) {
+	    info("%d maximum white moves; %d maximum black moves\n", max_white_moves, max_black_moves);
+	}
+
+	/* The top four movecnt values are reserved; see MOVECNT_MAX */
+
+	unsigned int field_bits;
+
+	for (field_bits = 3; (max_white_moves > (1U << field_bits) - 5) || (max_black_moves > (1U << field_bits) - 5); field_bits ++);
+
+	return field_bits;
+    }
+
+    EntriesTable(void) {
+
+	ComputeBitfields();
+
+	threads = 1;
+    }
+
+    /* DiskEntriesTable will want to delete some files, so this destructor has to be virtual. */
+
+    virtual ~EntriesTable() { }
+
+    /* The main thing we want to do with an EntriesTable is to access the entries!  These functions
+     * read entries (operator[]), set entries non-synchronously (used during initialization when
+     * only one thread will access each entry) and modify the entries synchronously (used during
+     * propagation passes when multiple threads may access an entry simultaneously).  They are
+     * virtual because DiskEntriesTable may need to access the disk in order to produce an entry.
+     */
+
+    virtual const nonatomic_entry operator[](const index_t index) = 0;
+
+    virtual void set(const index_t index, const nonatomic_entry & value) = 0;
+
+    virtual bool compare_exchange_weak(const index_t index, nonatomic_entry & expected, const nonatomic_entry & desired) = 0;
+
+    /* Sets the number of threads accessing the table.
+     *
+     * Used by the disk-based version of this class to figure out how many threads it has to wait
+     * for before it advances the buffer in the disk file.  If we have less than this number of
+     * threads, the code will stall indefinately waiting for the remaining, non-existant threads.
+     *
+     * XXX the very existence of this function is a kludge
+     */
+
+    void set_threads(uint8_t threads) {
+	this->threads = threads;
+    }
 
     /* This function is virtual so that subclasses can do a better job of handling a DTM overflow.
      * We only use it at the beginning of a pass.
@@ -9052,841 +10075,1500 @@ public:
 
 };
 
-/* temporary_file implements a temporary disk file that presents input and output streams, can be
- * optionally compressed, and will be deleted on disk when the object is destroyed.
+/* Temporary file directories.
+ *
+ * By default, intermediate files (the entries file and the proptable runs) go into the current
+ * working directory.  The --temp-dir option, which can be repeated, specifies a list of directories
+ * to use instead, each with an optional weight and capacity limit.  If more than one directory is
+ * specified, the first one is reserved for entries files and the proptable runs are spread across
+ * the rest using a weighted round-robin.  A proptable spill writes one run per thread at the same
+ * time, so this stripes each spill across all of the proptable directories.  The idea is to put
+ * each directory on its own disk.
+ *
+ * The capacity limit is only a soft one.  We don't know how big a run is going to get when we
+ * create it, so all we can do is skip a directory whose open temporary files already add up to its
+ * capacity, and if every directory is full, we ignore the limits altogether.  The first directory's
+ * weight and capacity are never used, since it's either the only directory or the one holding the
+ * entries file.
  */
 
-class temporary_file {
-
-    char filename[16];
-    int fd;
-    bool compress;
+enum class TemporaryFile { Entries, Proptable };
 
-    io::file_descriptor device(void)
-    {
-	lseek(fd, 0, SEEK_SET);
-	return io::file_descriptor(fd, io::never_close_handle);
-    }
+struct temporary_directory {
+    std::string path;
+    unsigned int weight;
+    uint64_t capacity;			/* in bytes; zero means unlimited */
+    int current_weight = 0;		/* for the weighted round-robin */
+    std::set<int> open_files;
 
-public:
-    temporary_file(std::string filename_template = "entriesXXXXXX", bool compress = true)
-	: compress(compress)
-    {
-	strcpy(filename, filename_template.c_str());
-	fd = mkostemp(filename, O_RDWR | O_CREAT | O_EXCL);
+    /* Add up the current sizes of all of our open files */
 
-	if (fd == -1) {
-	    fatal("Can't open '%s' for writing: %s\n", filename, strerror(errno));
+    uint64_t bytes_used(void) {
+	uint64_t total = 0;
+	for (int fd: open_files) {
+	    struct stat statbuf;
+	    if (fstat(fd, &statbuf) == 0) total += statbuf.st_size;
 	}
+	return total;
     }
+};
 
-    std::ostream * ostream(void)
-    {
-	io::filtering_ostream * os = new io::filtering_ostream;
+std::vector<temporary_directory> temporary_directories;
+std::mutex temporary_directories_lock;
 
-	if (compress) os->push(io::gzip_compressor());
-	os->push(device());
-	os->exceptions(BOOST_IOS::failbit | BOOST_IOS::badbit);
+/* Parse a --temp-dir argument, which looks like DIR[:WEIGHT[:MB]] */
 
-	return os;
-    }
+bool parse_temporary_directory(const char * arg)
+{
+    std::vector<std::string> fields;
+    temporary_directory dir;
 
-    std::istream * istream(void)
-    {
-	io::filtering_istream * is = new io::filtering_istream;
+    boost::split(fields, arg, boost::is_any_of(":"));
 
-	if (compress) is->push(io::gzip_decompressor());
-	is->push(device());
-	//is->exceptions(BOOST_IOS::failbit | BOOST_IOS::badbit);
+    if ((fields.size() > 3) || fields[0].empty()) return false;
 
-	return is;
-    }
+    dir.path = fields[0];
+    dir.weight = 1;
+    dir.capacity = 0;
 
-    ~temporary_file(void)
-    {
-	close(fd);
-	unlink(filename);
+    try {
+	if (fields.size() >= 2) dir.weight = boost::lexical_cast<unsigned int>(fields[1]);
+	if (fields.size() >= 3) dir.capacity = boost::lexical_cast<uint64_t>(fields[2]) << 20;
+    } catch (boost::bad_lexical_cast &) {
+	return false;
     }
-};
 
-class DiskEntriesTable: public EntriesTable {
+    if (dir.weight == 0) return false;
 
- private:
-    std::istream * entries_read_stream;
-    std::ostream * entries_write_stream;
+    temporary_directories.push_back(dir);
+    return true;
+}
 
-    temporary_file * entries_read_device;
-    temporary_file * entries_write_device;
+/* Pick a directory for a new temporary file.  Returns -1 for the current working directory.
+ * Expects temporary_directories_lock to be held.
+ */
 
-    std::mutex ready_to_advance_mutex;
-    std::condition_variable ready_to_advance_cond;
-    std::condition_variable ready_to_reset_cond;
-    int threads_waiting_to_advance;
-    int threads_waiting_to_reset;
+int choose_temporary_directory(TemporaryFile type)
+{
+    if (temporary_directories.empty()) return -1;
+    if ((type == TemporaryFile::Entries) || (temporary_directories.size() == 1)) return 0;
 
-    /* This is the in-memory portion of the table, and the index number of the first entry.  */
+    int chosen = -1;
+    int total_weight = 0;
 
-    atomic_entries_array entries;
-    index_t entry_buffer_start;
+    /* Smooth weighted round-robin: bump each eligible directory's current weight by its weight,
+     * pick the one with the largest current weight, then knock it back down by the total.  If
+     * every directory is full, ignore the capacity limits.
+     */
 
-    void open_new_entries_write_file(void)
-    {
-	entries_write_device = new temporary_file("entriesXXXXXX", compress_entries_table);
-	entries_write_stream = entries_write_device->ostream();
-    }
+    for (int pass = 0; (pass < 2) && (chosen == -1); pass ++) {
+	for (unsigned int i = 1; i < temporary_directories.size(); i ++) {
+	    temporary_directory & dir = temporary_directories[i];
 
-    void advance_entry_buffer(void)
-    {
-	entries >> *entries_write_stream;
+	    if ((pass == 0) && (dir.capacity != 0) && (dir.bytes_used() >= dir.capacity)) continue;
 
-	if (entries_read_device != nullptr) {
-	    entries << *entries_read_stream;
-	} else {
-	    entries.zero();
-	}
+	    dir.current_weight += dir.weight;
+	    total_weight += dir.weight;
 
-	entry_buffer_start += entry_buffer_size;
+	    if ((chosen == -1) || (dir.current_weight > temporary_directories[chosen].current_weight)) {
+		chosen = i;
+	    }
+	}
     }
 
-    void wait_for_all_threads_ready_then_advance_entry_buffer(void) {
-	std::unique_lock<std::mutex> lock(ready_to_advance_mutex);
+    temporary_directories[chosen].current_weight -= total_weight;
 
-	threads_waiting_to_advance ++;
-	if (threads_waiting_to_advance + threads_waiting_to_reset < threads) {
-	    ready_to_advance_cond.wait(lock);
-	} else {
-	    advance_entry_buffer();
-	    threads_waiting_to_advance = 0;
-	    ready_to_advance_cond.notify_all();
-	}
-    }
+    return chosen;
+}
 
-    void reset_files(void) {
+/* Direct I/O engine for temporary files.
+ *
+ * With the --direct-io option, temporary files bypass the page cache (O_DIRECT) and are read and
+ * written through a pair of boost iostreams devices that each keep several large, aligned buffers
+ * in flight, so the disks see a deep queue of big sequential requests.  The requests themselves
+ * are carried out by io_uring if we were compiled with liburing, or by a small pool of threads
+ * doing pread()/pwrite() otherwise.  If a filesystem won't do O_DIRECT (tmpfs, for example), we
+ * still use the engine, just through the page cache.
+ *
+ * Writes always use direct_io_queue_depth buffers of direct_io_buffer_size bytes.  Reads of an
+ * entries file do the same, but there can be hundreds of proptable runs open for reading at once
+ * (one for each leaf of the sorting network), so they read ahead with two smaller buffers each.
+ */
 
-	/* We're reseting for a new pass.  Write the current buffer out, write out everything left
-	 * in the input file, switch the output file to become the next pass's input file, destroy
-	 * the old input file, and create a new output file.
-	 */
+bool use_direct_io = false;
 
-	entries >> *entries_write_stream;
+const size_t direct_io_alignment = 4096;
+const size_t direct_io_buffer_size = 1 << 20;
+const int direct_io_queue_depth = 8;
+const size_t direct_io_proptable_buffer_size = 128 << 10;
+const int direct_io_proptable_queue_depth = 2;
+const int direct_io_threads = 4;
+const unsigned int direct_io_ring_entries = 256;
 
-	if (entries_read_device != nullptr) {
-	    while (! entries_read_stream->eof()) {
-		entries << *entries_read_stream;
-		entries >> *entries_write_stream;
-	    }
-	    delete entries_read_stream;
-	    delete entries_read_device;
-	}
+struct io_request {
+    int fd;
+    bool write;
+    char * buffer;
+    size_t length;		/* zero if this buffer hasn't been submitted */
+    off_t offset;
+    ssize_t result;
+    bool pending;
+};
 
-	entries_read_device = entries_write_device;
+class io_engine {
 
-	/* Do this before creating the read stream, because it may need to flush output to
-	 * the old write file, which is the new read file.
-	 */
+ private:
+    std::mutex lock;
+    std::condition_variable completion_cond;
 
-	if (entries_write_stream) delete entries_write_stream;
-	open_new_entries_write_file();
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    std::thread completion_thread;
 
-	entries_read_stream = entries_read_device->istream();
+    /* Hundreds of proptable runs can each have reads in flight at once, but if we ever have more
+     * requests in flight than the completion queue can hold, the kernel starts refusing to submit
+     * (or dropping completions), so submit() waits until there's room.  The completion queue is at
+     * least as big as the submission queue.
+     */
 
-	entry_buffer_start = 0;
+    unsigned int in_flight = 0;
 
-	entries << *entries_read_stream;
+    void completion_thread_main(void) {
+	while (1) {
+	    struct io_uring_cqe * cqe;
+	    int ret = io_uring_wait_cqe(&ring, &cqe);
+	    if (ret == -EINTR) continue;
+	    if (ret < 0) fatal("io_uring_wait_cqe: %s\n", strerror(-ret));
+
+	    io_request * req = static_cast<io_request *>(io_uring_cqe_get_data(cqe));
+	    int res = cqe->res;
+	    io_uring_cqe_seen(&ring, cqe);
+
+	    /* A NOP with no request attached is our signal to exit */
+	    if (req == nullptr) break;
+
+	    std::lock_guard<std::mutex> _(lock);
+	    req->result = res;
+	    req->pending = false;
+	    in_flight --;
+	    completion_cond.notify_all();
+	}
     }
 
-    void wait_for_all_threads_ready_then_reset(void) {
-	std::unique_lock<std::mutex> lock(ready_to_advance_mutex);
+    /* Submit everything in the submission queue.  -EBUSY and -EAGAIN just mean that the kernel
+     * wants us to wait for some completions (which the completion thread reaps without taking our
+     * lock) or some memory, so we retry.  Returns a negative errno for anything else.
+     */
 
-	threads_waiting_to_reset ++;
-	if (threads_waiting_to_reset < threads) {
-	    ready_to_reset_cond.wait(lock);
-	} else {
-	    reset_files();
-	    threads_waiting_to_reset = 0;
-	    ready_to_reset_cond.notify_all();
+    int submit_sqes(void) {
+	int ret;
+	while (((ret = io_uring_submit(&ring)) == -EBUSY) || (ret == -EAGAIN) || (ret == -EINTR)) {
+	    std::this_thread::yield();
 	}
+	return ret;
     }
 
-    void advance_entry_buffer_to_index(index_t index)
-    {
-	if (entry_buffer_start > index) wait_for_all_threads_ready_then_reset();
-	while (index >= entry_buffer_start + entry_buffer_size) {
-	    wait_for_all_threads_ready_then_advance_entry_buffer();
+    struct io_uring_sqe * get_sqe(void) {
+	struct io_uring_sqe * sqe;
+	while ((sqe = io_uring_get_sqe(&ring)) == nullptr) {
+	    int ret = submit_sqes();
+	    if (ret < 0) throw std::runtime_error(std::string("io_uring_submit: ") + strerror(-ret));
 	}
+	return sqe;
     }
+#else
+    std::deque<io_request *> queue;
+    std::condition_variable queue_cond;
+    std::vector<std::thread> threads;
+    bool exiting = false;
 
- public:
-    DiskEntriesTable(void) {
+    void thread_main(void) {
+	std::unique_lock<std::mutex> lk(lock);
 
-	threads_waiting_to_advance = 0;
-	threads_waiting_to_reset = 0;
+	while (1) {
+	    while (queue.empty() && ! exiting) queue_cond.wait(lk);
+	    if (queue.empty()) break;
 
-	entry_buffer_start = 0;
+	    io_request * req = queue.front();
+	    queue.pop_front();
 
-	entries_read_device = nullptr;
-	open_new_entries_write_file();
+	    lk.unlock();
 
-	print_current_format();
-    }
+	    ssize_t result;
+	    if (req->write) {
+		result = pwrite(req->fd, req->buffer, req->length, req->offset);
+	    } else {
+		result = pread(req->fd, req->buffer, req->length, req->offset);
+	    }
+	    if (result == -1) result = -errno;
 
-    ~DiskEntriesTable(void) {
-	if (entries_read_device != nullptr) delete entries_read_device;
-	if (entries_write_device != nullptr) delete entries_write_device;
+	    lk.lock();
+
+	    req->result = result;
+	    req->pending = false;
+	    completion_cond.notify_all();
+	}
     }
+#endif
 
-    const nonatomic_entry operator[](const index_t index) {
-	advance_entry_buffer_to_index(index);
+ public:
+    io_engine(void) {
+#ifdef HAVE_LIBURING
+	int ret = io_uring_queue_init(direct_io_ring_entries, &ring, 0);
+	if (ret < 0) throw std::runtime_error(std::string("io_uring_queue_init: ") + strerror(-ret));
+	completion_thread = std::thread(&io_engine::completion_thread_main, this);
+#else
+	for (int i = 0; i < direct_io_threads; i ++) {
+	    threads.push_back(std::thread(&io_engine::thread_main, this));
+	}
+#endif
+    }
 
-	return entries[index - entry_buffer_start];
+    ~io_engine() {
+#ifdef HAVE_LIBURING
+	{
+	    std::lock_guard<std::mutex> _(lock);
+	    struct io_uring_sqe * sqe = get_sqe();
+	    io_uring_prep_nop(sqe);
+	    io_uring_sqe_set_data(sqe, nullptr);
+	    submit_sqes();
+	}
+	completion_thread.join();
+	io_uring_queue_exit(&ring);
+#else
+	{
+	    std::lock_guard<std::mutex> _(lock);
+	    exiting = true;
+	    queue_cond.notify_all();
+	}
+	for (auto & thread : threads) thread.join();
+#endif
     }
 
-    void set(const index_t index, const nonatomic_entry & value) {
-	advance_entry_buffer_to_index(index);
+    void submit(io_request * req) {
+	std::unique_lock<std::mutex> lk(lock);
 
-	entries[index - entry_buffer_start] = value;
-    }
+#ifdef HAVE_LIBURING
+	while (in_flight >= direct_io_ring_entries) completion_cond.wait(lk);
 
-    bool compare_exchange_weak(const index_t index, nonatomic_entry & expected, const nonatomic_entry & desired) {
-	advance_entry_buffer_to_index(index);
+	struct io_uring_sqe * sqe = get_sqe();
+	if (req->write) {
+	    io_uring_prep_write(sqe, req->fd, req->buffer, req->length, req->offset);
+	} else {
+	    io_uring_prep_read(sqe, req->fd, req->buffer, req->length, req->offset);
+	}
+	io_uring_sqe_set_data(sqe, req);
 
-	return entries[index - entry_buffer_start].compare_exchange_weak(expected, desired);
+	/* There's no way to take an SQE back out of the ring once it's been prepared, so if the
+	 * submit fails, the next submit would send it along anyway, and its completion would land
+	 * on a request that's long gone.  Nothing sensible to do but stop.
+	 */
+
+	int ret = submit_sqes();
+	if (ret < 0) {
+	    fatal("io_uring_submit: %s\n", strerror(-ret));
+	    terminate();
+	}
+	in_flight ++;
+	req->pending = true;
+#else
+	req->pending = true;
+	queue.push_back(req);
+	queue_cond.notify_one();
+#endif
     }
-};
 
+    /* Wait for a request to complete and throw an exception if it failed.  Returns immediately if
+     * the request isn't pending.
+     */
 
-/***** INTRA-TABLE BACK PROPAGATION *****/
+    void wait(io_request * req) {
+	std::unique_lock<std::mutex> lk(lock);
 
+	while (req->pending) completion_cond.wait(lk);
 
-EntriesTablePtr<EntriesTable> entriesTable;
+	if (req->length == 0) return;
 
-/* Unpropagated index tracker.
- *
- * If this is a bitbase calculation, then on each pass through the table, we process the indices
- * that were flagged unpropagated on the last pass.  A non-bitbase, distance calculation might have
- * additional entries that need to processed, entries that were injected from a futurebase at a
- * particular distance.  In the bitbase case, we can optimize by keeping a list of unpropagated
- * indices, adding to it every time we flag one, and on the next pass only process the indices on
- * the list.  Otherwise, we have to sweep through the entire tablebase to find the unpropagated
- * indices.  Also, if there's lot of unpropagated indices, then this table would become huge.
- * So we fix its size at compile time, and if it overflows, then we fall back on sweeping
- * through the entire tablebase.  Plus, we're running multithreaded, so it all has to be
- * done with locks.
- *
- * Default table size is 1 MB, though this can be adjusted with the "-U" option.
- */
+	if (req->result < 0) {
+	    throw std::runtime_error(std::string(req->write ? "write: " : "read: ") + strerror(-req->result));
+	}
+	if (req->write && (static_cast<size_t>(req->result) != req->length)) {
+	    throw std::runtime_error("short write to temporary file");
+	}
+    }
+};
 
-struct UnpropagatedIndexTable {
-    size_t total_size;
-    index_t * unpropagated_indices;
-    size_t count = 0;
-    size_t last_pass_count = 0;
-    size_t next_pop = 0;
-    bool tracking = false;
-    bool last_pass_optimized = false;
-    bool direction = false;
-    std::mutex lock;
+io_engine & direct_io_engine(void)
+{
+    static io_engine engine;
+    return engine;
+}
 
-    UnpropagatedIndexTable(size_t size) : total_size(size)
-    {
-	size_t bytes = total_size * sizeof(index_t);
+/* A ring of aligned buffers, each with its own I/O request, that read or write a file sequentially */
 
-	try {
-	    unpropagated_indices = new index_t[total_size];
+class direct_io_buffers {
 
-	    if (bytes < 1024*1024) {
-		info("Malloced %zdKB for unpropagated index table\n", bytes/1024);
-	    } else {
-		info("Malloced %zdMB for unpropagated index table\n", bytes/(1024*1024));
+ protected:
+    int fd;
+    size_t buffer_size;
+    std::vector<io_request> requests;
+    unsigned int current = 0;
+    size_t position = 0;
+    off_t next_offset = 0;
+
+    direct_io_buffers(int fd, int depth, size_t buffer_size, bool write)
+	: fd(fd), buffer_size(buffer_size), requests(depth)
+    {
+	for (auto & req : requests) {
+	    void * ptr;
+	    if (posix_memalign(&ptr, direct_io_alignment, buffer_size) != 0) throw std::bad_alloc();
+	    req.fd = fd;
+	    req.write = write;
+	    req.buffer = static_cast<char *>(ptr);
+	    req.length = 0;
+	    req.pending = false;
+	}
+    }
+
+    ~direct_io_buffers() {
+	for (auto & req : requests) {
+	    try {
+		direct_io_engine().wait(&req);
+	    } catch (std::exception &) {
+		/* we're being destroyed; nobody left to report this to */
 	    }
-	} catch (std::bad_alloc ex) {
-	    fatal("Can't malloc %zdMB for unpropagated index table: %s\n", bytes/(1024*1024), ex.what());
+	    free(req.buffer);
 	}
+    }
 
+    void submit(io_request & req, size_t length) {
+	req.length = length;
+	req.offset = next_offset;
+	next_offset += length;
+	direct_io_engine().submit(&req);
     }
+};
 
-    void start_new_pass(void)
-    {
-	last_pass_optimized = tracking;
-	tracking = true;
+class direct_io_writer : public direct_io_buffers {
 
-	last_pass_count = count;
-	count = 0;
+ private:
+    off_t bytes_written = 0;
+    bool finished = false;
 
-	next_pop = 0;
+ public:
+    direct_io_writer(int fd) : direct_io_buffers(fd, direct_io_queue_depth, direct_io_buffer_size, true) { }
 
-	direction = ! direction;
-    }
+    std::streamsize write(const char * s, std::streamsize n) {
+	std::streamsize total = 0;
 
-    void track(const index_t index)
-    {
-	if (tracking) {
-	    std::unique_lock<std::mutex> _(lock);
+	while (n > 0) {
+	    io_request & req = requests[current];
 
-	    if (count + last_pass_count < total_size) {
-		if (direction) {
-		    unpropagated_indices[count] = index;
-		} else {
-		    unpropagated_indices[total_size - count - 1] = index;
-		}
-		count ++;
-	    } else {
-		tracking = false;
-		count = 0;
+	    /* Before we start filling a buffer, make sure its last write has completed */
+	    if (position == 0) direct_io_engine().wait(&req);
+
+	    size_t count = std::min(static_cast<size_t>(n), buffer_size - position);
+	    memcpy(req.buffer + position, s, count);
+
+	    position += count;
+	    s += count;
+	    n -= count;
+	    total += count;
+	    bytes_written += count;
+
+	    if (position == buffer_size) {
+		submit(req, buffer_size);
+		current = (current + 1) % requests.size();
+		position = 0;
 	    }
 	}
-    }
 
-    bool empty(void)
-    {
-	// XXX not thread safe (but not currently used in threaded code)
-	return (next_pop == last_pass_count);
+	return total;
     }
 
-    size_t size(void)
-    {
-	return (last_pass_count - next_pop);
-    }
+    /* Write out the final partial buffer, padded to the O_DIRECT alignment, wait for everything
+     * to complete, then truncate the padding back off the end of the file.
+     */
 
-    index_t next_index(void)
-    {
-	// XXX not thread safe (but not currently used in threaded code)
-	// XXX should through exception if empty()
-	index_t retval;
-	if (direction) {
-	    retval = unpropagated_indices[total_size - next_pop - 1];
-	} else {
-	    retval = unpropagated_indices[next_pop];
+    void finish(void) {
+	if (finished) return;
+	finished = true;
+
+	if (position > 0) {
+	    io_request & req = requests[current];
+	    size_t length = (position + direct_io_alignment - 1) & ~(direct_io_alignment - 1);
+	    memset(req.buffer + position, 0, length - position);
+	    submit(req, length);
 	}
-	next_pop ++;
-	return retval;
-    }
 
+	for (auto & req : requests) {
+	    direct_io_engine().wait(&req);
+	}
 
+	if (ftruncate(fd, bytes_written) == -1) {
+	    throw std::runtime_error(std::string("ftruncate: ") + strerror(errno));
+	}
+    }
 };
 
-UnpropagatedIndexTable * unpropagated_index_table = NULL;
-size_t unpropagated_index_table_MBs = 1;
+class direct_io_reader : public direct_io_buffers {
 
-/* finalize_update()
- *
- * starting with PTM_wins() and add_one_to_PNTM_wins()
- *
- * finalize_update() is called once we've labeled a position won for either one player or the other,
- * backed out its moves, figured out a position that leads to it in one move, and are ready to
- * update that other postion with the knowledge that either PTM can win, or that some of the moves
- * that lead out of it result in PNTM wins.
- *
- * Starting with 1.816, I've introduced a lockless update that uses C++11's atomic compare-exchange
- * primitive.  If another processor changes the entry while we're working on it, we go back and do
- * the calculation again.  The locks ran pretty quick, but burned a bit on each entry.
- */
+ private:
+    off_t file_size;
 
-inline void PTM_wins(index_t index, int dtm)
-{
-    nonatomic_entry expected = entriesTable[index];
-    nonatomic_entry desired;
+ public:
+    direct_io_reader(int fd, int depth, size_t buffer_size) : direct_io_buffers(fd, depth, buffer_size, false) {
+	struct stat statbuf;
 
-    if (index == debug_move) {
-	info("PTM_wins; index=%" PRIindex "; dtm=%d; table dtm=%d\n",
-	     index, dtm, expected.get_raw_DTM());
+	if (fstat(fd, &statbuf) == -1) {
+	    throw std::runtime_error(std::string("fstat: ") + strerror(errno));
+	}
+	file_size = statbuf.st_size;
+
+	for (auto & req : requests) {
+	    if (next_offset < file_size) submit(req, buffer_size);
+	}
     }
 
-    do {
-	desired = expected;
+    std::streamsize read(char * s, std::streamsize n) {
+	std::streamsize total = 0;
 
-	if (dtm < 0) {
+	while (n > 0) {
+	    io_request & req = requests[current];
 
-	    fatal("Negative distance to mate in PTM_wins!?\n");
+	    /* A buffer that was never submitted means we've read everything */
+	    if (req.length == 0) break;
 
-	} else if (desired.is_normal_movecnt()) {
+	    direct_io_engine().wait(&req);
 
-	    /* In ordinary chess, we should never get here with MOVECNT_PNTM_WINS_UNPROPED (or
-	     * PROPED) because we have to have decremented the movecnt already to zero to have
-	     * gotten either of those flags.  However, if this is a suicide analysis, we can get a
-	     * MOVECNT_PNTM_WINS from a forced capture, so we have to exclude this cases.  In any
-	     * event, this code fragment only runs for a "normal" movecnt field - none of the five
-	     * special cases.
-	     */
+	    if ((static_cast<size_t>(req.result) < req.length) && (req.offset + req.result < file_size)) {
+		throw std::runtime_error("short read from temporary file");
+	    }
 
-	    desired.set_PTM_wins_unpropagated();
-	    desired.set_raw_DTM(dtm);
-	    if (dtm <= max_tracked_dtm) positive_passes_needed[dtm] = true;
+	    size_t available = req.result - position;
 
-	} else if ((dtm < desired.get_raw_DTM())
-		   && (desired.does_PTM_win())
-		   && (desired.is_unpropagated())) {
+	    if (available == 0) {
+		/* This buffer is drained; start it reading further ahead */
+		if (next_offset < file_size) {
+		    submit(req, buffer_size);
+		} else {
+		    req.length = 0;
+		}
+		current = (current + 1) % requests.size();
+		position = 0;
+		continue;
+	    }
 
-	    /* This can happen if we get a PTM mate during futurebase back prop, then, later during
-	     * futurebase back prop or during intra-table back prop, improve upon the mate.
-	     */
+	    size_t count = std::min(static_cast<size_t>(n), available);
+	    memcpy(s, req.buffer + position, count);
 
-	    desired.set_raw_DTM(dtm);
-	    if (dtm <= max_tracked_dtm) positive_passes_needed[dtm] = true;
+	    position += count;
+	    s += count;
+	    n -= count;
+	    total += count;
 	}
-    } while (!entriesTable->compare_exchange_weak(index, expected, desired));
 
-    if ((! tracking_dtm) && expected.is_normal_movecnt() && desired.is_unpropagated()) {
-	if (unpropagated_index_table) {
-	    unpropagated_index_table->track(index);
-	}
+	return (total == 0) ? -1 : total;
     }
-}
+};
 
-inline void add_one_to_PNTM_wins(index_t index, int dtm)
-{
-    nonatomic_entry expected = entriesTable[index];
-    nonatomic_entry desired;
+/* boost iostreams copies devices around, so these just hold pointers to the real thing */
 
-    if (index == debug_move) {
-	info("add_one_to_PNTM_wins; index=%" PRIindex "; dtm=%d; table dtm=%d\n",
-	     index, dtm, expected.get_raw_DTM());
-    }
+class direct_io_sink {
+    std::shared_ptr<direct_io_writer> writer;
 
-    do {
-	desired = expected;
+ public:
+    typedef char char_type;
+    struct category : io::sink_tag, io::closable_tag { };
 
-	if (dtm > 0) {
-	    fatal("Positive distance to mate in PNTM_wins!?\n");
-	} else if (desired.is_normal_movecnt()) {
+    direct_io_sink(int fd) : writer(new direct_io_writer(fd)) { }
 
-	    /* Again, this is the code for a "normal" movecnt field. */
+    std::streamsize write(const char * s, std::streamsize n) {
+	return writer->write(s, n);
+    }
 
-	    // XXX entriesTable[index].movecnt --;
-	    desired.set_movecnt(desired.get_movecnt() - 1);
+    void close(void) {
+	writer->finish();
+    }
+};
 
-	    if ((dtm < desired.get_raw_DTM()) && (desired.get_raw_DTM() <= 0)) {
-		/* Since this is PNTM wins, PTM will make the move leading to the slowest mate. */
-		desired.set_raw_DTM(dtm);
-	    }
+class direct_io_source {
+    std::shared_ptr<direct_io_reader> reader;
 
-	    if (desired.does_PNTM_win()) {
-		/* This call pushed movecnt to zero, but the passed-in DTM might not be the best line,
-		 * so that's why we fetch entry DTM here.
-		 */
-		dtm = desired.get_raw_DTM();
-#ifdef DEBUG_PASS_DEPENDANCIES
-		if ((dtm >= min_tracked_dtm) && (! negative_passes_needed[-dtm])) {
-		    global_position_t global;
-		    index_to_global_position(current_tb, index, &global);
-		    printf("%d pass needed by %" PRIindex " %s\n",
-			   dtm, index, global_position_to_FEN(&global));
-		}
-#endif
-		if (dtm >= min_tracked_dtm) negative_passes_needed[-dtm] = true;
-	    }
-	}
-    } while (!entriesTable->compare_exchange_weak(index, expected, desired));
+ public:
+    typedef char char_type;
+    struct category : io::source_tag, io::closable_tag { };
 
-    if ((! tracking_dtm) && expected.is_normal_movecnt() && desired.is_unpropagated()) {
-	if (unpropagated_index_table) {
-	    unpropagated_index_table->track(index);
-	}
+    direct_io_source(int fd, int depth, size_t buffer_size) : reader(new direct_io_reader(fd, depth, buffer_size)) { }
+
+    std::streamsize read(char * s, std::streamsize n) {
+	return reader->read(s, n);
     }
-}
 
-/* For suicide analysis, we want to know if the current pass is backproping
- * from a capture or promotion-capture futurebase.
- *
- * XXX is there a more elegant way to flag this than using a global variable?
- */
+    void close(void) { }
+};
 
-bool doing_capture_backprop = false;
+/* temporary_file implements a temporary disk file that presents input and output streams, can be
+ * optionally compressed, and will be deleted on disk when the object is destroyed.
+ */
 
-void finalize_update(index_t index, short dtm, short movecnt, int futuremove)
-{
-    int i;
+class temporary_file {
 
-#if 0
-    /* Skip everything if the position isn't valid.  In particular, we don't track futuremove
-     * propagation for illegal positions.
-     */
+    std::string filename;
+    int fd;
+    int io_fd = -1;		/* separate O_DIRECT descriptor if use_direct_io */
+    TemporaryFile type;
+    bool compress;
+    int directory;
+    bool preserved = false;	/* don't unlink; a checkpoint refers to us */
 
-    if (get_entry_raw_DTM(index) == 1) return;
-#endif
+    io::file_descriptor device(void)
+    {
+	lseek(fd, 0, SEEK_SET);
+	return io::file_descriptor(fd, io::never_close_handle);
+    }
 
-    /* If we're doing a suicide analysis, captures are forced, so we never want to back-propagate a
-     * non-capture move into a position where a capture was possible.
-     */
+    void open_io_fd(void)
+    {
+	static bool warned = false;
 
-    if ((current_tb->variant == Variant::Suicide)
-	&& !doing_capture_backprop
-	&& entriesTable[index].is_capture_possible()) {
-	return;
+	io_fd = open(filename.c_str(), O_RDWR | O_DIRECT);
+	if (io_fd == -1) {
+	    if (! warned) {
+		warning("Can't open '%s' with O_DIRECT (%s); using buffered I/O\n", filename.c_str(), strerror(errno));
+		warned = true;
+	    }
+	    io_fd = dup(fd);
+	}
     }
 
-    /* The guts of committing an update into the entries table. */
+public:
+    temporary_file(TemporaryFile type = TemporaryFile::Entries, bool compress = true)
+	: type(type), compress(compress)
+    {
+	std::lock_guard<std::mutex> _(temporary_directories_lock);
 
-    if (dtm > 0) {
-	PTM_wins(index, dtm);
-    } else if (dtm < 0) {
-	for (i=0; i<movecnt; i++) {
-	    add_one_to_PNTM_wins(index, dtm);
+	directory = choose_temporary_directory(type);
+
+	if (directory != -1) {
+	    filename = temporary_directories[directory].path + "/";
 	}
-    } else {
-	/* dtm == 0; a discard; just decrement movecnt */
-	nonatomic_entry expected = entriesTable[index];
-	nonatomic_entry desired;
-	if (expected.is_normal_movecnt()) {
-	    do {
-		desired = expected;
-		desired.set_movecnt(desired.get_movecnt() - movecnt);
-	    } while (!entriesTable->compare_exchange_weak(index, expected, desired));
+	filename += (type == TemporaryFile::Entries) ? "entriesXXXXXX" : "proptableXXXXXX";
+
+	std::vector<char> filename_template(filename.begin(), filename.end());
+	filename_template.push_back('\0');
+
+	fd = mkostemp(filename_template.data(), O_RDWR | O_CREAT | O_EXCL);
+	filename = filename_template.data();
+
+	if (fd == -1) {
+	    fatal("Can't open '%s' for writing: %s\n", filename.c_str(), strerror(errno));
+	} else if (directory != -1) {
+	    temporary_directories[directory].open_files.insert(fd);
 	}
+
+	if (use_direct_io) open_io_fd();
     }
 
-}
+    /* Reopen a temporary file left behind by an earlier run, when we're resuming from a checkpoint */
 
-/* back_propagate_index()
- *
- * As we make a single, normal, generation pass through the table, this is what we do to each entry.
- * Check to see if it's unpropagated and its DTM matches the target DTM for this pass.  If so, flag
- * it as propagated and hand it off to a routine, back_propagate_index_within_table(), defined later
- * in the code, that will back out every possible move from this position, do all sorts of subtle things,
- * and finally "adjust" the positions that lead here by calling finalize_update()!
- *
- * Note: if we're using proptables, the call to finalize_update() will be buffered until the next pass.
- */
+    temporary_file(const std::string & filename, TemporaryFile type, bool compress)
+	: filename(filename), type(type), compress(compress), directory(-1)
+    {
+	std::lock_guard<std::mutex> _(temporary_directories_lock);
 
-void back_propagate_index_within_table(index_t index, int reflection);
+	fd = open(filename.c_str(), O_RDWR);
 
-template <bool use_templated_tracking_dtm, bool templated_tracking_dtm, typename EntriesTableType>
-void back_propagate_index(index_t index, int target_dtm, EntriesTableType entriesTable)
-{
-    const bool tracking_dtm = use_templated_tracking_dtm ? templated_tracking_dtm : ::tracking_dtm;
+	if (fd == -1) {
+	    throw std::runtime_error("Can't reopen '" + filename + "': " + strerror(errno));
+	}
 
-    if (((! tracking_dtm) && entriesTable->is_unpropagated(index))
-	|| (tracking_dtm && (entriesTable->get_DTM(index) == target_dtm))) {
+	for (unsigned int i = 0; i < temporary_directories.size(); i ++) {
+	    if (filename.compare(0, temporary_directories[i].path.size() + 1, temporary_directories[i].path + "/") == 0) {
+		directory = i;
+		temporary_directories[i].open_files.insert(fd);
+		break;
+	    }
+	}
 
-	/* What could another processor change?  Well, it's not going to flip the propagated flag,
-	 * because next_backprop_index (below) is atomic, so it's not going to attempt a back prop.
-	 *
-	 * XXX Could the DTM change (don't think so)
-	 */
+	if (use_direct_io) open_io_fd();
+    }
 
-	nonatomic_entry expected = entriesTable[index];
-	nonatomic_entry desired;
+    const std::string & name(void) const
+    {
+	return filename;
+    }
 
-	do {
-	    desired = expected;
-	    desired.flag_as_propagated();
-	} while (!entriesTable->compare_exchange_weak(index, expected, desired));
+    bool compressed(void) const
+    {
+	return compress;
+    }
 
-	/* Symmetry.
-	 *
-	 * The only case we really have to worry about here is diagonal symmetry, because in both
-	 * horizontal and vertical symmetry all of the positions neatly double up, so anytime we'd
-	 * have a move backprop into our symmetry restriction from outside it, a matching move will
-	 * backprop from inside out.
-	 *
-	 * For diagonal symmetry however, things aren't so neat, because squares along the diagonal
-	 * map to themselves.  So positions where both kings are on the diagonal don't have a
-	 * matching double, while the other positions do.  We deal with this here by backproping
-	 * both the position itself and its matching pair (if one exists).  If one doesn't exist,
-	 * then back_propagate_index_within_table() will quickly detect this case (when
-	 * index_to_position returns false).  We also doubled the movecnt of "paired" positions
-	 * during initialization, because moves will be backproped twice from doubled positions to
-	 * doubled positions, not just assumed like the horizontal or vertical cases.
-	 */
+    void preserve(void)
+    {
+	preserved = true;
+    }
 
-	back_propagate_index_within_table(index, REFLECTION_NONE);
-	if (current_tb->symmetry == 8) {
-	    back_propagate_index_within_table(index, REFLECTION_DIAGONAL);
+    std::ostream * ostream(void)
+    {
+	io::filtering_ostream * os = new io::filtering_ostream;
+
+	if (compress) os->push(io::gzip_compressor());
+	if (use_direct_io) {
+	    os->push(direct_io_sink(io_fd));
+	} else {
+	    os->push(device());
 	}
+	os->exceptions(BOOST_IOS::failbit | BOOST_IOS::badbit);
 
-	/* Track statistics.  For the "player wins" statistics, we don't want to count illegal (PNTM
-	 * mated) positions, so we don't increment anything if DTM is 1.
-	 *
-	 * XXX make these stats thread local
-	 */
+	return os;
+    }
 
-	positions_finalized_this_pass ++;
+    std::istream * istream(void)
+    {
+	io::filtering_istream * is = new io::filtering_istream;
 
-	if (expected.does_PTM_win()) {
-	    if (target_dtm > 1) player_wins[index_to_side_to_move(current_tb, index)] ++;
+	if (compress) is->push(io::gzip_decompressor());
+	if (use_direct_io && (type == TemporaryFile::Proptable)) {
+	    is->push(direct_io_source(io_fd, direct_io_proptable_queue_depth, direct_io_proptable_buffer_size));
+	} else if (use_direct_io) {
+	    is->push(direct_io_source(io_fd, direct_io_queue_depth, direct_io_buffer_size));
 	} else {
-	    player_wins[~ index_to_side_to_move(current_tb, index)] ++;
+	    is->push(device());
 	}
+	//is->exceptions(BOOST_IOS::failbit | BOOST_IOS::badbit);
+
+	return is;
     }
-}
 
-void back_propagate_index(index_t index, int target_dtm)
-{
-    back_propagate_index<false, false>(index, target_dtm, entriesTable);
-}
+    ~temporary_file(void)
+    {
+	if (directory != -1) {
+	    std::lock_guard<std::mutex> _(temporary_directories_lock);
+	    temporary_directories[directory].open_files.erase(fd);
+	}
+	if (io_fd != -1) close(io_fd);
+	close(fd);
+	if (! preserved) unlink(filename.c_str());
+    }
+};
 
+class DiskEntriesTable: public EntriesTable {
 
-/* If we're not using proptables, then this section of code spawns off a number of threads to run
- * through the entries table, intra-table backpropagating to a single target DTM.  We could go
- * though the table sequentially, each thread picking the next available entry for processing, but
- * that would create a lot of contention between threads as they access adjacent entries that occupy
- * the same cache line.  Instead, we break the table into large blocks and assign a thread to each
- * one.
- *
- * XXX What happens if part of the table back props a lot faster than another part?  For, say, a ten
- * minute pass with two threads, a 1% difference in speed would result in six seconds of idle time
- * for the faster thread.  Maybe we should use smaller blocks, just big enough to avoid cache
- * conflicts.  On the other hand, Intel processors recognize sequential data access patterns and
- * prefetch data from memory, so there is a clear advantage to a simple sequential access pattern.
- */
+ private:
+    std::istream * entries_read_stream;
+    std::ostream * entries_write_stream;
 
-void back_propagate_section(index_t start_index, index_t end_index, int target_dtm)
-{
-    index_t index;
+    temporary_file * entries_read_device;
+    temporary_file * entries_write_device;
 
-    CompactMemoryEntriesTable * cmet = dynamic_cast<CompactMemoryEntriesTable *>(entriesTable.entriesTable);
-    MemoryEntriesTable * met = dynamic_cast<MemoryEntriesTable *>(entriesTable.entriesTable);
+    std::mutex ready_to_advance_mutex;
+    std::condition_variable ready_to_advance_cond;
+    std::condition_variable ready_to_reset_cond;
+    int threads_waiting_to_advance;
+    int threads_waiting_to_reset;
 
-    if ((cmet != nullptr) && !tracking_dtm) {
-	auto etable = EntriesTablePtr<CompactMemoryEntriesTable>(cmet);
-	for (index = start_index; index <= end_index; index++) {
-	    mark_progress();
-	    back_propagate_index<true, false>(index, target_dtm, etable);
-	}
-    } else if ((met != nullptr) && tracking_dtm) {
-	auto etable = EntriesTablePtr<MemoryEntriesTable>(met);
-	for (index = start_index; index <= end_index; index++) {
-	    mark_progress();
-	    back_propagate_index<true, true>(index, target_dtm, etable);
-	}
-    } else {
-	for (index = start_index; index <= end_index; index++) {
-	    mark_progress();
-	    back_propagate_index(index, target_dtm);
-	}
+    /* This is the in-memory portion of the table, and the index number of the first entry.  */
+
+    atomic_entries_array entries;
+    index_t entry_buffer_start;
+
+    void open_new_entries_write_file(void)
+    {
+	entries_write_device = new temporary_file(TemporaryFile::Entries, compress_entries_table);
+	entries_write_stream = entries_write_device->ostream();
     }
 
-}
+    void advance_entry_buffer(void)
+    {
+	entries >> *entries_write_stream;
 
-void non_proptable_pass(int target_dtm)
-{
-    std::stringstream label;
-    label << "Pass " << std::setw(4) << target_dtm;
+	if (entries_read_device != nullptr) {
+	    entries << *entries_read_stream;
+	} else {
+	    entries.zero();
+	}
 
-    if ((! tracking_dtm) && unpropagated_index_table) {
+	entry_buffer_start += entry_buffer_size;
+    }
 
-	unpropagated_index_table->start_new_pass();
+    void wait_for_all_threads_ready_then_advance_entry_buffer(void) {
+	std::unique_lock<std::mutex> lock(ready_to_advance_mutex);
 
-	if (unpropagated_index_table->last_pass_optimized) {
+	threads_waiting_to_advance ++;
+	if (threads_waiting_to_advance + threads_waiting_to_reset < threads) {
+	    ready_to_advance_cond.wait(lock);
+	} else {
+	    advance_entry_buffer();
+	    threads_waiting_to_advance = 0;
+	    ready_to_advance_cond.notify_all();
+	}
+    }
 
-	    reset_progress_indicator(label.str().c_str(), unpropagated_index_table->size());
+    void reset_files(void) {
 
-	    while (! unpropagated_index_table->empty()) {
-		mark_progress();
-		back_propagate_index(unpropagated_index_table->next_index(), target_dtm);
-	    }
+	/* We're reseting for a new pass.  Write the current buffer out, write out everything left
+	 * in the input file, switch the output file to become the next pass's input file, destroy
+	 * the old input file, and create a new output file.
+	 */
 
-	    end_progress_indicator(positions_finalized_this_pass.load(), "positions finalized");
+	entries >> *entries_write_stream;
 
-	    return;
+	if (entries_read_device != nullptr) {
+	    while (! entries_read_stream->eof()) {
+		entries << *entries_read_stream;
+		entries >> *entries_write_stream;
+	    }
+	    delete entries_read_stream;
+	    delete entries_read_device;
 	}
-    }
 
-    std::thread t[num_threads];
-    unsigned int thread;
-    index_t block_size = current_tb->num_indices / num_threads;
+	entries_read_device = entries_write_device;
 
-    entriesTable->set_threads(num_threads);
+	/* Do this before creating the read stream, because it may need to flush output to
+	 * the old write file, which is the new read file.
+	 */
 
-    reset_progress_indicator(label.str().c_str(), current_tb->num_indices);
+	if (entries_write_stream) delete entries_write_stream;
+	open_new_entries_write_file();
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	index_t start_index = thread*block_size;
-	index_t end_index;
+	entries_read_stream = entries_read_device->istream();
 
-        if (thread != num_threads-1) {
-            end_index = (thread+1)*block_size - 1;
-        } else {
-            end_index = current_tb->num_indices - 1;
-        }
+	entry_buffer_start = 0;
 
-	t[thread] = std::thread(back_propagate_section, start_index, end_index, target_dtm);
+	entries << *entries_read_stream;
     }
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
+    void wait_for_all_threads_ready_then_reset(void) {
+	std::unique_lock<std::mutex> lock(ready_to_advance_mutex);
+
+	threads_waiting_to_reset ++;
+	if (threads_waiting_to_reset < threads) {
+	    ready_to_reset_cond.wait(lock);
+	} else {
+	    reset_files();
+	    threads_waiting_to_reset = 0;
+	    ready_to_reset_cond.notify_all();
+	}
     }
 
-    end_progress_indicator(positions_finalized_this_pass.load(), "positions finalized");
+    void advance_entry_buffer_to_index(index_t index)
+    {
+	if (entry_buffer_start > index) wait_for_all_threads_ready_then_reset();
+	while (index >= entry_buffer_start + entry_buffer_size) {
+	    wait_for_all_threads_ready_then_advance_entry_buffer();
+	}
+    }
 
-    entriesTable->set_threads(1);
-}
+ public:
+    DiskEntriesTable(void) {
 
+	threads_waiting_to_advance = 0;
+	threads_waiting_to_reset = 0;
 
-/***** PROPTABLES *****
- *
- * Proptables are used to optimize back propagation for large tablebases that can not fit into RAM.
- * A proptable is a priority queue that stores pending updates and then retrieves them in index
- * sorted order, allowing a batch of updates to be applied with a single linear pass through the
- * entries array.  We maintain two proptables, the input and the output, and as we make a single
- * pass through the tablebase, we're simultaneously committing changes from the input into the
- * current tablebase, and saving into the output any changes being generated.
- *
- * Or not.  We can disable proptables, which forces the program to use a random access pattern on
- * the entries array.  This is currently faster if the entries array can fit into RAM.  In code,
- * commit_update either calls finalize_update immediately (no proptable; random access) or enqueues
- * the update into the output proptable, so that it will later be retrieved and finalized in the
- * next call to proptable_pass, when the output proptable will have become the input proptable.
- *
- * XXX I used to have an option to store a PTM-wins-flag instead of DTM in the proptable entry to
- * make it smaller.  The only time it makes sense to use a PTM-wins-flag in the proptable is if
- * we're generating a bitbase (because otherwise we need a DTM field in the proptable).  Positive or
- * negative DTM values translate directly through to PTM wins or to its inverse, PNTM wins.  The
- * oddball is zero DTM, a draw, which only happens here if we're back propagating from a DTM
- * futurebase.  In that case, we need to look at the sense of the bitbase (white-wins or
- * white-draws), as well as which player is PTM to decide if we should set or clear the propentry's
- * flag.  I took this code out (for now).
- *
- * THE PRIORITY QUEUE
- *
- * I crafted my own priority_queue because I'm not happy with any of the existing options.
- *
- * The standard library's priority_queue holds everything in memory and thus can't deal effectively
- * with very large data sets.
- *
- * TPIE's priority_queue uses the disk, but isn't thread safe and can't compress its disk files.
- *
- * Mine is build from several pieces: an in-memory table; a templated class that dumps a container
- * to disk, then reads it back; a sorting network to read the files back in when we retreive.
- */
+	entry_buffer_start = 0;
 
-struct proptable_format {
-    int index_offset;
-    int index_bits;
-    int dtm_offset;
-    int dtm_bits;
-    int movecnt_offset;
-    int movecnt_bits;
-    int futuremove_offset;
-    int futuremove_bits;
-    uint64_t index_mask;
-    uint64_t dtm_mask;
-    uint64_t movecnt_mask;
-    uint64_t futuremove_mask;
-    int bits;
+	entries_read_device = nullptr;
+	open_new_entries_write_file();
 
-    proptable_format(index_t num_indices, int min_dtm, int max_dtm, int movecnt_bits, int max_futuremoves)
-	: movecnt_bits(movecnt_bits) {
+	print_current_format();
+    }
 
-	/* Tricky, tricky, tricky... 2^index_bits must be greater than or equal to num_indices.  dtm
-	 * ranges in [min_dtm, max_dtm] inclusive, so 2^(dtm_bits-1) must be strictly greater than
-	 * max_dtm and 2^(dtm_bits-1) must be greater than or equal to -min_dtm.  futuremove numbers
-	 * range from 0 to max_futuremoves-1, so 2^futuremove_bits must be greater than or equal to
-	 * max_futuremoves... and the senses of the comparisons are reversed for the loop!  Hope I
-	 * got it all right!
-	 */
+    /* Resume from a checkpointed entries file, leaving us in the same state reset_files() would */
 
-	for (index_bits = 1; (1ULL << index_bits) < num_indices; index_bits ++);
+    DiskEntriesTable(temporary_file * entries_file) {
 
-	if ((max_dtm != 0) || (min_dtm != 0)) {
-	    for (dtm_bits = 1; (1 << (dtm_bits - 1) <= max_dtm) || (1 << (dtm_bits - 1) < -min_dtm); dtm_bits ++);
-	} else {
-	    dtm_bits = 0;
-	}
+	threads_waiting_to_advance = 0;
+	threads_waiting_to_reset = 0;
 
-	for (futuremove_bits = 0; (1 << futuremove_bits) < (max_futuremoves + 1); futuremove_bits ++);
+	entry_buffer_start = 0;
 
-	/* Ordering is significant, since we may sort by directly comparing the marshaled values to
-	 * each other.  Therefore, index has to be the most significant field.
-	 */
+	entries_read_device = entries_file;
+	entries_read_stream = entries_read_device->istream();
+	open_new_entries_write_file();
 
-	dtm_offset = 0;
-	movecnt_offset = dtm_bits;
-	futuremove_offset = movecnt_offset + movecnt_bits;
-	index_offset = futuremove_offset + futuremove_bits;
+	entries << *entries_read_stream;
 
-	index_mask = (1ULL << index_bits) - 1;
-	dtm_mask = (1ULL << dtm_bits) - 1;
-	movecnt_mask = (1ULL << movecnt_bits) - 1;
-	futuremove_mask = (1ULL << futuremove_bits) - 1;
+	print_current_format();
+    }
 
-	bits = index_offset + index_bits;
+    /* Called (single threaded) between passes.  Flush everything from the last pass into a
+     * complete entries file, which becomes the input file for the next pass, and return it.
+     */
+
+    temporary_file * checkpoint(void) {
+	reset_files();
+	return entries_read_device;
+    }
+
+    ~DiskEntriesTable(void) {
+	if (entries_read_device != nullptr) delete entries_read_device;
+	if (entries_write_device != nullptr) delete entries_write_device;
+    }
+
+    const nonatomic_entry operator[](const index_t index) {
+	advance_entry_buffer_to_index(index);
+
+	return entries[index - entry_buffer_start];
+    }
+
+    void set(const index_t index, const nonatomic_entry & value) {
+	advance_entry_buffer_to_index(index);
+
+	entries[index - entry_buffer_start] = value;
+    }
+
+    bool compare_exchange_weak(const index_t index, nonatomic_entry & expected, const nonatomic_entry & desired) {
+	advance_entry_buffer_to_index(index);
+
+	return entries[index - entry_buffer_start].compare_exchange_weak(expected, desired);
     }
 };
 
-/* A simple disk-backed que.
- *
- * Template argument Container is the in-memory container class we're backing up, and it has to be a
- * contiguous array.  It has to provide a value_type typedef and an iterator typedef.  Our
- * constructor takes a pair of iterators.  They have to provide a base() method that returns a
- * pointer.  Our semantics are to make a copy of the container and export a pop_front() method to
- * walk through our data.
- *
- * Caveat: Instances of this class can not be copied, because then both copies would have the same
- * file descriptor and the first one destroyed would close it.
- *
- * For bit-aligned proptables, we don't actually use this class, but specialize it later.
- */
 
-template <typename Container>
-struct disk_que {
-    typedef typename Container::value_type value_type;
+/***** INTRA-TABLE BACK PROPAGATION *****/
 
-    temporary_file * file;
-    std::istream * is;
 
-    value_type last;
+EntriesTablePtr<EntriesTable> entriesTable;
 
-    int size;
-    int next;
+/* Unpropagated index tracker.
+ *
+ * If this is a bitbase calculation, then on each pass through the table, we process the indices
+ * that were flagged unpropagated on the last pass.  A non-bitbase, distance calculation might have
+ * additional entries that need to processed, entries that were injected from a futurebase at a
+ * particular distance.  In the bitbase case, we can optimize by keeping a list of unpropagated
+ * indices, adding to it every time we flag one, and on the next pass only process the indices on
+ * the list.  Otherwise, we have to sweep through the entire tablebase to find the unpropagated
+ * indices.  Also, if there's lot of unpropagated indices, then this table would become huge.
+ * So we fix its size at compile time, and if it overflows, then we fall back on sweeping
+ * through the entire tablebase.  Plus, we're running multithreaded, so it all has to be
+ * done with locks.
+ *
+ * Default table size is 1 MB, though this can be adjusted with the "-U" option.
+ */
 
-    disk_que(typename Container::iterator head, typename Container::iterator tail)
-	: size(tail - head), next(0)
+struct UnpropagatedIndexTable {
+    size_t total_size;
+    index_t * unpropagated_indices;
+    size_t count = 0;
+    size_t last_pass_count = 0;
+    size_t next_pop = 0;
+    bool tracking = false;
+    bool last_pass_optimized = false;
+    bool direction = false;
+    std::mutex lock;
+
+    UnpropagatedIndexTable(size_t size) : total_size(size)
     {
-	/* If we're compressing, convert the sorted array into a delta encoded list, which improves
-	 * gzip's ability to compress proptables dramatically.
-	 *
-	 * XXX changes contents of the data passed into the function, but we can get away with this
-	 * because we know it's about to be throw away
-	 */
+	size_t bytes = total_size * sizeof(index_t);
 
-	if (compress_proptables) {
-	    value_type last = *head;
-	    for (auto it=head+1; it < tail; it++) {
-		*it -= last;
-		last += *it;
+	try {
+	    unpropagated_indices = new index_t[total_size];
+
+	    if (bytes < 1024*1024) {
+		info("Malloced %zdKB for unpropagated index table\n", bytes/1024);
+	    } else {
+		info("Malloced %zdMB for unpropagated index table\n", bytes/(1024*1024));
 	    }
+	} catch (std::bad_alloc ex) {
+	    fatal("Can't malloc %zdMB for unpropagated index table: %s\n", bytes/(1024*1024), ex.what());
 	}
 
-	file = new temporary_file("proptableXXXXXX", compress_proptables);
+    }
 
-	std::ostream * os = file->ostream();
-	os->write(reinterpret_cast<char *>(head.base()), size * sizeof(value_type));
-	delete os;
+    void start_new_pass(void)
+    {
+	last_pass_optimized = tracking;
+	tracking = true;
 
-	is = file->istream();
-    }
+	last_pass_count = count;
+	count = 0;
 
-    ~disk_que() {
-	delete is;
-	delete file;
-    }
+	next_pop = 0;
 
-    bool empty(void) {
-	return (next == size);
+	direction = ! direction;
     }
 
-    value_type pop_front(void) {
-	value_type val;
-	if (empty()) throw std::runtime_error("read past end of disk_que");
-	is->read(reinterpret_cast<char *>(&val), sizeof(value_type));
+    void track(const index_t index)
+    {
+	if (tracking) {
+	    std::unique_lock<std::mutex> _(lock);
 
-	/* Back out delta encoding introduced above */
-	if (compress_proptables) {
-	    if (next > 0) {
-		val += last;
+	    if (count + last_pass_count < total_size) {
+		if (direction) {
+		    unpropagated_indices[count] = index;
+		} else {
+		    unpropagated_indices[total_size - count - 1] = index;
+		}
+		count ++;
+	    } else {
+		tracking = false;
+		count = 0;
 	    }
-	    last = val;
 	}
+    }
 
-	next ++;
-	return val;
+    bool empty(void)
+    {
+	// XXX not thread safe (but not currently used in threaded code)
+	return (next_pop == last_pass_count);
     }
-};
 
-/* A sorting network.
- *
- * We're reading from a container of pointers to subcontainers.  Each subcontainer is itself sorted,
+    size_t size(void)
+    {
+	return (last_pass_count - next_pop);
+    }
+
+    index_t next_index(void)
+    {
+	// XXX not thread safe (but not currently used in threaded code)
+	// XXX should through exception if empty()
+	index_t retval;
+	if (direction) {
+	    retval = unpropagated_indices[total_size - next_pop - 1];
+	} else {
+	    retval = unpropagated_indices[next_pop];
+	}
+	next_pop ++;
+	return retval;
+    }
+
+
+};
+
+UnpropagatedIndexTable * unpropagated_index_table = NULL;
+size_t unpropagated_index_table_MBs = 1;
+
+/* finalize_update()
+ *
+ * starting with PTM_wins() and add_one_to_PNTM_wins()
+ *
+ * finalize_update() is called once we've labeled a position won for either one player or the other,
+ * backed out its moves, figured out a position that leads to it in one move, and are ready to
+ * update that other postion with the knowledge that either PTM can win, or that some of the moves
+ * that lead out of it result in PNTM wins.
+ *
+ * Starting with 1.816, I've introduced a lockless update that uses C++11's atomic compare-exchange
+ * primitive.  If another processor changes the entry while we're working on it, we go back and do
+ * the calculation again.  The locks ran pretty quick, but burned a bit on each entry.
+ */
+
+inline void PTM_wins(index_t index, int dtm)
+{
+    nonatomic_entry expected = entriesTable[index];
+    nonatomic_entry desired;
+
+    if (index == debug_move) {
+	info("PTM_wins; index=%" PRIindex "; dtm=%d; table dtm=%d\n",
+	     index, dtm, expected.get_raw_DTM());
+    }
+
+    do {
+	desired = expected;
+
+	if (dtm < 0) {
+
+	    fatal("Negative distance to mate in PTM_wins!?\n");
+
+	} else if (desired.is_normal_movecnt()) {
+
+	    /* In ordinary chess, we should never get here with MOVECNT_PNTM_WINS_UNPROPED (or
+	     * PROPED) because we have to have decremented the movecnt already to zero to have
+	     * gotten either of those flags.  However, if this is a suicide analysis, we can get a
+	     * MOVECNT_PNTM_WINS from a forced capture, so we have to exclude this cases.  In any
+	     * event, this code fragment only runs for a "normal" movecnt field - none of the five
+	     * special cases.
+	     */
+
+	    desired.set_PTM_wins_unpropagated();
+	    desired.set_raw_DTM(dtm);
+	    if (dtm <= max_tracked_dtm) positive_passes_needed[dtm] = true;
+
+	} else if ((dtm < desired.get_raw_DTM())
+		   && (desired.does_PTM_win())
+		   && (desired.is_unpropagated())) {
+
+	    /* This can happen if we get a PTM mate during futurebase back prop, then, later during
+	     * futurebase back prop or during intra-table back prop, improve upon the mate.
+	     */
+
+	    desired.set_raw_DTM(dtm);
+	    if (dtm <= max_tracked_dtm) positive_passes_needed[dtm] = true;
+	}
+    } while (!entriesTable->compare_exchange_weak(index, expected, desired));
+
+    if ((! tracking_dtm) && expected.is_normal_movecnt() && desired.is_unpropagated()) {
+	if (unpropagated_index_table) {
+	    unpropagated_index_table->track(index);
+	}
+    }
+}
+
+inline void add_one_to_PNTM_wins(index_t index, int dtm)
+{
+    nonatomic_entry expected = entriesTable[index];
+    nonatomic_entry desired;
+
+    if (index == debug_move) {
+	info("add_one_to_PNTM_wins; index=%" PRIindex "; dtm=%d; table dtm=%d\n",
+	     index, dtm, expected.get_raw_DTM());
+    }
+
+    do {
+	desired = expected;
+
+	if (dtm > 0) {
+	    fatal("Positive distance to mate in PNTM_wins!?\n");
+	} else if (desired.is_normal_movecnt()) {
+
+	    /* Again, this is the code for a "normal" movecnt field. */
+
+	    // XXX entriesTable[index].movecnt --;
+	    desired.set_movecnt(desired.get_movecnt() - 1);
+
+	    if ((dtm < desired.get_raw_DTM()) && (desired.get_raw_DTM() <= 0)) {
+		/* Since this is PNTM wins, PTM will make the move leading to the slowest mate. */
+		desired.set_raw_DTM(dtm);
+	    }
+
+	    if (desired.does_PNTM_win()) {
+		/* This call pushed movecnt to zero, but the passed-in DTM might not be the best line,
+		 * so that's why we fetch entry DTM here.
+		 */
+		dtm = desired.get_raw_DTM();
+#ifdef DEBUG_PASS_DEPENDANCIES
+		if ((dtm >= min_tracked_dtm) && (! negative_passes_needed[-dtm])) {
+		    global_position_t global;
+		    index_to_global_position(current_tb, index, &global);
+		    printf("%d pass needed by %" PRIindex " %s\n",
+			   dtm, index, global_position_to_FEN(&global));
+		}
+#endif
+		if (dtm >= min_tracked_dtm) negative_passes_needed[-dtm] = true;
+	    }
+	}
+    } while (!entriesTable->compare_exchange_weak(index, expected, desired));
+
+    if ((! tracking_dtm) && expected.is_normal_movecnt() && desired.is_unpropagated()) {
+	if (unpropagated_index_table) {
+	    unpropagated_index_table->track(index);
+	}
+    }
+}
+
+/* For suicide analysis, we want to know if the current pass is backproping
+ * from a capture or promotion-capture futurebase.
+ *
+ * It's thread local because several futurebases can be back propagated at once, so each worker
+ * thread sets it from the futurebase_job it's working on.
+ *
+ * XXX is there a more elegant way to flag this than using a global variable?
+ */
+
+thread_local bool doing_capture_backprop = false;
+
+void finalize_update(index_t index, short dtm, short movecnt, int futuremove)
+{
+    int i;
+
+#if 0
+    /* Skip everything if the position isn't valid.  In particular, we don't track futuremove
+     * propagation for illegal positions.
+     */
+
+    if (get_entry_raw_DTM(index) == 1) return;
+#endif
+
+    /* If we're doing a suicide analysis, captures are forced, so we never want to back-propagate a
+     * non-capture move into a position where a capture was possible.
+     */
+
+    if ((current_tb->variant == Variant::Suicide)
+	&& !doing_capture_backprop
+	&& entriesTable[index].is_capture_possible()) {
+	return;
+    }
+
+    /* The guts of committing an update into the entries table. */
+
+    if (dtm > 0) {
+	PTM_wins(index, dtm);
+    } else if (dtm < 0) {
+	for (i=0; i<movecnt; i++) {
+	    add_one_to_PNTM_wins(index, dtm);
+	}
+    } else {
+	/* dtm == 0; a discard; just decrement movecnt */
+	nonatomic_entry expected = entriesTable[index];
+	nonatomic_entry desired;
+	if (expected.is_normal_movecnt()) {
+	    do {
+		desired = expected;
+		desired.set_movecnt(desired.get_movecnt() - movecnt);
+	    } while (!entriesTable->compare_exchange_weak(index, expected, desired));
+	}
+    }
+
+}
+
+/* back_propagate_index()
+ *
+ * As we make a single, normal, generation pass through the table, this is what we do to each entry.
+ * Check to see if it's unpropagated and its DTM matches the target DTM for this pass.  If so, flag
+ * it as propagated and hand it off to a routine, back_propagate_index_within_table(), defined later
+ * in the code, that will back out every possible move from this position, do all sorts of subtle things,
+ * and finally "adjust" the positions that lead here by calling finalize_update()!
+ *
+ * Note: if we're using proptables, the call to finalize_update() will be buffered until the next pass.
+ */
+
+void back_propagate_index_within_table(index_t index, int reflection);
+
+template <bool use_templated_tracking_dtm, bool templated_tracking_dtm, typename EntriesTableType>
+void back_propagate_index(index_t index, int target_dtm, EntriesTableType entriesTable)
+{
+    const bool tracking_dtm = use_templated_tracking_dtm ? templated_tracking_dtm : ::tracking_dtm;
+
+    if (((! tracking_dtm) && entriesTable->is_unpropagated(index))
+	|| (tracking_dtm && (entriesTable->get_DTM(index) == target_dtm))) {
+
+	/* What could another processor change?  Well, it's not going to flip the propagated flag,
+	 * because next_backprop_index (below) is atomic, so it's not going to attempt a back prop.
+	 *
+	 * XXX Could the DTM change (don't think so)
+	 */
+
+	nonatomic_entry expected = entriesTable[index];
+	nonatomic_entry desired;
+
+	do {
+	    desired = expected;
+	    desired.flag_as_propagated();
+	} while (!entriesTable->compare_exchange_weak(index, expected, desired));
+
+	/* Symmetry.
+	 *
+	 * The only case we really have to worry about here is diagonal symmetry, because in both
+	 * horizontal and vertical symmetry all of the positions neatly double up, so anytime we'd
+	 * have a move backprop into our symmetry restriction from outside it, a matching move will
+	 * backprop from inside out.
+	 *
+	 * For diagonal symmetry however, things aren't so neat, because squares along the diagonal
+	 * map to themselves.  So positions where both kings are on the diagonal don't have a
+	 * matching double, while the other positions do.  We deal with this here by backproping
+	 * both the position itself and its matching pair (if one exists).  If one doesn't exist,
+	 * then back_propagate_index_within_table() will quickly detect this case (when
+	 * index_to_position returns false).  We also doubled the movecnt of "paired" positions
+	 * during initialization, because moves will be backproped twice from doubled positions to
+	 * doubled positions, not just assumed like the horizontal or vertical cases.
+	 */
+
+	back_propagate_index_within_table(index, REFLECTION_NONE);
+	if (current_tb->symmetry == 8) {
+	    back_propagate_index_within_table(index, REFLECTION_DIAGONAL);
+	}
+
+	/* Track statistics.  For the "player wins" statistics, we don't want to count illegal (PNTM
+	 * mated) positions, so we don't increment anything if DTM is 1.
+	 *
+	 * XXX make these stats thread local
+	 */
+
+	positions_finalized_this_pass ++;
+
+	if (expected.does_PTM_win()) {
+	    if (target_dtm > 1) player_wins[index_to_side_to_move(current_tb, index)] ++;
+	} else {
+	    player_wins[~ index_to_side_to_move(current_tb, index)] ++;
+	}
+    }
+}
+
+void back_propagate_index(index_t index, int target_dtm)
+{
+    back_propagate_index<false, false>(index, target_dtm, entriesTable);
+}
+
+
+/* If we're not using proptables, then this section of code spawns off a number of threads to run
+ * through the entries table, intra-table backpropagating to a single target DTM.  We could go
+ * though the table sequentially, each thread picking the next available entry for processing, but
+ * that would create a lot of contention between threads as they access adjacent entries that occupy
+ * the same cache line.  Instead, we break the table into large blocks and assign a thread to each
+ * one.
+ *
+ * XXX What happens if part of the table back props a lot faster than another part?  For, say, a ten
+ * minute pass with two threads, a 1% difference in speed would result in six seconds of idle time
+ * for the faster thread.  Maybe we should use smaller blocks, just big enough to avoid cache
+ * conflicts.  On the other hand, Intel processors recognize sequential data access patterns and
+ * prefetch data from memory, so there is a clear advantage to a simple sequential access pattern.
+ */
+
+void back_propagate_section(index_t start_index, index_t end_index, int target_dtm)
+{
+    index_t index;
+
+    CompactMemoryEntriesTable * cmet = dynamic_cast<CompactMemoryEntriesTable *>(entriesTable.entriesTable);
+    MemoryEntriesTable * met = dynamic_cast<MemoryEntriesTable *>(entriesTable.entriesTable);
+
+    if ((cmet != nullptr) && !tracking_dtm) {
+	auto etable = EntriesTablePtr<CompactMemoryEntriesTable>(cmet);
+	for (index = start_index; index <= end_index; index++) {
+	    mark_progress();
+	    back_propagate_index<true, false>(index, target_dtm, etable);
+	}
+    } else if ((met != nullptr) && tracking_dtm) {
+	auto etable = EntriesTablePtr<MemoryEntriesTable>(met);
+	for (index = start_index; index <= end_index; index++) {
+	    mark_progress();
+	    back_propagate_index<true, true>(index, target_dtm, etable);
+	}
+    } else {
+	for (index = start_index; index <= end_index; index++) {
+	    mark_progress();
+	    back_propagate_index(index, target_dtm);
+	}
+    }
+
+}
+
+void non_proptable_pass(int target_dtm)
+{
+    std::stringstream label;
+    label << "Pass " << std::setw(4) << target_dtm;
+
+    if ((! tracking_dtm) && unpropagated_index_table) {
+
+	unpropagated_index_table->start_new_pass();
+
+	if (unpropagated_index_table->last_pass_optimized) {
+
+	    reset_progress_indicator(label.str().c_str(), unpropagated_index_table->size());
+
+	    while (! unpropagated_index_table->empty()) {
+		mark_progress();
+		back_propagate_index(unpropagated_index_table->next_index(), target_dtm);
+	    }
+
+	    end_progress_indicator(positions_finalized_this_pass.load(), "positions finalized");
+
+	    return;
+	}
+    }
+
+    std::thread t[num_threads];
+    unsigned int thread;
+    index_t block_size = current_tb->num_indices / num_threads;
+
+    entriesTable->set_threads(num_threads);
+
+    reset_progress_indicator(label.str().c_str(), current_tb->num_indices);
+
+    for (thread = 0; thread < num_threads; thread ++) {
+	index_t start_index = thread*block_size;
+	index_t end_index;
+
+        if (thread != num_threads-1) {
+            end_index = (thread+1)*block_size - 1;
+        } else {
+            end_index = current_tb->num_indices - 1;
+        }
+
+	t[thread] = std::thread(back_propagate_section, start_index, end_index, target_dtm);
+    }
+
+    for (thread = 0; thread < num_threads; thread ++) {
+	t[thread].join();
+    }
+
+    end_progress_indicator(positions_finalized_this_pass.load(), "positions finalized");
+
+    entriesTable->set_threads(1);
+}
+
+
+/***** PROPTABLES *****
+ *
+ * Proptables are used to optimize back propagation for large tablebases that can not fit into RAM.
+ * A proptable is a priority queue that stores pending updates and then retrieves them in index
+ * sorted order, allowing a batch of updates to be applied with a single linear pass through the
+ * entries array.  We maintain two proptables, the input and the output, and as we make a single
+ * pass through the tablebase, we're simultaneously committing changes from the input into the
+ * current tablebase, and saving into the output any changes being generated.
+ *
+ * Or not.  We can disable proptables, which forces the program to use a random access pattern on
+ * the entries array.  This is currently faster if the entries array can fit into RAM.  In code,
+ * commit_update either calls finalize_update immediately (no proptable; random access) or enqueues
+ * the update into the output proptable, so that it will later be retrieved and finalized in the
+ * next call to proptable_pass, when the output proptable will have become the input proptable.
+ *
+ * XXX I used to have an option to store a PTM-wins-flag instead of DTM in the proptable entry to
+ * make it smaller.  The only time it makes sense to use a PTM-wins-flag in the proptable is if
+ * we're generating a bitbase (because otherwise we need a DTM field in the proptable).  Positive or
+ * negative DTM values translate directly through to PTM wins or to its inverse, PNTM wins.  The
+ * oddball is zero DTM, a draw, which only happens here if we're back propagating from a DTM
+ * futurebase.  In that case, we need to look at the sense of the bitbase (white-wins or
+ * white-draws), as well as which player is PTM to decide if we should set or clear the propentry's
+ * flag.  I took this code out (for now).
+ *
+ * THE PRIORITY QUEUE
+ *
+ * I crafted my own priority_queue because I'm not happy with any of the existing options.
+ *
+ * The standard library's priority_queue holds everything in memory and thus can't deal effectively
+ * with very large data sets.
+ *
+ * TPIE's priority_queue uses the disk, but isn't thread safe and can't compress its disk files.
+ *
+ * Mine is build from several pieces: an in-memory table; a templated class that dumps a container
+ * to disk, then reads it back; a sorting network to read the files back in when we retreive.
+ */
+
+struct proptable_format {
+    int index_offset;
+    int index_bits;
+    int dtm_offset;
+    int dtm_bits;
+    int movecnt_offset;
+    int movecnt_bits;
+    int futuremove_offset;
+    int futuremove_bits;
+    uint64_t index_mask;
+    uint64_t dtm_mask;
+    uint64_t movecnt_mask;
+    uint64_t futuremove_mask;
+    int bits;
+
+    proptable_format(index_t num_indices, int min_dtm, int max_dtm, int movecnt_bits, int max_futuremoves)
+	: movecnt_bits(movecnt_bits) {
+
+	/* Tricky, tricky, tricky... 2^index_bits must be greater than or equal to num_indices.  dtm
+	 * ranges in [min_dtm, max_dtm] inclusive, so 2^(dtm_bits-1) must be strictly greater than
+	 * max_dtm and 2^(dtm_bits-1) must be greater than or equal to -min_dtm.  futuremove numbers
+	 * range from 0 to max_futuremoves-1, so 2^futuremove_bits must be greater than or equal to
+	 * max_futuremoves... and the senses of the comparisons are reversed for the loop!  Hope I
+	 * got it all right!
+	 */
+
+	for (index_bits = 1; (1ULL << index_bits) < num_indices; index_bits ++);
+
+	if ((max_dtm != 0) || (min_dtm != 0)) {
+	    for (dtm_bits = 1; (1 << (dtm_bits - 1) <= max_dtm) || (1 << (dtm_bits - 1) < -min_dtm); dtm_bits ++);
+	} else {
+	    dtm_bits = 0;
+	}
+
+	for (futuremove_bits = 0; (1 << futuremove_bits) < (max_futuremoves + 1); futuremove_bits ++);
+
+	/* Ordering is significant, since we may sort by directly comparing the marshaled values to
+	 * each other.  Therefore, index has to be the most significant field.
+	 */
+
+	dtm_offset = 0;
+	movecnt_offset = dtm_bits;
+	futuremove_offset = movecnt_offset + movecnt_bits;
+	index_offset = futuremove_offset + futuremove_bits;
+
+	index_mask = (1ULL << index_bits) - 1;
+	dtm_mask = (1ULL << dtm_bits) - 1;
+	movecnt_mask = (1ULL << movecnt_bits) - 1;
+	futuremove_mask = (1ULL << futuremove_bits) - 1;
+
+	bits = index_offset + index_bits;
+    }
+};
+
+/* A simple disk-backed que.
+ *
+ * Template argument Container is the in-memory container class we're backing up, and it has to be a
+ * contiguous array.  It has to provide a value_type typedef and an iterator typedef.  Our
+ * constructor takes a pair of iterators.  They have to provide a base() method that returns a
+ * pointer.  Our semantics are to make a copy of the container and export a pop_front() method to
+ * walk through our data.
+ *
+ * Caveat: Instances of this class can not be copied, because then both copies would have the same
+ * file descriptor and the first one destroyed would close it.
+ *
+ * For bit-aligned proptables, we don't actually use this class, but specialize it later.
+ */
+
+template <typename Container>
+struct disk_que {
+    typedef typename Container::value_type value_type;
+
+    temporary_file * file;
+    std::istream * is;
+
+    value_type last;
+
+    int size;
+    int next;
+
+    disk_que(typename Container::iterator head, typename Container::iterator tail)
+	: size(tail - head), next(0)
+    {
+	/* If we're compressing, convert the sorted array into a delta encoded list, which improves
+	 * gzip's ability to compress proptables dramatically.
+	 *
+	 * XXX changes contents of the data passed into the function, but we can get away with this
+	 * because we know it's about to be throw away
+	 */
+
+	if (compress_proptables) {
+	    value_type last = *head;
+	    for (auto it=head+1; it < tail; it++) {
+		*it -= last;
+		last += *it;
+	    }
+	}
+
+	file = new temporary_file(TemporaryFile::Proptable, compress_proptables);
+
+	std::ostream * os = file->ostream();
+	os->write(reinterpret_cast<char *>(head.base()), size * sizeof(value_type));
+	delete os;
+
+	is = file->istream();
+    }
+
+    /* Reopen a disk_que that was checkpointed by an earlier run */
+
+    disk_que(temporary_file * file, int size)
+	: file(file), size(size), next(0)
+    {
+	is = file->istream();
+    }
+
+    ~disk_que() {
+	delete is;
+	delete file;
+    }
+
+    bool empty(void) {
+	return (next == size);
+    }
+
+    value_type pop_front(void) {
+	value_type val;
+	if (empty()) throw std::runtime_error("read past end of disk_que");
+	is->read(reinterpret_cast<char *>(&val), sizeof(value_type));
+
+	/* Back out delta encoding introduced above */
+	if (compress_proptables) {
+	    if (next > 0) {
+		val += last;
+	    }
+	    last = val;
+	}
+
+	next ++;
+	return val;
+    }
+};
+
+/* A sorting network.
+ *
+ * We're reading from a container of pointers to subcontainers.  Each subcontainer is itself sorted,
  * but now we impose a total sort on all of them.  We do this by maintaining a binary tree (the
  * sorting network), with the subcontainers 'feeding' the leaves and each non-leaf being the
  * less-than comparison of the two nodes below it.  We also track which subcontainer each entry came
@@ -9895,5605 +11577,7755 @@ struct disk_que {
  * and run back up the tree from that leaf only, recomputing the comparisons.  It's laid out in
  * memory as an array, like this (in this example, highbit is 4):
  *
- *                    -4
- *                   /
- *                /-2--5
- *               1
- *                \-3--6
- *		     \
- *                    -7
+ *                    -4
+ *                   /
+ *                /-2--5
+ *               1
+ *                \-3--6
+ *		     \
+ *                    -7
+ *
+ * so that we can run that last step (backing up the tree, from right to left, in the diagram), just
+ * by right shifting the index.  I got this idea from Knuth.
+ */
+
+template <class Container>
+class sorting_network {
+
+    typedef typename Container::value_type SubcontainerPtr;
+    typedef typename dereference<SubcontainerPtr>::type Subcontainer;
+    typedef typename Subcontainer::value_type T;
+
+private:
+    Container * containers;
+    T * network;
+    int * container_num;
+    unsigned int highbit;
+
+    /* We don't initialize until the first retrieval request, which allows 'containers' to be
+     * modified, initially.  After we start retrieving, we expect 'containers' to be untouched.
+     */
+
+    void initialize_network(void) {
+
+	for (highbit = 1; highbit < containers->size(); highbit <<= 1);
+
+	network = new T[2 * highbit];
+	container_num = new int[2 * highbit];
+
+	/* Fill in the upper half of the network with either the first entry from a disk queue, or
+	 * an "infinite" entry for slots with no proptables.
+	 */
+
+	for (unsigned int i=0; i<highbit; i++) {
+	    if (i < containers->size()) {
+		network[highbit + i] = (*containers)[i]->pop_front();
+		container_num[highbit + i] = i;
+	    } else {
+		container_num[highbit + i] = -1;
+	    }
+	}
+
+	/* Then, sort into the lower half of the network. */
+
+	for (int network_node = highbit-1; network_node > 0; network_node --) {
+	    if (container_num[2*network_node] == -1) {
+		network[network_node] = network[2*network_node + 1];
+		container_num[network_node] = container_num[2*network_node + 1];
+	    } else if (container_num[2*network_node + 1] == -1) {
+		network[network_node] = network[2*network_node];
+		container_num[network_node] = container_num[2*network_node];
+	    } else if (network[2*network_node] < network[2*network_node + 1]) {
+		network[network_node] = network[2*network_node];
+		container_num[network_node] = container_num[2*network_node];
+	    } else {
+		network[network_node] = network[2*network_node + 1];
+		container_num[network_node] = container_num[2*network_node + 1];
+	    }
+	}
+    }
+
+public:
+
+    sorting_network(Container * containers):
+	containers(containers), network(nullptr), container_num(nullptr), highbit(0)
+    { }
+
+    ~sorting_network() {
+	if (network) delete[] network;
+	if (container_num) delete[] container_num;
+    }
+
+    bool empty(void) {
+	return (highbit == 0) ? containers->empty() : (container_num[1] == -1);
+    }
+
+    const T& front(void) {
+	if (highbit == 0) initialize_network();
+	return network[1];
+    }
+
+    T pop_front(void) {
+	if (highbit == 0) initialize_network();
+
+	T retval = network[1];
+	int network_node = highbit + container_num[1];
+
+	if ((*containers)[container_num[1]]->empty()) {
+	    container_num[network_node] = -1;
+	} else {
+	    network[network_node] = (*containers)[container_num[1]]->pop_front();
+	}
+
+	while (network_node > 1) {
+	    network_node >>= 1;
+	    if (container_num[2*network_node] == -1) {
+		network[network_node] = network[2*network_node + 1];
+		container_num[network_node] = container_num[2*network_node + 1];
+	    } else if (container_num[2*network_node + 1] == -1) {
+		network[network_node] = network[2*network_node];
+		container_num[network_node] = container_num[2*network_node];
+	    } else if (network[2*network_node] < network[2*network_node + 1]) {
+		network[network_node] = network[2*network_node];
+		container_num[network_node] = container_num[2*network_node];
+	    } else {
+		network[network_node] = network[2*network_node + 1];
+		container_num[network_node] = container_num[2*network_node + 1];
+	    }
+	}
+
+	return retval;
+    }
+};
+
+/* The proptable memory arena.
+ *
+ * Every proptable pass constructs a new output proptable just after the old output proptable
+ * (now the input proptable) has freed its in-memory buffers in prepare_to_retrieve(), and all of
+ * these buffers are the same size.  Instead of handing multi-gigabyte buffers back to the system
+ * and then page faulting them all back in on the next pass, we allocate them from this arena,
+ * which keeps freed blocks on a free list and hands them back out on the next request of the same
+ * size.  The net effect is that the same memory alternates between the input and output roles.
+ *
+ * arena_allocator is a std::allocator replacement that allocates from the arena.  It also
+ * default-initializes instead of value-initializing, so std::vector<T, arena_allocator<T>>(n)
+ * doesn't zero a recycled buffer on every pass.
+ */
+
+class memory_arena {
+
+ private:
+    std::mutex lock;
+    std::multimap<size_t, void *> free_blocks;
+    size_t bytes_allocated = 0;
+
+ public:
+    void * allocate(size_t bytes) {
+	std::lock_guard<std::mutex> _(lock);
+
+	auto it = free_blocks.find(bytes);
+	if (it != free_blocks.end()) {
+	    void * ptr = it->second;
+	    free_blocks.erase(it);
+	    return ptr;
+	}
+
+	void * ptr = ::operator new(bytes);
+	bytes_allocated += bytes;
+
+	if (bytes >= 1024*1024) {
+	    info("Allocated %zdMB for proptable buffer (%zdMB total)\n", bytes/(1024*1024), bytes_allocated/(1024*1024));
+	}
+
+	return ptr;
+    }
+
+    void deallocate(void * ptr, size_t bytes) {
+	std::lock_guard<std::mutex> _(lock);
+	free_blocks.insert(std::make_pair(bytes, ptr));
+    }
+
+    /* Return everything on the free list to the system */
+
+    void release(void) {
+	std::lock_guard<std::mutex> _(lock);
+	for (auto it = free_blocks.begin(); it != free_blocks.end(); it ++) {
+	    ::operator delete(it->second);
+	    bytes_allocated -= it->first;
+	}
+	free_blocks.clear();
+    }
+
+    ~memory_arena() {
+	release();
+    }
+};
+
+memory_arena proptable_arena;
+
+template <typename T>
+struct arena_allocator {
+    typedef T value_type;
+
+    arena_allocator() { }
+    template <typename U> arena_allocator(const arena_allocator<U> &) { }
+
+    T * allocate(size_t n) {
+	return static_cast<T *>(proptable_arena.allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T * ptr, size_t n) {
+	proptable_arena.deallocate(ptr, n * sizeof(T));
+    }
+
+    template <typename U> void construct(U * ptr) {
+	::new (static_cast<void *>(ptr)) U;
+    }
+
+    template <typename U, typename... Args> void construct(U * ptr, Args&&... args) {
+	::new (static_cast<void *>(ptr)) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const arena_allocator<T> &, const arena_allocator<U> &) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const arena_allocator<T> &, const arena_allocator<U> &) { return false; }
+
+/* The priority queue template.
+ *
+ * Initialize with the size of the in-memory portion in megabytes.  If we insert less than that
+ * size, do everything in-memory.  If we insert more, then dump to disk and use a sorting network to
+ * read it back.
+ *
+ * Our template takes three types.  The first (T) is the type to store in the priority queue, the
+ * second (MemoryContainer) is a container to hold that type in memory, and the third
+ * (DiskContainer) is a container to hold that type on disk.  Names notwithstanding, we don't impose
+ * any memory or disk requirements in this class.  We expect MemoryContainer to export begin() and
+ * end() methods that return random access iterators usable for insertion, retrieval, and sorting
+ * (with std::sort).  We expect DiskContainer to take a begin/end pair of iterators as a constructor
+ * and supply pop_front() for retrieval.  We just push into a MemoryContainer until it's full, sort
+ * it and copy it to a DiskContainer, and keep going until we're done.  Then, if we used
+ * DiskContainer at all, we sort and dump the final MemoryContainer into a DiskContainer and read
+ * back from the DiskContainers using a sorting network.  Otherwise, we read back directly from a
+ * single MemoryContainer, i.e, we don't use a DiskContainer at all unless we fill up a
+ * MemoryContainer.
+ *
+ * The in-memory table is double buffered.  We construct two MemoryContainers (so the caller should
+ * size each of them to half of the memory it wants to use) and push into one of them until it's
+ * full, then hand it off to a dedicated spill thread and keep pushing into the other one.  The
+ * spill thread breaks the full buffer into num_threads equal size blocks and sorts and dumps each
+ * block on its own helper thread, so the sort still takes advantage of multi-threading, but the
+ * threads doing the inserting never have to sort or write anything themselves.  They only stall if
+ * they fill the second buffer before the spill thread has finished with the first one.
+ *
+ * about inheriting std::mutex... we lock when we insert (though we shouldn't need this if tail can
+ * be bumped atomically)... we expect the caller to already hold the lock when we retrieve... we do
+ * this because we want to atomically retrieve the front element along with any elements equal to it
+ */
+
+template <typename T, typename MemoryContainer = std::vector<T, arena_allocator<T>>, typename DiskContainer = disk_que<MemoryContainer> >
+class priority_queue : public std::mutex {
+
+    typedef class synchronized<std::deque<std::shared_ptr<DiskContainer>>> DiskContainerQue;
+
+protected:
+    typedef typename MemoryContainer::iterator Iterator;
+
+    /* Called on each block after it's been sorted and before it's dumped to disk, giving a derived
+     * class the chance to merge equivalent entries.  Returns the new end of the block.
+     */
+
+    virtual Iterator coalesce(Iterator begin, Iterator end) {
+	return end;
+    }
+
+private:
+    DiskContainerQue disk_ques;
+    class sorting_network<DiskContainerQue> snetwork;
+
+    /* in_memory_queue is the buffer we're inserting into; spill_queue is the other buffer, which
+     * is either being sorted and dumped by the spill thread (if spill_busy is set) or is free.
+     */
+
+    MemoryContainer * in_memory_queue;
+    MemoryContainer * spill_queue;
+    Iterator head;
+    Iterator tail;
+    bool sorted;
+
+    std::atomic<size_t> item_count;
+
+    size_t remaining_space;
+    size_t block_size;
+
+    std::thread spill_thread;
+    std::mutex spill_mutex;
+    std::condition_variable spill_cond;
+    bool spill_busy;
+    bool spill_thread_exit;
+
+    void sort_and_dump_to_disk(Iterator begin, Iterator end) {
+	/* The sort is time-consuming, so we don't lock disk_ques until it's done */
+	std::sort(begin, end);
+	Iterator coalesced_end = coalesce(begin, end);
+	item_count -= end - coalesced_end;
+	end = coalesced_end;
+	std::lock_guard<std::mutex> _(disk_ques);
+	std::shared_ptr<DiskContainer> ptr(new DiskContainer(begin, end));
+	disk_ques.push_back(ptr);
+    }
+
+    /* Sort and dump a range of the in-memory table, one block per thread.  The last block picks
+     * up whatever is left over after dividing the range into block_size pieces.
+     */
+
+    void sort_and_dump_blocks_to_disk(Iterator begin, Iterator end) {
+
+	size_t size = end - begin;
+	unsigned int blocks = (block_size == 0) ? 1 : std::min<size_t>(num_threads, size / block_size);
+	std::thread t[num_threads];
+
+	if (blocks <= 1) {
+	    sort_and_dump_to_disk(begin, end);
+	    return;
+	}
+
+	for (unsigned int block = 0; block < blocks; block ++) {
+	    Iterator block_end = (block == blocks - 1) ? end : begin + (block + 1) * block_size;
+	    t[block] = std::thread(&priority_queue::sort_and_dump_to_disk, this, begin + block * block_size, block_end);
+	}
+
+	for (unsigned int block = 0; block < blocks; block ++) {
+	    t[block].join();
+	}
+    }
+
+    void spill_thread_main(void) {
+
+	std::unique_lock<std::mutex> lock(spill_mutex);
+
+	while (1) {
+	    while (! spill_busy && ! spill_thread_exit) spill_cond.wait(lock);
+
+	    if (! spill_busy) break;
+
+	    /* spill_queue doesn't change while spill_busy is set, so we can use it unlocked */
+
+	    lock.unlock();
+	    sort_and_dump_blocks_to_disk(spill_queue->begin(), spill_queue->end());
+	    lock.lock();
+
+	    spill_busy = false;
+	    spill_cond.notify_all();
+	}
+    }
+
+    /* Called with the primary lock held when the insertion buffer fills up.  Wait for the spill
+     * thread to finish with the other buffer (this is the only place inserting threads ever block
+     * on the disk), then swap buffers and give the full one to the spill thread.
+     */
+
+    void hand_off_full_buffer(void) {
+
+	std::unique_lock<std::mutex> lock(spill_mutex);
+
+	while (spill_busy) spill_cond.wait(lock);
+
+	std::swap(in_memory_queue, spill_queue);
+	spill_busy = true;
+	spill_cond.notify_all();
+
+	head = in_memory_queue->begin();
+	tail = head;
+	remaining_space = in_memory_queue->end() - in_memory_queue->begin();
+    }
+
+protected:
+
+    /* Derived classes that override coalesce() have to call this in their destructors, because
+     * the spill thread might be calling coalesce() while they're being destroyed.
+     */
+
+    void stop_spill_thread(void) {
+	if (spill_thread.joinable()) {
+	    {
+		std::lock_guard<std::mutex> _(spill_mutex);
+		spill_thread_exit = true;
+		spill_cond.notify_all();
+	    }
+	    spill_thread.join();
+	}
+    }
+
+public:
+    
+    void prepare_to_retrieve(void) {
+
+	/* What I'd really like here is to detect when we get to the point where we can start
+	 * retrieving, then alternate between filling the array from the front and from the back on
+	 * alternate passes.  Instead, I dump everything to disk and free the in-memory buffers back
+	 * into proptable_arena, where the next pass's output proptable will pick them up.
+	 */
+#if 0
+	/* If we never had to push anything to disk, just sort and retrieve in-memory.  The problem
+	 * with this code is that we might not be able to free much memory, something that we can
+	 * assure if we write everything out to disk.
+	 */
+	if (disk_ques.empty() && ! spill_busy) {
+	    if (! sorted) {
+		std::sort(head, tail);
+		in_memory_queue->resize(tail-head);
+		sorted = true;
+	    }
+	    return;
+	}
+#endif
+
+	/* We assume that we're locked, so no more insertions are coming.  The spill thread finishes
+	 * whatever buffer it's working on before it exits, then we dump the partially filled
+	 * insertion buffer ourselves.
+	 */
+	if (in_memory_queue) {
+	    stop_spill_thread();
+	    if (head != tail) {
+		sort_and_dump_blocks_to_disk(head, tail);
+		tail = head;
+	    }
+	    delete in_memory_queue;
+	    delete spill_queue;
+	    in_memory_queue = nullptr;
+	    spill_queue = nullptr;
+	}
+    }
+
+    /* Our constructor passes all of its arguments to MemoryContainer's constructor, twice */
+
+    template <typename... Args>
+    priority_queue(Args... args):
+	snetwork(&disk_ques),
+	in_memory_queue(new MemoryContainer(args...)),
+	spill_queue(new MemoryContainer(args...)),
+	head(in_memory_queue->begin()),
+	tail(head),
+	sorted(true),
+	item_count(0),
+	spill_busy(false),
+	spill_thread_exit(false)
+    {
+	block_size = (in_memory_queue->end() - in_memory_queue->begin()) / num_threads;
+
+	/* Round down block_size to a multiple of eight to ensure that the blocks are byte aligned */
+	while ((block_size % 8) != 0) block_size --;
+
+	remaining_space = in_memory_queue->end() - in_memory_queue->begin();
+
+	spill_thread = std::thread(&priority_queue::spill_thread_main, this);
+    }
+
+    virtual ~priority_queue() {
+	stop_spill_thread();
+	if (in_memory_queue) delete in_memory_queue;
+	if (spill_queue) delete spill_queue;
+    }
+
+    void push(const T& x) {
+
+	std::lock_guard<std::mutex> _(*this);
+
+	if (in_memory_queue == nullptr) throw std::runtime_error("priority_queue: push attempted after retrieval started");
+
+	item_count ++;
+	*(tail ++) = x;
+	remaining_space --;
+	sorted = false;
+
+	if (remaining_space == 0) {
+	    hand_off_full_buffer();
+	}
+    }
+
+    bool empty(void) {
+	// XXX use item_count here?
+	return disk_ques.empty() ? (head == tail) : snetwork.empty();
+    }
+
+    size_t count(void) {
+	return item_count;
+    }
+
+    /* The checkpoint code needs to know which files hold a proptable that's ready for retrieval,
+     * and needs to put them back into a new proptable when it resumes.
+     */
+
+    const std::deque<std::shared_ptr<DiskContainer>> & disk_containers(void) {
+	return disk_ques;
+    }
+
+    void add_disk_container(temporary_file * file, int size) {
+	std::lock_guard<std::mutex> _(disk_ques);
+	std::shared_ptr<DiskContainer> ptr(new DiskContainer(file, size));
+	item_count += size;
+	disk_ques.push_back(ptr);
+    }
+
+    const T front(void) {
+	prepare_to_retrieve();
+	if (disk_ques.empty()) {
+	    return *head;
+	} else {
+	    return snetwork.front();
+	}
+    }
+
+    T pop_front(void) {
+	prepare_to_retrieve();
+	item_count --;
+	if (disk_ques.empty()) {
+	    return *(head++);
+	} else {
+	    return snetwork.pop_front();
+	}
+    }
+};
+
+/* The entries in the proptable
+ *
+ * Required field sizes for futurebase back-propagation:
+ *
+ *   index - figure out from num_indices
+ *   dtm - figure out from futurebase preload, unless it isn't being tracked
+ *   movecnt - 0 (XXX - discarded futuremove only), 1, or 2 for 8-way symmetry conversion
+ *   futuremove - figure out from total_futuremoves
+ *
+ * Required field sizes for intra-tablebase propagation:
+ *
+ *   index - figure out from num_indices
+ *   dtm - known from pass number, unless it isn't being tracked
+ *   movecnt - always 1
+ *   futuremove - unneeded
+ *
+ * The fields are stored as object variables, and functions are provided to marshal and demarshal an
+ * entire proptable entry into whatever integer type is being used by the proptable.  encode<T> is a
+ * method that takes a proptable_format and packs everything into a return value of type T.
+ * proptable_entry<T> is a constructor that takes a proptable_format and a value of type T and
+ * initializes the object fields appropriately.
+ */
+
+class proptable_entry {
+
+private:
+    template<typename T>
+    static int value_to_dtm(proptable_format *format, T value) {
+	int dtm = (value >> format->dtm_offset) & format->dtm_mask;
+	if (dtm > (int) (format->dtm_mask >> 1)) dtm |= (~ (format->dtm_mask >> 1));
+	return dtm;
+    }
+
+public:
+    index_t index;
+    int dtm;
+    unsigned int movecnt;
+    int futuremove;
+
+    /* Can't initialize all our fields during construction since sorting_network creates an
+     * uninitialized array of proptable_entry's.
+     */
+    proptable_entry() {}
+
+    proptable_entry(index_t index, int dtm, unsigned int movecnt, int futuremove):
+	index(index), dtm(dtm), movecnt(movecnt), futuremove(futuremove) {}
+
+#if 0
+    template<typename T>
+    proptable_entry(proptable_format *format, T value):
+	proptable_entry(value >> format->index_offset, value_to_dtm(format, value),
+			((value >> format->movecnt_offset) & format->movecnt_mask) + 1,
+			(value >> format->futuremove_offset) & format->futuremove_mask)
+    {}
+#else
+    template<typename T>
+    proptable_entry(proptable_format *format, T value):
+	index(value >> format->index_offset), dtm(value_to_dtm(format, value)),
+	movecnt(((value >> format->movecnt_offset) & format->movecnt_mask) + 1),
+	futuremove((value >> format->futuremove_offset) & format->futuremove_mask)
+    {
+	if (static_cast<uint64_t>(futuremove) == format->futuremove_mask) {
+	    futuremove = NO_FUTUREMOVE;
+	}
+    }
+#endif
+
+    template<typename T>
+    T encode(proptable_format *format) {
+	return (index << format->index_offset)
+	    | ((dtm & format->dtm_mask) << format->dtm_offset)
+	    | (((movecnt - 1) & format->movecnt_mask) << format->movecnt_offset)
+	    | ((futuremove & format->futuremove_mask) << format->futuremove_offset);
+    }
+
+    /* This is used when we build current_pt_entries */
+
+    bool operator<(const proptable_entry &other) const {
+	return index < other.index;
+    }
+};
+
+
+/* Proptable - byte-aligned version
+ *
+ * Very simple - just construct a priority queue of a specified (integer) type and marshal/demarshal
+ * proptable_entry's into that integer.
+ *
+ * We also coalesce entries as they're sorted.  Many of the moves backed out of a pass lead to the
+ * same index, so two entries that differ only in their movecnt fields (same index, same DTM, and
+ * no futuremove) are merged into a single entry whose movecnt is the sum of the two, so long as
+ * the sum still fits into the movecnt field.  Entries with futuremoves are left alone, since each
+ * futuremove has to be checked off individually when the proptable is committed.
+ */
+
+template<typename T>
+class typed_proptable : public priority_queue<T> {
+
+    typedef typename priority_queue<T>::Iterator Iterator;
+
+    Iterator coalesce(Iterator begin, Iterator end) {
+
+	const T movecnt_field = static_cast<T>(format.movecnt_mask) << format.movecnt_offset;
+	const T no_futuremove = static_cast<T>(format.futuremove_mask) << format.futuremove_offset;
+
+	if (begin == end) return end;
+
+	Iterator last = begin;
+
+	for (Iterator it = begin + 1; it != end; it ++) {
+	    if ((((*it ^ *last) & ~movecnt_field) == 0) && ((*it & no_futuremove) == no_futuremove)) {
+		/* movecnt is stored minus one, remember? */
+		uint64_t movecnt = ((*last >> format.movecnt_offset) & format.movecnt_mask)
+		    + ((*it >> format.movecnt_offset) & format.movecnt_mask) + 2;
+		if (movecnt - 1 <= format.movecnt_mask) {
+		    *last = (*last & ~movecnt_field) | (static_cast<T>(movecnt - 1) << format.movecnt_offset);
+		    continue;
+		}
+	    }
+	    *(++ last) = *it;
+	}
+
+	return last + 1;
+    }
+
+public:
+    proptable_format format;
+
+    /* priority_queue<T>'s constructor passes all of its arguments to its MemoryContainer's
+     * constructor (remember?), and priority_queue<T>'s default MemoryContainer is a std::vector<T>
+     * allocated from proptable_arena, which will take a size_type and build a container with that
+     * many elements.  It builds two of them (it's double buffered), so each one gets half of our
+     * memory.
+     */
+
+    typed_proptable(proptable_format format, size_t size_in_bytes):
+	priority_queue<T>(size_in_bytes / sizeof(T) / 2), format(format)
+    {
+	if (format.bits > 8 * (int) sizeof(T)) throw std::runtime_error("proptable format too large");
+    }
+
+    ~typed_proptable() {
+	priority_queue<T>::stop_spill_thread();
+    }
+
+    proptable_entry front() {
+	return proptable_entry(&format, priority_queue<T>::front());
+    }
+
+    proptable_entry pop_front() {
+	return proptable_entry(&format, priority_queue<T>::pop_front());
+    }
+
+    void push(proptable_entry &entry) {
+	priority_queue<T>::push(entry.encode<T>(&format));
+    }
+};
+
+/* Proptable - bit-aligned version
+ *
+ * proptable_iterator (defined below) dereferences into proptable_ptr, which is a pointer into the
+ * in-memory table.  It's not a normal pointer because the in-memory table is bit-aligned, not
+ * byte-aligned.  It contains a pointer to the table format structure, a pointer to the base of the
+ * in-memory table, and an offset into the table, measured in entries, the exact size of which is
+ * contained in the format structure.
+ *
+ * To support std::sort, proptable_iterator has to dereference into a type that is Swappable,
+ * MoveConstructable and MoveAssignable (the C++11 standard's terminology).  That means that
+ * proptable_ptr has to operate as an lvalue that both points into the proptable (Swappable) and
+ * also can hold a temporary value (MoveConstructable and MoveAssignable).
+ *
+ * Both proptable_ptr and proptable_iterator contain pointers to the format, since both of them are
+ * dependent on either a memory_proptable or a disk_que<memory_proptable>.  On the other hand, both
+ * memory_proptable and disk_que<memory_proptable> contain actual format structures, not pointers.
+ */
+
+class proptable_iterator;
+class memory_proptable;
+
+class proptable_ptr {
+
+    friend class proptable_iterator;
+    friend class disk_que<memory_proptable>;
+    friend void swap(proptable_ptr a, proptable_ptr b);
+
+ private:
+    proptable_format *format;
+    uint64_t i;
+    void *base;
+    uint64_t value;
+
+    /* Private constructor: friend proptable_iterator constructs proptable_ptr when dereferencing */
+
+    proptable_ptr(proptable_format *format, void *base, uint64_t i):
+	format(format), i(i), base(base) {
+	    value = get_uint64_t_field(base, i * format->bits, format->bits);
+	}
+
+ public:
+
+    operator proptable_entry() {
+	return proptable_entry(format, value);
+    }
+
+    proptable_ptr & operator=(proptable_entry other) {
+	/* Set both our local copy and the copy in the proptable */
+
+	value = (other.index << format->index_offset)
+	| ((other.dtm & format->dtm_mask) << format->dtm_offset)
+	| (((other.movecnt - 1) & format->movecnt_mask) << format->movecnt_offset)
+	| ((other.futuremove & format->futuremove_mask) << format->futuremove_offset);
+
+	set_uint64_t_field(base, i * format->bits, format->bits, value);
+
+	return *this;
+    }
+
+    /* We don't use the default copy operator, since that would change base and i. */
+
+    proptable_ptr & operator=(proptable_ptr other) {
+	value = other.value;
+	set_uint64_t_field(base, i * format->bits, format->bits, value);
+	return *this;
+    }
+
+    /* We want to compare index fields, but we don't want to have to extract all the fields, since
+     * this function will be used a lot during sorting.  We make sure that index occupies the most
+     * significant bits, making this comparision simple.
+     */
+
+    bool operator<(const proptable_ptr & other) const {
+	return value < other.value;
+    }
+
+    /* This is here to allow disk_que's constructor to cast us to a (char *) and write us to disk */
+
+    operator char *() {
+	if (i % 8 != 0) throw std::runtime_error("can't convert bit-aligned proptable_ptr to char *");
+	return (char *)base + i * format->bits / 8;
+    }
+
+};
+
+void swap(proptable_ptr a, proptable_ptr b) {
+    uint64_t x = get_unsigned_int_field(a.base, a.i * a.format->bits, a.format->bits);
+    set_uint64_t_field(a.base, a.i * a.format->bits, a.format->bits,
+		       get_uint64_t_field(b.base, b.i * b.format->bits, b.format->bits));
+    set_uint64_t_field(b.base, b.i * b.format->bits, b.format->bits, x);
+}
+
+class proptable_iterator : public std::iterator<std::random_access_iterator_tag, proptable_ptr, uint64_t> {
+
+    friend class memory_proptable;
+    friend class disk_que<memory_proptable>;
+
+ private:
+    proptable_format *format;
+    uint64_t i;
+    void *ptr;
+
+    /* Private constructor ensures that only friends can create a proptable_iterator */
+
+    proptable_iterator(proptable_format *format, void *ptr, uint64_t i) : format(format), i(i), ptr(ptr) {}
+
+ public:
+
+    proptable_ptr operator*() const {
+	return proptable_ptr(format, ptr, i);
+    }
+
+    const proptable_iterator operator++(int zero) {
+	proptable_iterator retval(*this);
+	i ++;
+	return retval;
+    }
+
+    const proptable_iterator & operator++() {
+	i ++;
+	return *this;
+    }
+
+    const proptable_iterator operator--(int zero) {
+	proptable_iterator retval(*this);
+	i --;
+	return retval;
+    }
+
+    const proptable_iterator & operator--() {
+	i --;
+	return *this;
+    }
+
+    const proptable_iterator operator+(int val) {
+	proptable_iterator retval(*this);
+	retval.i += val;
+	return retval;
+    }
+
+    const proptable_iterator operator-(int val) {
+	proptable_iterator retval(*this);
+	retval.i -= val;
+	return retval;
+    }
+
+    uint64_t operator-(const proptable_iterator & other) {
+	return i - other.i;
+    }
+
+    bool operator==(const class proptable_iterator & other) {
+	return i == other.i;
+    }
+
+    bool operator!=(const class proptable_iterator & other) {
+	return i != other.i;
+    }
+
+    bool operator<(const class proptable_iterator & other) {
+	return i < other.i;
+    }
+
+    // this is for the loop comparision in disk_que
+    bool operator<=(const class proptable_iterator & other) const {
+	return i <= other.i;
+    }
+};
+
+class memory_proptable {
+
+ private:
+    proptable_format format;
+    size_t size_in_bytes;
+    size_t size_in_entries;
+    char *data;
+
+ public:
+    typedef proptable_entry value_type;
+    typedef proptable_iterator iterator;
+
+ memory_proptable(proptable_format format, size_t size_in_bytes):
+    format(format), size_in_bytes(size_in_bytes), size_in_entries(size_in_bytes / format.bits * 8),
+	data(static_cast<char *>(proptable_arena.allocate(size_in_bytes)))
+	{
+	    /* We use a uint64_t to swap proptable entries */
+	    if (format.bits > 64) throw std::runtime_error("proptable format too large");
+	}
+
+    ~memory_proptable() {
+	proptable_arena.deallocate(data, size_in_bytes);
+    }
+
+    class proptable_iterator begin() {
+	return proptable_iterator(&format, data, 0);
+    }
+
+    class proptable_iterator end() {
+	return proptable_iterator(&format, data, size_in_entries);
+    }
+};
+
+/* We don't use the generic disk_que template defined above, because it can't handle bit-aligned
+ * tables.  Instead, we specialize a disk_que that dumps a bit-aligned table.
+ */
+
+template <>
+struct disk_que<memory_proptable> {
+
+    typedef proptable_entry value_type;
+
+    static const int queue_size = 256;	// size of in-memory queue; must be a multiple of 8
+
+    int size;
+    int next;
+
+    temporary_file * file;
+    std::istream * is;
+
+    char *buffer;
+    proptable_format format;
+
+    disk_que(proptable_iterator head, proptable_iterator tail): size(tail - head), next(0), format(*(head.format)) {
+
+	size_t bits = size * format.bits;
+	size_t bytes = (bits + 7)/8;
+
+	file = new temporary_file(TemporaryFile::Proptable, compress_proptables);
+
+	std::ostream * os = file->ostream();
+	os->write(*head, bytes);
+	delete os;
+
+	is = file->istream();
+
+	// this will create a buffer with room for queue_size values
+	buffer = new char[queue_size * format.bits / 8];
+    }
+
+    ~disk_que() {
+	delete is;
+	delete file;
+	delete[] buffer;
+    }
+
+    bool empty(void) {
+	return (next == size);
+    }
+
+    proptable_entry pop_front(void) {
+	if (empty()) throw std::runtime_error("read past end of disk_que");
+	if (next % queue_size == 0) {
+	    is->read(buffer, queue_size * format.bits / 8);
+	}
+	proptable_ptr retval(&format, buffer, next % queue_size);
+	next ++;
+
+	return (proptable_entry) retval;
+    }
+};
+
+/* Finally, the actual priority queue(s) */
+
+// The bit-aligned version.  Significantly slower.
+//typedef priority_queue<class proptable_entry, class memory_proptable> proptable;
+
+// Byte-aligned versions.  No appreciable slowdown in using 64-bit version on a 32-bit problem.
+//typedef typed_proptable<uint32_t> proptable;
+typedef typed_proptable<uint64_t> proptable;
+
+proptable * input_proptable;
+proptable * output_proptable;
+
+/* Width of the movecnt field in intra-table proptables.  This limits how many moves into a single
+ * index can be coalesced into a single proptable entry.
+ */
+
+const int coalesced_movecnt_bits = 8;
+
+/* The initialization pass in proptable mode doesn't generate any output proptable entries, so the
+ * first intra-table pass would run with no input proptable, just to back propagate the positions
+ * that the initialization pass finalized.  Instead, we fuse that first intra-table pass into the
+ * initialization pass, back propagating each entry as soon as it's been initialized and had its
+ * futurebase results committed, saving a complete read/write cycle of the entries file.
+ *
+ * fused_pass_dtm is the target DTM of the fused intra-table pass (zero if we're not fusing), and
+ * fused_pass_positions_finalized is the number of positions that it back propagated.
+ */
+
+int fused_pass_dtm = 0;
+uint64_t fused_pass_positions_finalized = 0;
+
+futurevector_t initialize_tablebase_entry(tablebase_t *tb, index_t index);
+void finalize_futuremove(tablebase_t *tb, index_t index, futurevector_t futurevector);
+
+/***** CHECKPOINTS *****/
+
+/* Proptable runs can take days, so with --checkpoint, at the start of each proptable pass we
+ * write a checkpoint manifest (checkpoint.xml, in the current directory or the one given to
+ * --checkpoint) recording everything we need to restart that pass: the complete entries file left
+ * by the previous pass, the proptable runs that this pass is about to commit, the pass number and
+ * target DTM, the passes_needed arrays, the statistics counters, and the per-pass XML statistics
+ * gathered so far.  The files that the manifest refers to are preserved (not unlinked when we're
+ * done with them) until a newer manifest replaces it, at which point we unlink them ourselves.
+ * Once the tablebase has been written out, the manifest and all of its files are removed.  Without
+ * --checkpoint, nothing is preserved, so an interrupted run doesn't leave its (possibly huge)
+ * temporary files behind.
+ *
+ * "--resume" (which implies --checkpoint) reloads the manifest and reruns the pass it describes.
+ * We have to be run from the same directory, with the same control file and the same futurebases,
+ * since the futurebases are still preloaded to set the DTM ranges and the entries format.  Any
+ * files written during the interrupted pass itself are left lying around, since nothing refers to
+ * them.
+ *
+ * The initialization pass is checkpointed, too, which lets us skip futurebase back propagation,
+ * but it has no entries file yet.
+ */
+
+bool checkpointing = false;
+std::string checkpoint_filename = "checkpoint.xml";
+
+bool resume_from_checkpoint = false;
+int resume_target_dtm = 0;
+uint64_t resume_positions_finalized = 0;
+
+/* propagate_all_moves_within_tablebase() keeps this updated so we can checkpoint it */
+uint64_t positions_finalized_on_last_pass = 0;
+
+/* All of the files referred to by the last checkpoint we wrote (or resumed from) */
+std::vector<std::string> checkpoint_files;
+
+std::string passes_needed_to_string(bool * passes_needed, int size)
+{
+    std::string str;
+
+    for (int i = 0; i < size; i ++) {
+	str += passes_needed[i] ? '1' : '0';
+    }
+
+    return str;
+}
+
+void write_checkpoint(int target_dtm)
+{
+    xmlpp::Document doc;
+    xmlpp::Element * root = doc.create_root_node("checkpoint");
+    xmlpp::Element * node;
+    std::vector<std::string> files;
+
+    root->set_attribute("indices", boost::lexical_cast<std::string>(current_tb->num_indices));
+    root->set_attribute("pass", boost::lexical_cast<std::string>(total_passes));
+    root->set_attribute("target-dtm", boost::lexical_cast<std::string>(target_dtm));
+    root->set_attribute("positions-finalized-on-last-pass", boost::lexical_cast<std::string>(positions_finalized_on_last_pass));
+
+    node = root->add_child("counters");
+    node->set_attribute("legal-positions", boost::lexical_cast<std::string>(total_legal_positions));
+    node->set_attribute("PNTM-mated-positions", boost::lexical_cast<std::string>(total_PNTM_mated_positions));
+    node->set_attribute("stalemate-positions", boost::lexical_cast<std::string>(total_stalemate_positions));
+    node->set_attribute("forward-moves", boost::lexical_cast<std::string>(total_moves));
+    node->set_attribute("futuremoves", boost::lexical_cast<std::string>(total_futuremoves));
+    node->set_attribute("backproped-moves", boost::lexical_cast<std::string>(total_backproped_moves));
+    node->set_attribute("white-wins-positions", boost::lexical_cast<std::string>(player_wins[PieceColor::White]));
+    node->set_attribute("black-wins-positions", boost::lexical_cast<std::string>(player_wins[PieceColor::Black]));
+    node->set_attribute("max-dtm", boost::lexical_cast<std::string>(max_dtm));
+    node->set_attribute("min-dtm", boost::lexical_cast<std::string>(min_dtm));
+
+    node = root->add_child("passes-needed");
+    node->set_attribute("positive", passes_needed_to_string(positive_passes_needed, max_tracked_dtm + 1));
+    node->set_attribute("negative", passes_needed_to_string(negative_passes_needed, -min_tracked_dtm + 1));
+
+    /* The initialization pass creates the entries file, so there isn't one to checkpoint yet */
+
+    if (target_dtm != 0) {
+	temporary_file * entries_file = static_cast<DiskEntriesTable *>(entriesTable.entriesTable)->checkpoint();
+
+	entries_file->preserve();
+	files.push_back(entries_file->name());
+
+	node = root->add_child("entries");
+	node->set_attribute("filename", entries_file->name());
+	node->set_attribute("compressed", entries_file->compressed() ? "true" : "false");
+    }
+
+    node = root->add_child("proptable");
+    node->set_attribute("compressed", compress_proptables ? "true" : "false");
+
+    for (auto & run : input_proptable->disk_containers()) {
+	xmlpp::Element * run_node = node->add_child("run");
+
+	run->file->preserve();
+	files.push_back(run->file->name());
+
+	run_node->set_attribute("filename", run->file->name());
+	run_node->set_attribute("size", boost::lexical_cast<std::string>(run->size));
+    }
+
+    node = root->add_child("generation-statistics");
+
+    for (auto pass : generation_statistics->get_children("pass")) {
+	node->import_node(pass);
+    }
+
+    /* Write the new manifest under a different name and rename it into place, so that there's
+     * always one complete manifest on disk, then unlink the files that only the old one needed.
+     */
+
+    std::string new_checkpoint_filename = checkpoint_filename + ".new";
+
+    doc.write_to_file(new_checkpoint_filename);
+
+    if (rename(new_checkpoint_filename.c_str(), checkpoint_filename.c_str()) == -1) {
+	fatal("Can't rename '%s' to '%s': %s\n", new_checkpoint_filename.c_str(), checkpoint_filename.c_str(), strerror(errno));
+	return;
+    }
+
+    for (auto & filename : checkpoint_files) {
+	if (std::find(files.begin(), files.end(), filename) == files.end()) {
+	    unlink(filename.c_str());
+	}
+    }
+
+    checkpoint_files = files;
+}
+
+/* Called once the tablebase has been written out successfully */
+
+void remove_checkpoint(void)
+{
+    if (! checkpointing) return;
+
+    for (auto & filename : checkpoint_files) {
+	unlink(filename.c_str());
+    }
+    checkpoint_files.clear();
+
+    unlink(checkpoint_filename.c_str());
+}
+
+bool string_to_passes_needed(Glib::ustring str, bool * passes_needed, int size)
+{
+    if (str.length() != static_cast<size_t>(size)) return false;
+
+    for (int i = 0; i < size; i ++) {
+	passes_needed[i] = (str[i] == '1');
+    }
+
+    return true;
+}
+
+/* Reload the checkpoint manifest, rebuild the entries table (if the checkpointed pass wasn't the
+ * initialization pass) and construct output_proptable from the checkpointed runs, so that the next
+ * call to proptable_pass() will pick up where the checkpointed run left off.  'format' is the
+ * proptable format for the initialization pass; the intra-table format is always the same.
+ */
+
+bool resume_checkpoint(proptable_format format)
+{
+    xmlpp::DomParser parser;
+    xmlpp::Element * root;
+    xmlpp::NodeSet result;
+
+    try {
+	parser.parse_file(checkpoint_filename);
+	root = parser.get_document()->get_root_node();
+    } catch (const xmlpp::exception &ex) {
+	fatal("Can't load checkpoint '%s': %s\n", checkpoint_filename.c_str(), ex.what());
+	return false;
+    }
+
+    if (eval_to_uint64(root, "/checkpoint/@indices") != current_tb->num_indices) {
+	fatal("Checkpoint '%s' doesn't match this tablebase\n", checkpoint_filename.c_str());
+	return false;
+    }
+
+    int pass = eval_to_number_or_zero(root, "/checkpoint/@pass");
+    resume_target_dtm = eval_to_number_or_zero(root, "/checkpoint/@target-dtm");
+    resume_positions_finalized = eval_to_uint64(root, "/checkpoint/@positions-finalized-on-last-pass");
+
+    if (! string_to_passes_needed(root->eval_to_string("/checkpoint/passes-needed/@positive"),
+				  positive_passes_needed, max_tracked_dtm + 1)
+	|| ! string_to_passes_needed(root->eval_to_string("/checkpoint/passes-needed/@negative"),
+				     negative_passes_needed, -min_tracked_dtm + 1)) {
+	fatal("Checkpoint '%s' has different DTM ranges than this tablebase's futurebases\n", checkpoint_filename.c_str());
+	return false;
+    }
+
+    total_legal_positions = eval_to_uint64(root, "/checkpoint/counters/@legal-positions");
+    total_PNTM_mated_positions = eval_to_uint64(root, "/checkpoint/counters/@PNTM-mated-positions");
+    total_stalemate_positions = eval_to_uint64(root, "/checkpoint/counters/@stalemate-positions");
+    total_moves = eval_to_uint64(root, "/checkpoint/counters/@forward-moves");
+    total_futuremoves = eval_to_uint64(root, "/checkpoint/counters/@futuremoves");
+    total_backproped_moves = eval_to_uint64(root, "/checkpoint/counters/@backproped-moves");
+    player_wins[PieceColor::White] = eval_to_uint64(root, "/checkpoint/counters/@white-wins-positions");
+    player_wins[PieceColor::Black] = eval_to_uint64(root, "/checkpoint/counters/@black-wins-positions");
+    max_dtm = eval_to_number_or_zero(root, "/checkpoint/counters/@max-dtm");
+    min_dtm = eval_to_number_or_zero(root, "/checkpoint/counters/@min-dtm");
+
+    /* The per-pass statistics arrays aren't cumulative, so all we need is to make them big enough */
+
+    while (max_passes <= pass) expand_per_pass_statistics();
+    total_passes = pass;
+
+    for (auto node : root->find("/checkpoint/generation-statistics/pass")) {
+	generation_statistics->add_child_text("   ");
+	generation_statistics->import_node(node);
+	generation_statistics->add_child_text("\n   ");
+    }
+
+    /* Now reopen the files */
+
+    checkpoint_files.clear();
+
+    try {
+	result = root->find("/checkpoint/entries");
+
+	if (! result.empty()) {
+	    xmlpp::Element * node = exception_cast<xmlpp::Element *>(result[0]);
+	    temporary_file * entries_file = new temporary_file(node->get_attribute_value("filename"), TemporaryFile::Entries,
+							       node->get_attribute_value("compressed") == "true");
+	    entries_file->preserve();
+	    checkpoint_files.push_back(entries_file->name());
+	    compress_entries_table = entries_file->compressed();
+	    entriesTable = new DiskEntriesTable(entries_file);
+	} else {
+	    entriesTable = new DiskEntriesTable;
+	}
+
+	if (resume_target_dtm != 0) {
+	    format = proptable_format(current_tb->num_indices, 0, 0, coalesced_movecnt_bits, 0);
+	}
+
+	output_proptable = new proptable(format, proptable_MBs << 20);
+
+	compress_proptables = (root->eval_to_string("/checkpoint/proptable/@compressed") == "true");
+
+	for (auto node : root->find("/checkpoint/proptable/run")) {
+	    xmlpp::Element * run_node = exception_cast<xmlpp::Element *>(node);
+	    temporary_file * file = new temporary_file(run_node->get_attribute_value("filename"), TemporaryFile::Proptable,
+						       compress_proptables);
+	    file->preserve();
+	    checkpoint_files.push_back(file->name());
+	    output_proptable->add_disk_container(file, std::stoi(run_node->get_attribute_value("size")));
+	}
+    } catch (std::exception &ex) {
+	fatal("Can't resume from checkpoint '%s': %s\n", checkpoint_filename.c_str(), ex.what());
+	return false;
+    }
+
+    if (resume_target_dtm == 0) {
+	info("Resuming from checkpoint at initialization pass\n");
+    } else {
+	info("Resuming from checkpoint at pass %d\n", resume_target_dtm);
+    }
+
+    return true;
+}
+
+/* proptable_pass()
+ *
+ * Commit an old set of proptables into the entries array while writing a new set.
+ */
+
+std::atomic<index_t> proptable_shared_index;
+
+void proptable_pass_thread(int target_dtm)
+{
+    index_t index;
+    std::deque<class proptable_entry> current_pt_entries;
+
+    while (1) {
+
+	futurevector_t futurevector = 0;
+
+	current_pt_entries.clear();
+
+	/* Lock the input proptable, advance the shared index, retrieve everything
+	 * from the proptable that matches the new index, then unlock
+	 */
+
+	{
+	    std::lock_guard<std::mutex> _(*input_proptable);
+
+	    index = (proptable_shared_index ++);
+
+	    if (index >= current_tb->num_indices) break;
+
+	    if (! input_proptable->empty()) {
+
+		if (input_proptable->front().index < index) {
+		    fatal("Out-of-order entries in proptable\n");
+		}
+
+		while (! input_proptable->empty() && input_proptable->front().index == index) {
+		    current_pt_entries.push_back(input_proptable->pop_front());
+		}
+	    }
+	}
+
+	/* initialize_tablebase_entry() calls mark_progress(), so we only need to mark our progress
+	 * here if we're not calling initialize_tablebase_entry().
+	 */
+
+	if (target_dtm == 0) {
+	    futurevector = initialize_tablebase_entry(current_tb, index);
+	} else {
+	    mark_progress();
+	}
+
+	for (auto pt_entry = current_pt_entries.begin(); pt_entry != current_pt_entries.end(); pt_entry ++) {
+
+	    if (target_dtm != 0) {
+
+		/* Intra-table case: always update */
+
+		if (index == debug_move) {
+		    info("Committing proptable entry: index %" PRIindex "\n", pt_entry->index);
+		}
+
+		finalize_update(pt_entry->index, target_dtm, pt_entry->movecnt, 0);
+
+	    } else if ((pt_entry->futuremove == NO_FUTUREMOVE)
+		       || (FUTUREVECTOR(pt_entry->futuremove) & futurevector)) {
+
+		/* Futurebase case: only update if move is possible and hasn't been handled yet
+		 *
+		 * Double consideration of a futuremove can happen for symmetric tablebases.  In
+		 * this case, two different positions in the futurebase (or maybe just two different
+		 * reflections of the same position) can indicate a result for this entry.  Of
+		 * course, in this case the result should be the same.
+		 *
+		 * On the other hand, if we had two different tablebases indicating different
+		 * results for the same futuremove, that should trigger a warning.  We could add
+		 * that capability to the proptable code without too much trouble, but in the
+		 * non-proptable case, we're just keeping a bit vector in memory to make sure all
+		 * the futuremoves have been handled in some way and we don't have enough
+		 * information to check all of that.  Right now, we quietly ignore it.
+		 *
+		 * The movecnt field is only a single bit, and it isn't stored correctly if DTM is
+		 * zero, in which case movecnt is also zero.  Examine the code in
+		 * propagate_index_from_futurebase(), which is where all of these entries are
+		 * generated in the intra-table case, and notice that dtm=0 implies movecnt=0.
+		 */
+
+		if (index == debug_move) {
+		    info("Committing proptable entry: index %" PRIindex ", dtm %d, movecnt %u, futuremove %d\n",
+			 pt_entry->index, pt_entry->dtm, pt_entry->movecnt, pt_entry->futuremove);
+		}
+
+		if (pt_entry->dtm != 0) {
+		    finalize_update(pt_entry->index, pt_entry->dtm, pt_entry->movecnt, pt_entry->futuremove);
+		} else {
+		    finalize_update(pt_entry->index, 0, 0, pt_entry->futuremove);
+		}
+
+		if (pt_entry->futuremove != NO_FUTUREMOVE) {
+		    futurevector &= ~FUTUREVECTOR(pt_entry->futuremove);
+		}
+
+	    }
+
+	}
+
+	/* We've committed everything for this index that was in the input proptable.  Now either
+	 * check for back-propagation and maybe generate some updates for the output proptable
+	 * (intra-table case) or check to make sure that we've handled all the futuremoves that we
+	 * needed to, and check for conceded futuremoves, too, all in a subroutine.
+	 */
+
+	if (target_dtm != 0) {
+
+	    back_propagate_index(index, target_dtm);
+
+	} else {
+
+	    /* Don't track futuremoves for illegal (DTM 1) positions */
+	    if (entriesTable[index].get_DTM() != 1) {
+		finalize_futuremove(current_tb, index, futurevector);
+	    }
+
+	    /* This entry is now final for the initialization pass, so run the fused intra-table pass
+	     * on it right away.
+	     */
+	    if (fused_pass_dtm != 0) {
+		back_propagate_index(index, fused_pass_dtm);
+	    }
+	}
+
+    }
+}
+
+void proptable_pass(int target_dtm)
+{
+    std::thread t[num_threads];
+    unsigned int thread;
+
+    /* Proptable for intra-tablebase propagation only needs to record the index, since the dtm is
+     * known from the pass number and we're done tracking futuremoves.  Each move has a movecnt of
+     * one, but we leave room in the entry for a larger movecnt so that multiple moves into the
+     * same index can be coalesced into a single entry.
+     */
+
+    proptable_format format(current_tb->num_indices, 0, 0, coalesced_movecnt_bits, 0);
+
+    /* Swap proptables.  Our priority queue implementation is designed to do all the insertions
+     * first, then all the retrievals, and prepare_to_retrieve() can free a lot of memory.
+     */
+
+    input_proptable = output_proptable;
+    if (input_proptable) input_proptable->prepare_to_retrieve();
+
+    /* Checkpoint before we start, unless we've just resumed from this very checkpoint */
+
+    if (resume_from_checkpoint) {
+	resume_from_checkpoint = false;
+    } else if (input_proptable && checkpointing) {
+	write_checkpoint(target_dtm);
+    }
+
+    /* XXX std::bad_alloc is a real possibility here.  Please do something better than dying.
+     */
+
+    try {
+	output_proptable = new proptable(format, proptable_MBs << 20);
+    } catch (std::exception &ex) {
+	throw nested_exception("Constructing output proptable", ex);
+    }
+
+    proptable_shared_index = 0;
+
+    if (target_dtm == 0) {
+	reset_progress_indicator("Initializing tablebase", current_tb->num_indices);
+    } else {
+	std::stringstream label;
+	label << "Pass " << std::setw(4) << target_dtm;
+	reset_progress_indicator(label.str().c_str(), current_tb->num_indices);
+    }
+
+    entriesTable->set_threads(num_threads);
+
+    for (thread = 0; thread < num_threads; thread ++) {
+	t[thread] = std::thread(proptable_pass_thread, target_dtm);
+    }
+
+    for (thread = 0; thread < num_threads; thread ++) {
+	t[thread].join();
+    }
+
+    entriesTable->set_threads(1);
+
+    if ((target_dtm == 0) && (fused_pass_dtm == 0)) {
+	end_progress_indicator();
+    } else {
+	end_progress_indicator(positions_finalized_this_pass.load(), "positions finalized");
+    }
+
+    delete input_proptable;
+}
+
+/* reconstruct_proptable() is hardly ever used.  I put it in here because I had a kqqkqq calculation
+ * that died due to a memory leak and I wanted to restart it.
+ */
+
+void reconstruct_proptable_thread(int target_dtm)
+{
+    while (1) {
+
+	index_t index = (proptable_shared_index ++);
+
+	if (index >= current_tb->num_indices) break;
+
+	back_propagate_index(index, target_dtm);
+    }
+}
+
+void reconstruct_proptable(int target_dtm)
+{
+    std::thread t[num_threads];
+    unsigned int thread;
+
+    proptable_format format(current_tb->num_indices, 0, 0, coalesced_movecnt_bits, 0);
+
+    output_proptable = new proptable(format, proptable_MBs << 20);
+
+    proptable_shared_index = 0;
+
+    entriesTable->set_threads(num_threads);
+
+    for (thread = 0; thread < num_threads; thread ++) {
+	t[thread] = std::thread(proptable_pass_thread, target_dtm);
+    }
+
+    for (thread = 0; thread < num_threads; thread ++) {
+	t[thread].join();
+    }
+
+    entriesTable->set_threads(1);
+}
+
+void insert_new_propentry(index_t index, int dtm, unsigned int movecnt, int futuremove)
+{
+    class proptable_entry pt_entry;
+
+    if (futuremove != NO_FUTUREMOVE) {
+	assert(futuremove >= 0);
+	assert(static_cast<uint64_t>(futuremove) < output_proptable->format.futuremove_mask);
+    }
+
+    pt_entry.index = index;
+    pt_entry.dtm = dtm;
+    pt_entry.movecnt = movecnt;
+    pt_entry.futuremove = futuremove;
+
+    output_proptable->push(pt_entry);
+
+    /* fprintf(stderr, "Size of proptable: %llu\n", output_proptable->size()); */
+}
+
+
+/* Sparse futurevector storage
+ *
+ * Most positions don't have any futuremoves at all, so instead of a futurevector for every index,
+ * we split the indices into blocks and, for each block, keep a bitmap of which positions have a
+ * futurevector and a packed array of just those futurevectors.  For each 64-bit word of the
+ * bitmap, we also keep the bit offset of its first futurevector in the packed array, so finding an
+ * index's futurevector only takes a couple of popcounts.  When the side to move is encoded in the
+ * index, we count the white-to-move and black-to-move positions separately and give each
+ * futurevector only as many bits as its color needs.
+ *
+ * Each block is filled in by a single thread (initialize_tablebase() hands out whole blocks), so
+ * only test_and_clear() has to be atomic.
+ */
+
+class SparseFuturevectors {
+
+public:
+
+    static const index_t block_size = 4096;
+
+private:
+
+    struct block {
+	uint64_t present[block_size / 64];
+	uint32_t offset[block_size / 64];
+	char * futurevectors = nullptr;
+    };
+
+    std::vector<block> blocks;
+    index_t num_indices;
+    index_t stm_place;
+    int white_bits;
+    int black_bits;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> positions;
+
+    bool is_present(const block & b, index_t index) const {
+	return b.present[(index % block_size) / 64] & (1ULL << (index % 64));
+    }
+
+    /* Bit offset in the block's packed array of the futurevector at 'index' */
+
+    uint64_t locate(const block & b, index_t index) const {
+	uint64_t before = b.present[(index % block_size) / 64] & ((1ULL << (index % 64)) - 1);
+	uint64_t white = white_positions(index);
+
+	return b.offset[(index % block_size) / 64]
+	    + std::bitset<64>(before & white).count() * white_bits
+	    + std::bitset<64>(before & ~white).count() * black_bits;
+    }
+
+    /* Which bits of the bitmap word holding 'index' are white-to-move positions (see
+     * tablebase_t::stm_place).  With side-to-move in the MSB, only one word is mixed.
+     */
+
+    uint64_t white_positions(index_t index) const {
+	index_t first = index - (index % 64);
+
+	if (stm_place == 1) return 0x5555555555555555ULL;
+	if ((stm_place == 0) || (first + 64 <= stm_place)) return ~0ULL;
+	if (first >= stm_place) return 0;
+	return (1ULL << (stm_place - first)) - 1;
+    }
+
+    int length(index_t index) const {
+	return (white_positions(index) & (1ULL << (index % 64))) ? white_bits : black_bits;
+    }
+
+public:
+
+    SparseFuturevectors(tablebase_t * tb) : blocks((tb->num_indices + block_size - 1) / block_size),
+					    num_indices(tb->num_indices), stm_place(tb->stm_place), bytes(0), positions(0) {
+	white_bits = tb->white_futurevector_bits;
+	black_bits = tb->encode_stm ? tb->black_futurevector_bits : tb->white_futurevector_bits;
+    }
+
+    ~SparseFuturevectors() {
+	for (auto & b : blocks) delete [] b.futurevectors;
+    }
+
+    /* Store the futurevectors for the block starting at 'first_index' */
+
+    void set_block(index_t first_index, const futurevector_t * futurevectors) {
+	block & b = blocks[first_index / block_size];
+	index_t count = (num_indices - first_index < block_size) ? (num_indices - first_index) : block_size;
+	uint64_t bits = 0;
+	index_t present = 0;
+
+	for (index_t i = 0; i < count; i ++) {
+	    if (i % 64 == 0) {
+		b.present[i / 64] = 0;
+		b.offset[i / 64] = bits;
+	    }
+	    if (futurevectors[i] != 0) {
+		b.present[i / 64] |= (1ULL << (i % 64));
+		bits += length(first_index + i);
+		present ++;
+	    }
+	}
+
+	for (index_t i = (count + 63) / 64; i < block_size / 64; i ++) {
+	    b.present[i] = 0;
+	    b.offset[i] = bits;
+	}
+
+	if (bits > 0) {
+	    size_t block_bytes = ((bits + 7) >> 3) + 2*sizeof(int);
+
+	    b.futurevectors = new char[block_bytes];
+	    bytes += block_bytes;
+	    positions += present;
+
+	    for (index_t i = 0; i < count; i ++) {
+		if (futurevectors[i] != 0) {
+		    set_unsigned_int_field(b.futurevectors, locate(b, first_index + i), length(first_index + i),
+					   futurevectors[i]);
+		}
+	    }
+	}
+    }
+
+    futurevector_t get(index_t index) const {
+	const block & b = blocks[index / block_size];
+
+	if (! is_present(b, index)) return 0;
+
+	return get_unsigned_int_field(b.futurevectors, locate(b, index), length(index));
+    }
+
+    /* Check off a futuremove, and return true if it hadn't been checked off before */
+
+    bool test_and_clear(index_t index, int futuremove) {
+	const block & b = blocks[index / block_size];
+
+	if (! is_present(b, index)) return false;
+
+	return test_and_clear_bit_field(b.futurevectors, locate(b, index) + futuremove);
+    }
+
+    /* The first index at or after 'index' that has a futurevector, or num_indices if there isn't one */
+
+    index_t next(index_t index) const {
+	while (index < num_indices) {
+	    uint64_t word = blocks[index / block_size].present[(index % block_size) / 64] >> (index % 64);
+
+	    if (word != 0) {
+		while (! (word & 1)) {
+		    word >>= 1;
+		    index ++;
+		}
+		return index;
+	    }
+
+	    index = (index | 63) + 1;
+	}
+
+	return num_indices;
+    }
+
+    uint64_t size(void) const {
+	return bytes + blocks.size() * sizeof(block);
+    }
+
+    uint64_t num_positions(void) const {
+	return positions;
+    }
+
+    /* Worst case, if every position had a futurevector */
+
+    static uint64_t max_size(index_t num_indices, int white_bits, int black_bits, bool encode_stm) {
+	uint64_t futurevector_bits = encode_stm ? (white_bits + black_bits) * ((num_indices + 1) / 2) : white_bits * num_indices;
+	index_t num_blocks = (num_indices + block_size - 1) / block_size;
+
+	return num_blocks * (sizeof(block) + 2*sizeof(int)) + ((futurevector_bits + 7) >> 3);
+    }
+};
+
+/* If we're running multi-threaded, then there is a possibility that 1) two different positions will
+ * try to backprop into the same position (if we're not using proptables), or that 2) two different
+ * threads will try to retrieve from the proptable at the same time (if we're using proptables).
+ *
+ * The first case is handled by a locking sequence on individual entries in finalize_update(); the
+ * second case is handled by a locking sequence on the priority_queue in proptable_pass_thread().
+ */
+
+void commit_update(index_t index, short dtm, short movecnt, int futuremove)
+{
+
+    if (index == debug_move) {
+	info("commit_update; index=%" PRIindex "; dtm=%d; movecnt=%d; futuremove=%d\n",
+	     index, dtm, movecnt, futuremove);
+    }
+
+    backproped_moves_this_pass ++;
+
+    if (!using_proptables) {
+
+	if (! ignore_futurevectors) {
+
+	    if (futuremove != NO_FUTUREMOVE) {
+
+		/* Futuremove - check off bits in an array that got filled in when we initialized
+		 *
+		 * Do nothing if the bit is clear, either because we were never to process this
+		 * futuremove at all (this is how a suicide analysis rejects non-capture futuremoves
+		 * from a position where captures are possible), or because a previous pass through
+		 * this code has already processed it.  In the later case, we fatally complain if
+		 * the the entriesTable contains a normal position with DTM not 1 (PNTM in check).
+		 *
+		 * We can't tell the difference at this point, and probably need to use proptables
+		 * for more accurate checking.
+		 *
+		 * This is done atomically, because there will be other indices in this bit vector,
+		 * but test_and_clear_bit_field() skips the atomic operation if the bit is already
+		 * clear, which it is for every duplicate.
+		 */
+
+		if (! current_tb->futurevectors->test_and_clear(index, futuremove)) {
+
+		    if ((entriesTable[index].get_raw_DTM() != 1) && entriesTable[index].is_normal_movecnt()
+			&& (current_tb->variant != Variant::Suicide)) {
+
+			fatal("commit_update; futuremove processed; index=%" PRIindex "; dtm=%d; movecnt=%d; futuremove=%d\n",
+			      index, dtm, movecnt, futuremove);
+		    }
+
+		    return;
+		}
+
+	    }
+	}
+
+	finalize_update(index, dtm, movecnt, futuremove);
+
+    } else {
+
+	insert_new_propentry(index, dtm, movecnt, futuremove);
+
+    }
+
+}
+
+
+/* target_dtm 0 is the initialization / futurebase back prop pass */
+
+uint64_t propagation_pass(int target_dtm)
+{
+    positions_finalized_this_pass = 0;
+    backproped_moves_this_pass = 0;
+
+    if (tracking_dtm) {
+	if (target_dtm > 0) {
+	    entriesTable->verify_DTM_field_size(target_dtm+1);
+	} else {
+	    entriesTable->verify_DTM_field_size(target_dtm-1);
+	}
+    }
+
+    if (pass_type[total_passes] == nullptr) pass_type[total_passes] = "intratable";
+    pass_target_dtms[total_passes] = target_dtm;
+
+    if (using_proptables) {
+	proptable_pass(target_dtm);
+    } else {
+	non_proptable_pass(target_dtm);
+    }
+
+    positions_finalized[total_passes] = positions_finalized_this_pass;
+    backproped_moves[total_passes] = backproped_moves_this_pass;
+
+    total_backproped_moves += backproped_moves[total_passes];
+
+    if (positions_finalized_this_pass > 0) {
+	int finalized_dtm = ((target_dtm == 0) && using_proptables) ? fused_pass_dtm : target_dtm;
+	if (finalized_dtm > max_dtm) max_dtm = finalized_dtm;
+	if (finalized_dtm < min_dtm) min_dtm = finalized_dtm;
+    }
+
+    finalize_pass_statistics();
+
+    total_passes ++;
+    if (total_passes == max_passes) expand_per_pass_statistics();
+
+    return positions_finalized_this_pass;
+}
+
+/***** FUTUREBASES *****/
+
+/* Subroutines to backpropagate an individual index, or an individual local position (these are the
+ * "mini" routines), or a set of local positions that differ only in the en passant square.
  *
- * so that we can run that last step (backing up the tree, from right to left, in the diagram), just
- * by right shifting the index.  I got this idea from Knuth.
+ * The idea behind the en passant handling is this.  If we back propagate a position with the en
+ * passant square set, then that's the only position we process.  If we back prop a position without
+ * the en passant square set, then we process not only that position, but also any positions just
+ * like it that have en passant set.  The idea being that we set en passant if we actually need it,
+ * and we clear it if we don't need it, so if it's clear we need to process positions where it was
+ * set, but we didn't use it.
  */
 
-template <class Container>
-class sorting_network {
+bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position);
 
-    typedef typename Container::value_type SubcontainerPtr;
-    typedef typename dereference<SubcontainerPtr>::type Subcontainer;
-    typedef typename Subcontainer::value_type T;
+void propagate_minilocal_position_from_futurebase(local_position_t &current_position,
+						  const local_position_t &foreign_position,
+						  int futuremove, bool normalize)
+{
+    /* XXX get rid of this const_cast ; need it because get_DTM might modify its tablebase */
+    tablebase_t * futurebase = const_cast<tablebase_t *>(foreign_position.tb);
+    index_t current_index;
+    index_t future_index = foreign_position.index;
 
-private:
-    Container * containers;
-    T * network;
-    int * container_num;
-    unsigned int highbit;
+    /* Look up the position in the current tablebase... */
 
-    /* We don't initialize until the first retrieval request, which allows 'containers' to be
-     * modified, initially.  After we start retrieving, we expect 'containers' to be untouched.
+    if (normalize) {
+	current_index = normalized_position_to_index(current_position);
+    } else {
+	current_index = local_position_to_index(current_position);
+    }
+
+    if (current_index == INVALID_INDEX) {
+	return;
+    }
+
+    if ((futuremove < 0) && (futuremove != HANDLED_FUTUREMOVE)) {
+	fatal("Futuremove %d never assigned: %s\n", futuremove, current_position.FEN());
+	return;
+    }
+
+    /* local_position_to_index() updated the position structure's multiplicity and reflection, so we
+     * know they're correct.  If we're back proping into an 8-way symmetric tablebase (the only way
+     * REFLECTION_DIAGONAL will ever be set), we must be back proping from an 8-way symmetric
+     * futurebase (since futurebases can never have less symmetry than the current tablebase).  In
+     * this case, if diagonal reflection is required on the current position, then discard this case
+     * since we'll be called again without diagonal reflection.  Otherwise, use the 8-way
+     * multiplicity (2 and 4 way symmetry are ignored when computing multiplicity, which is thus
+     * always either 1 or 2) as a movecnt.
      */
 
-    void initialize_network(void) {
+    int movecnt;
 
-	for (highbit = 1; highbit < containers->size(); highbit <<= 1);
+    if (futuremove == HANDLED_FUTUREMOVE) {
+	movecnt = 1;
+	futuremove = NO_FUTUREMOVE;
+    } else if (ignore_futurevectors) {
+	movecnt = 1;
+    } else {
+	if ((current_position.multiplicity == 2) && (current_position.reflection & REFLECTION_DIAGONAL)) {
+	    return;
+	}
 
-	network = new T[2 * highbit];
-	container_num = new int[2 * highbit];
+	movecnt = current_position.multiplicity;
+    }
 
-	/* Fill in the upper half of the network with either the first entry from a disk queue, or
-	 * an "infinite" entry for slots with no proptables.
-	 */
+    if ((current_index == debug_move) || (future_index == debug_futuremove)) {
+	info("propagate_index_from_futurebase; %" PRIindex " %s refl %d mul %d from %s %s %" PRIindex " %s refl %d mul %d futuremove %d\n",
+	     current_index, current_position.FEN(), current_position.reflection, current_position.multiplicity,
+	     foreign_position.tb->filename.c_str(), foreign_position.tb->invert_colors ? "(Inv)" : "",
+	     foreign_position.index, foreign_position.FEN(), foreign_position.reflection,
+	     foreign_position.multiplicity, futuremove);
+    }
 
-	for (unsigned int i=0; i<highbit; i++) {
-	    if (i < containers->size()) {
-		network[highbit + i] = (*containers)[i]->pop_front();
-		container_num[highbit + i] = i;
-	    } else {
-		container_num[highbit + i] = -1;
+    if (futurebase->format.dtm_bits > 0) {
+
+	int dtm = futurebase->get_DTM(future_index);
+
+	if (dtm > 0) {
+	    /* Don't backprop DTM 1 (PNTM in check) because we don't count illegal moves (unless it's suicide) */
+	    if ((futurebase->variant == Variant::Suicide) || (dtm != 1)) {
+		commit_update(current_index, -dtm, movecnt, futuremove);
 	    }
+	} else if (dtm < 0) {
+	    commit_update(current_index, -dtm+1, movecnt, futuremove);
+	} else {
+	    /* We insert even if dtm is zero because we have to track futuremoves,
+	     * but we use movecnt=0 since this is a draw, which is different
+	     * from a discard.
+	     */
+	    commit_update(current_index, 0, 0, futuremove);
 	}
 
-	/* Then, sort into the lower half of the network. */
+    } else if (futurebase->format.basic_offset != -1) {
 
-	for (int network_node = highbit-1; network_node > 0; network_node --) {
-	    if (container_num[2*network_node] == -1) {
-		network[network_node] = network[2*network_node + 1];
-		container_num[network_node] = container_num[2*network_node + 1];
-	    } else if (container_num[2*network_node + 1] == -1) {
-		network[network_node] = network[2*network_node];
-		container_num[network_node] = container_num[2*network_node];
-	    } else if (network[2*network_node] < network[2*network_node + 1]) {
-		network[network_node] = network[2*network_node];
-		container_num[network_node] = container_num[2*network_node];
-	    } else {
-		network[network_node] = network[2*network_node + 1];
-		container_num[network_node] = container_num[2*network_node + 1];
+	Basic basic = futurebase->get_basic(future_index);
+
+	if (basic == Basic::Draw) {
+	    commit_update(current_index, 0, 0, futuremove);
+	} else if (basic == Basic::PTMwins) {
+	    commit_update(current_index, -2, movecnt, futuremove);
+	} else if (basic == Basic::PNTMwins) {
+	    commit_update(current_index, 2, movecnt, futuremove);
+	} else if (basic == Basic::Illegal) {
+	    /* basic == 3: illegal position, PNTM in check, no backprop */
+	} else {
+	    throw std::runtime_error("Basic::Unknown in backprop " + std::string(foreign_position.FEN()));
+	}
+
+    } else {
+
+	bool flag = futurebase->get_flag(future_index);
+	PieceColor stm = index_to_side_to_move(futurebase, future_index);
+
+	if (ignore_futurevectors) {
+	    if (PNTM_in_check(futurebase, &foreign_position)) {
+		return;
+	    }
+	}
+
+	/* What happens if we're back propagating a flag from a color-inverted futurebase?
+	 *
+	 * Well, first of all, a "white-wins" flag in an inverted futurebase becomes a "black-wins"
+	 * flag here, which is basically a "NOT white-draws" flag, so we have to be careful to
+	 * backprop from draw flags to win flags and from win flags to draw flags if the colors have
+	 * been inverted.  Other than that, since the side to move we just fetched is in the
+	 * futurebase, the white/black sense of the flag matches with it, so we don't need to invert
+	 * anything to figure out if this is a PTM win or a PNTM win.
+	 */
+
+	/* I use twos here because there's a lot of stuff that gets cut out for the special case of 1 */
+
+	if ((flag && (stm == PieceColor::White)) || (!flag && (stm == PieceColor::Black))) {
+	    commit_update(current_index, -2, movecnt, futuremove);
+	} else {
+	    commit_update(current_index, 2, movecnt, futuremove);
+	}
+
+    }
+}
+
+void propagate_local_position_from_futurebase(local_position_t &position,
+					      const local_position_t &foreign_position,
+					      const int futuremove, bool normalize)
+{
+    int piece;
+    const tablebase_t * const tb = position.tb;
+
+    /* We may need to consider a bunch of additional positions here that are identical to the base
+     * position except that a single one of the pawns on the fourth or fifth ranks was capturable en
+     * passant.
+     * 
+     * We key off the en_passant flag in the position that was passed in.  If it's set, then we're
+     * back propagating a position that requires en passant, so we just do it.  Otherwise, we're
+     * back propagating a position that doesn't require en passant, so we check for additional
+     * en passant positions.
+     */
+
+    propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
+
+    if (position.en_passant_square == ILLEGAL_POSITION) {
+
+	for (piece = 0; piece < tb->num_pieces; piece ++) {
+
+	    if (tb->pieces[piece].color == position.side_to_move) continue;
+	    if (tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+
+	    /* I took care in the calling routines to update board_vector specifically so we can
+	     * check for en passant legality here.
+	     */
+
+	    if ((tb->pieces[piece].color == PieceColor::White)
+		&& (ROW(position.piece_position[piece]) == 3)
+		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] - 8))
+		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] - 16))) {
+		position.set_en_passant_square(position.piece_position[piece] - 8);
+		propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
+	    }
+
+	    if ((tb->pieces[piece].color == PieceColor::Black)
+		&& (ROW(position.piece_position[piece]) == 4)
+		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] + 8))
+		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] + 16))) {
+		position.set_en_passant_square(position.piece_position[piece] + 8);
+		propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
 	    }
+
+	    position.clear_en_passant_square();
+	}
+    }
+}
+
+/* Reflections.
+ *
+ * If the futurebase has greater symmetry than the tablebase under construction, then we have to
+ * apply a series of reflections to each futurebase position in order to get all the corresponding
+ * positions in the current tablebase.  This utility function computes them.
+ *
+ * If we're back propagating from a futurebase with greater symmetry, then a single futurebase index
+ * will correspond to several positions in the current tablebase.  We'll need to apply some
+ * reflections to get those additional positions, so compute here how many of them we'll need.  It's
+ * a fairly easy calculation, since our symmetry options are currently limited to 1/2/4/8, so a
+ * simple ratio suffices, except if both tablebases have symmetry 8, in which case the more complex
+ * effects of diagonal symmetry require a double conversion no matter what.
+ */
+
+
+int compute_reflections(tablebase_t *tb, tablebase_t *futurebase, int *reflections)
+{
+    int max_reflection;
+
+    max_reflection = futurebase->symmetry / tb->symmetry;
+    if ((futurebase->symmetry == 8) && (tb->symmetry == 8)) max_reflection = 2;
+
+    reflections[0] = REFLECTION_NONE;
+    if (futurebase->symmetry == 8) reflections[1] = REFLECTION_DIAGONAL;
+    if (futurebase->symmetry == 4) reflections[1] = REFLECTION_VERTICAL;
+    if (futurebase->symmetry == 2) reflections[1] = REFLECTION_HORIZONTAL;
+    if (max_reflection >= 4) {
+	if (futurebase->symmetry == 8) {
+	    /* This is either the 8 -> 2 or 8 -> 1 cases */
+	    reflections[2] = reflections[0] | REFLECTION_VERTICAL;
+	    reflections[3] = reflections[1] | REFLECTION_VERTICAL;
+	} else {
+	    /* This is the 4 -> 1 case */
+	    reflections[2] = reflections[0] | REFLECTION_HORIZONTAL;
+	    reflections[3] = reflections[1] | REFLECTION_HORIZONTAL;
+	}
+    }
+    if (max_reflection == 8) {
+	/* The 8 -> 1 case */
+	reflections[4] = reflections[0] | REFLECTION_HORIZONTAL;
+	reflections[5] = reflections[1] | REFLECTION_HORIZONTAL;
+	reflections[6] = reflections[2] | REFLECTION_HORIZONTAL;
+	reflections[7] = reflections[3] | REFLECTION_HORIZONTAL;
+    }
+
+    if (! futurebase->encode_stm) {
+	for (int r = 0; r < max_reflection; r ++) {
+	    reflections[max_reflection + r] = reflections[r] | REFLECTION_COLOR;
 	}
+	max_reflection *= 2;
     }
 
-public:
+    return max_reflection;
+}
 
-    sorting_network(Container * containers):
-	containers(containers), network(nullptr), container_num(nullptr), highbit(0)
-    { }
 
-    ~sorting_network() {
-	if (network) delete[] network;
-	if (container_num) delete[] container_num;
-    }
+/* Everything the futurebase backprop routines need to know about the futurebase they're working on.
+ *
+ * This used to be a set of global variables, but now several futurebases can be back propagated at
+ * the same time (see back_propagate_all_futurebases()), so each of them gets its own job.
+ */
 
-    bool empty(void) {
-	return (highbit == 0) ? containers->empty() : (container_num[1] == -1);
-    }
+struct futurebase_job {
+    tablebase_t * futurebase;
+    void (* backprop_function)(const futurebase_job &, index_t, int);
 
-    const T& front(void) {
-	if (highbit == 0) initialize_network();
-	return network[1];
-    }
+    int max_reflection;
+    int reflections[16];
 
-    T pop_front(void) {
-	if (highbit == 0) initialize_network();
+    bool doing_capture_backprop;
 
-	T retval = network[1];
-	int network_node = highbit + container_num[1];
+    /* Promotion and capture-promotion futurebases only */
 
-	if ((*containers)[container_num[1]]->empty()) {
-	    container_num[network_node] = -1;
-	} else {
-	    network[network_node] = (*containers)[container_num[1]]->pop_front();
-	}
+    PieceColor promotion_color;
+    int first_back_rank_square;
+    int last_back_rank_square;
+    int promotion_move;
 
-	while (network_node > 1) {
-	    network_node >>= 1;
-	    if (container_num[2*network_node] == -1) {
-		network[network_node] = network[2*network_node + 1];
-		container_num[network_node] = container_num[2*network_node + 1];
-	    } else if (container_num[2*network_node + 1] == -1) {
-		network[network_node] = network[2*network_node];
-		container_num[network_node] = container_num[2*network_node];
-	    } else if (network[2*network_node] < network[2*network_node + 1]) {
-		network[network_node] = network[2*network_node];
-		container_num[network_node] = container_num[2*network_node];
-	    } else {
-		network[network_node] = network[2*network_node + 1];
-		container_num[network_node] = container_num[2*network_node + 1];
-	    }
-	}
+    /* Bookkeeping for the worker pool */
 
-	return retval;
-    }
+    index_t indices_to_read;
+    unsigned int workers = 0;
+    bool exhausted = false;
 };
 
-/* The priority queue template.
+/* Index range pruning
  *
- * Initialize with the size of the in-memory portion in megabytes.  If we insert less than that
- * size, do everything in-memory.  If we insert more, then dump to disk and use a sorting network to
- * read it back.
+ * Most of a promotion futurebase can't possibly back propagate into the current tablebase.  Going
+ * from kqk into kpk, for example, only the positions with the queen on the eighth rank matter, and
+ * that's one in eight of them.  If the futurebase's encoding stores the promoted piece as a single
+ * digit of the index (see index_encoding::piece_digit()), we can figure out which values of that
+ * digit are interesting, and then skip over every chunk of the futurebase where the digit never
+ * takes one of those values.  fetch_entry() does the skipping, so we don't even decompress them.
  *
- * Our template takes three types.  The first (T) is the type to store in the priority queue, the
- * second (MemoryContainer) is a container to hold that type in memory, and the third
- * (DiskContainer) is a container to hold that type on disk.  Names notwithstanding, we don't impose
- * any memory or disk requirements in this class.  We expect MemoryContainer to export begin() and
- * end() methods that return random access iterators usable for insertion, retrieval, and sorting
- * (with std::sort).  We expect DiskContainer to take a begin/end pair of iterators as a constructor
- * and supply pop_front() for retrieval.  We just push into a MemoryContainer until it's full, sort
- * it and copy it to a DiskContainer, and keep going until we're done.  Then, if we used
- * DiskContainer at all, we sort and dump the final MemoryContainer into a DiskContainer and read
- * back from the DiskContainers using a sorting network.  Otherwise, we read back directly from a
- * single MemoryContainer, i.e, we don't use a DiskContainer at all unless we fill up a
- * MemoryContainer.
+ * Reflections move the piece around, so we take the union over all of them, and if there are
+ * several identical promoted pieces, any one of them could be the one that just promoted.
  *
- * We take advantage of multi-threading by breaking the in-memory table into equal size blocks, then
- * making each thread sort and write a single block.  This is done by detecting when we write into
- * the last num_threads elements in the table and using that as a trigger to sort and dump
- * 1/num_threads-th of it.  So long as the table is at least n^2 elements, we're fine.
+ * Captures work the same way, using the squares that the capturing side could possibly have
+ * captured onto, but since a king can usually capture anywhere, that doesn't often save anything.
  *
- * about inheriting std::mutex... we lock when we insert (though we shouldn't need this if tail can
- * be bumped atomically)... we expect the caller to already hold the lock when we retrieve... we do
- * this because we want to atomically retrieve the front element along with any elements equal to it
+ * If we can't describe things like this, we leave relevant_digits empty and read everything.
+ * Returns the number of indices we'll actually be reading, for the progress indicator.
  */
 
-template <typename T, typename MemoryContainer = std::vector<T>, typename DiskContainer = disk_que<MemoryContainer> >
-class priority_queue : public std::mutex {
+index_t compute_relevant_indices(tablebase_t *tb, const futurebase_job & job)
+{
+    tablebase_t * futurebase = job.futurebase;
+    std::vector<int> candidates;
+    uint64_t target_squares = 0;
 
-    typedef class synchronized<std::deque<std::shared_ptr<DiskContainer>>> DiskContainerQue;
-    typedef typename MemoryContainer::iterator Iterator;
+    std::vector<tablebase_t::index_digit> digits;
 
-private:
-    DiskContainerQue disk_ques;
-    class sorting_network<DiskContainerQue> snetwork;
+    futurebase->relevant_digits.clear();
+    futurebase->relevant_chunks.clear();
 
-    MemoryContainer * in_memory_queue;
-    Iterator head;
-    Iterator tail;
-    bool sorted;
+    switch (futurebase->futurebase_type) {
 
-    size_t item_count;
+    case FuturebaseType::Promotion:
+    case FuturebaseType::CapturePromotion:
 
-    size_t remaining_space;
-    size_t block_size;
-    unsigned int blocks_dumped_to_disk;
-    std::mutex blocks_dumped_to_disk_mutex;
-    std::condition_variable blocks_dumped_to_disk_cond;
+	for (int piece = 0; piece < futurebase->num_pieces; piece ++) {
+	    if ((futurebase->pieces[piece].color == futurebase->pieces[futurebase->extra_piece].color)
+		&& (futurebase->pieces[piece].piece_type == futurebase->pieces[futurebase->extra_piece].piece_type)) {
+		candidates.push_back(piece);
+	    }
+	}
 
-    void sort_and_dump_to_disk(Iterator begin, Iterator end) {
-	/* The sort is time-consuming, so we don't lock disk_ques until it's done */
-	std::sort(begin, end);
-	std::lock_guard<std::mutex> _(disk_ques);
-	std::shared_ptr<DiskContainer> ptr(new DiskContainer(begin, end));
-	disk_ques.push_back(ptr);
-    }
+	for (int square = job.first_back_rank_square; square <= job.last_back_rank_square; square ++) {
+	    target_squares |= BITVECTOR(square);
+	}
 
-public:
-    
-    void prepare_to_retrieve(void) {
+	break;
 
-	/* XXX What I'd really like here is to detect when we get to the point where we can start
-	 * retrieving, then alternate between filling the array from the front and from the back on
-	 * alternate passes.  Right now, I just comment out this code and alloc a new array each
-	 * time around.
-	 */
-#if 0
-	/* If we never had to push anything to disk, just sort and retrieve in-memory.  The problem
-	 * with this code is that we might not be able to free much memory, something that we can
-	 * assure if we write everything out to disk.
-	 */
-	if (disk_ques.empty() && (remaining_space >= num_threads)) {
-	    if (! sorted) {
-		std::sort(head, tail);
-		in_memory_queue->resize(tail-head);
-		sorted = true;
+    case FuturebaseType::Capture:
+	{
+	    int captured_piece = (futurebase->missing_pawn != -1) ? futurebase->missing_pawn : futurebase->missing_non_pawn;
+	    PieceColor capturing_color = ~ tb->pieces[captured_piece].color;
+	    PieceColor foreign_color = futurebase->invert_colors ? ~ capturing_color : capturing_color;
+
+	    for (int piece = 0; piece < tb->num_pieces; piece ++) {
+		if (tb->pieces[piece].color == capturing_color) {
+		    target_squares |= tb->possible_capture_squares(piece);
+		}
+	    }
+
+	    for (int piece = 0; piece < futurebase->num_pieces; piece ++) {
+		if (futurebase->pieces[piece].color == foreign_color) candidates.push_back(piece);
 	    }
-	    return;
 	}
-#endif
 
-	/* We assume that we're locked, so remaining_space remains constant and indicates whether
-	 * other threads are dumping to disk.
-	 */
-	if (in_memory_queue) {
-	    if (remaining_space >= num_threads) {
-		if (head != tail) {
-		    sort_and_dump_to_disk(head, tail);
-		    tail = head;
+	break;
+
+    case FuturebaseType::Pawngen:
+	{
+	    /* A pawngen futurebase's pawngen index is the most significant digit of its index, and
+	     * we only care about the pawngen indices where moving a pawn backwards lands us in our
+	     * own range.  When we're one slice of a big tablebase, that's usually a small fraction of
+	     * the futurebase.  No candidates, so the reflection loop below does nothing.
+	     */
+
+	    const struct pawngen & fb_pawngen = *futurebase->pawngen;
+	    const struct pawngen & local_pawngen = *tb->pawngen;
+	    auto in_range = [&local_pawngen] (int pawngen_index) {
+		return (pawngen_index >= local_pawngen.start) && (pawngen_index < local_pawngen.start + local_pawngen.count);
+	    };
+	    tablebase_t::index_digit digit;
+
+	    digit.place = futurebase->encoding->size * futurebase->stm_stride();
+	    digit.radix = fb_pawngen.count;
+	    digit.allowed.assign(fb_pawngen.count, false);
+
+	    for (int value = 0; value < fb_pawngen.count; value ++) {
+		int pawngen_index = fb_pawngen.start + value;
+		const pawn_position & pp = local_pawngen.pawn_positions_by_index[pawngen_index];
+
+		for (int piece = 0; piece < tb->num_pieces; piece ++) {
+		    if (tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+		    if (((pp.prev_position[piece] != ILLEGAL_POSITION)
+			 && in_range(pawngen_index + pp.delta_pawngen_index[piece]))
+			|| ((pp.prev_position2[piece] != ILLEGAL_POSITION)
+			    && in_range(pawngen_index + pp.delta_pawngen_index2[piece]))) {
+			digit.allowed[value] = true;
+			break;
+		    }
 		}
-	    } else {
-		unsigned int current = num_threads - remaining_space - 1;
+	    }
 
-		sort_and_dump_to_disk(in_memory_queue->begin() + current * block_size,
-				      in_memory_queue->end());
+	    if (std::find(digit.allowed.begin(), digit.allowed.end(), false) == digit.allowed.end()) {
+		return futurebase->num_indices;
 	    }
-	    delete in_memory_queue;
-	    in_memory_queue = nullptr;
-	}
-    }
 
-    /* Our constructor passes all of its arguments to MemoryContainer's constructor */
+	    digits.push_back(digit);
+	}
 
-    template <typename... Args>
-    priority_queue(Args... args):
-	snetwork(&disk_ques),
-	in_memory_queue(new MemoryContainer(args...)),
-	head(in_memory_queue->begin()),
-	tail(head),
-	sorted(true),
-	item_count(0)
-    {
-	block_size = (in_memory_queue->end() - in_memory_queue->begin()) / num_threads;
+	break;
 
-	/* Round down block_size to a multiple of eight to ensure that the blocks are byte aligned */
-	while ((block_size % 8) != 0) block_size --;
+    default:
 
-	blocks_dumped_to_disk = 0;
-	remaining_space = in_memory_queue->end() - in_memory_queue->begin();
+	return futurebase->num_indices;
     }
 
-    ~priority_queue() {
-	if (in_memory_queue) delete in_memory_queue;
-    }
+    for (int reflection = 0; reflection < job.max_reflection; reflection ++) {
 
-    void push(const T& x) {
+	for (auto piece : candidates) {
 
-	std::unique_lock<std::mutex> self_lock(*this);
+	    /* Which encoded squares end up on a target square, once we've reflected the position
+	     * and translated it into the current tablebase?  A color reflection also swaps the
+	     * piece with its color symmetric twin (see index_to_local_position()).
+	     */
 
-	if (in_memory_queue == nullptr) throw std::runtime_error("priority_queue: push attempted after retrieval started");
+	    int encoded_piece = piece;
+	    uint64_t squares = 0;
 
-	item_count ++;
-	*(tail ++) = x;
-	remaining_space --;
-	sorted = false;
+	    if (job.reflections[reflection] & REFLECTION_COLOR) {
+		encoded_piece = futurebase->pieces[piece].color_symmetric_transpose;
+	    }
 
-	if (remaining_space < num_threads) {
+	    for (int square = 0; square < 64; square ++) {
+		int local_square = reverse_reflection[job.reflections[reflection] & 7][square];
 
-	    unsigned int current = num_threads - remaining_space - 1;
+		if (job.reflections[reflection] & REFLECTION_COLOR) local_square = 63 - local_square;
 
-	    if (current != num_threads - 1) {
-		/* If there's still room to insert at the end, we unlock while we're sorting and
-		 * dumping to disk, but the real reason to unlock is to let other threads into this
-		 * code so they can also sort and dump to disk (it's a slow operation).
-		 */
-		self_lock.unlock();
-		sort_and_dump_to_disk(in_memory_queue->begin() + current * block_size,
-				      in_memory_queue->begin() + (current+1) * block_size);
-	    } else {
-		sort_and_dump_to_disk(in_memory_queue->begin() + current * block_size,
-				      in_memory_queue->end());
+		if (futurebase->invert_colors) local_square = rowcol2square(7 - ROW(local_square), COL(local_square));
+
+		if (target_squares & BITVECTOR(local_square)) squares |= BITVECTOR(square);
 	    }
 
-	    /* Now we lock on a different mutex that protects a condition variable.  We never hold
-	     * this lock doing anything that blocks on the primary lock - just increment
-	     * blocks_dumped_to_disk and notify the thread waiting for it to reach num_threads,
-	     * which is holding the primary lock.
-	     */
+	    tablebase_t::index_digit digit;
 
-	    std::unique_lock<std::mutex> lock(blocks_dumped_to_disk_mutex);
+	    if (! futurebase->encoding->piece_digit(futurebase, encoded_piece, squares,
+						    &digit.place, &digit.radix, digit.allowed)) {
+		return futurebase->num_indices;
+	    }
 
-	    blocks_dumped_to_disk ++;
-	    blocks_dumped_to_disk_cond.notify_all();
+	    digit.place *= futurebase->stm_stride();
 
-	    if (current == num_threads - 1) {
-		/* There's no remaining space, we're locked, and dumps to disk have at least started
-		 * for all blocks.  Make sure they're all done before we reset everything and get
-		 * going again.
-		 */
+	    /* If every value of the digit is interesting, there's nothing to skip */
 
-		while (blocks_dumped_to_disk < num_threads) {
-		    blocks_dumped_to_disk_cond.wait(lock);
-		}
+	    if (std::find(digit.allowed.begin(), digit.allowed.end(), false) == digit.allowed.end()) {
+		return futurebase->num_indices;
+	    }
 
-		tail = head;
-		remaining_space = in_memory_queue->end() - in_memory_queue->begin();
-		blocks_dumped_to_disk = 0;
+	    /* Merge digits that we've seen before for other reflections */
+
+	    auto existing = std::find_if(digits.begin(), digits.end(),
+					 [&digit](const tablebase_t::index_digit & d) { return d.place == digit.place; });
+
+	    if (existing == digits.end()) {
+		digits.push_back(digit);
+	    } else {
+		for (index_t value = 0; value < digit.radix; value ++) {
+		    if (digit.allowed[value]) existing->allowed[value] = true;
+		}
 	    }
 	}
     }
 
-    bool empty(void) {
-	// XXX use item_count here?
-	return disk_ques.empty() ? (head == tail) : snetwork.empty();
-    }
-
-    size_t count(void) {
-	return item_count;
-    }
+    /* With side-to-move in the MSB, the digits keep counting up through the black-to-move half, so
+     * they're only right there if the half starts on a boundary of every one of them.
+     */
 
-    const T front(void) {
-	prepare_to_retrieve();
-	if (disk_ques.empty()) {
-	    return *head;
-	} else {
-	    return snetwork.front();
+    if (futurebase->stm_place > 1) {
+	for (auto & digit : digits) {
+	    if (futurebase->stm_place % (digit.place * digit.radix) != 0) return futurebase->num_indices;
 	}
     }
 
-    T pop_front(void) {
-	prepare_to_retrieve();
-	item_count --;
-	if (disk_ques.empty()) {
-	    return *(head++);
-	} else {
-	    return snetwork.pop_front();
+    /* Now mark every chunk in which at least one digit takes an interesting value somewhere */
+
+    index_t num_chunks = (futurebase->num_indices + futurebase_stride - 1) / futurebase_stride;
+    index_t relevant_indices = 0;
+
+    futurebase->relevant_chunks.assign(num_chunks, false);
+
+    for (index_t chunk = 0; chunk < num_chunks; chunk ++) {
+
+	index_t first = chunk * futurebase_stride;
+	index_t last = std::min(first + futurebase_stride, futurebase->num_indices) - 1;
+
+	for (auto & digit : digits) {
+	    index_t first_value = first / digit.place;
+	    index_t last_value = last / digit.place;
+
+	    if (last_value - first_value + 1 > digit.radix) last_value = first_value + digit.radix - 1;
+
+	    for (index_t value = first_value; value <= last_value; value ++) {
+		if (digit.allowed[value % digit.radix]) {
+		    futurebase->relevant_chunks[chunk] = true;
+		    break;
+		}
+	    }
+
+	    if (futurebase->relevant_chunks[chunk]) break;
 	}
+
+	if (futurebase->relevant_chunks[chunk]) relevant_indices += last - first + 1;
     }
-};
 
-/* The entries in the proptable
+    futurebase->relevant_digits = std::move(digits);
+
+    return relevant_indices;
+}
+
+/* The four futurebase back-propagation functions
  *
- * Required field sizes for futurebase back-propagation:
+ * These functions handle threading differently from the intra-table case, where we split the
+ * tablebase up into N sections for the N threads and let each thread tear into its own section.
+ * This time, we're reading the futurebase from disk, and it might be biiiig, so we want to proceed
+ * through it sequentially.  Each thread reads a portion of the futurebase, calls the appropriate
+ * one of these functions for every index in that portion, and loops until everything is done.
  *
- *   index - figure out from num_indices
- *   dtm - figure out from futurebase preload, unless it isn't being tracked
- *   movecnt - 0 (XXX - discarded futuremove only), 1, or 2 for 8-way symmetry conversion
- *   futuremove - figure out from total_futuremoves
+ * job.reflections[] gets computed for every futurebase.  See comments on compute_reflections().
  *
- * Required field sizes for intra-tablebase propagation:
+ * For each possible reflection of each possible futuremove, we attempt to translate the futurebase
+ * pieces into corresponding local tablebase pieces.  Actually, we did this for the entire
+ * futurebase when we loaded it, and those piece assignments should never change within a single
+ * futurebase, so all we really do is blunder check.
+ */
+
+/* NORMAL PAWN PROMOTION
  *
- *   index - figure out from num_indices
- *   dtm - known from pass number, unless it isn't being tracked
- *   movecnt - always 1
- *   futuremove - unneeded
+ * We can easily identify what we're promoting into, since there's a single type and color of piece
+ * in the futurebase of which there are one more than in the current tablebase.  Assume, without
+ * loss of generality, that it's a queen.  There are also pawns in the current tablebase.  To a
+ * first approximation, we have to consider all pairs of local pawns and foreign queens.
  *
- * The fields are stored as object variables, and functions are provided to marshal and demarshal an
- * entire proptable entry into whatever integer type is being used by the proptable.  encode<T> is a
- * method that takes a proptable_format and packs everything into a return value of type T.
- * proptable_entry<T> is a constructor that takes a proptable_format and a value of type T and
- * initializes the object fields appropriately.
+ * Actually, we can limit things further.  Let's just consider each foreign queen in turn.  The only
+ * possible local pawn that could promote into it is located one square directly behind it.  So in a
+ * given futurebase position, we only need to consider all foreign queens, with the local position
+ * that leads to it uniquely determined.
+ *
+ * Furthermore, in a given position, each foreign piece will map into a local semilegal group.  One
+ * of those local semilegal groups will have one more piece (the extra piece) map into it; all of
+ * the others must have the same number of pieces map into them as they contain.  Once a local
+ * position has been setup for back propagation, that special semilegal group will be fully
+ * populated and will contain the promotion square, too.  We just cycle the promotion square among
+ * all of the n pieces in this group, creating n+1 total positions.  None of pieces that map into
+ * other semilegal groups could be the promotion piece, because that would create an imbalance among
+ * the semilegal groups - one would have one piece too many, another would have one piece too few.
+ *
+ * Prior to 1.779, we cycled among semilegal groups in the FUTUREBASE, but that was a bug.
+ * Futurebase semilegal groups don't matter, only the local semilegal group matters.
  */
 
-class proptable_entry {
+void propagate_moves_from_promotion_futurebase(const futurebase_job & job, index_t future_index, int reflection)
+{
+    tablebase_t * futurebase = job.futurebase;
+    local_position_t foreign_position(futurebase);
+    local_position_t position(current_tb);
+    translation_result translation;
+    int true_pawn;
 
-private:
-    template<typename T>
-    static int value_to_dtm(proptable_format *format, T value) {
-	int dtm = (value >> format->dtm_offset) & format->dtm_mask;
-	if (dtm > (int) (format->dtm_mask >> 1)) dtm |= (~ (format->dtm_mask >> 1));
-	return dtm;
-    }
+    /* Take the position from the futurebase and translate it into a local position for the current
+     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
+     * there should be one piece missing from the local position (the pawn that promoted) and one
+     * piece extra (what it promoted into).  There can be no pieces on restricted squares.
+     */
 
-public:
-    index_t index;
-    int dtm;
-    unsigned int movecnt;
-    int futuremove;
+    if (! index_to_local_position(futurebase, future_index, job.reflections[reflection],
+				  &foreign_position)) return;
 
-    /* Can't initialize all our fields during construction since sorting_network creates an
-     * uninitialized array of proptable_entry's.
-     */
-    proptable_entry() {}
+    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
+							       current_tb, &position,
+							       futurebase->invert_colors);
 
-    proptable_entry(index_t index, int dtm, unsigned int movecnt, int futuremove):
-	index(index), dtm(dtm), movecnt(movecnt), futuremove(futuremove) {}
+    if (translation != invalid_translation) {
 
-#if 0
-    template<typename T>
-    proptable_entry(proptable_format *format, T value):
-	proptable_entry(value >> format->index_offset, value_to_dtm(format, value),
-			((value >> format->movecnt_offset) & format->movecnt_mask) + 1,
-			(value >> format->futuremove_offset) & format->futuremove_mask)
-    {}
-#else
-    template<typename T>
-    proptable_entry(proptable_format *format, T value):
-	index(value >> format->index_offset), dtm(value_to_dtm(format, value)),
-	movecnt(((value >> format->movecnt_offset) & format->movecnt_mask) + 1),
-	futuremove((value >> format->futuremove_offset) & format->futuremove_mask)
-    {
-	if (static_cast<uint64_t>(futuremove) == format->futuremove_mask) {
-	    futuremove = NO_FUTUREMOVE;
-	}
-    }
-#endif
+	if ((translation.extra_piece == NONE) || (translation.missing_piece1 == NONE)
+	    || (translation.missing_piece2 != NONE) || (translation.restricted_piece != NONE)) return;
 
-    template<typename T>
-    T encode(proptable_format *format) {
-	return (index << format->index_offset)
-	    | ((dtm & format->dtm_mask) << format->dtm_offset)
-	    | (((movecnt - 1) & format->movecnt_mask) << format->movecnt_offset)
-	    | ((futuremove & format->futuremove_mask) << format->futuremove_offset);
-    }
+	uint8_t pawn = translation.missing_piece1;
 
-    /* This is used when we build current_pt_entries */
+	/* Since the last move had to have been a promotion move, there is absolutely no way we
+	 * could have en passant capturable pawns in the futurebase position.
+	 */
 
-    bool operator<(const proptable_entry &other) const {
-	return index < other.index;
-    }
-};
+	if (position.en_passant_square != ILLEGAL_POSITION) return;
 
+	/* Whatever color the promoted piece is, after the promotion it must be the other side to
+	 * move.
+	 */
 
-/* Proptable - byte-aligned version
- *
- * Very simple - just construct a priority queue of a specified (integer) type and marshal/demarshal
- * proptable_entry's into that integer.
- */
+	if (position.side_to_move == job.promotion_color) return;
 
-template<typename T>
-class typed_proptable : public priority_queue<T> {
+	/* We're going to back step a half move now */
 
-public:
-    proptable_format format;
+	position.flip_side_to_move();
 
-    /* priority_queue<T>'s constructor passes all of its arguments to its MemoryContainer's
-     * constructor (remember?), and priority_queue<T>'s default MemoryContainer is std::vector<T>,
-     * which will take a size_type and build a container with that many elements.
-     */
+	/* We need an extra loop in here to handle futurebases with multiple identical pieces.
+	 * Let's say we're back propagating from a Q+Q endgame into a Q+P endgame.  If we've got a
+	 * futurebase position with both queens on the back rank, then we have to consider the
+	 * possibility that the pawn could promote into either of them.
+	 */
 
-    typed_proptable(proptable_format format, size_t size_in_bytes):
-	priority_queue<T>(size_in_bytes / sizeof(T)), format(format)
-    {
-	if (format.bits > 8 * (int) sizeof(T)) throw std::runtime_error("proptable format too large");
-    }
+	int promotion_sq = foreign_position.piece_position[translation.extra_piece];
 
-    proptable_entry front() {
-	return proptable_entry(&format, priority_queue<T>::front());
-    }
+	if (futurebase->invert_colors)
+	    promotion_sq = rowcol2square(7 - ROW(promotion_sq), COL(promotion_sq));
 
-    proptable_entry pop_front() {
-	return proptable_entry(&format, priority_queue<T>::pop_front());
-    }
+	int local_piece = futurebase->pieces[translation.extra_piece].matching_local_semilegal_group[promotion_sq];
 
-    void push(proptable_entry &entry) {
-	priority_queue<T>::push(entry.encode<T>(&format));
-    }
-};
+	while (true) {
 
-/* Proptable - bit-aligned version
- *
- * proptable_iterator (defined below) dereferences into proptable_ptr, which is a pointer into the
- * in-memory table.  It's not a normal pointer because the in-memory table is bit-aligned, not
- * byte-aligned.  It contains a pointer to the table format structure, a pointer to the base of the
- * in-memory table, and an offset into the table, measured in entries, the exact size of which is
- * contained in the format structure.
- *
- * To support std::sort, proptable_iterator has to dereference into a type that is Swappable,
- * MoveConstructable and MoveAssignable (the C++11 standard's terminology).  That means that
- * proptable_ptr has to operate as an lvalue that both points into the proptable (Swappable) and
- * also can hold a temporary value (MoveConstructable and MoveAssignable).
- *
- * Both proptable_ptr and proptable_iterator contain pointers to the format, since both of them are
- * dependent on either a memory_proptable or a disk_que<memory_proptable>.  On the other hand, both
- * memory_proptable and disk_que<memory_proptable> contain actual format structures, not pointers.
- */
+	    /* The extra piece has to be on the back rank.
+	     *
+	     * I used to (pre 1.547) 'break' here if it wasn't, figuring that since identical pieces
+	     * are sorted into ascending square numbers, if we'd backed up to an extra piece that
+	     * wasn't on the back rank, then there couldn't be any more identical pieces on the back
+	     * rank.
+	     *
+	     * But Laurent Bartholdi exposed that as a bug.  If black is promoting, then we start
+	     * with the piece with the highest square number - that isn't on the back rank - and
+	     * have to back up to find one that is.
+	     *
+	     * We could invert the whole piece processing order to make the original optimization
+	     * work, but then when you consider what can happen if there are movement restrictions
+	     * in the futurebase, maybe the pieces aren't even going to show up in the right order.
+	     * Better to ditch that whole idea, I think.
+	     */
 
-class proptable_iterator;
-class memory_proptable;
+	    if ((promotion_sq >= job.first_back_rank_square) && (promotion_sq <= job.last_back_rank_square)) {
 
-class proptable_ptr {
+		/* There has to be an empty square right behind where the pawn came from, and it has
+		 * to be at least semilegal for the pawn.
+		 */
 
-    friend class proptable_iterator;
-    friend class disk_que<memory_proptable>;
-    friend void swap(proptable_ptr a, proptable_ptr b);
+		if (!(position.board_vector & BITVECTOR(promotion_sq - job.promotion_move))
+		    && (current_tb->pieces[pawn].semilegal_squares & BITVECTOR(promotion_sq - job.promotion_move))) {
 
- private:
-    proptable_format *format;
-    uint64_t i;
-    void *base;
-    uint64_t value;
+		    local_position_t new_position = position;
 
-    /* Private constructor: friend proptable_iterator constructs proptable_ptr when dereferencing */
+		    /* Put the missing pawn on the seventh (or second). */
 
-    proptable_ptr(proptable_format *format, void *base, uint64_t i):
-	format(format), i(i), base(base) {
-	    value = get_uint64_t_field(base, i * format->bits, format->bits);
-	}
+		    new_position.place_piece(pawn, promotion_sq - job.promotion_move);
 
- public:
+		    /* Normalize the position, and back prop it. */
 
-    operator proptable_entry() {
-	return proptable_entry(format, value);
-    }
+		    normalize_position(current_tb, &new_position);
 
-    proptable_ptr & operator=(proptable_entry other) {
-	/* Set both our local copy and the copy in the proptable */
+		    true_pawn = new_position.permuted_piece[pawn];
 
-	value = (other.index << format->index_offset)
-	| ((other.dtm & format->dtm_mask) << format->dtm_offset)
-	| (((other.movecnt - 1) & format->movecnt_mask) << format->movecnt_offset)
-	| ((other.futuremove & format->futuremove_mask) << format->futuremove_offset);
+		    propagate_local_position_from_futurebase(new_position, foreign_position,
+							     promotions[true_pawn][futurebase->promotion], true);
+		}
 
-	set_uint64_t_field(base, i * format->bits, format->bits, value);
+	    }
 
-	return *this;
-    }
+	    /* If the extra piece mapped into a non-empty semilegal group, then swap it with
+	     * the next piece in the group and try again.
+	     */
 
-    /* We don't use the default copy operator, since that would change base and i. */
+	    if (local_piece == -1) return;
 
-    proptable_ptr & operator=(proptable_ptr other) {
-	value = other.value;
-	set_uint64_t_field(base, i * format->bits, format->bits, value);
-	return *this;
+	    int new_promotion_sq = position.piece_position[local_piece];
+
+	    position.move_piece(local_piece, promotion_sq);
+	    promotion_sq = new_promotion_sq;
+
+	    local_piece = current_tb->pieces[local_piece].next_piece_in_semilegal_group;
+	}
     }
+}
 
-    /* We want to compare index fields, but we don't want to have to extract all the fields, since
-     * this function will be used a lot during sorting.  We make sure that index occupies the most
-     * significant bits, making this comparision simple.
+void propagate_moves_from_promotion_capture_futurebase(const futurebase_job & job, index_t future_index, int reflection)
+{
+    tablebase_t * futurebase = job.futurebase;
+    local_position_t foreign_position(futurebase);
+    local_position_t position(current_tb);
+    translation_result translation;
+    int true_captured_piece;
+    int true_pawn;
+
+    /* Take the position from the futurebase and translate it into a local position for the current
+     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
+     * there should be two pieces missing from the local position (the pawn that promoted and the
+     * piece it captured) and one piece extra (what it promoted into).  There can be no pieces on
+     * restricted squares.
      */
 
-    bool operator<(const proptable_ptr & other) const {
-	return value < other.value;
-    }
+    if (! index_to_local_position(futurebase, future_index, job.reflections[reflection],
+				  &foreign_position)) return;
 
-    /* This is here to allow disk_que's constructor to cast us to a (char *) and write us to disk */
+    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
+							       current_tb, &position,
+							       futurebase->invert_colors);
 
-    operator char *() {
-	if (i % 8 != 0) throw std::runtime_error("can't convert bit-aligned proptable_ptr to char *");
-	return (char *)base + i * format->bits / 8;
-    }
+    if (translation != invalid_translation) {
 
-};
+	if ((translation.extra_piece == NONE) || (translation.missing_piece1 == NONE)
+	    || (translation.missing_piece2 == NONE) || (translation.restricted_piece != NONE)) return;
 
-void swap(proptable_ptr a, proptable_ptr b) {
-    uint64_t x = get_unsigned_int_field(a.base, a.i * a.format->bits, a.format->bits);
-    set_uint64_t_field(a.base, a.i * a.format->bits, a.format->bits,
-		       get_uint64_t_field(b.base, b.i * b.format->bits, b.format->bits));
-    set_uint64_t_field(b.base, b.i * b.format->bits, b.format->bits, x);
-}
+	/* Since the last move had to have been a promotion move, there is absolutely no way
+	 * we could have en passant capturable pawns in the futurebase position.
+	 */
+
+	if (position.en_passant_square != ILLEGAL_POSITION) return;
+
+	/* Whatever color the promoted piece is, after the promotion it must be the other
+	 * side to move.
+	 */
+
+	if (position.side_to_move == job.promotion_color) return;
+
+	/* We're going to back step a half move now */
+
+	position.flip_side_to_move();
 
-class proptable_iterator : public std::iterator<std::random_access_iterator_tag, proptable_ptr, uint64_t> {
+	/* We need an extra loop in here to handle futurebases with multiple identical pieces.
+	 * Let's say we're back propagating from a Q+Q endgame into a Q+P endgame.  If we've got a
+	 * futurebase position with both queens on the back rank, then we have to consider the
+	 * possibility that the pawn could promote into either of them.
+	 */
 
-    friend class memory_proptable;
-    friend class disk_que<memory_proptable>;
+	int promotion_sq = foreign_position.piece_position[translation.extra_piece];
 
- private:
-    proptable_format *format;
-    uint64_t i;
-    void *ptr;
+	if (futurebase->invert_colors)
+	    promotion_sq = rowcol2square(7 - ROW(promotion_sq), COL(promotion_sq));
 
-    /* Private constructor ensures that only friends can create a proptable_iterator */
+	int local_piece = futurebase->pieces[translation.extra_piece].matching_local_semilegal_group[promotion_sq];
 
-    proptable_iterator(proptable_format *format, void *ptr, uint64_t i) : format(format), i(i), ptr(ptr) {}
+	while (true) {
 
- public:
+	    /* The extra piece has to be on the back rank.
+	     *
+	     * I used to (pre 1.547) 'break' here if it wasn't, figuring that since identical pieces
+	     * are sorted into ascending square numbers, if we'd backed up to an extra piece that
+	     * wasn't on the back rank, then there couldn't be any more identical pieces on the back
+	     * rank.
+	     *
+	     * But Laurent Bartholdi exposed that as a bug.  If black is promoting, then we start
+	     * with the piece with the highest square number - that isn't on the back rank - and
+	     * have to back up to find one that is.
+	     *
+	     * We could invert the whole piece processing order to make the original optimization
+	     * work, but then when you consider what can happen if there are movement restrictions
+	     * in the futurebase, maybe the pieces aren't even going to show up in the right order.
+	     * Better to ditch that whole idea, I think.
+	     */
 
-    proptable_ptr operator*() const {
-	return proptable_ptr(format, ptr, i);
-    }
+	    if ((promotion_sq >= job.first_back_rank_square) && (promotion_sq <= job.last_back_rank_square)) {
 
-    const proptable_iterator operator++(int zero) {
-	proptable_iterator retval(*this);
-	i ++;
-	return retval;
-    }
+		/* Consider first a capture to the left (white's left).  There has to be an empty
+		 * square where the pawn came from, and it has to be at least semilegal.
+		 */
 
-    const proptable_iterator & operator++() {
-	i ++;
-	return *this;
-    }
+		if ((COL(promotion_sq) != 0)
+		    && !(position.board_vector & BITVECTOR(promotion_sq - job.promotion_move - 1))
+		    && (current_tb->pieces[translation.missing_piece1].semilegal_squares & BITVECTOR(promotion_sq - job.promotion_move - 1))) {
 
-    const proptable_iterator operator--(int zero) {
-	proptable_iterator retval(*this);
-	i --;
-	return retval;
-    }
+		    local_position_t new_position = position;
 
-    const proptable_iterator & operator--() {
-	i --;
-	return *this;
-    }
+		    /* Put the piece that was captured onto the board on the promotion square. */
 
-    const proptable_iterator operator+(int val) {
-	proptable_iterator retval(*this);
-	retval.i += val;
-	return retval;
-    }
+		    new_position.place_piece(translation.missing_piece2, promotion_sq);
 
-    const proptable_iterator operator-(int val) {
-	proptable_iterator retval(*this);
-	retval.i -= val;
-	return retval;
-    }
+		    /* Put the missing pawn on the seventh (or second). */
 
-    uint64_t operator-(const proptable_iterator & other) {
-	return i - other.i;
-    }
+		    new_position.place_piece(translation.missing_piece1, promotion_sq - job.promotion_move - 1);
 
-    bool operator==(const class proptable_iterator & other) {
-	return i == other.i;
-    }
+		    /* Back propagate the resulting position */
 
-    bool operator!=(const class proptable_iterator & other) {
-	return i != other.i;
-    }
+		    normalize_position(current_tb, &new_position);
 
-    bool operator<(const class proptable_iterator & other) {
-	return i < other.i;
-    }
+		    true_captured_piece = new_position.permuted_piece[translation.missing_piece2];
+		    true_pawn = new_position.permuted_piece[translation.missing_piece1];
 
-    // this is for the loop comparision in disk_que
-    bool operator<=(const class proptable_iterator & other) const {
-	return i <= other.i;
-    }
-};
+		    /* This function also back props any similar positions with one of the pawns
+		     * from the side that didn't promote in an en passant state.
+		     */
 
-class memory_proptable {
+		    propagate_local_position_from_futurebase(new_position, foreign_position,
+							     promotion_captures[true_pawn][true_captured_piece][futurebase->promotion], true);
 
- private:
-    proptable_format format;
-    size_t size_in_entries;
-    char *data;
+		}
 
- public:
-    typedef proptable_entry value_type;
-    typedef proptable_iterator iterator;
+		/* Now consider a capture to the right (white's right).  Again, there has to be an
+		 * empty square where the pawn came from, and it has to be semilegal.
+		 */
 
- memory_proptable(proptable_format format, size_t size_in_bytes):
-    format(format), size_in_entries(size_in_bytes / format.bits * 8), data(new char[size_in_bytes])
-	{
-	    /* We use a uint64_t to swap proptable entries */
-	    if (format.bits > 64) throw std::runtime_error("proptable format too large");
-	}
+		if ((COL(promotion_sq) != 7)
+		    && !(position.board_vector & BITVECTOR(promotion_sq - job.promotion_move + 1))
+		    && (current_tb->pieces[translation.missing_piece1].semilegal_squares & BITVECTOR(promotion_sq - job.promotion_move + 1))) {
 
-    ~memory_proptable() {
-	delete[] data;
-    }
+		    local_position_t new_position = position;
 
-    class proptable_iterator begin() {
-	return proptable_iterator(&format, data, 0);
-    }
+		    /* Put the piece that was captured onto the board on the promotion square. */
 
-    class proptable_iterator end() {
-	return proptable_iterator(&format, data, size_in_entries);
-    }
-};
+		    new_position.place_piece(translation.missing_piece2, promotion_sq);
 
-/* We don't use the generic disk_que template defined above, because it can't handle bit-aligned
- * tables.  Instead, we specialize a disk_que that dumps a bit-aligned table.
- */
+		    /* Put the missing pawn on the seventh (or second). */
 
-template <>
-struct disk_que<memory_proptable> {
+		    new_position.place_piece(translation.missing_piece1, promotion_sq - job.promotion_move + 1);
 
-    typedef proptable_entry value_type;
+		    normalize_position(current_tb, &new_position);
 
-    static const int queue_size = 256;	// size of in-memory queue; must be a multiple of 8
+		    true_captured_piece = new_position.permuted_piece[translation.missing_piece2];
+		    true_pawn = new_position.permuted_piece[translation.missing_piece1];
 
-    int size;
-    int next;
+		    propagate_local_position_from_futurebase(new_position, foreign_position,
+							     promotion_captures[true_pawn][true_captured_piece][futurebase->promotion], true);
 
-    temporary_file * file;
-    std::istream * is;
+		}
 
-    char *buffer;
-    proptable_format format;
+	    }
 
-    disk_que(proptable_iterator head, proptable_iterator tail): size(tail - head), next(0), format(*(head.format)) {
+	    /* If the extra piece mapped into a non-empty semilegal group, then swap it with the
+	     * next piece in the group and try again.
+	     */
 
-	size_t bits = size * format.bits;
-	size_t bytes = (bits + 7)/8;
+	    if (local_piece == -1) return;
 
-	file = new temporary_file("proptableXXXXXX", compress_proptables);
+	    int new_promotion_sq = position.piece_position[local_piece];
 
-	std::ostream * os = file->ostream();
-	os->write(*head, bytes);
-	delete os;
+	    position.move_piece(local_piece, promotion_sq);
+	    promotion_sq = new_promotion_sq;
 
-	is = file->istream();
+	    local_piece = current_tb->pieces[local_piece].next_piece_in_semilegal_group;
 
-	// this will create a buffer with room for queue_size values
-	buffer = new char[queue_size * format.bits / 8];
+	}
     }
+}
 
-    ~disk_que() {
-	delete is;
-	delete file;
-	delete[] buffer;
-    }
+/* Propagate moves from a futurebase that resulted from capturing one of the pieces in the current
+ * tablebase.
+ *
+ * I'm thinking of changing that "invert_colors_of_futurebase" flag to be a subroutine that gets
+ * passed in.  It could be a pointer to invert_colors_of_global_position to do what it does now.  Or
+ * it could be a "reflect board around vertical axis" to move a d4 pawn to e4.  Also see my comments
+ * on invert_colors_of_global position.
+ */
 
-    bool empty(void) {
-	return (next == size);
-    }
+void consider_possible_captures(const local_position_t &foreign_position, const local_position_t *position,
+				const int capturing_piece, const int captured_piece)
+{
+    /* When we finally convert the position to an index (in local_position_to_index()), we'll make a
+     * copy of the position and normalize it by sorting the identical pieces so that they are in
+     * ascending order.  But we have to at least be aware of this here, in order to figure out which
+     * piece "actually" got captured (we're always called with captured_piece set to the last piece
+     * number of any identical pieces), so we can figure out which futuremove number to use.
+     */
 
-    proptable_entry pop_front(void) {
-	if (empty()) throw std::runtime_error("read past end of disk_que");
-	if (next % queue_size == 0) {
-	    is->read(buffer, queue_size * format.bits / 8);
-	}
-	proptable_ptr retval(&format, buffer, next % queue_size);
-	next ++;
+    int true_captured_piece;
+    int true_capturing_piece;
 
-	return (proptable_entry) retval;
-    }
-};
+    /* We only want to consider pieces of the side which captured... */
 
-/* Finally, the actual priority queue(s) */
+    if (current_tb->pieces[capturing_piece].color == current_tb->pieces[captured_piece].color) return;
 
-// The bit-aligned version.  Significantly slower.
-//typedef priority_queue<class proptable_entry, class memory_proptable> proptable;
+    /* The en passant special case:
+     *
+     * If both the piece that captured and the piece that was captured are both pawns, and either a
+     * white pawn captured from the fifth rank, or a black pawn captured from the fourth, then there
+     * are two possible back prop positions - the obvious one, and the one where the captured pawn
+     * was in an en passant state.  We also make sure right away that the rank is clear where the
+     * pawn had to come from, and the rank is clear where the pawn had to go to, ensuring that an en
+     * passant move was even possible.
+     */
 
-// Byte-aligned versions.  No appreciable slowdown in using 64-bit version on a 32-bit problem.
-//typedef typed_proptable<uint32_t> proptable;
-typedef typed_proptable<uint64_t> proptable;
+    /* XXX if statements inside the for loop can be moved out of it */
 
-proptable * input_proptable;
-proptable * output_proptable;
+    if ((current_tb->pieces[capturing_piece].piece_type == PieceType::Pawn)
+	&& (current_tb->pieces[captured_piece].piece_type == PieceType::Pawn)
+	&& !(position->board_vector & BITVECTOR(position->piece_position[capturing_piece]-8))
+	&& !(position->board_vector & BITVECTOR(position->piece_position[capturing_piece]+8))) {
 
-futurevector_t initialize_tablebase_entry(tablebase_t *tb, index_t index);
-void finalize_futuremove(tablebase_t *tb, index_t index, futurevector_t futurevector);
+	for (auto &dir : movements(current_tb->pieces[capturing_piece].piece_type,
+				   current_tb->pieces[capturing_piece].color,
+				   position->piece_position[capturing_piece],
+				   Movement::Backward, Movement::Capture)) {
 
-/* proptable_pass()
- *
- * Commit an old set of proptables into the entries array while writing a new set.
- */
+	    for (auto &movement : dir) {
 
-std::atomic<index_t> proptable_shared_index;
+		if ((current_tb->pieces[capturing_piece].color == PieceColor::Black) && (ROW(movement) == 3)) {
 
-void proptable_pass_thread(int target_dtm)
-{
-    index_t index;
-    std::deque<class proptable_entry> current_pt_entries;
+		    /* A black pawn capturing a white one (en passant)
+		     *
+		     * The white pawn is actually a rank higher than usual.
+		     */
+
+		    if ((current_tb->pieces[captured_piece].semilegal_squares
+			 & BITVECTOR(position->piece_position[capturing_piece] + 8))) {
 
-    while (1) {
+			local_position_t new_position = *position;
 
-	futurevector_t futurevector = 0;
+			new_position.uncapture_piece(capturing_piece, captured_piece, movement);
 
-	current_pt_entries.clear();
+			new_position.set_en_passant_square(new_position.piece_position[captured_piece]);
 
-	/* Lock the input proptable, advance the shared index, retrieve everything
-	 * from the proptable that matches the new index, then unlock
-	 */
+			new_position.move_piece(captured_piece, new_position.piece_position[captured_piece] + 8);
 
-	{
-	    std::lock_guard<std::mutex> _(*input_proptable);
+			normalize_position(current_tb, &new_position);
 
-	    index = (proptable_shared_index ++);
+			true_capturing_piece = new_position.permuted_piece[capturing_piece];
+			true_captured_piece = new_position.permuted_piece[captured_piece];
 
-	    if (index >= current_tb->num_indices) break;
+			propagate_local_position_from_futurebase(new_position, foreign_position,
+								 futurecaptures[true_capturing_piece][true_captured_piece], true);
 
-	    if (! input_proptable->empty()) {
+		    }
 
-		if (input_proptable->front().index < index) {
-		    fatal("Out-of-order entries in proptable\n");
 		}
 
-		while (! input_proptable->empty() && input_proptable->front().index == index) {
-		    current_pt_entries.push_back(input_proptable->pop_front());
-		}
-	    }
-	}
+		if ((current_tb->pieces[capturing_piece].color == PieceColor::White) && (ROW(movement) == 4)) {
 
-	/* initialize_tablebase_entry() calls mark_progress(), so we only need to mark our progress
-	 * here if we're not calling initialize_tablebase_entry().
-	 */
+		    /* A white pawn capturing a black one (en passant)
+		     *
+		     * The black pawn is actually a rank lower than usual.
+		     */
 
-	if (target_dtm == 0) {
-	    futurevector = initialize_tablebase_entry(current_tb, index);
-	} else {
-	    mark_progress();
-	}
+		    if ((current_tb->pieces[captured_piece].semilegal_squares
+			 & BITVECTOR(position->piece_position[capturing_piece] - 8))) {
 
-	for (auto pt_entry = current_pt_entries.begin(); pt_entry != current_pt_entries.end(); pt_entry ++) {
+			local_position_t new_position = *position;
 
-	    if (target_dtm != 0) {
+			new_position.uncapture_piece(capturing_piece, captured_piece, movement);
 
-		/* Intra-table case: always update */
+			new_position.set_en_passant_square(new_position.piece_position[captured_piece]);
 
-		if (index == debug_move) {
-		    info("Committing proptable entry: index %" PRIindex "\n", pt_entry->index);
-		}
+			new_position.move_piece(captured_piece, new_position.piece_position[captured_piece] - 8);
 
-		finalize_update(pt_entry->index, target_dtm, 1, 0);
+			normalize_position(current_tb, &new_position);
 
-	    } else if ((pt_entry->futuremove == NO_FUTUREMOVE)
-		       || (FUTUREVECTOR(pt_entry->futuremove) & futurevector)) {
+			true_capturing_piece = new_position.permuted_piece[capturing_piece];
+			true_captured_piece = new_position.permuted_piece[captured_piece];
 
-		/* Futurebase case: only update if move is possible and hasn't been handled yet
-		 *
-		 * Double consideration of a futuremove can happen for symmetric tablebases.  In
-		 * this case, two different positions in the futurebase (or maybe just two different
-		 * reflections of the same position) can indicate a result for this entry.  Of
-		 * course, in this case the result should be the same.
-		 *
-		 * On the other hand, if we had two different tablebases indicating different
-		 * results for the same futuremove, that should trigger a warning.  We could add
-		 * that capability to the proptable code without too much trouble, but in the
-		 * non-proptable case, we're just keeping a bit vector in memory to make sure all
-		 * the futuremoves have been handled in some way and we don't have enough
-		 * information to check all of that.  Right now, we quietly ignore it.
-		 *
-		 * The movecnt field is only a single bit, and it isn't stored correctly if DTM is
-		 * zero, in which case movecnt is also zero.  Examine the code in
-		 * propagate_index_from_futurebase(), which is where all of these entries are
-		 * generated in the intra-table case, and notice that dtm=0 implies movecnt=0.
-		 */
+			propagate_local_position_from_futurebase(new_position, foreign_position,
+								 futurecaptures[true_capturing_piece][true_captured_piece], true);
 
-		if (index == debug_move) {
-		    info("Committing proptable entry: index %" PRIindex ", dtm %d, movecnt %u, futuremove %d\n",
-			 pt_entry->index, pt_entry->dtm, pt_entry->movecnt, pt_entry->futuremove);
+		    }
 		}
+	    }
+	}
+    }
 
-		if (pt_entry->dtm != 0) {
-		    finalize_update(pt_entry->index, pt_entry->dtm, pt_entry->movecnt, pt_entry->futuremove);
-		} else {
-		    finalize_update(pt_entry->index, 0, 0, pt_entry->futuremove);
-		}
+    /* If the square we're about to put the captured piece on isn't semilegal for it, then don't
+     * consider this capturing piece in this future position any more.  This is after the en passant
+     * case because an en passant pawn capture is special, since then the capturing piece ends up on
+     * a different square from the captured piece.
+     */
 
-		if (pt_entry->futuremove != NO_FUTUREMOVE) {
-		    futurevector &= ~FUTUREVECTOR(pt_entry->futuremove);
-		}
+    if (!(current_tb->pieces[captured_piece].semilegal_squares
+	  & BITVECTOR(position->piece_position[capturing_piece]))) {
+	return;
+    }
 
-	    }
+    /* Now consider all possible backwards movements of the capturing piece. */
 
-	}
+    for (auto &dir : movements(current_tb->pieces[capturing_piece].piece_type,
+			       current_tb->pieces[capturing_piece].color,
+			       position->piece_position[capturing_piece],
+			       Movement::Backward, Movement::Capture)) {
 
-	/* We've committed everything for this index that was in the input proptable.  Now either
-	 * check for back-propagation and maybe generate some updates for the output proptable
-	 * (intra-table case) or check to make sure that we've handled all the futuremoves that we
-	 * needed to, and check for conceded futuremoves, too, all in a subroutine.
-	 */
+	for (auto &movement : dir) {
 
-	if (target_dtm != 0) {
+	    if (BITVECTOR(movement) & position->board_vector) break;
 
-	    back_propagate_index(index, target_dtm);
+	    /* We already checked that the captured piece was on a semilegal square for it.  Now
+	     * check the capturing piece.
+	     */
 
-	} else {
+	    if (! (current_tb->pieces[capturing_piece].semilegal_squares & BITVECTOR(movement))) continue;
 
-	    /* Don't track futuremoves for illegal (DTM 1) positions */
-	    if (entriesTable[index].get_DTM() != 1) {
-		finalize_futuremove(current_tb, index, futurevector);
-	    }
+	    /* Move the capturing piece, normalize the position, and back prop it.
+	     *
+	     * We have to figure out the "true" capturing and captured pieces, which might not
+	     * be the pieces we started with (see comments on normalization).
+	     */
 
-	    /* XXX why not back_propagate_index(index, -1) now and save a pass? */
-	}
+	    local_position_t new_position = *position;
 
-    }
-}
+	    new_position.uncapture_piece(capturing_piece, captured_piece, movement);
 
-void proptable_pass(int target_dtm)
-{
-    std::thread t[num_threads];
-    unsigned int thread;
+	    normalize_position(current_tb, &new_position);
 
-    /* Proptable for intra-tablebase propagation only needs to record the index, since the dtm is
-     * known from the pass number, the movecnt is always one, and we're done tracking futuremoves.
-     */
+	    true_capturing_piece = new_position.permuted_piece[capturing_piece];
+	    true_captured_piece = new_position.permuted_piece[captured_piece];
 
-    proptable_format format(current_tb->num_indices, 0, 0, 0, 0);
+	    propagate_local_position_from_futurebase(new_position, foreign_position,
+						     futurecaptures[true_capturing_piece][true_captured_piece], true);
+	}
+    }
 
-    /* Swap proptables.  Our priority queue implementation is designed to do all the insertions
-     * first, then all the retrievals, and prepare_to_retrieve() can free a lot of memory.
-     */
+}
 
-    input_proptable = output_proptable;
-    if (input_proptable) input_proptable->prepare_to_retrieve();
+void propagate_moves_from_capture_futurebase(const futurebase_job & job, index_t future_index, int reflection)
+{
+    tablebase_t * futurebase = job.futurebase;
+    local_position_t foreign_position(futurebase);
+    local_position_t position(current_tb);
+    int piece;
+    translation_result translation;
 
-    /* XXX std::bad_alloc is a real possibility here.  Please do something better than dying.
+    /* Take the position from the futurebase and translate it into a local position for the current
+     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
+     * there should be one piece missing from the local position: the piece that was captured.
+     * There could possibly be one piece on a restricted square, as well.  If so, then it must be
+     * the piece that moved in order to capture.
      */
 
-    try {
-	output_proptable = new proptable(format, proptable_MBs << 20);
-    } catch (std::exception &ex) {
-	throw nested_exception("Constructing output proptable", ex);
-    }
-
-    proptable_shared_index = 0;
+    /* XXX If the futurebase is more liberal than the tablebase, then there will be
+     * positions with multiple restricted pieces that should be quietly ignored.
+     */
 
-    if (target_dtm == 0) {
-	reset_progress_indicator("Initializing tablebase", current_tb->num_indices);
-    } else {
-	std::stringstream label;
-	label << "Pass " << std::setw(4) << target_dtm;
-	reset_progress_indicator(label.str().c_str(), current_tb->num_indices);
-    }
+    if (! index_to_local_position(futurebase, future_index, job.reflections[reflection],
+				  &foreign_position)) return;
 
-    entriesTable->set_threads(num_threads);
+    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
+							       current_tb, &position,
+							       futurebase->invert_colors);
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread] = std::thread(proptable_pass_thread, target_dtm);
+    if (future_index == debug_futuremove) {
+	info("capture backprop; reflection=%d; translation=%x\n",
+	     job.reflections[reflection], translation);
     }
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
-    }
+    if (translation != invalid_translation) {
 
-    entriesTable->set_threads(1);
+	if ((translation.extra_piece != NONE) || (translation.missing_piece1 == NONE)
+	    || (translation.missing_piece2 != NONE)) {
+	    return;
+	}
 
-    if (target_dtm == 0) {
-	end_progress_indicator();
-    } else {
-	end_progress_indicator(positions_finalized_this_pass.load(), "positions finalized");
-    }
+	uint8_t captured_piece = translation.missing_piece1;
 
-    delete input_proptable;
-}
+	/* Since the last move had to have been a capture move, there is absolutely no way
+	 * we could have en passant capturable pawns in the futurebase position.
+	 */
 
-/* reconstruct_proptable() is hardly ever used.  I put it in here because I had a kqqkqq calculation
- * that died due to a memory leak and I wanted to restart it.
- */
+	if (position.en_passant_square != ILLEGAL_POSITION) return;
 
-void reconstruct_proptable_thread(int target_dtm)
-{
-    while (1) {
+	/* Since the position resulted from a capture, we only want to consider future
+	 * positions where the side to move is not the side that captured.
+	 */
 
-	index_t index = (proptable_shared_index ++);
+	if (position.side_to_move != current_tb->pieces[captured_piece].color) return;
 
-	if (index >= current_tb->num_indices) break;
+	/* We're going to back step a half move now */
 
-	back_propagate_index(index, target_dtm);
-    }
-}
+	position.flip_side_to_move();
 
-void reconstruct_proptable(int target_dtm)
-{
-    std::thread t[num_threads];
-    unsigned int thread;
+	if (translation.restricted_piece == NONE) {
 
-    proptable_format format(current_tb->num_indices, 0, 0, 0, 0);
+	    /* No pieces were on restricted squares.  Consider them all as the possible
+	     * capturing piece.
+	     */
 
-    output_proptable = new proptable(format, proptable_MBs << 20);
+	    for (piece = 0; piece < current_tb->num_pieces; piece++) {
 
-    proptable_shared_index = 0;
+		consider_possible_captures(foreign_position, &position, piece, captured_piece);
+	    }
 
-    entriesTable->set_threads(num_threads);
+	} else {
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread] = std::thread(proptable_pass_thread, target_dtm);
-    }
+	    /* One piece was on a restricted square.  It's the obvious capturing piece, but it's not
+	     * the only possible one.  A restricted piece is on a square whose semilegal group is
+	     * either empty or already full.  If the square's semilegal group is in fact empty, then
+	     * there's only one restricted piece we need to consider.  Otherwise, we need to
+	     * consider each piece in the semilegal group as the possible restricted piece.
+	     */
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
-    }
+	    int restricted_square = position.piece_position[translation.restricted_piece];
 
-    entriesTable->set_threads(1);
-}
+	    consider_possible_captures(foreign_position, &position, translation.restricted_piece, captured_piece);
 
-void insert_new_propentry(index_t index, int dtm, unsigned int movecnt, int futuremove)
-{
-    class proptable_entry pt_entry;
+	    for (piece = 0; piece < current_tb->num_pieces; piece++) {
 
-    if (futuremove != NO_FUTUREMOVE) {
-	assert(futuremove >= 0);
-	assert(static_cast<uint64_t>(futuremove) < output_proptable->format.futuremove_mask);
-    }
+		if ((current_tb->pieces[piece].color == current_tb->pieces[translation.restricted_piece].color)
+		    && (current_tb->pieces[piece].piece_type == current_tb->pieces[translation.restricted_piece].piece_type)
+		    && (current_tb->pieces[piece].semilegal_squares & BITVECTOR(restricted_square))) {
 
-    pt_entry.index = index;
-    pt_entry.dtm = dtm;
-    pt_entry.movecnt = movecnt;
-    pt_entry.futuremove = futuremove;
+		    position.swap_pieces(translation.restricted_piece, piece);
 
-    output_proptable->push(pt_entry);
+		    consider_possible_captures(foreign_position, &position, translation.restricted_piece, captured_piece);
 
-    /* fprintf(stderr, "Size of proptable: %llu\n", output_proptable->size()); */
+		    position.swap_pieces(translation.restricted_piece, piece);
+		}
+	    }
+	}
+    }
 }
 
-
-/* If we're running multi-threaded, then there is a possibility that 1) two different positions will
- * try to backprop into the same position (if we're not using proptables), or that 2) two different
- * threads will try to retrieve from the proptable at the same time (if we're using proptables).
+/* A "normal" futurebase is one that's identical to our own in terms of the number and types
+ * of pieces.  It differs only in the frozen positions of the pieces.
  *
- * The first case is handled by a locking sequence on individual entries in finalize_update(); the
- * second case is handled by a locking sequence on the priority_queue in proptable_pass_thread().
+ * XXX not sure how to handle symmetry changes here.  At the moment it's not an issue, since we
+ * don't allow frozen pieces in symmetric tablebases.
  */
 
-void commit_update(index_t index, short dtm, short movecnt, int futuremove)
+void propagate_moves_from_normal_futurebase(const futurebase_job & job, index_t future_index, int reflection)
 {
+    tablebase_t * futurebase = job.futurebase;
+    local_position_t foreign_position(futurebase);
+    local_position_t parent_position(current_tb);
+    local_position_t current_position(current_tb); /* i.e, last position that moved to parent_position */
+    translation_result translation;
+    int piece;
+    int origin_square;
 
-    if (index == debug_move) {
-	info("commit_update; index=%" PRIindex "; dtm=%d; movecnt=%d; futuremove=%d\n",
-	     index, dtm, movecnt, futuremove);
-    }
-
-    backproped_moves_this_pass ++;
-
-    if (!using_proptables) {
-
-	if (! ignore_futurevectors) {
-
-	    if (futuremove != NO_FUTUREMOVE) {
+    /* Translate the futurebase index into a local position.  We have exactly the same number and
+     * type of pieces here, but exactly one of them is on a restricted square (according to the
+     * current tablebase).  If more than one of them was on a restricted square, then there'd be no
+     * way we could get to this futurebase with a single move.  On the other hand, if none of them
+     * were on restricted squares, then this would be a position in the current tablebase.
+     */
 
-		/* Futuremove - check off bits in an array that got filled in when we initialized
-		 *
-		 * Do nothing if the bit is clear, either because we were never to process this
-		 * futuremove at all (this is how a suicide analysis rejects non-capture futuremoves
-		 * from a position where captures are possible), or because a previous pass through
-		 * this code has already processed it.  In the later case, we fatally complain if
-		 * the the entriesTable contains a normal position with DTM not 1 (PNTM in check).
-		 *
-		 * We can't tell the difference at this point, and probably need to use proptables
-		 * for more accurate checking.
-		 *
-		 * This is done atomically, because there will be other indices in this bit vector.
-		 */
+    /* XXX we need to permute the restricted piece around in its semilegal set */
 
-		long long bit_offset = ((long long)index * current_tb->futurevector_bits);
+    /* XXX If the futurebase is more liberal than the tablebase, then there will be positions with
+     * multiple restricted pieces that should be quietly ignored.
+     */
 
-		if (! test_and_set_bit_field(current_tb->futurevectors, bit_offset + futuremove, 0)) {
+    if (! index_to_local_position(futurebase, future_index, job.reflections[reflection],
+				  &foreign_position)) return;
 
-		    if ((entriesTable[index].get_raw_DTM() != 1) && entriesTable[index].is_normal_movecnt()
-			&& (current_tb->variant != Variant::Suicide)) {
+    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
+							       current_tb, &current_position,
+							       futurebase->invert_colors);
 
-			fatal("commit_update; futuremove processed; index=%" PRIindex "; dtm=%d; movecnt=%d; futuremove=%d\n",
-			      index, dtm, movecnt, futuremove);
-		    }
+    if (future_index == debug_futuremove) {
+	info("normal backprop; reflection=%d; translation=%x\n",
+	     job.reflections[reflection], translation);
+    }
 
-		    return;
-		}
+    if (translation != invalid_translation) {
 
-	    }
+	if ((translation.missing_piece1 != NONE) || (translation.missing_piece2 != NONE)
+	    || (translation.extra_piece != NONE) || (translation.restricted_piece == NONE)) {
+	    return;
 	}
 
-	finalize_update(index, dtm, movecnt, futuremove);
-
-    } else {
-
-	insert_new_propentry(index, dtm, movecnt, futuremove);
+	piece = translation.restricted_piece;
 
-    }
+	origin_square = current_position.piece_position[piece];
 
-}
+	/* We've moving BACKWARDS in the game, so this has to be a piece of the player who is NOT TO
+	 * PLAY here - this is the LAST move we're considering, not the next move.
+	 */
 
+	if (current_tb->pieces[piece].color == current_position.side_to_move) return;
 
-/* target_dtm 0 is the initialization / futurebase back prop pass */
+	/* If there are any en passant capturable pawns in the position, then the last move had to
+	 * have been a pawn move.  In fact, in this case, we already know exactly what the last move
+	 * had to have been.
+	 */
 
-uint64_t propagation_pass(int target_dtm)
-{
-    positions_finalized_this_pass = 0;
-    backproped_moves_this_pass = 0;
+	if (current_position.en_passant_square != ILLEGAL_POSITION) {
 
-    if (tracking_dtm) {
-	if (target_dtm > 0) {
-	    entriesTable->verify_DTM_field_size(target_dtm+1);
-	} else {
-	    entriesTable->verify_DTM_field_size(target_dtm-1);
-	}
-    }
+	    if (current_tb->pieces[piece].piece_type != PieceType::Pawn) return;
 
-    if (pass_type[total_passes] == nullptr) pass_type[total_passes] = "intratable";
-    pass_target_dtms[total_passes] = target_dtm;
+	    if (((current_tb->pieces[piece].color == PieceColor::White)
+		 && (current_position.piece_position[piece] != current_position.en_passant_square + 8))
+		|| ((current_tb->pieces[piece].color == PieceColor::Black)
+		    && (current_position.piece_position[piece] != current_position.en_passant_square - 8))) {
 
-    if (using_proptables) {
-	proptable_pass(target_dtm);
-    } else {
-	non_proptable_pass(target_dtm);
-    }
+		/* No reason to complain here.  Maybe some other pawn was the en passant pawn. */
+		return;
+	    }
 
-    positions_finalized[total_passes] = positions_finalized_this_pass;
-    backproped_moves[total_passes] = backproped_moves_this_pass;
+	    current_position.flip_side_to_move();
+	    current_position.clear_en_passant_square();
 
-    total_backproped_moves += backproped_moves[total_passes];
+	    int square;
+	    if (current_tb->pieces[piece].color == PieceColor::White)
+		square = current_position.piece_position[piece] - 16;
+	    else
+		square = current_position.piece_position[piece] + 16;
 
-    if (positions_finalized_this_pass > 0) {
-	if (target_dtm > max_dtm) max_dtm = target_dtm;
-	if (target_dtm < min_dtm) min_dtm = target_dtm;
-    }
+	    current_position.move_piece(piece, square);
 
-    finalize_pass_statistics();
+	    /* We never back out into a restricted position.  Since we've already decided that this
+	     * is the only possible back-move from this point, well...
+	     */
 
-    total_passes ++;
-    if (total_passes == max_passes) expand_per_pass_statistics();
+	    if (! (current_tb->pieces[piece].semilegal_squares
+		   & BITVECTOR(current_position.piece_position[piece]))) {
+		return;
+	    }
 
-    return positions_finalized_this_pass;
-}
+	    propagate_local_position_from_futurebase(current_position, foreign_position,
+						     futuremoves[piece][origin_square], false);
 
-/***** FUTUREBASES *****/
+	    return;
+	}
 
-/* Subroutines to backpropagate an individual index, or an individual local position (these are the
- * "mini" routines), or a set of local positions that differ only in the en passant square.
- *
- * The idea behind the en passant handling is this.  If we back propagate a position with the en
- * passant square set, then that's the only position we process.  If we back prop a position without
- * the en passant square set, then we process not only that position, but also any positions just
- * like it that have en passant set.  The idea being that we set en passant if we actually need it,
- * and we clear it if we don't need it, so if it's clear we need to process positions where it was
- * set, but we didn't use it.
- */
+	/* Abuse of notation here.  We just want to keep a copy of current_position because we
+	 * change it around a lot during the loops below.
+	 */
 
-bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position);
+	parent_position = current_position;
 
-void propagate_minilocal_position_from_futurebase(local_position_t &current_position,
-						  const local_position_t &foreign_position,
-						  int futuremove, bool normalize)
-{
-    /* XXX get rid of this const_cast ; need it because get_DTM might modify its tablebase */
-    tablebase_t * futurebase = const_cast<tablebase_t *>(foreign_position.tb);
-    index_t current_index;
-    index_t future_index = foreign_position.index;
+	for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+				   current_tb->pieces[piece].color,
+				   parent_position.piece_position[piece],
+				   Movement::Backward, Movement::NonCapture)) {
 
-    /* Look up the position in the current tablebase... */
+	    for (auto &movement : dir) {
 
-    if (normalize) {
-	current_index = normalized_position_to_index(current_position);
-    } else {
-	current_index = local_position_to_index(current_position);
-    }
+		/* We never back out into a restricted position (obviously) */
 
-    if (current_index == INVALID_INDEX) {
-	return;
-    }
+		if (! (current_tb->pieces[piece].semilegal_squares & BITVECTOR(movement))) continue;
 
-    if ((futuremove < 0) && (futuremove != HANDLED_FUTUREMOVE)) {
-	fatal("Futuremove %d never assigned: %s\n", futuremove, current_position.FEN());
-	return;
-    }
+		/* Back stepping a half move here involves several things: flipping the side-to-move
+		 * flag, clearing any en passant pawns into regular pawns, moving the piece
+		 * (backwards), and considering a bunch of additional positions identical to the
+		 * base position except that a single one of the pawns on the fourth or fifth ranks
+		 * was capturable en passant.
+		 *
+		 * Of course, the only way we could have gotten an en passant pawn is if THIS MOVE
+		 * created it.  Since this isn't a pawn move, that can't happen.  Checking
+		 * additional en passant positions is taken care of in
+		 * propagate_one_move_within_table()
+		 */
 
-    /* local_position_to_index() updated the position structure's multiplicity and reflection, so we
-     * know they're correct.  If we're back proping into an 8-way symmetric tablebase (the only way
-     * REFLECTION_DIAGONAL will ever be set), we must be back proping from an 8-way symmetric
-     * futurebase (since futurebases can never have less symmetry than the current tablebase).  In
-     * this case, if diagonal reflection is required on the current position, then discard this case
-     * since we'll be called again without diagonal reflection.  Otherwise, use the 8-way
-     * multiplicity (2 and 4 way symmetry are ignored when computing multiplicity, which is thus
-     * always either 1 or 2) as a movecnt.
-     */
+		/* But we start with an extra check to make sure this isn't a double pawn move, it
+		 * which case it would result in an en passant position, not the non-en passant
+		 * position we are in now (en passant got taken care of in the special case above).
+		 */
 
-    int movecnt;
+		/* XXX should be unnecessary because of NoDoublePawn */
 
-    if (futuremove == HANDLED_FUTUREMOVE) {
-	movecnt = 1;
-	futuremove = NO_FUTUREMOVE;
-    } else if (ignore_futurevectors) {
-	movecnt = 1;
-    } else {
-	if ((current_position.multiplicity == 2) && (current_position.reflection & REFLECTION_DIAGONAL)) {
-	    return;
+		if (((movement - parent_position.piece_position[piece]) == 16)
+		    || ((movement - parent_position.piece_position[piece]) == -16)) {
+		    continue;
+		}
+
+		current_position.flip_side_to_move();
+
+		current_position.move_piece(piece, movement);
+
+		propagate_local_position_from_futurebase(current_position, foreign_position,
+							 futuremoves[piece][origin_square], false);
+	    }
 	}
 
-	movecnt = current_position.multiplicity;
     }
+}
 
-    if ((current_index == debug_move) || (future_index == debug_futuremove)) {
-	info("propagate_index_from_futurebase; %" PRIindex " %s refl %d mul %d from %s %s %" PRIindex " %s refl %d mul %d futuremove %d\n",
-	     current_index, current_position.FEN(), current_position.reflection, current_position.multiplicity,
-	     foreign_position.tb->filename.c_str(), foreign_position.tb->invert_colors ? "(Inv)" : "",
-	     foreign_position.index, foreign_position.FEN(), foreign_position.reflection,
-	     foreign_position.multiplicity, futuremove);
-    }
+/* A "pawngen" futurebase is one that's identical to our own, except that it uses a different range
+ * of pawngen indices.  Its local positions can just be copied into our own local position
+ * structure, eliminating the need for the time-consuming translation function.
+ *
+ * This is how a big pawngen tablebase gets split into slices (see the start and count attributes
+ * on the pawngen element), each generated separately with the slices holding its successor pawn
+ * positions as futurebases.  Both slices compute the same pawn_positions_by_index table, so
+ * pawngen_index means the same thing in either, but the index itself is relative to the start of
+ * whichever slice it came from.  Once we've moved the pawn and landed inside our own slice,
+ * rebase_pawngen_position() fixes up the index to be relative to our own start.
+ */
 
-    if (futurebase->format.dtm_bits > 0) {
+void rebase_pawngen_position(local_position_t & position, const tablebase_t * futurebase)
+{
+    if (! position.decoded) return;
 
-	int dtm = futurebase->get_DTM(future_index);
+    /* With side-to-move in the MSB, it's worth half of whichever tablebase the index came from */
 
-	if (dtm > 0) {
-	    /* Don't backprop DTM 1 (PNTM in check) because we don't count illegal moves (unless it's suicide) */
-	    if ((futurebase->variant == Variant::Suicide) || (dtm != 1)) {
-		commit_update(current_index, -dtm, movecnt, futuremove);
-	    }
-	} else if (dtm < 0) {
-	    commit_update(current_index, -dtm+1, movecnt, futuremove);
-	} else {
-	    /* We insert even if dtm is zero because we have to track futuremoves,
-	     * but we use movecnt=0 since this is a draw, which is different
-	     * from a discard.
-	     */
-	    commit_update(current_index, 0, 0, futuremove);
-	}
+    index_t offset_in_block = position.index - futurebase->add_stm(position.pawngen_base_index, position.side_to_move);
 
-    } else if (futurebase->format.basic_offset != -1) {
+    position.pawngen_base_index = (position.pawngen_index - current_tb->pawngen->start) * current_tb->encoding->size;
+    position.index = current_tb->add_stm(position.pawngen_base_index, position.side_to_move) + offset_in_block;
+}
 
-	Basic basic = futurebase->get_basic(future_index);
+void propagate_moves_from_pawngen_futurebase(const futurebase_job & job, index_t future_index, int reflection)
+{
+    tablebase_t * futurebase = job.futurebase;
+    local_position_t foreign_position(futurebase);
+    local_position_t current_position(current_tb);
 
-	if (basic == Basic::Draw) {
-	    commit_update(current_index, 0, 0, futuremove);
-	} else if (basic == Basic::PTMwins) {
-	    commit_update(current_index, -2, movecnt, futuremove);
-	} else if (basic == Basic::PNTMwins) {
-	    commit_update(current_index, 2, movecnt, futuremove);
-	} else if (basic == Basic::Illegal) {
-	    /* basic == 3: illegal position, PNTM in check, no backprop */
-	} else {
-	    throw std::runtime_error("Basic::Unknown in backprop " + std::string(foreign_position.FEN()));
-	}
+    if (! index_to_local_position(futurebase, future_index, job.reflections[reflection],
+				  &foreign_position)) return;
 
-    } else {
+    if (future_index == debug_futuremove) {
+	info("normal backprop; reflection=%d\n", job.reflections[reflection]);
+    }
 
-	bool flag = futurebase->get_flag(future_index);
-	PieceColor stm = index_to_side_to_move(futurebase, future_index);
+    int pawngen_index = foreign_position.pawngen_index;
 
-	if (ignore_futurevectors) {
-	    if (PNTM_in_check(futurebase, &foreign_position)) {
-		return;
-	    }
-	}
+    for (int piece = 0; piece < current_tb->num_pieces; piece ++) {
 
-	/* What happens if we're back propagating a flag from a color-inverted futurebase?
+	/* We only consider pawn moves, since they're the only things that change the pawngen index */
+
+	if (current_tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+
+	/* We've moving BACKWARDS in the game, so this has to be a piece of the player who is NOT TO
+	 * PLAY here - this is the LAST move we're considering, not the next move.
+	 */
+
+	if (current_tb->pieces[piece].color == foreign_position.side_to_move) continue;
+
+	/* XXX big assumption here - that we can just copy a position from foreign to current
 	 *
-	 * Well, first of all, a "white-wins" flag in an inverted futurebase becomes a "black-wins"
-	 * flag here, which is basically a "NOT white-draws" flag, so we have to be careful to
-	 * backprop from draw flags to win flags and from win flags to draw flags if the colors have
-	 * been inverted.  Other than that, since the side to move we just fetched is in the
-	 * futurebase, the white/black sense of the flag matches with it, so we don't need to invert
-	 * anything to figure out if this is a PTM win or a PNTM win.
+	 * Flip side-to-move while the index still belongs to the futurebase, since it's worth a
+	 * different amount in each of us if it's in the MSB.
 	 */
+	current_position = foreign_position;
+	current_position.flip_side_to_move();
+	current_position.tb = current_tb;
 
-	/* I use twos here because there's a lot of stuff that gets cut out for the special case of 1 */
+	/* can we move the pawn backwards and get a position in this tablebase? */
 
-	if ((flag && (stm == PieceColor::White)) || (!flag && (stm == PieceColor::Black))) {
-	    commit_update(current_index, -2, movecnt, futuremove);
-	} else {
-	    commit_update(current_index, 2, movecnt, futuremove);
+	int delta_pawngen_index = current_tb->pawngen->pawn_positions_by_index[pawngen_index].delta_pawngen_index[piece];
+	uint8_t prev_position = current_tb->pawngen->pawn_positions_by_index[pawngen_index].prev_position[piece];
+
+	if (future_index == debug_futuremove) {
+	    info("pawngen backprop; delta_pawngen_index=%d; prev_position=%d\n", delta_pawngen_index, prev_position);
 	}
 
-    }
-}
+	if ((prev_position != ILLEGAL_POSITION) && (! (current_position.board_vector & BITVECTOR(prev_position)))) {
+	    int new_pawngen_index = pawngen_index + delta_pawngen_index;
 
-void propagate_local_position_from_futurebase(local_position_t &position,
-					      const local_position_t &foreign_position,
-					      const int futuremove, bool normalize)
-{
-    int piece;
-    const tablebase_t * const tb = position.tb;
+	    /* move_piece's pawngen optimization makes this quick */
+	    current_position.move_piece(piece, prev_position);
 
-    /* We may need to consider a bunch of additional positions here that are identical to the base
-     * position except that a single one of the pawns on the fourth or fifth ranks was capturable en
-     * passant.
-     * 
-     * We key off the en_passant flag in the position that was passed in.  If it's set, then we're
-     * back propagating a position that requires en passant, so we just do it.  Otherwise, we're
-     * back propagating a position that doesn't require en passant, so we check for additional
-     * en passant positions.
-     */
+	    if ((new_pawngen_index >= current_tb->pawngen->start)
+		&& (new_pawngen_index < current_tb->pawngen->start + current_tb->pawngen->count)) {
+		/* back prop.  Rebase a copy, since the double pawn move below starts from this
+		 * position and its index has to stay relative to the futurebase until then.
+		 */
+		local_position_t rebased_position = current_position;
+		rebase_pawngen_position(rebased_position, futurebase);
+		propagate_local_position_from_futurebase(rebased_position, foreign_position, HANDLED_FUTUREMOVE, false);
+	    }
 
-    propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
+	    /* is a double pawn move possible? */
 
-    if (position.en_passant_square == ILLEGAL_POSITION) {
+	    int delta_pawngen_index2 = current_tb->pawngen->pawn_positions_by_index[pawngen_index].delta_pawngen_index2[piece];
+	    int prev_position2 = current_tb->pawngen->pawn_positions_by_index[pawngen_index].prev_position2[piece];
 
-	for (piece = 0; piece < tb->num_pieces; piece ++) {
+	    if (future_index == debug_futuremove) {
+		info("pawngen backprop; delta_pawngen_index2=%d; prev_position2=%d\n", delta_pawngen_index2, prev_position2);
+	    }
 
-	    if (tb->pieces[piece].color == position.side_to_move) continue;
-	    if (tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+	    if ((prev_position2 != ILLEGAL_POSITION) && (! (current_position.board_vector & BITVECTOR(prev_position2)))) {
+		int new2_pawngen_index = pawngen_index + delta_pawngen_index2;
 
-	    /* I took care in the calling routines to update board_vector specifically so we can
-	     * check for en passant legality here.
-	     */
+		if ((new2_pawngen_index >= current_tb->pawngen->start)
+		    && (new2_pawngen_index < current_tb->pawngen->start + current_tb->pawngen->count)) {
 
-	    if ((tb->pieces[piece].color == PieceColor::White)
-		&& (ROW(position.piece_position[piece]) == 3)
-		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] - 8))
-		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] - 16))) {
-		position.set_en_passant_square(position.piece_position[piece] - 8);
-		propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
-	    }
+		    /* move_piece's pawngen optimization makes this quick */
+		    current_position.move_piece(piece, prev_position2);
 
-	    if ((tb->pieces[piece].color == PieceColor::Black)
-		&& (ROW(position.piece_position[piece]) == 4)
-		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] + 8))
-		&& !(position.board_vector & BITVECTOR(position.piece_position[piece] + 16))) {
-		position.set_en_passant_square(position.piece_position[piece] + 8);
-		propagate_minilocal_position_from_futurebase(position, foreign_position, futuremove, normalize);
+		    /* back prop */
+		    rebase_pawngen_position(current_position, futurebase);
+		    propagate_local_position_from_futurebase(current_position, foreign_position, HANDLED_FUTUREMOVE, false);
+		}
 	    }
-
-	    position.clear_en_passant_square();
 	}
     }
 }
 
-/* Reflections.
+/* The futurebase worker pool
  *
- * If the futurebase has greater symmetry than the tablebase under construction, then we have to
- * apply a series of reflections to each futurebase position in order to get all the corresponding
- * positions in the current tablebase.  This utility function computes them.
+ * A small futurebase like kqk can't keep many threads busy, and while we're decompressing one
+ * futurebase, nothing else is going on with the disk.  So instead of back propagating the
+ * futurebases one at a time, each with its own team of threads, we work on up to
+ * concurrent_futurebases of them at once, with a single pool of num_threads workers shared among
+ * them.  A worker sticks with its futurebase until there's nothing left to read from it, then moves
+ * on to whichever active futurebase has the fewest workers.  Once a futurebase has been completely
+ * read, we activate the next one waiting, and the last worker to finish with it shuts down its
+ * read-ahead.
  *
- * If we're back propagating from a futurebase with greater symmetry, then a single futurebase index
- * will correspond to several positions in the current tablebase.  We'll need to apply some
- * reflections to get those additional positions, so compute here how many of them we'll need.  It's
- * a fairly easy calculation, since our symmetry options are currently limited to 1/2/4/8, so a
- * simple ratio suffices, except if both tablebases have symmetry 8, in which case the more complex
- * effects of diagonal symmetry require a double conversion no matter what.
+ * Updates into the entries table are atomic (or go into the proptables), so it doesn't matter to
+ * them which futurebase they came from.
  */
 
+unsigned int concurrent_futurebases = 4;
 
-int compute_reflections(tablebase_t *tb, tablebase_t *futurebase, int *reflections)
-{
-    int max_reflection;
+class futurebase_pool {
 
-    max_reflection = futurebase->symmetry / tb->symmetry;
-    if ((futurebase->symmetry == 8) && (tb->symmetry == 8)) max_reflection = 2;
+    std::mutex lock;
+    std::deque<futurebase_job *> pending;
+    std::vector<futurebase_job *> active;
+    unsigned int max_active;
 
-    reflections[0] = REFLECTION_NONE;
-    if (futurebase->symmetry == 8) reflections[1] = REFLECTION_DIAGONAL;
-    if (futurebase->symmetry == 4) reflections[1] = REFLECTION_VERTICAL;
-    if (futurebase->symmetry == 2) reflections[1] = REFLECTION_HORIZONTAL;
-    if (max_reflection >= 4) {
-	if (futurebase->symmetry == 8) {
-	    /* This is either the 8 -> 2 or 8 -> 1 cases */
-	    reflections[2] = reflections[0] | REFLECTION_VERTICAL;
-	    reflections[3] = reflections[1] | REFLECTION_VERTICAL;
-	} else {
-	    /* This is the 4 -> 1 case */
-	    reflections[2] = reflections[0] | REFLECTION_HORIZONTAL;
-	    reflections[3] = reflections[1] | REFLECTION_HORIZONTAL;
+    /* Called with the lock held */
+
+    void activate(void) {
+	unsigned int reading = std::count_if(active.begin(), active.end(),
+					     [] (const futurebase_job * job) { return ! job->exhausted; });
+
+	while (! pending.empty() && (reading < max_active)) {
+	    futurebase_job * job = pending.front();
+	    pending.pop_front();
+	    job->futurebase->start_read_ahead();
+	    active.push_back(job);
+	    reading ++;
 	}
     }
-    if (max_reflection == 8) {
-	/* The 8 -> 1 case */
-	reflections[4] = reflections[0] | REFLECTION_HORIZONTAL;
-	reflections[5] = reflections[1] | REFLECTION_HORIZONTAL;
-	reflections[6] = reflections[2] | REFLECTION_HORIZONTAL;
-	reflections[7] = reflections[3] | REFLECTION_HORIZONTAL;
+
+public:
+
+    futurebase_pool(std::vector<futurebase_job> & jobs) {
+	max_active = std::max(1U, std::min(concurrent_futurebases, num_threads));
+	for (auto & job : jobs) pending.push_back(& job);
+	activate();
     }
 
-    if (! futurebase->encode_stm) {
-	for (int r = 0; r < max_reflection; r ++) {
-	    reflections[max_reflection + r] = reflections[r] | REFLECTION_COLOR;
+    /* A worker calls this when it has run out of work on 'job' (nullptr the first time), and gets
+     * back the next job to work on, or nullptr if there's nothing left for it to do.
+     */
+
+    futurebase_job * next_job(futurebase_job * job) {
+	std::lock_guard<std::mutex> _(lock);
+
+	if (job) {
+	    job->exhausted = true;
+	    job->workers --;
+
+	    if (job->workers == 0) {
+		job->futurebase->stop_read_ahead();
+		active.erase(std::find(active.begin(), active.end(), job));
+	    }
+
+	    activate();
 	}
-	max_reflection *= 2;
+
+	futurebase_job * best = nullptr;
+
+	for (auto candidate : active) {
+	    if (! candidate->exhausted && (! best || (candidate->workers < best->workers))) {
+		best = candidate;
+	    }
+	}
+
+	if (best) best->workers ++;
+
+	return best;
     }
+};
 
-    return max_reflection;
-}
+void back_propagate_futurebase_thread(futurebase_pool * pool)
+{
+    futurebase_job * job = nullptr;
+    index_t future_index;
+    int reflection;
+    int i;
 
+    while ((job = pool->next_job(job)) != nullptr) {
 
-/* Some variables common to many or all of the futurebase backprop routines */
+	tablebase_t * futurebase = job->futurebase;
 
-int max_reflection;
-int reflections[16];
+	doing_capture_backprop = job->doing_capture_backprop;
 
-PieceColor promotion_color;
-int first_back_rank_square;
-int last_back_rank_square;
-int promotion_move;
+	/* fetch_entry() skips over chunks that can't back propagate into the current tablebase (see
+	 * compute_relevant_indices()), and we skip over individual indices within the chunks.
+	 */
 
-tablebase_t * futurebase;
+	while ((future_index = futurebase->fetch_entry()) < futurebase->num_indices) {
 
-std::atomic<index_t> next_future_index;
+	    for (i=0; i<futurebase_stride; i++) {
 
-/* The four futurebase back-propagation functions
- *
- * These functions handle threading differently from the intra-table case, where we split the
- * tablebase up into N sections for the N threads and let each thread tear into its own section.
- * This time, we're reading the futurebase from disk, and it might be biiiig, so we want to proceed
- * through it sequentially.  Each thread reads a portion of the futurebase, calls the appropriate
- * one of these functions for every index in that portion, and loops until everything is done.
- *
- * reflections[] is a global variable that gets computed for every futurebase.  See comments on
- * compute_reflections().
- *
- * For each possible reflection of each possible futuremove, we attempt to translate the futurebase
- * pieces into corresponding local tablebase pieces.  Actually, we did this for the entire
- * futurebase when we loaded it, and those piece assignments should never change within a single
- * futurebase, so all we really do is blunder check.
- */
+		if (future_index + i < futurebase->num_indices) {
 
-/* NORMAL PAWN PROMOTION
- *
- * We can easily identify what we're promoting into, since there's a single type and color of piece
- * in the futurebase of which there are one more than in the current tablebase.  Assume, without
- * loss of generality, that it's a queen.  There are also pawns in the current tablebase.  To a
- * first approximation, we have to consider all pairs of local pawns and foreign queens.
+		    /* It's tempting to break out the loop here if the position isn't a win, but we
+		     * want to track futuremoves in order to make sure we don't miss one, so the
+		     * simplest way to do that is to run this loop even for draws.
+		     */
+
+		    mark_progress();
+
+		    if (! futurebase->index_is_relevant(future_index + i)) continue;
+
+		    for (reflection = 0; reflection < job->max_reflection; reflection ++) {
+			(*job->backprop_function)(*job, future_index + i, reflection);
+		    }
+		}
+	    }
+	}
+    }
+}
+
+/* Back propagates from all the futurebases.
  *
- * Actually, we can limit things further.  Let's just consider each foreign queen in turn.  The only
- * possible local pawn that could promote into it is located one square directly behind it.  So in a
- * given futurebase position, we only need to consider all foreign queens, with the local position
- * that leads to it uniquely determined.
+ * Should be called after the tablebase has been initialized, but before intra-table propagation.
  *
- * Furthermore, in a given position, each foreign piece will map into a local semilegal group.  One
- * of those local semilegal groups will have one more piece (the extra piece) map into it; all of
- * the others must have the same number of pieces map into them as they contain.  Once a local
- * position has been setup for back propagation, that special semilegal group will be fully
- * populated and will contain the promotion square, too.  We just cycle the promotion square among
- * all of the n pieces in this group, creating n+1 total positions.  None of pieces that map into
- * other semilegal groups could be the promotion piece, because that would create an imbalance among
- * the semilegal groups - one would have one piece too many, another would have one piece too few.
+ * Runs through the parsed XML control file, pulls out all the futurebases, sets up a job for each
+ * one, and hands them all to the worker pool.
  *
- * Prior to 1.779, we cycled among semilegal groups in the FUTUREBASE, but that was a bug.
- * Futurebase semilegal groups don't matter, only the local semilegal group matters.
+ * Returns true, or false if something went wrong
  */
 
-void propagate_moves_from_promotion_futurebase(index_t future_index, int reflection)
-{
-    local_position_t foreign_position(futurebase);
-    local_position_t position(current_tb);
-    translation_result translation;
-    int true_pawn;
+bool back_propagate_all_futurebases(tablebase_t *tb) {
 
-    /* Take the position from the futurebase and translate it into a local position for the current
-     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
-     * there should be one piece missing from the local position (the pawn that promoted) and one
-     * piece extra (what it promoted into).  There can be no pieces on restricted squares.
-     */
+    int fbnum;
+    std::vector<futurebase_job> jobs;
+    index_t indices_to_read = 0;
 
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
+    for (fbnum = 0; fbnum < num_futurebases; fbnum ++) {
 
-    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
-							       current_tb, &position,
-							       futurebase->invert_colors);
+	futurebase_job job;
 
-    if (translation != invalid_translation) {
+	job.futurebase = & futurebases[fbnum];
+	job.max_reflection = compute_reflections(tb, job.futurebase, job.reflections);
+	job.backprop_function = nullptr;
 
-	if ((translation.extra_piece == NONE) || (translation.missing_piece1 == NONE)
-	    || (translation.missing_piece2 != NONE) || (translation.restricted_piece != NONE)) return;
+	switch (job.futurebase->futurebase_type) {
 
-	uint8_t pawn = translation.missing_piece1;
+	case FuturebaseType::Capture:
 
-	/* Since the last move had to have been a promotion move, there is absolutely no way we
-	 * could have en passant capturable pawns in the futurebase position.
-	 */
+	    if (fatal_errors == 0) {
+		job.backprop_function = &propagate_moves_from_capture_futurebase;
+		job.doing_capture_backprop = true;
+	    }
 
-	if (position.en_passant_square != ILLEGAL_POSITION) return;
+	    break;
 
-	/* Whatever color the promoted piece is, after the promotion it must be the other side to
-	 * move.
-	 */
+	case FuturebaseType::Promotion:
 
-	if (position.side_to_move == promotion_color) return;
+	    if (fatal_errors == 0) {
 
-	/* We're going to back step a half move now */
+		job.promotion_color = tb->pieces[job.futurebase->missing_pawn].color;
+		job.first_back_rank_square = ((job.promotion_color == PieceColor::White) ? 56 : 0);
+		job.last_back_rank_square = ((job.promotion_color == PieceColor::White) ? 63 : 7);
+		job.promotion_move = ((job.promotion_color == PieceColor::White) ? 8 : -8);
 
-	position.flip_side_to_move();
+		job.backprop_function = &propagate_moves_from_promotion_futurebase;
+		job.doing_capture_backprop = false;
+	    }
 
-	/* We need an extra loop in here to handle futurebases with multiple identical pieces.
-	 * Let's say we're back propagating from a Q+Q endgame into a Q+P endgame.  If we've got a
-	 * futurebase position with both queens on the back rank, then we have to consider the
-	 * possibility that the pawn could promote into either of them.
-	 */
+	    break;
 
-	int promotion_sq = foreign_position.piece_position[translation.extra_piece];
+	case FuturebaseType::CapturePromotion:
 
-	if (futurebase->invert_colors)
-	    promotion_sq = rowcol2square(7 - ROW(promotion_sq), COL(promotion_sq));
+	    if (fatal_errors == 0) {
 
-	int local_piece = futurebase->pieces[translation.extra_piece].matching_local_semilegal_group[promotion_sq];
+		job.promotion_color = tb->pieces[job.futurebase->missing_pawn].color;
+		job.first_back_rank_square = ((job.promotion_color == PieceColor::White) ? 56 : 0);
+		job.last_back_rank_square = ((job.promotion_color == PieceColor::White) ? 63 : 7);
+		job.promotion_move = ((job.promotion_color == PieceColor::White) ? 8 : -8);
 
-	while (true) {
+		job.backprop_function = &propagate_moves_from_promotion_capture_futurebase;
+		job.doing_capture_backprop = true;
+	    }
 
-	    /* The extra piece has to be on the back rank.
-	     *
-	     * I used to (pre 1.547) 'break' here if it wasn't, figuring that since identical pieces
-	     * are sorted into ascending square numbers, if we'd backed up to an extra piece that
-	     * wasn't on the back rank, then there couldn't be any more identical pieces on the back
-	     * rank.
-	     *
-	     * But Laurent Bartholdi exposed that as a bug.  If black is promoting, then we start
-	     * with the piece with the highest square number - that isn't on the back rank - and
-	     * have to back up to find one that is.
-	     *
-	     * We could invert the whole piece processing order to make the original optimization
-	     * work, but then when you consider what can happen if there are movement restrictions
-	     * in the futurebase, maybe the pieces aren't even going to show up in the right order.
-	     * Better to ditch that whole idea, I think.
-	     */
+	    break;
 
-	    if ((promotion_sq >= first_back_rank_square) && (promotion_sq <= last_back_rank_square)) {
+	case FuturebaseType::Normal:
 
-		/* There has to be an empty square right behind where the pawn came from, and it has
-		 * to be at least semilegal for the pawn.
-		 */
+	    if (fatal_errors == 0) {
+		job.backprop_function = propagate_moves_from_normal_futurebase;
+		job.doing_capture_backprop = false;
+	    }
 
-		if (!(position.board_vector & BITVECTOR(promotion_sq - promotion_move))
-		    && (current_tb->pieces[pawn].semilegal_squares & BITVECTOR(promotion_sq - promotion_move))) {
+	    break;
 
-		    local_position_t new_position = position;
+	case FuturebaseType::Pawngen:
 
-		    /* Put the missing pawn on the seventh (or second). */
+	    /* We index into our own pawn_positions_by_index with the futurebase's pawngen indices,
+	     * so both of us have to have started from the same pawn position.  And if our pawngen
+	     * ranges overlap, pawn moves inside the overlap would get counted twice - once here and
+	     * once during intra-table back propagation.
+	     */
 
-		    new_position.place_piece(pawn, promotion_sq - promotion_move);
+	    if (! tb->pawngen || ! job.futurebase->pawngen
+		|| (tb->pawngen->initial_white_pawns != job.futurebase->pawngen->initial_white_pawns)
+		|| (tb->pawngen->initial_black_pawns != job.futurebase->pawngen->initial_black_pawns)
+		|| (tb->pawngen->pawn_positions_by_index.size() != job.futurebase->pawngen->pawn_positions_by_index.size())) {
+		fatal("Pawngen futurebase '%s' doesn't use the same pawn positions as this tablebase\n",
+		      job.futurebase->filename.c_str());
+	    } else if ((job.futurebase->pawngen->start < tb->pawngen->start + tb->pawngen->count)
+		       && (tb->pawngen->start < job.futurebase->pawngen->start + job.futurebase->pawngen->count)) {
+		fatal("Pawngen futurebase '%s' overlaps this tablebase's pawngen indices\n",
+		      job.futurebase->filename.c_str());
+	    } else if (job.futurebase->stm_placement != tb->stm_placement) {
+		fatal("Pawngen futurebase '%s' doesn't put side-to-move in the same place as this tablebase\n",
+		      job.futurebase->filename.c_str());
+	    }
 
-		    /* Normalize the position, and back prop it. */
+	    if (fatal_errors == 0) {
+		job.backprop_function = propagate_moves_from_pawngen_futurebase;
+		job.doing_capture_backprop = false;
+	    }
 
-		    normalize_position(current_tb, &new_position);
+	    break;
 
-		    true_pawn = new_position.permuted_piece[pawn];
+	default:
 
-		    propagate_local_position_from_futurebase(new_position, foreign_position,
-							     promotions[true_pawn][futurebase->promotion], true);
-		}
+	    fatal("Unknown back propagation type for futurebase '%s'\n", job.futurebase->filename.c_str());
+	    break;
 
-	    }
+	}
 
-	    /* If the extra piece mapped into a non-empty semilegal group, then swap it with
-	     * the next piece in the group and try again.
-	     */
+	if (job.backprop_function) {
 
-	    if (local_piece == -1) return;
+	    job.indices_to_read = compute_relevant_indices(tb, job);
 
-	    int new_promotion_sq = position.piece_position[local_piece];
+	    if (job.indices_to_read < job.futurebase->num_indices) {
+		info("Skipping %.1f%% of '%s' that can't back propagate\n",
+		     100.0 * (job.futurebase->num_indices - job.indices_to_read) / job.futurebase->num_indices,
+		     job.futurebase->filename.c_str());
+	    }
 
-	    position.move_piece(local_piece, promotion_sq);
-	    promotion_sq = new_promotion_sq;
+	    indices_to_read += job.indices_to_read;
 
-	    local_piece = current_tb->pieces[local_piece].next_piece_in_semilegal_group;
+	    jobs.push_back(job);
 	}
     }
-}
 
-void propagate_moves_from_promotion_capture_futurebase(index_t future_index, int reflection)
-{
-    local_position_t foreign_position(futurebase);
-    local_position_t position(current_tb);
-    translation_result translation;
-    int true_captured_piece;
-    int true_pawn;
+    if (! jobs.empty()) {
 
-    /* Take the position from the futurebase and translate it into a local position for the current
-     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
-     * there should be two pieces missing from the local position (the pawn that promoted and the
-     * piece it captured) and one piece extra (what it promoted into).  There can be no pieces on
-     * restricted squares.
-     */
+	std::thread t[num_threads];
+	unsigned int thread;
 
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
+	std::string status_message("Back propagating (");
 
-    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
-							       current_tb, &position,
-							       futurebase->invert_colors);
+	if (jobs.size() == 1) {
+	    status_message += futurebase_types[jobs[0].futurebase->futurebase_type];
+	    status_message += ") from '";
+	    status_message += jobs[0].futurebase->filename;
+	    status_message += "'";
+	} else {
+	    status_message += "concurrently) from ";
+	    status_message += std::to_string(jobs.size());
+	    status_message += " futurebases";
+	}
 
-    if (translation != invalid_translation) {
+	reset_progress_indicator(status_message.c_str(), indices_to_read);
 
-	if ((translation.extra_piece == NONE) || (translation.missing_piece1 == NONE)
-	    || (translation.missing_piece2 == NONE) || (translation.restricted_piece != NONE)) return;
+	futurebase_pool pool(jobs);
 
-	/* Since the last move had to have been a promotion move, there is absolutely no way
-	 * we could have en passant capturable pawns in the futurebase position.
-	 */
+	for (thread = 0; thread < num_threads; thread ++) {
+	    t[thread] = std::thread(back_propagate_futurebase_thread, & pool);
+	}
 
-	if (position.en_passant_square != ILLEGAL_POSITION) return;
+	for (thread = 0; thread < num_threads; thread ++) {
+	    t[thread].join();
+	}
 
-	/* Whatever color the promoted piece is, after the promotion it must be the other
-	 * side to move.
-	 */
+	end_progress_indicator();
+    }
 
-	if (position.side_to_move == promotion_color) return;
+    return (fatal_errors == 0);
+}
 
-	/* We're going to back step a half move now */
+/***** PRUNING *****/
 
-	position.flip_side_to_move();
+/* If we don't want to fully analyze out the tree past the table we're now building, we prune some
+ * possible futuremoves.  Of course, this will affect the accuracy of the table; the table is a
+ * result of BOTH the position it was set up for AND the pruning decisions (and any pruning
+ * decisions made on the futurebases used to calculate this one).
+ *
+ * We specify pruning in a simple way - by omitting future tables for moves we don't want to
+ * consider.  This can be dangerous, so we require this feature to be specifically enabled.  There
+ * are two possibilities: moves can be DISCARDED, or victory can be CONCEDED to the side that makes
+ * the move.
+ *
+ * So, if we are white, and assuming that this is a table with a frozen white pawn on e3, we can
+ * prune by simply ignoring Pe4 as a possible move.  If there is a black pawn on the g-file, and we
+ * don't want to compute out what happens after it queens, we can prune by conceding Pg1=X as a win
+ * for black.
+ *
+ * For example, let's say we're looking at a Q-and-P vs. Q-and-P endgame.  There are four completely
+ * mobile pieces (2 Ks and 2 Qs), and this is easy.  But if one of the pawns queens, then we've got
+ * a more complex game with five mobile pieces.  But we don't want to completely discard all
+ * possible enemy promotions, if we can immediately capture the new queen.  So we construct a
+ * special tablebase with a queen frozen on the queening square, concede any move by that queen as a
+ * win, then use it as a futurebase.
+ *
+ * And finally, we want to label in the file header that this pruning was done.  In particular, if
+ * we use a pruned tablebase to compute another (earlier) pruned tablebase, we want to make sure the
+ * pruning is consistent, i.e. "our" side has to stay the same.  This is guaranteed by explicitly
+ * flagging in the XML header which sides can be pruned in which way (concede or discard).
+ */
 
-	/* We need an extra loop in here to handle futurebases with multiple identical pieces.
-	 * Let's say we're back propagating from a Q+Q endgame into a Q+P endgame.  If we've got a
-	 * futurebase position with both queens on the back rank, then we have to consider the
-	 * possibility that the pawn could promote into either of them.
-	 */
+bool all_futuremoves_handled = true;
 
-	int promotion_sq = foreign_position.piece_position[translation.extra_piece];
+/* finalize_futuremove()
+ *
+ * After all futurebase backpropagation is done, this function is called on each legal position to
+ * check if there are any futuremoves that weren't handled by the futurebases.  If so, we either
+ * complain or prune, depending on how we're configured.  We don't use commit_update(), and instead
+ * call finalize_update() directly, because we're making a pass through the entries array to call
+ * finalize_futuremove(), and can thus update the entry directly, without going through a proptable.
+ */
 
-	if (futurebase->invert_colors)
-	    promotion_sq = rowcol2square(7 - ROW(promotion_sq), COL(promotion_sq));
+void finalize_futuremove(tablebase_t *tb, index_t index, futurevector_t futurevector) {
 
-	int local_piece = futurebase->pieces[translation.extra_piece].matching_local_semilegal_group[promotion_sq];
+    unsigned int futuremove;
+    PieceColor stm = index_to_side_to_move(tb, index);
 
-	while (true) {
+    if (futurevector & unpruned_futuremoves[stm]) {
+	global_position_t global;
+	index_to_global_position(tb, index, &global);
+	fatal("Futuremoves not handled: %" PRIindex " %s", index, global_position_to_FEN(&global));
+	for (futuremove = 0; futuremove < num_futuremoves[stm]; futuremove ++) {
+	    if (futurevector & FUTUREVECTOR(futuremove)	& unpruned_futuremoves[stm]) {
+		fatal(" %s", movestr[stm][futuremove]);
+	    }
+	}
+	fatal("\n");
+	all_futuremoves_handled = false;
+    }
 
-	    /* The extra piece has to be on the back rank.
-	     *
-	     * I used to (pre 1.547) 'break' here if it wasn't, figuring that since identical pieces
-	     * are sorted into ascending square numbers, if we'd backed up to an extra piece that
-	     * wasn't on the back rank, then there couldn't be any more identical pieces on the back
-	     * rank.
-	     *
-	     * But Laurent Bartholdi exposed that as a bug.  If black is promoting, then we start
-	     * with the piece with the highest square number - that isn't on the back rank - and
-	     * have to back up to find one that is.
-	     *
-	     * We could invert the whole piece processing order to make the original optimization
-	     * work, but then when you consider what can happen if there are movement restrictions
-	     * in the futurebase, maybe the pieces aren't even going to show up in the right order.
-	     * Better to ditch that whole idea, I think.
-	     */
+    /* concede - we treat these unhandled futuremoves as forced wins for PTM.  We update the entry
+     * with DTM=2 (mate in one) and movecnt=1 (doesn't matter for a PTM win).
+     */
 
-	    if ((promotion_sq >= first_back_rank_square) && (promotion_sq <= last_back_rank_square)) {
+    if (futurevector & conceded_futuremoves[stm]) {
+	finalize_update(index, 2, 1, NO_FUTUREMOVE);
+    }
 
-		/* Consider first a capture to the left (white's left).  There has to be an empty
-		 * square where the pawn came from, and it has to be at least semilegal.
-		 */
+    /* discard - we ignore these unhandled futuremoves by updating with DTM=0, which decrements
+     * movecnt by position.multiplicity, because we multiplied movecnt by position.multiplicity when
+     * we initialized the entry.
+     *
+     * XXX Can't test the use of position.multiplicity because we currently can't have piece
+     * restrictions with symmetric tablebases, we need 8-way symmetry to get multiplicity, and we
+     * need piece restrictions to get a futurebase where only some futuremoves are handled.
+     */
 
-		if ((COL(promotion_sq) != 0)
-		    && !(position.board_vector & BITVECTOR(promotion_sq - promotion_move - 1))
-		    && (current_tb->pieces[translation.missing_piece1].semilegal_squares & BITVECTOR(promotion_sq - promotion_move - 1))) {
+    if (futurevector & discarded_futuremoves[stm]) {
+	for (futuremove = 0; futuremove < num_futuremoves[stm]; futuremove ++) {
+	    if (futurevector & FUTUREVECTOR(futuremove) & discarded_futuremoves[stm]) {
 
-		    local_position_t new_position = position;
+		local_position_t position(tb);
 
-		    /* Put the piece that was captured onto the board on the promotion square. */
+		index_to_local_position(tb, index, REFLECTION_NONE, &position);
 
-		    new_position.place_piece(translation.missing_piece2, promotion_sq);
+		finalize_update(index, 0, position.multiplicity, NO_FUTUREMOVE);
+	    }
+	}
+    }
+}
 
-		    /* Put the missing pawn on the seventh (or second). */
+/* have_all_futuremoves_been_handled() - this is the non-proptable case to run through the entries
+ * table and call finalize_futuremove()
+ */
 
-		    new_position.place_piece(translation.missing_piece1, promotion_sq - promotion_move - 1);
+bool have_all_futuremoves_been_handled(tablebase_t *tb) {
 
-		    /* Back propagate the resulting position */
+    if (ignore_futurevectors) return true;
 
-		    normalize_position(current_tb, &new_position);
+    if (tb->futurevector_bits == 0) return true;
 
-		    true_captured_piece = new_position.permuted_piece[translation.missing_piece2];
-		    true_pawn = new_position.permuted_piece[translation.missing_piece1];
+    index_t index;
 
-		    /* This function also back props any similar positions with one of the pawns
-		     * from the side that didn't promote in an en passant state.
-		     */
+    /* Positions without futuremoves have nothing to finalize, so we only need to visit the ones
+     * with futurevectors.
+     */
 
-		    propagate_local_position_from_futurebase(new_position, foreign_position,
-							     promotion_captures[true_pawn][true_captured_piece][futurebase->promotion], true);
+    for (index = tb->futurevectors->next(0); index < tb->num_indices; index = tb->futurevectors->next(index + 1)) {
+	if (entriesTable[index].get_DTM() != 1) {
+	    finalize_futuremove(tb, index, tb->futurevectors->get(index));
+	}
+    }
 
-		}
+    return all_futuremoves_handled;
+}
 
-		/* Now consider a capture to the right (white's right).  Again, there has to be an
-		 * empty square where the pawn came from, and it has to be semilegal.
-		 */
+/* assign_pruning_statement() - a helper function for compute_pruned_futuremoves()
+ *
+ * searches the tablebase's XML pruning statements for one matching (more or less identically) the
+ * specified color and string.  If there is a match, set the corresponding bit in the
+ * pruned_futuremoves bit vector.  The function can be called more than once for a given bit, but
+ * probably shouldn't be.  For example, the function might be called on the same bit for "PxQ=Q" if
+ * there are two pawns that can promote into a queen.  UNIX-style wildcards are allowed, so "Kd4"
+ * would match against "Kd4", "Kd?", "K?4", "K[a-d]4", or "K*".  The function also allows a trailing
+ * "any" in the prune statement to act as a "*" wildcard for backwards compatibility.
+ *
+ * If there are multiple prune statements that match a given futuremove, it's a warning if they are
+ * of the same type; a fatal error if their types are different.
+ */
 
-		if ((COL(promotion_sq) != 7)
-		    && !(position.board_vector & BITVECTOR(promotion_sq - promotion_move + 1))
-		    && (current_tb->pieces[translation.missing_piece1].semilegal_squares & BITVECTOR(promotion_sq - promotion_move + 1))) {
+int match_pruning_statement(tablebase_t *tb, PieceColor color, const char *pruning_statement)
+{
+    xmlpp::NodeSet result;
+    int type = RESTRICTION_NONE;
 
-		    local_position_t new_position = position;
+    result = tb->xml->get_root_node()->find("//prune");
 
-		    /* Put the piece that was captured onto the board on the promotion square. */
+    for (auto prune = result.begin(); prune != result.end(); prune ++) {
 
-		    new_position.place_piece(translation.missing_piece2, promotion_sq);
+	Glib::ustring prune_color = (*prune)->eval_to_string("@color");
+	Glib::ustring prune_move = (*prune)->eval_to_string("@move");
+	Glib::ustring prune_type = (*prune)->eval_to_string("@type");
 
-		    /* Put the missing pawn on the seventh (or second). */
+	/* Trailing 'any' is an older syntax that means '*' */
 
-		    new_position.place_piece(translation.missing_piece1, promotion_sq - promotion_move + 1);
+	auto pos = prune_move.find("any");
+	if (pos != std::string::npos) {
+	    prune_move.replace(pos, std::string::npos, "*");
+	}
 
-		    normalize_position(current_tb, &new_position);
+	if ((colors.at(prune_color) == color)
+	    && (fnmatch(prune_move.c_str(), pruning_statement, FNM_CASEFOLD) == 0)) {
 
-		    true_captured_piece = new_position.permuted_piece[translation.missing_piece2];
-		    true_pawn = new_position.permuted_piece[translation.missing_piece1];
+	    if (type == RESTRICTION_NONE) {
+		type = restriction_types.at(prune_type);
+	    } else if (type != restriction_types.at(prune_type)) {
+		fatal("Conflicting %s pruning statements match futuremove %s\n",
+		      colors.at(color).c_str(), pruning_statement);
+	    } else {
+		warning("Multiple %s pruning statements match futuremove %s\n",
+			colors.at(color).c_str(), pruning_statement);
+	    }
+	}
+    }
 
-		    propagate_local_position_from_futurebase(new_position, foreign_position,
-							     promotion_captures[true_pawn][true_captured_piece][futurebase->promotion], true);
+    return type;
+}
 
-		}
+void assign_pruning_statement(tablebase_t *tb, PieceColor color, int futuremove)
+{
+    int type;
+    const char * pruning_statement = movestr[color][futuremove];
 
-	    }
+    if (futuremove == -1) return;
 
-	    /* If the extra piece mapped into a non-empty semilegal group, then swap it with the
-	     * next piece in the group and try again.
-	     */
+    pruning_statement = movestr[color][futuremove];
 
-	    if (local_piece == -1) return;
+    type = match_pruning_statement(tb, color, pruning_statement);
 
-	    int new_promotion_sq = position.piece_position[local_piece];
+    if (type != RESTRICTION_NONE) {
 
-	    position.move_piece(local_piece, promotion_sq);
-	    promotion_sq = new_promotion_sq;
+	if (pruned_futuremoves[color] & FUTUREVECTOR(futuremove)) {
+	    warning("Multiple pruning statements ('%s') match a futuremove\n", pruning_statement);
+	}
 
-	    local_piece = current_tb->pieces[local_piece].next_piece_in_semilegal_group;
+	pruned_futuremoves[color] |= FUTUREVECTOR(futuremove);
 
+	if (type == RESTRICTION_CONCEDE) {
+	    conceded_futuremoves[color] |= FUTUREVECTOR(futuremove);
+	    if (discarded_futuremoves[color] & FUTUREVECTOR(futuremove)) {
+		fatal("Conflicting pruning statements ('%s') match a futuremove\n",
+		      pruning_statement);
+	    }
+	}
+	if (type == RESTRICTION_DISCARD) {
+	    discarded_futuremoves[color] |= FUTUREVECTOR(futuremove);
+	    if (conceded_futuremoves[color] & FUTUREVECTOR(futuremove)) {
+		fatal("Conflicting pruning statements ('%s') match a futuremove\n",
+		      pruning_statement);
+	    }
 	}
     }
 }
 
-/* Propagate moves from a futurebase that resulted from capturing one of the pieces in the current
- * tablebase.
+/* assign_numbers_to_futuremoves()
  *
- * I'm thinking of changing that "invert_colors_of_futurebase" flag to be a subroutine that gets
- * passed in.  It could be a pointer to invert_colors_of_global_position to do what it does now.  Or
- * it could be a "reflect board around vertical axis" to move a d4 pawn to e4.  Also see my comments
- * on invert_colors_of_global position.
+ * We could just dismiss any moves that aren't handled by our futurebases, but I've found this to be
+ * a source of error, since moves tend to get overlooked this way.  We're also concerned with the
+ * more sobering possibility of a single move getting processed twice by two different futurebases.
+ *
+ * So we assign numbers, bit positions in a bit vector, actually, to each futuremove.  When we
+ * initialize the tablebase, we set bits in the vector (each position has its own vector) for each
+ * futuremove possible from that position.  As we back propagate futuremoves, we check the bit to
+ * make sure it's still set, then clear it.  After we've back propagated all the futurebases, we run
+ * through the entire tablebase, making sure that the only bits that remain set correspond to prune
+ * statements.
+ *
+ * This function not only assigns the numbers, but also prints an identifying string, such as "KxP"
+ * or "Re4", into the movestr array for each number assigned.  This string will then be matched
+ * against the pruning statements specified in the configuration file.  Sometimes the strings will
+ * repeat.  For example, if we have two pawns and an enemy queen, we'll probably end up with two
+ * different bit positions, both assigned as "QxP".  The reason is that there are probably positions
+ * where the queen could take either pawn, so both possibilities have to be tracked.
+ *
+ * Because we need a "futurevector" for each position in the tablebase, we want to keep it as small
+ * as possible, so we try to use as few bit positions as possible.  In particular, we track white
+ * and black futuremoves seperately (since from a given position only one or the other will be
+ * possible) and we try to reuse bit positions for pawn capture-promotions if the pawns are
+ * sufficiently restricted so that only one or the other could capture the enemy piece in a given
+ * position.
  */
 
-void consider_possible_captures(const local_position_t &foreign_position, const local_position_t *position,
-				const int capturing_piece, const int captured_piece)
-{
-    /* When we finally convert the position to an index (in local_position_to_index()), we'll make a
-     * copy of the position and normalize it by sorting the identical pieces so that they are in
-     * ascending order.  But we have to at least be aware of this here, in order to figure out which
-     * piece "actually" got captured (we're always called with captured_piece set to the last piece
-     * number of any identical pieces), so we can figure out which futuremove number to use.
-     */
-
-    int true_captured_piece;
-    int true_capturing_piece;
-
-    /* We only want to consider pieces of the side which captured... */
+void assign_numbers_to_futuremoves(tablebase_t *tb) {
 
-    if (current_tb->pieces[capturing_piece].color == current_tb->pieces[captured_piece].color) return;
+    int piece;
+    int captured_piece;
+    int capturing_piece;
+    int sq;
+    int promotion;
+    uint64_t possible_captures[MAX_PIECES];
+    char local_movestr[MOVESTR_CHARS];
+    int futurebase_cnt;
+    int fbnum;
 
-    /* The en passant special case:
-     *
-     * If both the piece that captured and the piece that was captured are both pawns, and either a
-     * white pawn captured from the fifth rank, or a black pawn captured from the fourth, then there
-     * are two possible back prop positions - the obvious one, and the one where the captured pawn
-     * was in an en passant state.  We also make sure right away that the rank is clear where the
-     * pawn had to come from, and the rank is clear where the pawn had to go to, ensuring that an en
-     * passant move was even possible.
+    /* Start by computing a board vector (possible_captures) showing all possible squares where each
+     * piece can capture onto.
      */
 
-    /* XXX if statements inside the for loop can be moved out of it */
-
-    if ((current_tb->pieces[capturing_piece].piece_type == PieceType::Pawn)
-	&& (current_tb->pieces[captured_piece].piece_type == PieceType::Pawn)
-	&& !(position->board_vector & BITVECTOR(position->piece_position[capturing_piece]-8))
-	&& !(position->board_vector & BITVECTOR(position->piece_position[capturing_piece]+8))) {
-
-	for (auto &dir : movements(current_tb->pieces[capturing_piece].piece_type,
-				   current_tb->pieces[capturing_piece].color,
-				   position->piece_position[capturing_piece],
-				   Movement::Backward, Movement::Capture)) {
-
-	    for (auto &movement : dir) {
-
-		if ((current_tb->pieces[capturing_piece].color == PieceColor::Black) && (ROW(movement) == 3)) {
+    for (piece = 0; piece < tb->num_pieces; piece ++) {
 
-		    /* A black pawn capturing a white one (en passant)
-		     *
-		     * The white pawn is actually a rank higher than usual.
-		     */
+	possible_captures[piece] = 0;
 
-		    if ((current_tb->pieces[captured_piece].semilegal_squares
-			 & BITVECTOR(position->piece_position[capturing_piece] + 8))) {
+	for (sq = 0; sq < 64; sq ++) {
 
-			local_position_t new_position = *position;
+	    /* We make the checks here using legal_squares and not semilegal_squares because
+	     * we're assigning futuremove numbers to individual pieces that can capture.  The
+	     * movements we consider here, being captures, would take us to a futurebase anyway,
+	     * so there's no question of whether the resulting position is fully legal or not.
+	     */
 
-			new_position.uncapture_piece(capturing_piece, captured_piece, movement);
+	    if (tb->pieces[piece].legal_squares & BITVECTOR(sq)) {
 
-			new_position.set_en_passant_square(new_position.piece_position[captured_piece]);
+		for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+					   current_tb->pieces[piece].color,
+					   sq,
+					   Movement::Forward, Movement::Capture)) {
 
-			new_position.move_piece(captured_piece, new_position.piece_position[captured_piece] + 8);
+		    for (auto &movement : dir) {
 
-			normalize_position(current_tb, &new_position);
+			possible_captures[piece] |= BITVECTOR(movement);
 
-			true_capturing_piece = new_position.permuted_piece[capturing_piece];
-			true_captured_piece = new_position.permuted_piece[captured_piece];
+			/* If we hit a frozen piece, then this movement direction ends here */
+			if (BITVECTOR(movement) & tb->frozen_pieces_vector) break;
+		    }
+		}
+	    }
+	}
+    }
 
-			propagate_local_position_from_futurebase(new_position, foreign_position,
-								 futurecaptures[true_capturing_piece][true_captured_piece], true);
+    /* Now, consider all possible pairs of pieces that might capture, and assign a number (in the
+     * futurecaptures array) to each pair.  We'll ultimately use this number as an index into a bit
+     * vector to determine if this capture has been handled in any particular position.  However,
+     * there's a common enough "special" case: the two pieces are frozen (or at least sufficiently
+     * restricted) so that the capture can never occur.  Go to the trouble of checking for this.
+     */
 
-		    }
+    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
 
-		}
+	if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
 
-		if ((current_tb->pieces[capturing_piece].color == PieceColor::White) && (ROW(movement) == 4)) {
+	for (capturing_piece = 0; capturing_piece < tb->num_pieces; capturing_piece ++) {
 
-		    /* A white pawn capturing a black one (en passant)
-		     *
-		     * The black pawn is actually a rank lower than usual.
-		     */
+	    /* If this is a suicide analysis and we can capture a player's only (i.e, last) piece,
+	     * we lose.  Treat this just like a 'resign' prune, except that we don't need prune or
+	     * prune-enable statements, since these are the rules of the game!
+	     */
 
-		    if ((current_tb->pieces[captured_piece].semilegal_squares
-			 & BITVECTOR(position->piece_position[capturing_piece] - 8))) {
+	    if ((tb->variant == Variant::Suicide) && (tb->num_pieces_by_color[tb->pieces[captured_piece].color] == 1)) {
 
-			local_position_t new_position = *position;
+		futurecaptures[capturing_piece][captured_piece] = RESIGN_FUTUREMOVE;
 
-			new_position.uncapture_piece(capturing_piece, captured_piece, movement);
+		for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+		    promotion_captures[capturing_piece][captured_piece][promotion] = RESIGN_FUTUREMOVE;
+		}
 
-			new_position.set_en_passant_square(new_position.piece_position[captured_piece]);
+		continue;
+	    }
 
-			new_position.move_piece(captured_piece, new_position.piece_position[captured_piece] - 8);
+	    futurecaptures[capturing_piece][captured_piece] = NO_FUTUREMOVE;
 
-			normalize_position(current_tb, &new_position);
+	    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+		promotion_captures[capturing_piece][captured_piece][promotion] = NO_FUTUREMOVE;
+	    }
 
-			true_capturing_piece = new_position.permuted_piece[capturing_piece];
-			true_captured_piece = new_position.permuted_piece[captured_piece];
+	    if (tb->pieces[capturing_piece].color == tb->pieces[captured_piece].color) continue;
 
-			propagate_local_position_from_futurebase(new_position, foreign_position,
-								 futurecaptures[true_capturing_piece][true_captured_piece], true);
+	    if (tb->pieces[capturing_piece].piece_type != PieceType::Pawn) {
 
-		    }
-		}
-	    }
-	}
-    }
+		if (possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares) {
 
-    /* If the square we're about to put the captured piece on isn't semilegal for it, then don't
-     * consider this capturing piece in this future position any more.  This is after the en passant
-     * case because an en passant pawn capture is special, since then the capturing piece ends up on
-     * a different square from the captured piece.
-     */
+		    sprintf(local_movestr, "%cx%c",
+			    piece_char[tb->pieces[capturing_piece].piece_type],
+			    piece_char[tb->pieces[captured_piece].piece_type]);
 
-    if (!(current_tb->pieces[captured_piece].semilegal_squares
-	  & BITVECTOR(position->piece_position[capturing_piece]))) {
-	return;
-    }
+		    movestr[tb->pieces[capturing_piece].color]
+			[num_futuremoves[tb->pieces[capturing_piece].color]]
+			= strdup(local_movestr);
 
-    /* Now consider all possible backwards movements of the capturing piece. */
+		    futurecaptures[capturing_piece][captured_piece]
+			= num_futuremoves[tb->pieces[capturing_piece].color] ++;
+		}
 
-    for (auto &dir : movements(current_tb->pieces[capturing_piece].piece_type,
-			       current_tb->pieces[capturing_piece].color,
-			       position->piece_position[capturing_piece],
-			       Movement::Backward, Movement::Capture)) {
+	    } else {
 
-	for (auto &movement : dir) {
+		/* if it's a pawn-takes-pawn situation, check for en passant as well */
 
-	    if (BITVECTOR(movement) & position->board_vector) break;
+		if ((possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares)
+		    | ((tb->pieces[captured_piece].piece_type == PieceType::Pawn)
+		       && (((tb->pieces[capturing_piece].color == PieceColor::White)
+			    ? ((possible_captures[capturing_piece] & 0x0000ff0000000000LL) >> 8)
+			    : ((possible_captures[capturing_piece] & 0x0000000000ff0000LL) << 8))
+			   & tb->pieces[captured_piece].legal_squares))) {
 
-	    /* We already checked that the captured piece was on a semilegal square for it.  Now
-	     * check the capturing piece.
-	     */
+		    int candidate_futuremove = NO_FUTUREMOVE;
 
-	    if (! (current_tb->pieces[capturing_piece].semilegal_squares & BITVECTOR(movement))) continue;
+		    /* start by dishing out a non-promotion futurecapture */
 
-	    /* Move the capturing piece, normalize the position, and back prop it.
-	     *
-	     * We have to figure out the "true" capturing and captured pieces, which might not
-	     * be the pieces we started with (see comments on normalization).
-	     */
+		    sprintf(local_movestr, "%cx%c",
+			    piece_char[tb->pieces[capturing_piece].piece_type],
+			    piece_char[tb->pieces[captured_piece].piece_type]);
 
-	    local_position_t new_position = *position;
+		    movestr[tb->pieces[capturing_piece].color]
+			[num_futuremoves[tb->pieces[capturing_piece].color]]
+			= strdup(local_movestr);
 
-	    new_position.uncapture_piece(capturing_piece, captured_piece, movement);
+		    futurecaptures[capturing_piece][captured_piece]
+			= num_futuremoves[tb->pieces[capturing_piece].color] ++;
 
-	    normalize_position(current_tb, &new_position);
+		    /* Keep going only if it's a pawn capture that results in promotion */
 
-	    true_capturing_piece = new_position.permuted_piece[capturing_piece];
-	    true_captured_piece = new_position.permuted_piece[captured_piece];
+		    if (! (possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares
+			   & ((tb->pieces[capturing_piece].color == PieceColor::White)
+			      ? 0xff00000000000000LL : 0x00000000000000ffLL))) {
+			continue;
+		    }
 
-	    propagate_local_position_from_futurebase(new_position, foreign_position,
-						     futurecaptures[true_capturing_piece][true_captured_piece], true);
-	}
-    }
+		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-}
+			candidate_futuremove = NO_FUTUREMOVE;
 
-void propagate_moves_from_capture_futurebase(index_t future_index, int reflection)
-{
-    local_position_t foreign_position(futurebase);
-    local_position_t position(current_tb);
-    int piece;
-    translation_result translation;
+			sprintf(local_movestr, "Px%c=%c",
+				piece_char[tb->pieces[captured_piece].piece_type],
+				piece_char[promoted_pieces[promotion]]);
 
-    /* Take the position from the futurebase and translate it into a local position for the current
-     * tablebase.  If the futurebase index was illegal, the function will return -1.  Otherwise,
-     * there should be one piece missing from the local position: the piece that was captured.
-     * There could possibly be one piece on a restricted square, as well.  If so, then it must be
-     * the piece that moved in order to capture.
-     */
+			/* Be conservative about handing out bit positions in the futurevector.
+			 * Look through the other pieces that have been assigned bit positions and
+			 * see if we can find one with an identical movestr that can never capture
+			 * onto the squares that our piece can capture onto and reuse its bit
+			 * positions.
+			 *
+			 * This code could be a lot more aggressively conservative, but for now I
+			 * settle for handling the common simple case of pawns more than two files
+			 * apart never being able to capture the same piece.  I only look at
+			 * futuremoves for the current captured_piece, and only so far as the
+			 * current capturing_piece.  That's why the nesting order of the two
+			 * captured_piece and capturing_piece loops is important above.  First we
+			 * look for a candidate futuremove, then we try to bust it by looking for
+			 * overlaps.
+			 */
 
-    /* XXX If the futurebase is more liberal than the tablebase, then there will be
-     * positions with multiple restricted pieces that should be quietly ignored.
-     */
+			for (piece = 0; piece < capturing_piece; piece ++) {
+			    if (tb->pieces[piece].color != tb->pieces[capturing_piece].color) continue;
+			    if (promotion_captures[piece][captured_piece][promotion] != NO_FUTUREMOVE) {
+				if ((! (possible_captures[capturing_piece] & possible_captures[piece]))
+				    && (! strcmp(local_movestr, movestr[tb->pieces[piece].color][promotion_captures[piece][captured_piece][promotion]]))) {
+				    candidate_futuremove = promotion_captures[piece][captured_piece][promotion];
+				}
+			    }
+			}
 
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
+			if (candidate_futuremove != NO_FUTUREMOVE) {
+			    for (piece = 0; piece < capturing_piece; piece ++) {
+				if (tb->pieces[piece].color != tb->pieces[capturing_piece].color) continue;
+				if (! (possible_captures[capturing_piece] & possible_captures[piece])) continue;
+				if (promotion_captures[piece][captured_piece][promotion] != NO_FUTUREMOVE) {
+				    if (promotion_captures[piece][captured_piece][promotion] == candidate_futuremove) {
+					candidate_futuremove = NO_FUTUREMOVE;
+					break;
+				    }
+				}
+			    }
+			}
 
-    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
-							       current_tb, &position,
-							       futurebase->invert_colors);
+			if (candidate_futuremove == NO_FUTUREMOVE) {
+			    candidate_futuremove = num_futuremoves[tb->pieces[capturing_piece].color] ++;
+			    movestr[tb->pieces[capturing_piece].color][candidate_futuremove] = strdup(local_movestr);
+			}
 
-    if (future_index == debug_futuremove) {
-	info("capture backprop; reflection=%d; translation=%x\n",
-	     reflections[reflection], translation);
+			promotion_captures[capturing_piece][captured_piece][promotion] = candidate_futuremove;
+		    }
+		}
+	    }
+	}
     }
 
-    if (translation != invalid_translation) {
+    /* We also want to consider all promotions.  We don't wrap this into the pawn code that follows
+     * because we want to count all promotions together, not a set for each destination square.
+     * This is a special case of a more general problem that this code doesn't address yet.  We want
+     * to minimize the assigned numbers to keep the futuremove bit vector small, so we want to reuse
+     * those numbers if we're sure that two moves can't happen from different squares.  I.e, if a
+     * king is restricted to the f1/h3 rectangle, then it can move to e1 from f1 and it can move to
+     * h4 from h3, but there is no single position from which it can move to both e1 and h4.  So we
+     * can use the same position in the bit vector for Ke1 and Kh4.  But we don't (yet).
+     */
 
-	if ((translation.extra_piece != NONE) || (translation.missing_piece1 == NONE)
-	    || (translation.missing_piece2 != NONE)) {
-	    return;
+    for (piece = 0; piece < tb->num_pieces; piece ++) {
+	for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+	    promotions[piece][promotion] = NO_FUTUREMOVE;
 	}
+	if (tb->pieces[piece].piece_type == PieceType::Pawn) {
+	    for (sq = (tb->pieces[piece].color == PieceColor::White ? 48 : 8);
+		 sq <= (tb->pieces[piece].color == PieceColor::White ? 55 : 15); sq++) {
+		if (tb->pieces[piece].legal_squares & BITVECTOR(sq)) {
 
-	uint8_t captured_piece = translation.missing_piece1;
+		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+			promotions[piece][promotion] = num_futuremoves[tb->pieces[piece].color];
+			sprintf(local_movestr, "P=%c", piece_char[promoted_pieces[promotion]]);
+			movestr[tb->pieces[piece].color][promotions[piece][promotion]] = strdup(local_movestr);
+			num_futuremoves[tb->pieces[piece].color] ++;
+		    }
 
-	/* Since the last move had to have been a capture move, there is absolutely no way
-	 * we could have en passant capturable pawns in the futurebase position.
-	 */
+		    break;
+		}
+	    }
+	}
+    }
 
-	if (position.en_passant_square != ILLEGAL_POSITION) return;
+    /* And now all piece moves outside their restriction.  We record a futuremove for each possible
+     * destination square that the piece can reach outside its move restriction, unless we've
+     * determined that there are no "normal" futurebases, in which case we flag the pruning right
+     * here and now.
+     */
 
-	/* Since the position resulted from a capture, we only want to consider future
-	 * positions where the side to move is not the side that captured.
-	 */
+    futurebase_cnt = 0;
 
-	if (position.side_to_move != current_tb->pieces[captured_piece].color) return;
+    for (fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+	if (futurebases[fbnum].futurebase_type == FuturebaseType::Normal) futurebase_cnt ++;
+    }
 
-	/* We're going to back step a half move now */
+    for (piece = 0; piece < tb->num_pieces; piece ++) {
 
-	position.flip_side_to_move();
+	for (sq = 0; sq < 64; sq ++) futuremoves[piece][sq] = NO_FUTUREMOVE;
 
-	if (translation.restricted_piece == NONE) {
+	for (sq = 0; sq < 64; sq ++) {
 
-	    /* No pieces were on restricted squares.  Consider them all as the possible
-	     * capturing piece.
-	     */
+	    /* Consider as _starting_ squares only those within the piece's movement restriction */
 
-	    for (piece = 0; piece < current_tb->num_pieces; piece++) {
+	    if (! (tb->pieces[piece].legal_squares & BITVECTOR(sq))) continue;
 
-		consider_possible_captures(foreign_position, &position, piece, captured_piece);
-	    }
+	    for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+				       current_tb->pieces[piece].color,
+				       sq,
+				       Movement::Forward, Movement::NonCapture)) {
 
-	} else {
+		for (auto &movement : dir) {
 
-	    /* One piece was on a restricted square.  It's the obvious capturing piece, but it's not
-	     * the only possible one.  A restricted piece is on a square whose semilegal group is
-	     * either empty or already full.  If the square's semilegal group is in fact empty, then
-	     * there's only one restricted piece we need to consider.  Otherwise, we need to
-	     * consider each piece in the semilegal group as the possible restricted piece.
-	     */
+		    /* If we hit a frozen piece, movement has to stop.  We don't consider captures
+		     * here; they were handled above.
+		     */
 
-	    int restricted_square = position.piece_position[translation.restricted_piece];
+		    if (BITVECTOR(movement) & tb->frozen_pieces_vector) break;
 
-	    consider_possible_captures(foreign_position, &position, translation.restricted_piece, captured_piece);
+		    /* If the piece is moving outside its semilegal squares, it's a futuremove.  If
+		     * it's moving from a legal square to a semilegal square, it's also a
+		     * futuremove... except for a special case.  Obviously the other piece in its
+		     * semilegal group can't be on either the square it's moving from or the square
+		     * it's moving to (no other piece can be).  If all remaining legal squares
+		     * available to that other piece are also legal squares for this piece, then we
+		     * can always successfully flip the two pieces and this isn't a futuremove.  The
+		     * converse is that there must be at least one legal square available to the
+		     * other piece that isn't a legal square for this piece; in other words, this
+		     * piece must have another semilegal square that isn't legal.
+		     */
 
-	    for (piece = 0; piece < current_tb->num_pieces; piece++) {
+		    if (!(tb->pieces[piece].semilegal_squares & BITVECTOR(movement))
 
-		if ((current_tb->pieces[piece].color == current_tb->pieces[translation.restricted_piece].color)
-		    && (current_tb->pieces[piece].piece_type == current_tb->pieces[translation.restricted_piece].piece_type)
-		    && (current_tb->pieces[piece].semilegal_squares & BITVECTOR(restricted_square))) {
+			|| (!(tb->pieces[piece].legal_squares & BITVECTOR(movement))
+			    && ( tb->pieces[piece].semilegal_squares & ~(tb->pieces[piece].legal_squares)
+				 & ~BITVECTOR(movement) & ~BITVECTOR(sq) ))) {
 
-		    position.swap_pieces(translation.restricted_piece, piece);
+			if (futuremoves[piece][movement] == NO_FUTUREMOVE) {
 
-		    consider_possible_captures(foreign_position, &position, translation.restricted_piece, captured_piece);
+			    sprintf(local_movestr, "%c%c%c", piece_char[tb->pieces[piece].piece_type],
+				    'a' + COL(movement), '1' + ROW(movement));
 
-		    position.swap_pieces(translation.restricted_piece, piece);
+			    if (futurebase_cnt > 0) {
+				futuremoves[piece][movement]
+				    = num_futuremoves[tb->pieces[piece].color];
+				movestr[tb->pieces[piece].color][num_futuremoves[tb->pieces[piece].color]]
+				    = strdup(local_movestr);
+				num_futuremoves[tb->pieces[piece].color] ++;
+			    } else {
+				switch (match_pruning_statement(tb, tb->pieces[piece].color,
+								local_movestr)) {
+				case RESTRICTION_DISCARD:
+				    futuremoves[piece][movement] = DISCARD_FUTUREMOVE;
+				    break;
+				case RESTRICTION_CONCEDE:
+				    futuremoves[piece][movement] = CONCEDE_FUTUREMOVE;
+				    break;
+				}
+			    }
+			}
+		    }
 		}
 	    }
 	}
     }
-}
-
-/* A "normal" futurebase is one that's identical to our own in terms of the number and types
- * of pieces.  It differs only in the frozen positions of the pieces.
- *
- * XXX not sure how to handle symmetry changes here.  At the moment it's not an issue, since we
- * don't allow frozen pieces in symmetric tablebases.
- */
-
-void propagate_moves_from_normal_futurebase(index_t future_index, int reflection)
-{
-    local_position_t foreign_position(futurebase);
-    local_position_t parent_position(current_tb);
-    local_position_t current_position(current_tb); /* i.e, last position that moved to parent_position */
-    translation_result translation;
-    int piece;
-    int origin_square;
 
-    /* Translate the futurebase index into a local position.  We have exactly the same number and
-     * type of pieces here, but exactly one of them is on a restricted square (according to the
-     * current tablebase).  If more than one of them was on a restricted square, then there'd be no
-     * way we could get to this futurebase with a single move.  On the other hand, if none of them
-     * were on restricted squares, then this would be a position in the current tablebase.
-     */
-
-    /* XXX we need to permute the restricted piece around in its semilegal set */
+    info("%d possible WHITE futuremoves\n", num_futuremoves[PieceColor::White]);
+    if (tb->encode_stm) {
+	info("%d possible BLACK futuremoves\n", num_futuremoves[PieceColor::Black]);
+    } else {
+	num_futuremoves[PieceColor::Black] = 0;
+    }
 
-    /* XXX If the futurebase is more liberal than the tablebase, then there will be positions with
-     * multiple restricted pieces that should be quietly ignored.
-     */
+    if (num_futuremoves[PieceColor::White] > sizeof(futurevector_t)*8) {
+	fatal("Too many futuremoves - %d!  (only %d bits futurevector_t)\n",
+	      num_futuremoves[PieceColor::White], sizeof(futurevector_t)*8);
+	terminate();
+    }
+    if (num_futuremoves[PieceColor::Black] > sizeof(futurevector_t)*8) {
+	fatal("Too many futuremoves - %d!  (only %d bits futurevector_t)\n",
+	      num_futuremoves[PieceColor::Black], sizeof(futurevector_t)*8);
+	terminate();
+    }
+}
 
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
+void print_futuremoves(void)
+{
+    unsigned int i;
 
-    translation = translate_foreign_position_to_local_position(futurebase, &foreign_position,
-							       current_tb, &current_position,
-							       futurebase->invert_colors);
+    info("%d unpruned and unhandled WHITE futuremoves\n", num_futuremoves[PieceColor::White]);
+    if (current_tb->encode_stm) info("%d unpruned and unhandled BLACK futuremoves\n", num_futuremoves[PieceColor::Black]);
 
-    if (future_index == debug_futuremove) {
-	info("normal backprop; reflection=%d; translation=%x\n",
-	     reflections[reflection], translation);
+    for (i=0; i < num_futuremoves[PieceColor::White]; i ++) {
+	info("WHITE Futuremove %i: %s\n", i, movestr[PieceColor::White][i]);
+    }
+    for (i=0; i < num_futuremoves[PieceColor::Black]; i ++) {
+	if (current_tb->encode_stm) info("BLACK Futuremove %i: %s\n", i, movestr[PieceColor::Black][i]);
     }
+}
 
-    if (translation != invalid_translation) {
+/* This is where we parse pruning statements.  Fill in the pruned_futuremoves bit vector with bits
+ * set for the various pruned moves.  We call this routine after assign_numbers_to_futuremoves(),
+ * which also prints strings into the movestr array, and now we use those strings to match against
+ * pruning statements.  To make this routine easier, assign_pruning_statement() can be called with a
+ * '-1' futuremove, in which case it will do nothing.
+ *
+ * XXX something else I'd like to do here is to flag all of the pruning statements to make
+ * sure we've used each one, and complain if any are left unused.
+ */
 
-	if ((translation.missing_piece1 != NONE) || (translation.missing_piece2 != NONE)
-	    || (translation.extra_piece != NONE) || (translation.restricted_piece == NONE)) {
-	    return;
-	}
+bool compute_pruned_futuremoves(tablebase_t *tb)
+{
+    xmlpp::NodeSet result;
 
-	piece = translation.restricted_piece;
+    /* Check pruning statements for consistency, and record stalemate pruning if specified */
 
-	origin_square = current_position.piece_position[piece];
+    result = tb->xml->get_root_node()->find("//prune");
 
-	/* We've moving BACKWARDS in the game, so this has to be a piece of the player who is NOT TO
-	 * PLAY here - this is the LAST move we're considering, not the next move.
-	 */
+    for (auto prune = result.begin(); prune != result.end(); prune ++) {
 
-	if (current_tb->pieces[piece].color == current_position.side_to_move) return;
+	Glib::ustring prune_color = (*prune)->eval_to_string("@color");
+	Glib::ustring prune_type = (*prune)->eval_to_string("@type");
 
-	/* If there are any en passant capturable pawns in the position, then the last move had to
-	 * have been a pawn move.  In fact, in this case, we already know exactly what the last move
-	 * had to have been.
-	 */
+	PieceColor color = colors.at(prune_color);
+	int type = restriction_types.at(prune_type);
 
-	if (current_position.en_passant_square != ILLEGAL_POSITION) {
+	if (! (type & tb->prune_enable[color])) {
+	    fatal("Prune statements don't match tablebase prune-enables\n");
+	}
+    }
 
-	    if (current_tb->pieces[piece].piece_type != PieceType::Pawn) return;
+    if (fatal_errors != 0) return false;
 
-	    if (((current_tb->pieces[piece].color == PieceColor::White)
-		 && (current_position.piece_position[piece] != current_position.en_passant_square + 8))
-		|| ((current_tb->pieces[piece].color == PieceColor::Black)
-		    && (current_position.piece_position[piece] != current_position.en_passant_square - 8))) {
+    for (auto color : BothColors) {
+	for (auto fm = 0U; fm < num_futuremoves[color]; fm ++) {
+	    assign_pruning_statement(tb, color, fm);
+	}
+    }
 
-		/* No reason to complain here.  Maybe some other pawn was the en passant pawn. */
-		return;
-	    }
+    unpruned_futuremoves[PieceColor::White] = ~pruned_futuremoves[PieceColor::White];
+    unpruned_futuremoves[PieceColor::Black] = ~pruned_futuremoves[PieceColor::Black];
 
-	    current_position.flip_side_to_move();
-	    current_position.clear_en_passant_square();
+    return (fatal_errors == 0);
+}
 
-	    int square;
-	    if (current_tb->pieces[piece].color == PieceColor::White)
-		square = current_position.piece_position[piece] - 16;
-	    else
-		square = current_position.piece_position[piece] + 16;
 
-	    current_position.move_piece(piece, square);
+/* check_pruning()
+ *
+ * We run this function after we've assigned numbers to the futuremoves and then matched pruning
+ * statements against them, but before we initialize the tablebase.
+ *
+ * Check the futurebases to see if there are any for a given futuremove.  If not, check to make sure
+ * the futuremove is pruned.  Otherwise, signal an error and exit right now.  Just because this test
+ * is passed doesn't mean a particular futuremove is handled in a particular position (that's why we
+ * use the bit vector), but if the test fails, well, then we know (almost) for sure that we'd get to
+ * the end of program with unhandled futurebases, so we can save ourselves a long computation by
+ * making this basic check now.
+ *
+ * If no futurebases exist for a given futuremove and it is correctly pruned, then flag it for
+ * optimization, since there is no need to track its futurebase back propagation.
+ *
+ * Also check to see if there are any futurebases that will always match a futuremove.  If so, we
+ * can also optimize these away.  If multiple futurebases match a futuremove and one of them will
+ * always match the futuremove, then we can also signal an error now, because we're going to get
+ * multiply handled futuremoves.
+ *
+ * There is an off chance that piece restrictions will prevent a futuremove from taking place, but
+ * this code will conclude nevertheless that it is possible and demand either a prune statement or a
+ * futurebase.  In this rare case, introducing an extraneous prune statement or two should solve the
+ * problem.
+ */
 
-	    /* We never back out into a restricted position.  Since we've already decided that this
-	     * is the only possible back-move from this point, well...
-	     */
+uint64_t tablebase_t::possible_capture_squares(const int capturing_piece) const
+{
+    uint64_t result = 0LL;
 
-	    if (! (current_tb->pieces[piece].semilegal_squares
-		   & BITVECTOR(current_position.piece_position[piece]))) {
-		return;
+    for (square_t from=0; from < NUM_SQUARES; from++) {
+	if (pieces[capturing_piece].legal_squares & BITVECTOR(from)) {
+	    for (auto &dir: movements(pieces[capturing_piece].piece_type, pieces[capturing_piece].color,
+				     from, Movement::Forward, Movement::Capture)) {
+		for (auto &to: dir) {
+		    result |= BITVECTOR(to);
+		}
 	    }
-
-	    propagate_local_position_from_futurebase(current_position, foreign_position,
-						     futuremoves[piece][origin_square], false);
-
-	    return;
 	}
+    }
 
-	/* Abuse of notation here.  We just want to keep a copy of current_position because we
-	 * change it around a lot during the loops below.
-	 */
-
-	parent_position = current_position;
-
-	for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-				   current_tb->pieces[piece].color,
-				   parent_position.piece_position[piece],
-				   Movement::Backward, Movement::NonCapture)) {
-
-	    for (auto &movement : dir) {
-
-		/* We never back out into a restricted position (obviously) */
+    return result;
+}
 
-		if (! (current_tb->pieces[piece].semilegal_squares & BITVECTOR(movement))) continue;
+bool tablebase_t::futurebase_matches_capture(const tablebase_t& fb, const int captured_piece) const
+{
+    /* I've made this a bit more liberal now, because if we're dealing with move restrictions,
+     * then we might have a missing piece in the futurebase line up with one of our pieces that
+     * is identical to captured_piece in the sense that it's the same color and type, but not
+     * identical in the sense of next_piece_in_semilegal_group.
+     */
 
-		/* Back stepping a half move here involves several things: flipping the side-to-move
-		 * flag, clearing any en passant pawns into regular pawns, moving the piece
-		 * (backwards), and considering a bunch of additional positions identical to the
-		 * base position except that a single one of the pawns on the fourth or fifth ranks
-		 * was capturable en passant.
-		 *
-		 * Of course, the only way we could have gotten an en passant pawn is if THIS MOVE
-		 * created it.  Since this isn't a pawn move, that can't happen.  Checking
-		 * additional en passant positions is taken care of in
-		 * propagate_one_move_within_table()
-		 */
+    if (fb.futurebase_type != FuturebaseType::Capture) return false;
 
-		/* But we start with an extra check to make sure this isn't a double pawn move, it
-		 * which case it would result in an en passant position, not the non-en passant
-		 * position we are in now (en passant got taken care of in the special case above).
-		 */
+    if (pieces[captured_piece].piece_type == PieceType::Pawn) {
+	if ((fb.missing_pawn != -1)
+	    && (pieces[fb.missing_pawn].color == pieces[captured_piece].color)) return true;
+    } else {
+	if ((fb.missing_non_pawn != -1)
+	    && (pieces[fb.missing_non_pawn].color == pieces[captured_piece].color)
+	    && (pieces[fb.missing_non_pawn].piece_type == pieces[captured_piece].piece_type)) return true;
+    }
 
-		/* XXX should be unnecessary because of NoDoublePawn */
+    return false;
+}
 
-		if (((movement - parent_position.piece_position[piece]) == 16)
-		    || ((movement - parent_position.piece_position[piece]) == -16)) {
-		    continue;
-		}
+bool tablebase_t::futurebase_matches_capture_promotion(const tablebase_t& fb, const int captured_piece, const int promotion) const
+{
+    if (fb.futurebase_type != FuturebaseType::CapturePromotion) return false;
 
-		current_position.flip_side_to_move();
+    if ((pieces[fb.missing_non_pawn].color == pieces[captured_piece].color)
+	&& (pieces[fb.missing_non_pawn].piece_type == pieces[captured_piece].piece_type)
+	&& (fb.promotion == promotion)) {
+	return true;
+    }
 
-		current_position.move_piece(piece, movement);
+    return false;
+}
 
-		propagate_local_position_from_futurebase(current_position, foreign_position,
-							 futuremoves[piece][origin_square], false);
-	    }
-	}
+bool tablebase_t::futurebase_matches_promotion(const tablebase_t& fb, const int promoting_pawn, const int promotion) const
+{
+    if (fb.futurebase_type != FuturebaseType::Promotion) return false;
 
+    if ((pieces[fb.missing_pawn].color == pieces[promoting_pawn].color)
+	&& (fb.promotion == promotion)) {
+	return true;
     }
-}
 
-/* A "pawngen" futurebase is one that's identical to our own, except that it uses a different range
- * of pawngen indices.  Its local positions can just be copied into our own local position
- * structure, eliminating the need for the time-consuming translation function.
- */
+    return false;
+}
 
-void propagate_moves_from_pawngen_futurebase(index_t future_index, int reflection)
+uint64_t flip_legal_squares(const uint64_t legal_squares)
 {
-    local_position_t foreign_position(futurebase);
-    local_position_t current_position(current_tb);
-
-    if (! index_to_local_position(futurebase, future_index, reflections[reflection],
-				  &foreign_position)) return;
+    uint64_t output = 0LL;
 
-    if (future_index == debug_futuremove) {
-	info("normal backprop; reflection=%d\n", reflections[reflection]);
+    for (int i=0; i<64; i++) {
+	if (legal_squares & BITVECTOR(i)) {
+	    output |= BITVECTOR(63-i);
+	}
     }
 
-    int pawngen_index = foreign_position.pawngen_index;
+    return output;
+}
 
-    for (int piece = 0; piece < current_tb->num_pieces; piece ++) {
+bool tablebase_t::futurebase_completely_handles_capture(const tablebase_t& fb, const int capturing_piece, const int captured_piece) const
+{
+    if (! futurebase_matches_capture(fb, captured_piece)) return false;
 
-	/* We only consider pawn moves, since they're the only things that change the pawngen index */
+    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
+     * if our initial pawn positions are identical.
+     */
 
-	if (current_tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+    if (fb.pawngen) {
+	if (! pawngen) return false;
+	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
+	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
+    }
 
-	/* We've moving BACKWARDS in the game, so this has to be a piece of the player who is NOT TO
-	 * PLAY here - this is the LAST move we're considering, not the next move.
-	 */
+    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
+     * to consider all possible such mappings.  Remember that there's one less piece in the
+     * futurebase, and that nothing in the futurebase maps to the captured piece.
+     */
 
-	if (current_tb->pieces[piece].color == foreign_position.side_to_move) continue;
+    int local_piece[MAX_PIECES];
 
-	/* XXX big assumption here - that we can just copy a position from foreign to current */
-	current_position = foreign_position;
-	current_position.tb = current_tb;
-	current_position.flip_side_to_move();
+    for (int piece = 0; piece < num_pieces - 1; piece ++) {
+	if (piece < captured_piece) {
+	    local_piece[piece] = piece;
+	} else {
+	    local_piece[piece] = piece+1;
+	}
+    }
 
-	/* can we move the pawn backwards and get a position in this tablebase? */
+    /* Compute a bitvector of squares where a capture is possible.  Slight proviso here for pawns -
+     * since capture-promotions are handled in a different subroutine, we use LEGAL_PAWN_BITVECTOR
+     * to exclude the last rank.
+     */
 
-	int delta_pawngen_index = current_tb->pawngen->pawn_positions_by_index[pawngen_index].delta_pawngen_index[piece];
-	uint8_t prev_position = current_tb->pawngen->pawn_positions_by_index[pawngen_index].prev_position[piece];
+    uint64_t capture_squares = possible_capture_squares(capturing_piece);
 
-	if (future_index == debug_futuremove) {
-	    info("pawngen backprop; delta_pawngen_index=%d; prev_position=%d\n", delta_pawngen_index, prev_position);
-	}
+    if (pieces[capturing_piece].piece_type == PieceType::Pawn) {
+	capture_squares &= LEGAL_PAWN_BITVECTOR;
+    }
 
-	if ((prev_position != ILLEGAL_POSITION) && (! (current_position.board_vector & BITVECTOR(prev_position)))) {
-	    int new_pawngen_index = pawngen_index + delta_pawngen_index;
+    /* Can we find a suitable mapping?
+     *
+     * The capturing piece will end up on the captured piece's square, so each legal square for the
+     * captured piece in the current tablebase must be legal for the capturing piece in the
+     * futurebase, assuming that a capture is possible on that square.
+     *
+     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
+     * its location restriction.
+     */
 
-	    /* move_piece's pawngen optimization makes this quick */
-	    current_position.move_piece(piece, prev_position);
+    do {
+	int piece;
 
-	    if ((new_pawngen_index >= current_tb->pawngen->start)
-		&& (new_pawngen_index < current_tb->pawngen->start + current_tb->pawngen->count)) {
-		/* back prop */
-		propagate_local_position_from_futurebase(current_position, foreign_position, HANDLED_FUTUREMOVE, false);
-	    }
+	for (piece = 0; piece < num_pieces - 1; piece ++) {
+	    if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
+	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
+	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
 
-	    /* is a double pawn move possible? */
+	    /* If we're using pawngen, we've already checked that the pawns match right */
+	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
 
-	    int delta_pawngen_index2 = current_tb->pawngen->pawn_positions_by_index[pawngen_index].delta_pawngen_index2[piece];
-	    int prev_position2 = current_tb->pawngen->pawn_positions_by_index[pawngen_index].prev_position2[piece];
+	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
 
-	    if (future_index == debug_futuremove) {
-		info("pawngen backprop; delta_pawngen_index2=%d; prev_position2=%d\n", delta_pawngen_index2, prev_position2);
+	    if (fb.invert_colors) {
+		fb_legal_squares = flip_legal_squares(fb_legal_squares);
 	    }
 
-	    if ((prev_position2 != ILLEGAL_POSITION) && (! (current_position.board_vector & BITVECTOR(prev_position2)))) {
-		int new2_pawngen_index = pawngen_index + delta_pawngen_index2;
+	    if ((local_piece[piece] != capturing_piece)
+		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
+		    != pieces[local_piece[piece]].legal_squares)) break;
+	    if ((local_piece[piece] == capturing_piece)
+		&& ((fb_legal_squares & pieces[captured_piece].legal_squares & capture_squares)
+		    != (pieces[captured_piece].legal_squares & capture_squares))) break;
+	}
 
-		if ((new2_pawngen_index >= current_tb->pawngen->start)
-		    && (new2_pawngen_index < current_tb->pawngen->start + current_tb->pawngen->count)) {
+	/* We've found a mapping of pieces that meets the above criteria. */
+	if (piece == num_pieces - 1) {
+	    return true;
+	}
 
-		    /* move_piece's pawngen optimization makes this quick */
-		    current_position.move_piece(piece, prev_position2);
+    } while (std::next_permutation(local_piece, local_piece + num_pieces - 1));
 
-		    /* back prop */
-		    propagate_local_position_from_futurebase(current_position, foreign_position, HANDLED_FUTUREMOVE, false);
-		}
-	    }
-	}
-    }
+    return false;
 }
 
-/* Back propagates from all the futurebases.
- *
- * Should be called after the tablebase has been initialized, but before intra-table propagation.
- *
- * Runs through the parsed XML control file, pulls out all the futurebases, and back-propagates each
- * one.
- *
- * Returns true, or false if something went wrong
- */
-
-void back_propagate_futurebase_thread(void (* backprop_function)(index_t, int))
+bool tablebase_t::futurebase_completely_handles_capture_promotion(const tablebase_t& fb, const int capturing_piece, const int captured_piece, const int promotion) const
 {
-    index_t future_index;
-    int reflection;
-    int i;
+    if (! futurebase_matches_capture_promotion(fb, captured_piece, promotion)) return false;
 
-    /* XXX We could limit the range of future_index here to only those positions where the promoted
-     * piece appears on the back rank, but watch out for reflection.
+    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
+     * if our initial pawn positions are identical.
      */
 
-    while ((future_index = futurebase->fetch_entry()) < futurebase->num_indices) {
-
-	for (i=0; i<futurebase_stride; i++) {
-
-	    if (future_index + i < futurebase->num_indices) {
+    if (fb.pawngen) {
+	if (! pawngen) return false;
+	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
+	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
+    }
 
-		/* It's tempting to break out the loop here if the position isn't a win, but we want
-		 * to track futuremoves in order to make sure we don't miss one, so the simplest way
-		 * to do that is to run this loop even for draws.
-		 */
+    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
+     * to consider all possible such mappings.  Remember that there's one less piece in the
+     * futurebase, and that nothing in the futurebase maps to the captured piece.
+     */
 
-		mark_progress();
+    int local_piece[MAX_PIECES];
 
-		for (reflection = 0; reflection < max_reflection; reflection ++) {
-		    (*backprop_function)(future_index + i, reflection);
-		}
-	    }
+    for (int piece = 0; piece < num_pieces - 1; piece ++) {
+	if (piece < captured_piece) {
+	    local_piece[piece] = piece;
+	} else {
+	    local_piece[piece] = piece+1;
 	}
     }
-}
-
-bool back_propagate_all_futurebases(tablebase_t *tb) {
 
-    int fbnum;
-    void (* backprop_function)(index_t, int);
+    /* Can we find a suitable mapping?
+     *
+     * The capturing piece will end up on the captured piece's square, so each legal square for the
+     * captured piece in the current tablebase must be legal for the capturing piece in the
+     * futurebase.
+     *
+     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
+     * its location restriction.
+     */
 
-    for (fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+    do {
+	int piece;
 
-	futurebase = & futurebases[fbnum];
+	for (piece = 0; piece < num_pieces - 1; piece ++) {
+	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
+	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
 
-	max_reflection = compute_reflections(tb, futurebase, reflections);
+	    if (local_piece[piece] != capturing_piece) {
+		if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
+	    } else {
+		if (fb.pieces[piece].piece_type != promoted_pieces[promotion]) break;
+	    }
 
-	next_future_index = 0;
-	backprop_function = nullptr;
+	    /* If we're using pawngen, we've already checked that the pawns match right */
 
-	switch (futurebase->futurebase_type) {
+	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
 
-	case FuturebaseType::Capture:
+	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
 
-	    if (fatal_errors == 0) {
-		backprop_function = &propagate_moves_from_capture_futurebase;
-		doing_capture_backprop = true;
+	    if (fb.invert_colors) {
+		fb_legal_squares = flip_legal_squares(fb_legal_squares);
 	    }
 
-	    break;
-
-	case FuturebaseType::Promotion:
+	    /* For most pieces, check that the legal squares in the futurebase are a superset
+	     * of the legal squares in the local tablebase. */
 
-	    if (fatal_errors == 0) {
+	    if ((local_piece[piece] != capturing_piece)
+		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
+		    != pieces[local_piece[piece]].legal_squares)) break;
 
-		promotion_color = tb->pieces[futurebase->missing_pawn].color;
-		first_back_rank_square = ((promotion_color == PieceColor::White) ? 56 : 0);
-		last_back_rank_square = ((promotion_color == PieceColor::White) ? 63 : 7);
-		promotion_move = ((promotion_color == PieceColor::White) ? 8 : -8);
+	    /* For the capturing and promoting pawn, find its possible promotion-capture squares,
+	     * and make sure the legal squares in the futurebase are a superset of them.
+	     *
+	     * This code ignores frozen pieces that might block a promotion, but this routine is
+	     * essentially an optimisation.  If it returns false, then we need to check every
+	     * position to see if its futuremoves are handled.  Ignoring frozen pieces just means
+	     * that we might need to check those positions by hand, slowing the program down but not
+	     * affecting its proper operation.
+	     */
 
-		backprop_function = &propagate_moves_from_promotion_futurebase;
-		doing_capture_backprop = false;
+	    if (local_piece[piece] == capturing_piece) {
+		uint64_t promotion_squares = possible_capture_squares(capturing_piece);
+		if (pieces[capturing_piece].color == PieceColor::White) {
+		    promotion_squares &= 0xff00000000000000LL;
+		} else {
+		    promotion_squares &= 0x00000000000000ffLL;
+		}
+		promotion_squares &= pieces[captured_piece].legal_squares;
+		if ((fb_legal_squares & promotion_squares) != promotion_squares) break;
 	    }
+	}
 
-	    break;
+	/* We've found a mapping of pieces that meets the above criteria. */
+	if (piece == num_pieces - 1) {
+	    return true;
+	}
 
-	case FuturebaseType::CapturePromotion:
+    } while (std::next_permutation(local_piece, local_piece + num_pieces - 1));
 
-	    if (fatal_errors == 0) {
+    return false;
+}
 
-		promotion_color = tb->pieces[futurebase->missing_pawn].color;
-		first_back_rank_square = ((promotion_color == PieceColor::White) ? 56 : 0);
-		last_back_rank_square = ((promotion_color == PieceColor::White) ? 63 : 7);
-		promotion_move = ((promotion_color == PieceColor::White) ? 8 : -8);
+bool tablebase_t::futurebase_completely_handles_promotion(const tablebase_t& fb, const int promoting_pawn, const int promotion) const
+{
+    if (! futurebase_matches_promotion(fb, promoting_pawn, promotion)) return false;
 
-		backprop_function = &propagate_moves_from_promotion_capture_futurebase;
-		doing_capture_backprop = true;
-	    }
+    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
+     * if our initial pawn positions are identical.
+     */
 
-	    break;
+    if (fb.pawngen) {
+	if (! pawngen) return false;
+	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
+	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
+    }
 
-	case FuturebaseType::Normal:
+    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
+     * to consider all possible such mappings.
+     */
 
-	    if (fatal_errors == 0) {
-		backprop_function = propagate_moves_from_normal_futurebase;
-		doing_capture_backprop = false;
-	    }
+    int local_piece[MAX_PIECES];
 
-	    break;
+    for (int piece = 0; piece < num_pieces; piece ++) {
+	local_piece[piece] = piece;
+    }
 
-	case FuturebaseType::Pawngen:
+    /* Can we find a suitable mapping?
+     *
+     * The capturing piece will end up on the captured piece's square, so each legal square for the
+     * captured piece in the current tablebase must be legal for the capturing piece in the
+     * futurebase.
+     *
+     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
+     * its location restriction.
+     */
 
-	    if (fatal_errors == 0) {
-		backprop_function = propagate_moves_from_pawngen_futurebase;
-		doing_capture_backprop = false;
-	    }
+    do {
+	int piece;
 
-	    break;
+	for (piece = 0; piece < num_pieces; piece ++) {
+	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
+	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
 
-	default:
+	    if (local_piece[piece] != promoting_pawn) {
+		if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
+	    } else {
+		if (fb.pieces[piece].piece_type != promoted_pieces[promotion]) break;
+	    }
 
-	    fatal("Unknown back propagation type for futurebase '%s'\n", futurebase->filename.c_str());
-	    break;
+	    /* If we're using pawngen, we've already checked that the pawns match right */
 
-	}
+	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
 
-	if (backprop_function) {
+	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
 
-	    std::thread t[num_threads];
-	    unsigned int thread;
+	    if (fb.invert_colors) {
+		fb_legal_squares = flip_legal_squares(fb_legal_squares);
+	    }
 
-	    std::string status_message("Back propagating (");
-	    status_message += futurebase_types[futurebase->futurebase_type];
-	    status_message += ") from '";
-	    status_message += futurebase->filename;
-	    status_message += "'";
+	    /* For most pieces, check that the legal squares in the futurebase are a superset
+	     * of the legal squares in the local tablebase. */
 
-	    reset_progress_indicator(status_message.c_str(), futurebase->num_indices);
+	    if ((local_piece[piece] != promoting_pawn)
+		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
+		    != pieces[local_piece[piece]].legal_squares)) break;
 
-	    for (thread = 0; thread < num_threads; thread ++) {
-		t[thread] = std::thread(back_propagate_futurebase_thread, backprop_function);
-	    }
+	    /* For the promoting pawn, find its possible promotion squares and make sure the legal
+	     * squares in the futurebase are a superset of them.
+	     *
+	     * This code ignores frozen pieces that might block a promotion, but this routine is
+	     * essentially an optimisation.  If it returns false, then we need to check every
+	     * position to see if its futuremoves are handled.  Ignoring frozen pieces just means
+	     * that we might need to check those positions by hand, slowing the program down but not
+	     * affecting its proper operation.
+	     */
 
-	    for (thread = 0; thread < num_threads; thread ++) {
-		t[thread].join();
+	    if (local_piece[piece] == promoting_pawn) {
+		uint64_t promotion_squares;
+		if (pieces[promoting_pawn].color == PieceColor::White) {
+		    promotion_squares = (pieces[promoting_pawn].legal_squares & 0x00ff000000000000LL) << 8;
+		} else {
+		    promotion_squares = (pieces[promoting_pawn].legal_squares & 0x000000000000ff00LL) >> 8;
+		}
+		if ((fb_legal_squares & promotion_squares) != promotion_squares) break;
 	    }
+	}
 
-	    end_progress_indicator();
+	/* We've found a mapping of pieces that meets the above criteria. */
+	if (piece == num_pieces) {
+	    return true;
 	}
-    }
 
-    return (fatal_errors == 0);
+    } while (std::next_permutation(local_piece, local_piece + num_pieces));
+
+    return false;
 }
 
-/***** PRUNING *****/
+bool check_pruning(tablebase_t *tb)
+{
+    /* For each possible captured_piece (i.e, everything but the two kings) check for capture
+     * futurebases.  tb->white_king and tb->black_king are -1 for suicide, so all pieces are treated
+     * the same in a suicide analysis.
+     */
 
-/* If we don't want to fully analyze out the tree past the table we're now building, we prune some
- * possible futuremoves.  Of course, this will affect the accuracy of the table; the table is a
- * result of BOTH the position it was set up for AND the pruning decisions (and any pruning
- * decisions made on the futurebases used to calculate this one).
- *
- * We specify pruning in a simple way - by omitting future tables for moves we don't want to
- * consider.  This can be dangerous, so we require this feature to be specifically enabled.  There
- * are two possibilities: moves can be DISCARDED, or victory can be CONCEDED to the side that makes
- * the move.
- *
- * So, if we are white, and assuming that this is a table with a frozen white pawn on e3, we can
- * prune by simply ignoring Pe4 as a possible move.  If there is a black pawn on the g-file, and we
- * don't want to compute out what happens after it queens, we can prune by conceding Pg1=X as a win
- * for black.
- *
- * For example, let's say we're looking at a Q-and-P vs. Q-and-P endgame.  There are four completely
- * mobile pieces (2 Ks and 2 Qs), and this is easy.  But if one of the pawns queens, then we've got
- * a more complex game with five mobile pieces.  But we don't want to completely discard all
- * possible enemy promotions, if we can immediately capture the new queen.  So we construct a
- * special tablebase with a queen frozen on the queening square, concede any move by that queen as a
- * win, then use it as a futurebase.
- *
- * And finally, we want to label in the file header that this pruning was done.  In particular, if
- * we use a pruned tablebase to compute another (earlier) pruned tablebase, we want to make sure the
- * pruning is consistent, i.e. "our" side has to stay the same.  This is guaranteed by explicitly
- * flagging in the XML header which sides can be pruned in which way (concede or discard).
- */
+    for (int captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
 
-bool all_futuremoves_handled = true;
+	if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
 
-/* finalize_futuremove()
- *
- * After all futurebase backpropagation is done, this function is called on each legal position to
- * check if there are any futuremoves that weren't handled by the futurebases.  If so, we either
- * complain or prune, depending on how we're configured.  We don't use commit_update(), and instead
- * call finalize_update() directly, because we're making a pass through the entries array to call
- * finalize_futuremove(), and can thus update the entry directly, without going through a proptable.
- */
+	/* If we're not encoding side-to-move, then all of the positions in the tablebase are WHITE
+	 * to move positions, so we don't care if the captured piece is WHITE.
+	 */
 
-void finalize_futuremove(tablebase_t *tb, index_t index, futurevector_t futurevector) {
+	if ((! tb->encode_stm) && (tb->pieces[captured_piece].color == PieceColor::White)) continue;
 
-    unsigned int futuremove;
-    PieceColor stm = index_to_side_to_move(tb, index);
+	int futurebase_cnt = 0;
 
-    if (futurevector & unpruned_futuremoves[stm]) {
-	global_position_t global;
-	index_to_global_position(tb, index, &global);
-	fatal("Futuremoves not handled: %" PRIindex " %s", index, global_position_to_FEN(&global));
-	for (futuremove = 0; futuremove < num_futuremoves[stm]; futuremove ++) {
-	    if (futurevector & FUTUREVECTOR(futuremove)	& unpruned_futuremoves[stm]) {
-		fatal(" %s", movestr[stm][futuremove]);
+	for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+	    if (tb->futurebase_matches_capture(futurebases[fbnum], captured_piece)) {
+		futurebase_cnt ++;
 	    }
 	}
-	fatal("\n");
-	all_futuremoves_handled = false;
-    }
 
-    /* concede - we treat these unhandled futuremoves as forced wins for PTM.  We update the entry
-     * with DTM=2 (mate in one) and movecnt=1 (doesn't matter for a PTM win).
-     */
+	/* If no such futurebase exists, then for every other piece, see if the piece restrictions
+	 * would permit it to capture the original piece in question.  If so, there must be a prune
+	 * statement, or it's an error.  On the other hand, if a futurebase handles all of our
+	 * captures, then it must be the only matching futurebase.
+	 */
 
-    if (futurevector & conceded_futuremoves[stm]) {
-	finalize_update(index, 2, 1, NO_FUTUREMOVE);
-    }
+	for (int capturing_piece = 0; capturing_piece < tb->num_pieces; capturing_piece ++) {
 
-    /* discard - we ignore these unhandled futuremoves by updating with DTM=0, which decrements
-     * movecnt by position.multiplicity, because we multiplied movecnt by position.multiplicity when
-     * we initialized the entry.
-     *
-     * XXX Can't test the use of position.multiplicity because we currently can't have piece
-     * restrictions with symmetric tablebases, we need 8-way symmetry to get multiplicity, and we
-     * need piece restrictions to get a futurebase where only some futuremoves are handled.
-     */
+	    if (futurecaptures[capturing_piece][captured_piece] == NO_FUTUREMOVE) continue;
+	    if (futurecaptures[capturing_piece][captured_piece] == RESIGN_FUTUREMOVE) continue;
 
-    if (futurevector & discarded_futuremoves[stm]) {
-	for (futuremove = 0; futuremove < num_futuremoves[stm]; futuremove ++) {
-	    if (futurevector & FUTUREVECTOR(futuremove) & discarded_futuremoves[stm]) {
+	    if (futurecaptures[capturing_piece][captured_piece] < 0) {
+		fatal("futurecaptures (%d) < 0 but not NO_FUTUREMOVE!\n", futurecaptures[capturing_piece][captured_piece]);
+	    }
 
-		local_position_t position(tb);
+	    if (futurebase_cnt == 0) {
 
-		index_to_local_position(tb, index, REFLECTION_NONE, &position);
+		if (discarded_futuremoves[tb->pieces[capturing_piece].color]
+		    & FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece])) {
+		    futurecaptures[capturing_piece][captured_piece] = DISCARD_FUTUREMOVE;
+		} else if (conceded_futuremoves[tb->pieces[capturing_piece].color]
+			   & FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece])) {
+		    futurecaptures[capturing_piece][captured_piece] = CONCEDE_FUTUREMOVE;
+		} else {
+		    fatal("No futurebase or pruning for %s move %s\n",
+			  colors.at(tb->pieces[capturing_piece].color).c_str(),
+			  movestr[tb->pieces[capturing_piece].color][futurecaptures[capturing_piece][captured_piece]]);
+		    return false;
+		}
 
-		finalize_update(index, 0, position.multiplicity, NO_FUTUREMOVE);
+	    } else {
+		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+		    if (tb->futurebase_completely_handles_capture(futurebases[fbnum], capturing_piece, captured_piece)) {
+
+			if (futurebase_cnt > 1) {
+			    fatal("Multiple futurebases handle %s move %s\n",
+				  colors.at(tb->pieces[capturing_piece].color).c_str(),
+				  movestr[tb->pieces[capturing_piece].color][futurecaptures[capturing_piece][captured_piece]]);
+			    return false;
+			}
+			if (futurecaptures[capturing_piece][captured_piece] >= 0) {
+			    handled_futuremoves[tb->pieces[capturing_piece].color] |= FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece]);
+			    futurecaptures[capturing_piece][captured_piece] = HANDLED_FUTUREMOVE;
+			}
+			break;
+		    }
+		}
 	    }
 	}
     }
-}
-
-/* have_all_futuremoves_been_handled() - this is the non-proptable case to run through the entries
- * table and call finalize_futuremove()
- */
-
-bool have_all_futuremoves_been_handled(tablebase_t *tb) {
-
-    if (ignore_futurevectors) return true;
-
-    if (tb->futurevector_bits == 0) return true;
-
-    index_t index;
-
-    /* XXX this code is probably inefficient, and though it appears to assume a little-endian
-     * architecture, I've tried to do it the same way everywhere, so I think it should work no
-     * matter the endianness.  Might have alignment problems, though.
-     */
 
-    for (index = 0; index < tb->num_indices; index ++) {
-	if (entriesTable[index].get_DTM() != 1) {
-	    long long bit_offset = ((long long)index * current_tb->futurevector_bits);
-	    futurevector_t futurevector = *((futurevector_t *)(current_tb->futurevectors + (bit_offset >> 3)));
+    /* Pawns - check for both promotion and promotion capture futurebases here.  Same idea. */
 
-	    futurevector >>= bit_offset & 7;
-	    futurevector &= (1 << current_tb->futurevector_bits) - 1;
-	    finalize_futuremove(tb, index, futurevector);
-	}
-    }
+    for (int pawn = 0; pawn < tb->num_pieces; pawn ++) {
 
-    return all_futuremoves_handled;
-}
+	int promotion;
 
-/* assign_pruning_statement() - a helper function for compute_pruned_futuremoves()
- *
- * searches the tablebase's XML pruning statements for one matching (more or less identically) the
- * specified color and string.  If there is a match, set the corresponding bit in the
- * pruned_futuremoves bit vector.  The function can be called more than once for a given bit, but
- * probably shouldn't be.  For example, the function might be called on the same bit for "PxQ=Q" if
- * there are two pawns that can promote into a queen.  UNIX-style wildcards are allowed, so "Kd4"
- * would match against "Kd4", "Kd?", "K?4", "K[a-d]4", or "K*".  The function also allows a trailing
- * "any" in the prune statement to act as a "*" wildcard for backwards compatibility.
- *
- * If there are multiple prune statements that match a given futuremove, it's a warning if they are
- * of the same type; a fatal error if their types are different.
- */
+	if (tb->pieces[pawn].piece_type != PieceType::Pawn) continue;
 
-int match_pruning_statement(tablebase_t *tb, PieceColor color, const char *pruning_statement)
-{
-    xmlpp::NodeSet result;
-    int type = RESTRICTION_NONE;
+	if ((! tb->encode_stm) && (tb->pieces[pawn].color == PieceColor::Black)) continue;
 
-    result = tb->xml->get_root_node()->find("//prune");
+	/* First, we're looking for promotion capture futurebases. */
 
-    for (auto prune = result.begin(); prune != result.end(); prune ++) {
+	for (int captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
 
-	Glib::ustring prune_color = (*prune)->eval_to_string("@color");
-	Glib::ustring prune_move = (*prune)->eval_to_string("@move");
-	Glib::ustring prune_type = (*prune)->eval_to_string("@type");
+	    if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
 
-	/* Trailing 'any' is an older syntax that means '*' */
+	    /* Check to see if the pawn can even be on a square where a promotion capture is
+	     * possible.
+	     */
 
-	auto pos = prune_move.find("any");
-	if (pos != std::string::npos) {
-	    prune_move.replace(pos, std::string::npos, "*");
-	}
+	    if (tb->pieces[pawn].color == PieceColor::White) {
+		if (! (tb->pieces[pawn].legal_squares & 0x00ff000000000000LL)) break;
+	    } else {
+		if (! (tb->pieces[pawn].legal_squares & 0x000000000000ff00LL)) break;
+	    }
 
-	if ((colors.at(prune_color) == color)
-	    && (fnmatch(prune_move.c_str(), pruning_statement, FNM_CASEFOLD) == 0)) {
+	    /* Check to see that the other piece can be on a square where it could be promotion
+	     * captured.  It's still possible that the other piece could be on a back rank, but
+	     * never on a square where it could be captured by the pawn, but we leave that
+	     * possibility unchecked.  It'd probably be best to tie this code in with the code in
+	     * assign_numbers_to_futuremoves() - maybe by flagging which captures it was determined
+	     * that promotion was possible in?
+	     */
 
-	    if (type == RESTRICTION_NONE) {
-		type = restriction_types.at(prune_type);
-	    } else if (type != restriction_types.at(prune_type)) {
-		fatal("Conflicting %s pruning statements match futuremove %s\n",
-		      colors.at(color).c_str(), pruning_statement);
+	    if (tb->pieces[pawn].color == PieceColor::White) {
+		if (! (tb->pieces[captured_piece].legal_squares & 0xff00000000000000LL)) continue;
 	    } else {
-		warning("Multiple %s pruning statements match futuremove %s\n",
-			colors.at(color).c_str(), pruning_statement);
+		if (! (tb->pieces[captured_piece].legal_squares & 0x00000000000000ffLL)) continue;
 	    }
-	}
-    }
 
-    return type;
-}
+	    /* check all futurebases for a 'promotion capture' with captured_piece missing */
 
-void assign_pruning_statement(tablebase_t *tb, PieceColor color, int futuremove)
-{
-    int type;
-    const char * pruning_statement = movestr[color][futuremove];
+	    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-    if (futuremove == -1) return;
+		int futurebase_cnt = 0;
 
-    pruning_statement = movestr[color][futuremove];
+		if (promotion_captures[pawn][captured_piece][promotion] < 0) continue;
 
-    type = match_pruning_statement(tb, color, pruning_statement);
+		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+		    if (tb->futurebase_matches_capture_promotion(futurebases[fbnum], captured_piece, promotion)) {
+			futurebase_cnt ++;
+		    }
+		}
 
-    if (type != RESTRICTION_NONE) {
+		/* If no such futurebase exists, then there must be a prune statement, or it's an
+		 * error.
+		 */
 
-	if (pruned_futuremoves[color] & FUTUREVECTOR(futuremove)) {
-	    warning("Multiple pruning statements ('%s') match a futuremove\n", pruning_statement);
-	}
+		if (futurebase_cnt == 0) {
 
-	pruned_futuremoves[color] |= FUTUREVECTOR(futuremove);
+		    if (discarded_futuremoves[tb->pieces[pawn].color]
+			& FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion])) {
+			promotion_captures[pawn][captured_piece][promotion] = DISCARD_FUTUREMOVE;
+		    } else if (conceded_futuremoves[tb->pieces[pawn].color]
+			       & FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion])) {
+			promotion_captures[pawn][captured_piece][promotion] = CONCEDE_FUTUREMOVE;
+		    } else {
+			fatal("No futurebase or pruning for %s move %s\n",
+			      colors.at(tb->pieces[pawn].color).c_str(),
+			      movestr[tb->pieces[pawn].color][promotion_captures[pawn][captured_piece][promotion]]);
+			return false;
+		    }
 
-	if (type == RESTRICTION_CONCEDE) {
-	    conceded_futuremoves[color] |= FUTUREVECTOR(futuremove);
-	    if (discarded_futuremoves[color] & FUTUREVECTOR(futuremove)) {
-		fatal("Conflicting pruning statements ('%s') match a futuremove\n",
-		      pruning_statement);
-	    }
-	}
-	if (type == RESTRICTION_DISCARD) {
-	    discarded_futuremoves[color] |= FUTUREVECTOR(futuremove);
-	    if (conceded_futuremoves[color] & FUTUREVECTOR(futuremove)) {
-		fatal("Conflicting pruning statements ('%s') match a futuremove\n",
-		      pruning_statement);
-	    }
-	}
-    }
-}
+		} else {
 
-/* assign_numbers_to_futuremoves()
- *
- * We could just dismiss any moves that aren't handled by our futurebases, but I've found this to be
- * a source of error, since moves tend to get overlooked this way.  We're also concerned with the
- * more sobering possibility of a single move getting processed twice by two different futurebases.
- *
- * So we assign numbers, bit positions in a bit vector, actually, to each futuremove.  When we
- * initialize the tablebase, we set bits in the vector (each position has its own vector) for each
- * futuremove possible from that position.  As we back propagate futuremoves, we check the bit to
- * make sure it's still set, then clear it.  After we've back propagated all the futurebases, we run
- * through the entire tablebase, making sure that the only bits that remain set correspond to prune
- * statements.
- *
- * This function not only assigns the numbers, but also prints an identifying string, such as "KxP"
- * or "Re4", into the movestr array for each number assigned.  This string will then be matched
- * against the pruning statements specified in the configuration file.  Sometimes the strings will
- * repeat.  For example, if we have two pawns and an enemy queen, we'll probably end up with two
- * different bit positions, both assigned as "QxP".  The reason is that there are probably positions
- * where the queen could take either pawn, so both possibilities have to be tracked.
- *
- * Because we need a "futurevector" for each position in the tablebase, we want to keep it as small
- * as possible, so we try to use as few bit positions as possible.  In particular, we track white
- * and black futuremoves seperately (since from a given position only one or the other will be
- * possible) and we try to reuse bit positions for pawn capture-promotions if the pawns are
- * sufficiently restricted so that only one or the other could capture the enemy piece in a given
- * position.
- */
+		    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+			if (tb->futurebase_completely_handles_capture_promotion(futurebases[fbnum], pawn, captured_piece, promotion)) {
 
-void assign_numbers_to_futuremoves(tablebase_t *tb) {
+			    if (futurebase_cnt > 1) {
+				fatal("Multiple futurebases handle %s move %s\n",
+				      colors.at(tb->pieces[pawn].color).c_str(),
+				      movestr[tb->pieces[pawn].color][promotion_captures[pawn][captured_piece][promotion]]);
+				return false;
+			    }
+			    if (promotion_captures[pawn][captured_piece][promotion] >= 0) {
+				handled_futuremoves[tb->pieces[pawn].color] |= FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion]);
+				promotion_captures[pawn][captured_piece][promotion] = HANDLED_FUTUREMOVE;
+			    }
+			    break;
+			}
+		    }
+		}
 
-    int piece;
-    int captured_piece;
-    int capturing_piece;
-    int sq;
-    int promotion;
-    uint64_t possible_captures[MAX_PIECES];
-    char local_movestr[MOVESTR_CHARS];
-    int futurebase_cnt;
-    int fbnum;
+	    }
+	}
 
-    /* Start by computing a board vector (possible_captures) showing all possible squares where each
-     * piece can capture onto.
-     */
+	/* straight promotion futurebases */
 
-    for (piece = 0; piece < tb->num_pieces; piece ++) {
+	for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-	possible_captures[piece] = 0;
+	    if (promotions[pawn][promotion] < 0) continue;
 
-	for (sq = 0; sq < 64; sq ++) {
+	    int futurebase_cnt = 0;
 
-	    /* We make the checks here using legal_squares and not semilegal_squares because
-	     * we're assigning futuremove numbers to individual pieces that can capture.  The
-	     * movements we consider here, being captures, would take us to a futurebase anyway,
-	     * so there's no question of whether the resulting position is fully legal or not.
-	     */
+	    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+		if (tb->futurebase_matches_promotion(futurebases[fbnum], pawn, promotion)) {
+		    futurebase_cnt ++;
+		}
+	    }
 
-	    if (tb->pieces[piece].legal_squares & BITVECTOR(sq)) {
+	    if (futurebase_cnt == 0) {
 
-		for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-					   current_tb->pieces[piece].color,
-					   sq,
-					   Movement::Forward, Movement::Capture)) {
+		if (discarded_futuremoves[tb->pieces[pawn].color] & FUTUREVECTOR(promotions[pawn][promotion])) {
+		    promotions[pawn][promotion] = DISCARD_FUTUREMOVE;
+		} else if (conceded_futuremoves[tb->pieces[pawn].color] & FUTUREVECTOR(promotions[pawn][promotion])) {
+		    promotions[pawn][promotion] = CONCEDE_FUTUREMOVE;
+		} else {
+		    fatal("No futurebase or pruning for %s move %s\n",
+			  colors.at(tb->pieces[pawn].color).c_str(),
+			  movestr[tb->pieces[pawn].color][promotions[pawn][promotion]]);
+		    return false;
+		}
 
-		    for (auto &movement : dir) {
+	    } else {
 
-			possible_captures[piece] |= BITVECTOR(movement);
+		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+		    if (tb->futurebase_completely_handles_promotion(futurebases[fbnum], pawn, promotion)) {
 
-			/* If we hit a frozen piece, then this movement direction ends here */
-			if (BITVECTOR(movement) & tb->frozen_pieces_vector) break;
+			if (futurebase_cnt > 1) {
+			    fatal("Multiple futurebases handle %s move %s\n",
+				  colors.at(tb->pieces[pawn].color).c_str(),
+				  movestr[tb->pieces[pawn].color][promotions[pawn][promotion]]);
+			    return false;
+			}
+			if (promotions[pawn][promotion] >= 0) {
+			    handled_futuremoves[tb->pieces[pawn].color] |= FUTUREVECTOR(promotions[pawn][promotion]);
+			    promotions[pawn][promotion] = HANDLED_FUTUREMOVE;
+			}
+			break;
 		    }
 		}
 	    }
 	}
     }
 
-    /* Now, consider all possible pairs of pieces that might capture, and assign a number (in the
-     * futurecaptures array) to each pair.  We'll ultimately use this number as an index into a bit
-     * vector to determine if this capture has been handled in any particular position.  However,
-     * there's a common enough "special" case: the two pieces are frozen (or at least sufficiently
-     * restricted) so that the capture can never occur.  Go to the trouble of checking for this.
+    /* Check for any futurebases that match our piece types exactly.  It (or they) must correspond
+     * to restricted piece movements.
      */
 
-    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
-
-	if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
-
-	for (capturing_piece = 0; capturing_piece < tb->num_pieces; capturing_piece ++) {
+    int futurebase_cnt = 0;
 
-	    /* If this is a suicide analysis and we can capture a player's only (i.e, last) piece,
-	     * we lose.  Treat this just like a 'resign' prune, except that we don't need prune or
-	     * prune-enable statements, since these are the rules of the game!
-	     */
+    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
+	if (futurebases[fbnum].futurebase_type == FuturebaseType::Normal) {
+	    futurebase_cnt ++;
+	}
+    }
 
-	    if ((tb->variant == Variant::Suicide) && (tb->num_pieces_by_color[tb->pieces[captured_piece].color] == 1)) {
+    /* I'd like to construct a mask of all allowable squares for each color and type of piece, and
+     * verify that the futurebases or pruning actually account for all possible restricted
+     * movements.  This would let me catch early things like forgetting to specify a g4 tablebase
+     * for a pawn frozen on g2.  For now, we only check for missing pruning if there are no "normal"
+     * futurebases at all.
+     */
 
-		futurecaptures[capturing_piece][captured_piece] = RESIGN_FUTUREMOVE;
+    if (futurebase_cnt == 0) {
+	for (int piece = 0; piece < tb->num_pieces; piece ++) {
+	    if ((! tb->encode_stm) && (tb->pieces[piece].color == PieceColor::Black)) continue;
+	    for (int sq = 0; sq < 64; sq ++) {
+		if (futuremoves[piece][sq] >= 0) {
 
-		for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-		    promotion_captures[capturing_piece][captured_piece][promotion] = RESIGN_FUTUREMOVE;
+		    if (! (pruned_futuremoves[tb->pieces[piece].color] & FUTUREVECTOR(futuremoves[piece][sq]))) {
+			fatal("No futurebase or pruning for %s move %s\n",
+			      colors.at(tb->pieces[piece].color).c_str(),
+			      movestr[tb->pieces[piece].color][futuremoves[piece][sq]]);
+			return false;
+		    }
 		}
-
-		continue;
 	    }
+	}
+    }
 
-	    futurecaptures[capturing_piece][captured_piece] = NO_FUTUREMOVE;
+    return true;
+}
 
-	    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-		promotion_captures[capturing_piece][captured_piece][promotion] = NO_FUTUREMOVE;
-	    }
 
-	    if (tb->pieces[capturing_piece].color == tb->pieces[captured_piece].color) continue;
+/* optimize_futuremoves()
+ *
+ * Once we've assigned futuremove numbers, then gone and checked pruning, some of those futuremoves
+ * might now be completely pruned, and their numbers were changed to DISCARD_FUTUREMOVE,
+ * CONCEDE_FUTUREMOVE, RESIGN_FUTUREMOVE or HANDLED_FUTUREMOVE.  Find any unused numbers and
+ * collapse the remaining futuremoves down into a smaller set.
+ */
 
-	    if (tb->pieces[capturing_piece].piece_type != PieceType::Pawn) {
+void initialize_futuremoves(tablebase_t *tb)
+{
+    for (int piece = 0; piece < tb->num_pieces; piece ++) {
 
-		if (possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares) {
+	for (int piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
 
-		    sprintf(local_movestr, "%cx%c",
-			    piece_char[tb->pieces[capturing_piece].piece_type],
-			    piece_char[tb->pieces[captured_piece].piece_type]);
+	    futurecaptures[piece][piece2] = NO_FUTUREMOVE;
 
-		    movestr[tb->pieces[capturing_piece].color]
-			[num_futuremoves[tb->pieces[capturing_piece].color]]
-			= strdup(local_movestr);
+	    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+		promotion_captures[piece][piece2][promotion] = NO_FUTUREMOVE;
+	    }
+	}
 
-		    futurecaptures[capturing_piece][captured_piece]
-			= num_futuremoves[tb->pieces[capturing_piece].color] ++;
-		}
+	for (square_t sq = 0; sq < 64; sq ++) {
+	    futuremoves[piece][sq] = NO_FUTUREMOVE;
+	}
 
-	    } else {
+	for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+	    promotions[piece][promotion] = NO_FUTUREMOVE;
+	}
+    }
+}
 
-		/* if it's a pawn-takes-pawn situation, check for en passant as well */
+void remove_futuremove(futurevector_t *fvp, int fm)
+{
+    *fvp = ((*fvp) & (FUTUREVECTOR(fm)-1)) | (((*fvp) & ~(FUTUREVECTOR(fm+1)-1)) >> 1);
+}
 
-		if ((possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares)
-		    | ((tb->pieces[captured_piece].piece_type == PieceType::Pawn)
-		       && (((tb->pieces[capturing_piece].color == PieceColor::White)
-			    ? ((possible_captures[capturing_piece] & 0x0000ff0000000000LL) >> 8)
-			    : ((possible_captures[capturing_piece] & 0x0000000000ff0000LL) << 8))
-			   & tb->pieces[captured_piece].legal_squares))) {
+void optimize_futuremoves(tablebase_t *tb)
+{
+    int fm, fm2, piece, piece2, sq, promotion;
 
-		    int candidate_futuremove = NO_FUTUREMOVE;
+    for (auto color : BothColors) {
 
-		    /* start by dishing out a non-promotion futurecapture */
+	for (fm = 0; fm < (int) num_futuremoves[color]; fm++) {
 
-		    sprintf(local_movestr, "%cx%c",
-			    piece_char[tb->pieces[capturing_piece].piece_type],
-			    piece_char[tb->pieces[captured_piece].piece_type]);
+	    bool optimize_this_futuremove = true;
 
-		    movestr[tb->pieces[capturing_piece].color]
-			[num_futuremoves[tb->pieces[capturing_piece].color]]
-			= strdup(local_movestr);
+	    /* XXX make this a subroutine */
 
-		    futurecaptures[capturing_piece][captured_piece]
-			= num_futuremoves[tb->pieces[capturing_piece].color] ++;
+	    for (piece = 0; piece < tb->num_pieces; piece ++) {
 
-		    /* Keep going only if it's a pawn capture that results in promotion */
+		if (tb->pieces[piece].color != color) continue;
 
-		    if (! (possible_captures[capturing_piece] & tb->pieces[captured_piece].legal_squares
-			   & ((tb->pieces[capturing_piece].color == PieceColor::White)
-			      ? 0xff00000000000000LL : 0x00000000000000ffLL))) {
-			continue;
+		for (piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
+		    if (futurecaptures[piece][piece2] == fm) {
+			optimize_this_futuremove = false;
+			break;
 		    }
-
+		    if (tb->pieces[piece].piece_type == PieceType::Pawn) {
+			for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+			    if (promotion_captures[piece][piece2][promotion] == fm) {
+				optimize_this_futuremove = false;
+				break;
+			    }
+			}
+		    }
+		}
+		for (sq = 0; sq < 64; sq ++) {
+		    if (futuremoves[piece][sq] == fm) {
+			optimize_this_futuremove = false;
+			break;
+		    }
+		}
+		if (tb->pieces[piece].piece_type == PieceType::Pawn) {
 		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+			if (promotions[piece][promotion] == fm) {
+			    optimize_this_futuremove = false;
+			    break;
+			}
+		    }
+		}
+	    }
 
-			candidate_futuremove = NO_FUTUREMOVE;
 
-			sprintf(local_movestr, "Px%c=%c",
-				piece_char[tb->pieces[captured_piece].piece_type],
-				piece_char[promoted_pieces[promotion]]);
+	    if (optimize_this_futuremove) {
 
-			/* Be conservative about handing out bit positions in the futurevector.
-			 * Look through the other pieces that have been assigned bit positions and
-			 * see if we can find one with an identical movestr that can never capture
-			 * onto the squares that our piece can capture onto and reuse its bit
-			 * positions.
-			 *
-			 * This code could be a lot more aggressively conservative, but for now I
-			 * settle for handling the common simple case of pawns more than two files
-			 * apart never being able to capture the same piece.  I only look at
-			 * futuremoves for the current captured_piece, and only so far as the
-			 * current capturing_piece.  That's why the nesting order of the two
-			 * captured_piece and capturing_piece loops is important above.  First we
-			 * look for a candidate futuremove, then we try to bust it by looking for
-			 * overlaps.
-			 */
+		for (piece = 0; piece < tb->num_pieces; piece ++) {
 
-			for (piece = 0; piece < capturing_piece; piece ++) {
-			    if (tb->pieces[piece].color != tb->pieces[capturing_piece].color) continue;
-			    if (promotion_captures[piece][captured_piece][promotion] != NO_FUTUREMOVE) {
-				if ((! (possible_captures[capturing_piece] & possible_captures[piece]))
-				    && (! strcmp(local_movestr, movestr[tb->pieces[piece].color][promotion_captures[piece][captured_piece][promotion]]))) {
-				    candidate_futuremove = promotion_captures[piece][captured_piece][promotion];
-				}
-			    }
-			}
+		    if (tb->pieces[piece].color == color) {
 
-			if (candidate_futuremove != NO_FUTUREMOVE) {
-			    for (piece = 0; piece < capturing_piece; piece ++) {
-				if (tb->pieces[piece].color != tb->pieces[capturing_piece].color) continue;
-				if (! (possible_captures[capturing_piece] & possible_captures[piece])) continue;
-				if (promotion_captures[piece][captured_piece][promotion] != NO_FUTUREMOVE) {
-				    if (promotion_captures[piece][captured_piece][promotion] == candidate_futuremove) {
-					candidate_futuremove = NO_FUTUREMOVE;
-					break;
+			for (piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
+			    if (futurecaptures[piece][piece2] > fm) {
+				futurecaptures[piece][piece2] --;
+			    }
+			    if (tb->pieces[piece].piece_type == PieceType::Pawn) {
+				for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+				    if (promotion_captures[piece][piece2][promotion] > fm) {
+					promotion_captures[piece][piece2][promotion] --;
 				    }
 				}
 			    }
 			}
 
-			if (candidate_futuremove == NO_FUTUREMOVE) {
-			    candidate_futuremove = num_futuremoves[tb->pieces[capturing_piece].color] ++;
-			    movestr[tb->pieces[capturing_piece].color][candidate_futuremove] = strdup(local_movestr);
+			for (sq = 0; sq < 64; sq ++) {
+			    if (futuremoves[piece][sq] > fm) {
+				futuremoves[piece][sq] --;
+			    }
 			}
 
-			promotion_captures[capturing_piece][captured_piece][promotion] = candidate_futuremove;
+			if (tb->pieces[piece].piece_type == PieceType::Pawn) {
+			    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+				if (promotions[piece][promotion] > fm) {
+				    promotions[piece][promotion] --;
+				}
+			    }
+			}
 		    }
 		}
-	    }
-	}
-    }
-
-    /* We also want to consider all promotions.  We don't wrap this into the pawn code that follows
-     * because we want to count all promotions together, not a set for each destination square.
-     * This is a special case of a more general problem that this code doesn't address yet.  We want
-     * to minimize the assigned numbers to keep the futuremove bit vector small, so we want to reuse
-     * those numbers if we're sure that two moves can't happen from different squares.  I.e, if a
-     * king is restricted to the f1/h3 rectangle, then it can move to e1 from f1 and it can move to
-     * h4 from h3, but there is no single position from which it can move to both e1 and h4.  So we
-     * can use the same position in the bit vector for Ke1 and Kh4.  But we don't (yet).
-     */
-
-    for (piece = 0; piece < tb->num_pieces; piece ++) {
-	for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-	    promotions[piece][promotion] = NO_FUTUREMOVE;
-	}
-	if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-	    for (sq = (tb->pieces[piece].color == PieceColor::White ? 48 : 8);
-		 sq <= (tb->pieces[piece].color == PieceColor::White ? 55 : 15); sq++) {
-		if (tb->pieces[piece].legal_squares & BITVECTOR(sq)) {
 
-		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-			promotions[piece][promotion] = num_futuremoves[tb->pieces[piece].color];
-			sprintf(local_movestr, "P=%c", piece_char[promoted_pieces[promotion]]);
-			movestr[tb->pieces[piece].color][promotions[piece][promotion]] = strdup(local_movestr);
-			num_futuremoves[tb->pieces[piece].color] ++;
-		    }
-
-		    break;
+		if (pruned_futuremoves[color] & FUTUREVECTOR(fm)) {
+		    info("Pruned %s futuremove %s\n", colors.at(color).c_str(), movestr[color][fm]);
+		} else if (handled_futuremoves[color] & FUTUREVECTOR(fm)) {
+		    info("%s futuremove %s completely handled by futurebases\n", colors.at(color).c_str(), movestr[color][fm]);
+		} else {
+		    info("Optimized %s futuremove %s, but not sure how!\n", colors.at(color).c_str(), movestr[color][fm]);
 		}
-	    }
-	}
-    }
-
-    /* And now all piece moves outside their restriction.  We record a futuremove for each possible
-     * destination square that the piece can reach outside its move restriction, unless we've
-     * determined that there are no "normal" futurebases, in which case we flag the pruning right
-     * here and now.
-     */
-
-    futurebase_cnt = 0;
-
-    for (fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-	if (futurebases[fbnum].futurebase_type == FuturebaseType::Normal) futurebase_cnt ++;
-    }
-
-    for (piece = 0; piece < tb->num_pieces; piece ++) {
-
-	for (sq = 0; sq < 64; sq ++) futuremoves[piece][sq] = NO_FUTUREMOVE;
-
-	for (sq = 0; sq < 64; sq ++) {
-
-	    /* Consider as _starting_ squares only those within the piece's movement restriction */
-
-	    if (! (tb->pieces[piece].legal_squares & BITVECTOR(sq))) continue;
 
-	    for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-				       current_tb->pieces[piece].color,
-				       sq,
-				       Movement::Forward, Movement::NonCapture)) {
+		remove_futuremove(&(pruned_futuremoves[color]), fm);
+		remove_futuremove(&(unpruned_futuremoves[color]), fm);
+		remove_futuremove(&(conceded_futuremoves[color]), fm);
+		remove_futuremove(&(discarded_futuremoves[color]), fm);
+		remove_futuremove(&(handled_futuremoves[color]), fm);
 
-		for (auto &movement : dir) {
+		// free(movestr[color][fm]);
 
-		    /* If we hit a frozen piece, movement has to stop.  We don't consider captures
-		     * here; they were handled above.
-		     */
+		for (fm2 = fm + 1; fm2 < (int) num_futuremoves[color]; fm2++) {
+		    movestr[color][fm2-1] = movestr[color][fm2];
+		}
 
-		    if (BITVECTOR(movement) & tb->frozen_pieces_vector) break;
+		num_futuremoves[color] --;
+		fm --;
+	    }
+	}
+    }
+}
 
-		    /* If the piece is moving outside its semilegal squares, it's a futuremove.  If
-		     * it's moving from a legal square to a semilegal square, it's also a
-		     * futuremove... except for a special case.  Obviously the other piece in its
-		     * semilegal group can't be on either the square it's moving from or the square
-		     * it's moving to (no other piece can be).  If all remaining legal squares
-		     * available to that other piece are also legal squares for this piece, then we
-		     * can always successfully flip the two pieces and this isn't a futuremove.  The
-		     * converse is that there must be at least one legal square available to the
-		     * other piece that isn't a legal square for this piece; in other words, this
-		     * piece must have another semilegal square that isn't legal.
-		     */
+/***** INTRA-TABLE MOVE PROPAGATION *****/
 
-		    if (!(tb->pieces[piece].semilegal_squares & BITVECTOR(movement))
+/* We've got a move that needs to be propagated, so we back out one half-move to all of the
+ * positions that could have gotten us here and update their counters in various obscure ways.
+ */
 
-			|| (!(tb->pieces[piece].legal_squares & BITVECTOR(movement))
-			    && ( tb->pieces[piece].semilegal_squares & ~(tb->pieces[piece].legal_squares)
-				 & ~BITVECTOR(movement) & ~BITVECTOR(sq) ))) {
+void propagate_one_minimove_within_table(tablebase_t *tb, index_t future_index, local_position_t *current_position)
+{
+    index_t current_index;
+    int dtm = entriesTable[future_index].get_DTM();
 
-			if (futuremoves[piece][movement] == NO_FUTUREMOVE) {
+    current_index = local_position_to_index(tb, current_position);
 
-			    sprintf(local_movestr, "%c%c%c", piece_char[tb->pieces[piece].piece_type],
-				    'a' + COL(movement), '1' + ROW(movement));
+    if (current_index == INVALID_INDEX) {
 
-			    if (futurebase_cnt > 0) {
-				futuremoves[piece][movement]
-				    = num_futuremoves[tb->pieces[piece].color];
-				movestr[tb->pieces[piece].color][num_futuremoves[tb->pieces[piece].color]]
-				    = strdup(local_movestr);
-				num_futuremoves[tb->pieces[piece].color] ++;
-			    } else {
-				switch (match_pruning_statement(tb, tb->pieces[piece].color,
-								local_movestr)) {
-				case RESTRICTION_DISCARD:
-				    futuremoves[piece][movement] = DISCARD_FUTUREMOVE;
-				    break;
-				case RESTRICTION_CONCEDE:
-				    futuremoves[piece][movement] = CONCEDE_FUTUREMOVE;
-				    break;
-				}
-			    }
-			}
-		    }
-		}
-	    }
+	if (future_index == debug_move) {
+	    info("propagate_one_minimove_within_table:  current_index=INVALID"
+		 "; future_index=%" PRIindex "; dtm=%d\n",
+		 future_index, dtm);
 	}
-    }
 
-    info("%d possible WHITE futuremoves\n", num_futuremoves[PieceColor::White]);
-    if (tb->encode_stm) {
-	info("%d possible BLACK futuremoves\n", num_futuremoves[PieceColor::Black]);
-    } else {
-	num_futuremoves[PieceColor::Black] = 0;
+	return;
     }
 
-    if (num_futuremoves[PieceColor::White] > sizeof(futurevector_t)*8) {
-	fatal("Too many futuremoves - %d!  (only %d bits futurevector_t)\n",
-	      num_futuremoves[PieceColor::White], sizeof(futurevector_t)*8);
-	terminate();
+    if ((current_index == debug_move) || (future_index == debug_move)) {
+	info("propagate_one_minimove_within_table:  current_index=%"
+	     PRIindex "; future_index=%" PRIindex "; dtm=%d\n",
+	     current_index, future_index, dtm);
     }
-    if (num_futuremoves[PieceColor::Black] > sizeof(futurevector_t)*8) {
-	fatal("Too many futuremoves - %d!  (only %d bits futurevector_t)\n",
-	      num_futuremoves[PieceColor::Black], sizeof(futurevector_t)*8);
-	terminate();
+
+    /* Parent position is the FUTURE position.  We now back-propagate to
+     * the current position, which is the PAST position.
+     *
+     * If the player to move in the FUTURE position wins, then we add one to that
+     * player's win count in the PAST position.  On other other hand, if the player not
+     * to move in the FUTURE position wins, then the player to move in the PAST position
+     * has a winning move (the one we're considering).
+     */
+
+    if (dtm > 0) {
+	commit_update(current_index, -dtm, 1, NO_FUTUREMOVE);
+    } else if (dtm < 0) {
+	commit_update(current_index, -dtm+1, 1, NO_FUTUREMOVE);
+    } else if (entriesTable[future_index].does_PTM_win()) {
+	commit_update(current_index, -2, 1, NO_FUTUREMOVE);
+    } else if (entriesTable[future_index].does_PNTM_win()) {
+	commit_update(current_index, 2, 1, NO_FUTUREMOVE);
+    } else {
+	fatal("Intra-table back prop doesn't match dtm or movecnt\n");
     }
 }
 
-void print_futuremoves(void)
+void propagate_one_move_within_table(tablebase_t *tb, index_t future_index, local_position_t *position)
 {
-    unsigned int i;
+    int piece;
 
-    info("%d unpruned and unhandled WHITE futuremoves\n", num_futuremoves[PieceColor::White]);
-    if (current_tb->encode_stm) info("%d unpruned and unhandled BLACK futuremoves\n", num_futuremoves[PieceColor::Black]);
+    propagate_one_minimove_within_table(tb, future_index, position);
 
-    for (i=0; i < num_futuremoves[PieceColor::White]; i ++) {
-	info("WHITE Futuremove %i: %s\n", i, movestr[PieceColor::White][i]);
+    /* En passant:
+     *
+     * We should never enter this function with en-passant set.
+     *
+     * However, we may need to consider a bunch of additional positions here that are identical to
+     * the base position except that a single one of the pawns on the fourth or fifth ranks was
+     * capturable en passant.  Those positions are identical to the base position except that one
+     * extra en passant capture is possible.  Since this is intra-table, we don't do captures.  Just
+     * back-prop into any extra en passant positions that might exist.
+     */
+
+    if (position->en_passant_square != ILLEGAL_POSITION) {
+	fatal("position->en_passant_square != ILLEGAL_POSITION in propagate_one_move_within_table()\n");
     }
-    for (i=0; i < num_futuremoves[PieceColor::Black]; i ++) {
-	if (current_tb->encode_stm) info("BLACK Futuremove %i: %s\n", i, movestr[PieceColor::Black][i]);
+
+    for (piece = 0; piece < tb->num_pieces; piece ++) {
+
+	if (tb->pieces[piece].color == position->side_to_move) continue;
+	if (tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+
+	/* I've taken care to update board_vector in the routine that calls here specifically so we
+	 * can check for en passant legality here.
+	 */
+
+	if ((tb->pieces[piece].color == PieceColor::White)
+	    && (ROW(position->piece_position[piece]) == 3)
+	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] - 8))
+	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] - 16))) {
+	    position->set_en_passant_square(position->piece_position[piece] - 8);
+	    propagate_one_minimove_within_table(tb, future_index, position);
+	}
+
+	if ((tb->pieces[piece].color == PieceColor::Black)
+	    && (ROW(position->piece_position[piece]) == 4)
+	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] + 8))
+	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] + 16))) {
+	    position->set_en_passant_square(position->piece_position[piece] + 8);
+	    propagate_one_minimove_within_table(tb, future_index, position);
+	}
+
+	position->clear_en_passant_square();
     }
 }
 
-/* This is where we parse pruning statements.  Fill in the pruned_futuremoves bit vector with bits
- * set for the various pruned moves.  We call this routine after assign_numbers_to_futuremoves(),
- * which also prints strings into the movestr array, and now we use those strings to match against
- * pruning statements.  To make this routine easier, assign_pruning_statement() can be called with a
- * '-1' futuremove, in which case it will do nothing.
+/* back_propagate_index_within_table()
  *
- * XXX something else I'd like to do here is to flag all of the pruning statements to make
- * sure we've used each one, and complain if any are left unused.
+ * Once the final status of an index has been determined, this function back propagates all moves
+ * (within the tablebase) from the corresponding position.
  */
 
-bool compute_pruned_futuremoves(tablebase_t *tb)
+void back_propagate_index_within_table(index_t index, int reflection)
 {
-    xmlpp::NodeSet result;
-
-    /* Check pruning statements for consistency, and record stalemate pruning if specified */
+    local_position_t position(current_tb);
 
-    result = tb->xml->get_root_node()->find("//prune");
+    /* This can fail if the reflection isn't valid for this index */
 
-    for (auto prune = result.begin(); prune != result.end(); prune ++) {
+    if (! index_to_local_position(current_tb, index, reflection, &position)) {
 
-	Glib::ustring prune_color = (*prune)->eval_to_string("@color");
-	Glib::ustring prune_type = (*prune)->eval_to_string("@type");
+	if (index == debug_move) {
+	    info("back_propagate_index_within_table; index=%" PRIindex "; reflection %d; INVALID\n",
+		 index, reflection);
+	}
 
-	PieceColor color = colors.at(prune_color);
-	int type = restriction_types.at(prune_type);
+	return;
+    }
 
-	if (! (type & tb->prune_enable[color])) {
-	    fatal("Prune statements don't match tablebase prune-enables\n");
-	}
+    if (index == debug_move) {
+	info("back_propagate_index_within_table; index=%" PRIindex "; reflection %d\n", index, reflection);
     }
 
-    if (fatal_errors != 0) return false;
+    position.flip_side_to_move();
 
-    for (auto color : BothColors) {
-	for (auto fm = 0U; fm < num_futuremoves[color]; fm ++) {
-	    assign_pruning_statement(tb, color, fm);
-	}
-    }
+    /* If there are any en passant capturable pawns in the position, then the last move had to
+     * have been a pawn move.  In fact, in this case, we already know exactly what the last move
+     * had to have been.
+     */
 
-    unpruned_futuremoves[PieceColor::White] = ~pruned_futuremoves[PieceColor::White];
-    unpruned_futuremoves[PieceColor::Black] = ~pruned_futuremoves[PieceColor::Black];
+    if (position.en_passant_square != ILLEGAL_POSITION) {
 
-    return (fatal_errors == 0);
-}
+	int en_passant_pawn = -1;
 
+	/* XXX let's store en_passant_pawn in the local position structure and avoid this loop */
 
-/* check_pruning()
- *
- * We run this function after we've assigned numbers to the futuremoves and then matched pruning
- * statements against them, but before we initialize the tablebase.
- *
- * Check the futurebases to see if there are any for a given futuremove.  If not, check to make sure
- * the futuremove is pruned.  Otherwise, signal an error and exit right now.  Just because this test
- * is passed doesn't mean a particular futuremove is handled in a particular position (that's why we
- * use the bit vector), but if the test fails, well, then we know (almost) for sure that we'd get to
- * the end of program with unhandled futurebases, so we can save ourselves a long computation by
- * making this basic check now.
- *
- * If no futurebases exist for a given futuremove and it is correctly pruned, then flag it for
- * optimization, since there is no need to track its futurebase back propagation.
- *
- * Also check to see if there are any futurebases that will always match a futuremove.  If so, we
- * can also optimize these away.  If multiple futurebases match a futuremove and one of them will
- * always match the futuremove, then we can also signal an error now, because we're going to get
- * multiply handled futuremoves.
- *
- * There is an off chance that piece restrictions will prevent a futuremove from taking place, but
- * this code will conclude nevertheless that it is possible and demand either a prune statement or a
- * futurebase.  In this rare case, introducing an extraneous prune statement or two should solve the
- * problem.
- */
+	for (int piece = 0; piece < current_tb->num_pieces; piece++) {
+
+	    if (current_tb->pieces[piece].color != position.side_to_move) continue;
+	    if (current_tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+
+	    if (((current_tb->pieces[piece].color == PieceColor::White)
+		 && (position.piece_position[piece] - 8 == position.en_passant_square))
+		|| ((current_tb->pieces[piece].color == PieceColor::Black)
+		    && (position.piece_position[piece] + 8 == position.en_passant_square))) {
+		if (en_passant_pawn != -1) fatal("Two en passant pawns in back prop?!\n");
+		en_passant_pawn = piece;
+	    }
+	}
+	if (en_passant_pawn == -1) {
+	    fatal("No en passant pawn in back prop!?\n");
+	} else {
+
+	    int square;
+
+	    if (current_tb->pieces[en_passant_pawn].color == PieceColor::White)
+		square = position.piece_position[en_passant_pawn] - 16;
+	    else
+		square = position.piece_position[en_passant_pawn] + 16;
 
-uint64_t tablebase_t::possible_capture_squares(const int capturing_piece) const
-{
-    uint64_t result = 0LL;
+	    /* We never back out into a restricted position.  Since we've already decided that this
+	     * is the only legal back-move from this point, well...
+	     */
 
-    for (square_t from=0; from < NUM_SQUARES; from++) {
-	if (pieces[capturing_piece].legal_squares & BITVECTOR(from)) {
-	    for (auto &dir: movements(pieces[capturing_piece].piece_type, pieces[capturing_piece].color,
-				     from, Movement::Forward, Movement::Capture)) {
-		for (auto &to: dir) {
-		    result |= BITVECTOR(to);
-		}
+	    if (! (current_tb->pieces[en_passant_pawn].semilegal_squares & BITVECTOR(square))) {
+		return;
 	    }
+
+	    local_position_t new_position = position;
+
+	    new_position.clear_en_passant_square();
+
+	    new_position.move_piece(en_passant_pawn, square);
+
+	    propagate_one_move_within_table(current_tb, index, &new_position);
 	}
+
+	return;
     }
 
-    return result;
-}
+    /* foreach (mobile piece of player NOT TO PLAY) { */
 
-bool tablebase_t::futurebase_matches_capture(const tablebase_t& fb, const int captured_piece) const
-{
-    /* I've made this a bit more liberal now, because if we're dealing with move restrictions,
-     * then we might have a missing piece in the futurebase line up with one of our pieces that
-     * is identical to captured_piece in the sense that it's the same color and type, but not
-     * identical in the sense of next_piece_in_semilegal_group.
-     */
+    for (int piece = 0; piece < current_tb->num_pieces; piece++) {
 
-    if (fb.futurebase_type != FuturebaseType::Capture) return false;
+	/* We've moving BACKWARDS in the game, so we want the pieces of the player who is NOT TO
+	 * PLAY here - this is the LAST move we're considering, not the next move.
+	 */
 
-    if (pieces[captured_piece].piece_type == PieceType::Pawn) {
-	if ((fb.missing_pawn != -1)
-	    && (pieces[fb.missing_pawn].color == pieces[captured_piece].color)) return true;
-    } else {
-	if ((fb.missing_non_pawn != -1)
-	    && (pieces[fb.missing_non_pawn].color == pieces[captured_piece].color)
-	    && (pieces[fb.missing_non_pawn].piece_type == pieces[captured_piece].piece_type)) return true;
-    }
+	if (current_tb->pieces[piece].color != position.side_to_move)
+	    continue;
 
-    return false;
-}
+	square_t origin_square = position.piece_position[piece];
 
-bool tablebase_t::futurebase_matches_capture_promotion(const tablebase_t& fb, const int captured_piece, const int promotion) const
-{
-    if (fb.futurebase_type != FuturebaseType::CapturePromotion) return false;
+	for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+				   current_tb->pieces[piece].color,
+				   origin_square,
+				   Movement::Backward, Movement::NonCapture)) {
 
-    if ((pieces[fb.missing_non_pawn].color == pieces[captured_piece].color)
-	&& (pieces[fb.missing_non_pawn].piece_type == pieces[captured_piece].piece_type)
-	&& (fb.promotion == promotion)) {
-	return true;
-    }
+	    /* What about captures?  Well, first of all, there are no captures here!  We're moving
+	     * BACKWARDS in the game... and pieces don't appear out of thin air.  Captures are
+	     * handled by back-propagation from futurebases, not here in the movement code.  The
+	     * piece moving had to come from somewhere, and that somewhere will now be an empty
+	     * square, so once we've hit another piece along a movement vector, there's absolutely
+	     * no need to consider anything further.
+	     */
 
-    return false;
-}
+	    for (auto &movement : dir) {
 
-bool tablebase_t::futurebase_matches_promotion(const tablebase_t& fb, const int promoting_pawn, const int promotion) const
-{
-    if (fb.futurebase_type != FuturebaseType::Promotion) return false;
+		if ((position.board_vector & BITVECTOR(movement)) != 0) break;
 
-    if ((pieces[fb.missing_pawn].color == pieces[promoting_pawn].color)
-	&& (fb.promotion == promotion)) {
-	return true;
-    }
+		/* We never back out into a restricted position (obviously) */
 
-    return false;
-}
+		if (! (current_tb->pieces[piece].semilegal_squares & BITVECTOR(movement))) continue;
 
-uint64_t flip_legal_squares(const uint64_t legal_squares)
-{
-    uint64_t output = 0LL;
+		/* Back stepping a half move here involves several things: flipping the side-to-move
+		 * flag, clearing any en passant pawns into regular pawns, moving the piece
+		 * (backwards), and considering a bunch of additional positions identical to the
+		 * base position except that a single one of the pawns on the fourth or fifth ranks
+		 * was capturable en passant.
+		 *
+		 * En passant.
+		 *
+		 * The only way we could have gotten an en passant pawn is if THIS MOVE created it.
+		 * We handle that as a special case above, so we shouldn't have to worry about
+		 * clearing en passant pawns here - there should be none.
+		 *
+		 * However, we may be considering a position without en passant set, but from which
+		 * a backwards double pawn move is possible.  We want to know if it has a matching
+		 * position with en passant set.  If so, we do nothing here, since the double pawn
+		 * move will be handled by the en passant code above.  If not, we process the double
+		 * pawn move here.
+		 *
+		 * Checking additional en passant positions is taken care of in
+		 * propagate_one_move_within_table()
+		 */
 
-    for (int i=0; i<64; i++) {
-	if (legal_squares & BITVECTOR(i)) {
-	    output |= BITVECTOR(63-i);
-	}
-    }
+		if ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
+		    && (abs(movement - origin_square) == 16)) {
 
-    return output;
-}
+		    local_position_t new_position = position;
 
-bool tablebase_t::futurebase_completely_handles_capture(const tablebase_t& fb, const int capturing_piece, const int captured_piece) const
-{
-    if (! futurebase_matches_capture(fb, captured_piece)) return false;
+		    if (new_position.side_to_move == PieceColor::White) {
+			new_position.set_en_passant_square(origin_square - 8);
+		    } else {
+			new_position.set_en_passant_square(origin_square + 8);
+		    }
+		    new_position.flip_side_to_move();
 
-    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
-     * if our initial pawn positions are identical.
-     */
+		    bool en_passant_position_exists = (local_position_to_index(current_tb, &new_position) != INVALID_INDEX);
 
-    if (fb.pawngen) {
-	if (! pawngen) return false;
-	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
-	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
-    }
+		    if (en_passant_position_exists) continue;
+		}
 
-    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
-     * to consider all possible such mappings.  Remember that there's one less piece in the
-     * futurebase, and that nothing in the futurebase maps to the captured piece.
-     */
+		local_position_t new_position = position;
 
-    int local_piece[MAX_PIECES];
+		new_position.move_piece(piece, movement);
 
-    for (int piece = 0; piece < num_pieces - 1; piece ++) {
-	if (piece < captured_piece) {
-	    local_piece[piece] = piece;
-	} else {
-	    local_piece[piece] = piece+1;
+		propagate_one_move_within_table(current_tb, index, &new_position);
+	    }
 	}
-    }
 
-    /* Compute a bitvector of squares where a capture is possible.  Slight proviso here for pawns -
-     * since capture-promotions are handled in a different subroutine, we use LEGAL_PAWN_BITVECTOR
-     * to exclude the last rank.
-     */
+    }
+}
 
-    uint64_t capture_squares = possible_capture_squares(capturing_piece);
+/* In-check tests
+ *
+ * We use board masks for quickly testing a position to see if we're in check.
+ *
+ * The test works by indexing an array by piece type, piece square, and king square, which returns a
+ * mask that is ANDed with the board mask.  If the result is non-zero, then no capture is possible.
+ * If the result is zero, then the king's in check from that piece.  For sliding piece attacks, we
+ * use a mask with ones along the path between the two squares.  For positions where capture is
+ * always possible, we use a zero mask.  For positions where no capture is possible, we use an
+ * all-1s mask.
+ *
+ * We segregate pawn checks by color; they are a special case.
+ *
+ * sizeof(board_mask) = 229376, so this array should fit in your average L2 cache (mine is 2 MB)
+ *
+ * XXX could use this to speed up the routines after PTM_in_check(), but none of them are used
+ * during generation, so they're not as important.
+ */
 
-    if (pieces[capturing_piece].piece_type == PieceType::Pawn) {
-	capture_squares &= LEGAL_PAWN_BITVECTOR;
-    }
+//board_mask[7][64][64];
 
-    /* Can we find a suitable mapping?
-     *
-     * The capturing piece will end up on the captured piece's square, so each legal square for the
-     * captured piece in the current tablebase must be legal for the capturing piece in the
-     * futurebase, assuming that a capture is possible on that square.
-     *
-     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
-     * its location restriction.
-     */
+std::map<PieceType, uint64_t[64][64]> board_mask;
+std::map<PieceColor, bool[64][64]> pawn_board_mask;
 
-    do {
-	int piece;
+void initialize_board_masks(void)
+{
+    /* Initialize entire array with ALL_ONES_BITVECTOR */
+    for (square_t A = 0; A < 64; A ++) {
+	for (square_t B = 0; B < 64; B ++) {
+	    for (auto piece : AllPieceTypes) {
+		board_mask[piece][A][B] = ALL_ONES_BITVECTOR;
+	    }
+	    for (auto color : BothColors) {
+		pawn_board_mask[color][A][B] = false;
+	    }
+	}
+    }
 
-	for (piece = 0; piece < num_pieces - 1; piece ++) {
-	    if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
-	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
-	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
+    for (int piece_square = 0; piece_square < 64; piece_square ++) {
 
-	    /* If we're using pawngen, we've already checked that the pawns match right */
-	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
+	for (auto piece : AllPieceTypes) {
 
-	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
+	    if (piece != PieceType::Pawn) {
 
-	    if (fb.invert_colors) {
-		fb_legal_squares = flip_legal_squares(fb_legal_squares);
-	    }
+		for (auto &dir : movements(piece, PieceColor::White,
+					   piece_square,
+					   Movement::Forward, Movement::Capture)) {
 
-	    if ((local_piece[piece] != capturing_piece)
-		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
-		    != pieces[local_piece[piece]].legal_squares)) break;
-	    if ((local_piece[piece] == capturing_piece)
-		&& ((fb_legal_squares & pieces[captured_piece].legal_squares & capture_squares)
-		    != (pieces[captured_piece].legal_squares & capture_squares))) break;
-	}
+		    uint64_t mask = 0;
 
-	/* We've found a mapping of pieces that meets the above criteria. */
-	if (piece == num_pieces - 1) {
-	    return true;
-	}
+		    for (auto &movement : dir) {
 
-    } while (std::next_permutation(local_piece, local_piece + num_pieces - 1));
+			board_mask[piece][piece_square][movement] = mask;
 
-    return false;
-}
+			mask |= BITVECTOR(movement);
 
-bool tablebase_t::futurebase_completely_handles_capture_promotion(const tablebase_t& fb, const int capturing_piece, const int captured_piece, const int promotion) const
-{
-    if (! futurebase_matches_capture_promotion(fb, captured_piece, promotion)) return false;
+		    }
+		}
 
-    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
-     * if our initial pawn positions are identical.
-     */
+	    } else {
 
-    if (fb.pawngen) {
-	if (! pawngen) return false;
-	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
-	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
-    }
+		for (auto color : BothColors) {
 
-    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
-     * to consider all possible such mappings.  Remember that there's one less piece in the
-     * futurebase, and that nothing in the futurebase maps to the captured piece.
-     */
+		    for (auto &dir : movements(piece, color,
+					       piece_square,
+					       Movement::Forward, Movement::Capture)) {
 
-    int local_piece[MAX_PIECES];
+			for (auto &movement : dir) {
 
-    for (int piece = 0; piece < num_pieces - 1; piece ++) {
-	if (piece < captured_piece) {
-	    local_piece[piece] = piece;
-	} else {
-	    local_piece[piece] = piece+1;
+			    pawn_board_mask[color][piece_square][movement] = true;
+
+			}
+		    }
+		}
+	    }
 	}
     }
+}
 
-    /* Can we find a suitable mapping?
-     *
-     * The capturing piece will end up on the captured piece's square, so each legal square for the
-     * captured piece in the current tablebase must be legal for the capturing piece in the
-     * futurebase.
-     *
-     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
-     * its location restriction.
-     */
+bool PTM_in_check(const tablebase_t *tb, const local_position_t *position)
+{
+    /* The concept of check doesn't exist in suicide - kings are normal pieces */
 
-    do {
-	int piece;
+    if (tb->variant == Variant::Suicide) return false;
 
-	for (piece = 0; piece < num_pieces - 1; piece ++) {
-	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
-	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
+    const int king = (position->side_to_move == PieceColor::White) ? tb->white_king : tb->black_king;
+    const int king_position = position->piece_position[king];
 
-	    if (local_piece[piece] != capturing_piece) {
-		if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
-	    } else {
-		if (fb.pieces[piece].piece_type != promoted_pieces[promotion]) break;
-	    }
+    for (int piece = 0; piece < tb->num_pieces; piece++) {
 
-	    /* If we're using pawngen, we've already checked that the pawns match right */
+	/* We only want to consider pieces of the side which is NOT to move... */
 
-	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
+	if (tb->pieces[piece].color == position->side_to_move) continue;
 
-	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
+	/* We might have removed the piece from the position... */
 
-	    if (fb.invert_colors) {
-		fb_legal_squares = flip_legal_squares(fb_legal_squares);
-	    }
+	if (position->piece_position[piece] == ILLEGAL_POSITION) continue;
 
-	    /* For most pieces, check that the legal squares in the futurebase are a superset
-	     * of the legal squares in the local tablebase. */
+	if (tb->pieces[piece].piece_type != PieceType::Pawn) {
 
-	    if ((local_piece[piece] != capturing_piece)
-		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
-		    != pieces[local_piece[piece]].legal_squares)) break;
+	    if ((board_mask[tb->pieces[piece].piece_type][position->piece_position[piece]][king_position]
+		 & position->board_vector) == 0) return true;
 
-	    /* For the capturing and promoting pawn, find its possible promotion-capture squares,
-	     * and make sure the legal squares in the futurebase are a superset of them.
-	     *
-	     * This code ignores frozen pieces that might block a promotion, but this routine is
-	     * essentially an optimisation.  If it returns false, then we need to check every
-	     * position to see if its futuremoves are handled.  Ignoring frozen pieces just means
-	     * that we might need to check those positions by hand, slowing the program down but not
-	     * affecting its proper operation.
-	     */
+	} else {
 
-	    if (local_piece[piece] == capturing_piece) {
-		uint64_t promotion_squares = possible_capture_squares(capturing_piece);
-		if (pieces[capturing_piece].color == PieceColor::White) {
-		    promotion_squares &= 0xff00000000000000LL;
-		} else {
-		    promotion_squares &= 0x00000000000000ffLL;
-		}
-		promotion_squares &= pieces[captured_piece].legal_squares;
-		if ((fb_legal_squares & promotion_squares) != promotion_squares) break;
-	    }
-	}
+	    if (pawn_board_mask[tb->pieces[piece].color][position->piece_position[piece]][king_position])
+		return true;
 
-	/* We've found a mapping of pieces that meets the above criteria. */
-	if (piece == num_pieces - 1) {
-	    return true;
 	}
-
-    } while (std::next_permutation(local_piece, local_piece + num_pieces - 1));
+    }
 
     return false;
 }
 
-bool tablebase_t::futurebase_completely_handles_promotion(const tablebase_t& fb, const int promoting_pawn, const int promotion) const
+bool global_PTM_in_check(global_position_t *position)
 {
-    if (! futurebase_matches_promotion(fb, promoting_pawn, promotion)) return false;
-
-    /* If the futurebase uses pawngen, then we will only optimize it out if we also use pawngen, and
-     * if our initial pawn positions are identical.
-     */
+    if (position->variant == Variant::Suicide) return false;
 
-    if (fb.pawngen) {
-	if (! pawngen) return false;
-	if (pawngen->initial_white_pawns != fb.pawngen->initial_white_pawns) return false;
-	if (pawngen->initial_black_pawns != fb.pawngen->initial_black_pawns) return false;
-    }
+    for (square_t square = 0; square < 64; square ++) {
 
-    /* Set up a mapping from the futurebase pieces to the local pieces.  We'll permute this around
-     * to consider all possible such mappings.
-     */
+	if (position->board[square] == 0) continue;
 
-    int local_piece[MAX_PIECES];
+	auto const pair = global_pieces2.at(position->board[square]);
 
-    for (int piece = 0; piece < num_pieces; piece ++) {
-	local_piece[piece] = piece;
-    }
+	/* We only want to consider pieces of the side which is NOT to move... */
 
-    /* Can we find a suitable mapping?
-     *
-     * The capturing piece will end up on the captured piece's square, so each legal square for the
-     * captured piece in the current tablebase must be legal for the capturing piece in the
-     * futurebase.
-     *
-     * For other local pieces, there must a corresponding piece in the futurebase with a superset of
-     * its location restriction.
-     */
+	if (position->side_to_move == pair.first) continue;
 
-    do {
-	int piece;
+	const PieceType piece_type = pair.second;
 
-	for (piece = 0; piece < num_pieces; piece ++) {
-	    if (!fb.invert_colors && (fb.pieces[piece].color != pieces[local_piece[piece]].color)) break;
-	    if (fb.invert_colors && (fb.pieces[piece].color == pieces[local_piece[piece]].color)) break;
+	for (auto &dir : movements(piece_type, pair.first, square,
+				   Movement::Forward, Movement::Capture)) {
 
-	    if (local_piece[piece] != promoting_pawn) {
-		if (fb.pieces[piece].piece_type != pieces[local_piece[piece]].piece_type) break;
-	    } else {
-		if (fb.pieces[piece].piece_type != promoted_pieces[promotion]) break;
-	    }
+	    for (auto &movement : dir) {
 
-	    /* If we're using pawngen, we've already checked that the pawns match right */
+		/* Now check to see if the movement ended because we hit against the king
+		 * of the opposite color.  If so, we're in check.
+		 */
 
-	    if (fb.pawngen && fb.pieces[piece].piece_type == PieceType::Pawn) continue;
+		if ((position->side_to_move == PieceColor::White) && (position->board[movement] == 'K'))
+		    return true;
+		if ((position->side_to_move == PieceColor::Black) && (position->board[movement] == 'k'))
+		    return true;
+		
+		/* Otherwise, if we hit a piece, end this movement and go on to the next one */
 
-	    uint64_t fb_legal_squares = fb.pieces[piece].legal_squares;
+		if (position->board[movement] != 0) break;
 
-	    if (fb.invert_colors) {
-		fb_legal_squares = flip_legal_squares(fb_legal_squares);
 	    }
+	}
+    }
 
-	    /* For most pieces, check that the legal squares in the futurebase are a superset
-	     * of the legal squares in the local tablebase. */
+    return false;
+}
 
-	    if ((local_piece[piece] != promoting_pawn)
-		&& ((fb_legal_squares & pieces[local_piece[piece]].legal_squares)
-		    != pieces[local_piece[piece]].legal_squares)) break;
+/* XXX very similar to global_PTM_in_check */
 
-	    /* For the promoting pawn, find its possible promotion squares and make sure the legal
-	     * squares in the futurebase are a superset of them.
-	     *
-	     * This code ignores frozen pieces that might block a promotion, but this routine is
-	     * essentially an optimisation.  If it returns false, then we need to check every
-	     * position to see if its futuremoves are handled.  Ignoring frozen pieces just means
-	     * that we might need to check those positions by hand, slowing the program down but not
-	     * affecting its proper operation.
-	     */
+bool global_PNTM_in_check(global_position_t *position)
+{
+    if (position->variant == Variant::Suicide) return false;
 
-	    if (local_piece[piece] == promoting_pawn) {
-		uint64_t promotion_squares;
-		if (pieces[promoting_pawn].color == PieceColor::White) {
-		    promotion_squares = (pieces[promoting_pawn].legal_squares & 0x00ff000000000000LL) << 8;
-		} else {
-		    promotion_squares = (pieces[promoting_pawn].legal_squares & 0x000000000000ff00LL) >> 8;
-		}
-		if ((fb_legal_squares & promotion_squares) != promotion_squares) break;
-	    }
-	}
+    for (square_t square = 0; square < 64; square ++) {
 
-	/* We've found a mapping of pieces that meets the above criteria. */
-	if (piece == num_pieces) {
-	    return true;
-	}
+	if (position->board[square] == 0) continue;
 
-    } while (std::next_permutation(local_piece, local_piece + num_pieces));
+	auto const pair = global_pieces2.at(position->board[square]);
 
-    return false;
-}
+	/* We only want to consider pieces of the side which is to move... */
 
-bool check_pruning(tablebase_t *tb)
-{
-    /* For each possible captured_piece (i.e, everything but the two kings) check for capture
-     * futurebases.  tb->white_king and tb->black_king are -1 for suicide, so all pieces are treated
-     * the same in a suicide analysis.
-     */
+	if (position->side_to_move != pair.first) continue;
 
-    for (int captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+	const PieceType piece_type = pair.second;
 
-	if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
+	for (auto &dir : movements(piece_type, pair.first, square,
+				   Movement::Forward, Movement::Capture)) {
 
-	/* If we're not encoding side-to-move, then all of the positions in the tablebase are WHITE
-	 * to move positions, so we don't care if the captured piece is WHITE.
-	 */
+	    for (auto &movement : dir) {
 
-	if ((! tb->encode_stm) && (tb->pieces[captured_piece].color == PieceColor::White)) continue;
+		/* Now check to see if the movement ended because we hit against the king
+		 * of the opposite color.  If so, we're in check.
+		 */
 
-	int futurebase_cnt = 0;
+		if ((position->side_to_move == PieceColor::White) && (position->board[movement] == 'k'))
+		    return true;
+		if ((position->side_to_move == PieceColor::Black) && (position->board[movement] == 'K'))
+		    return true;
 
-	for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-	    if (tb->futurebase_matches_capture(futurebases[fbnum], captured_piece)) {
-		futurebase_cnt ++;
+		/* Otherwise, if we hit a piece, end this movement and go on to the next one */
+
+		if (position->board[movement] != 0) break;
 	    }
+
 	}
+    }
 
-	/* If no such futurebase exists, then for every other piece, see if the piece restrictions
-	 * would permit it to capture the original piece in question.  If so, there must be a prune
-	 * statement, or it's an error.  On the other hand, if a futurebase handles all of our
-	 * captures, then it must be the only matching futurebase.
-	 */
+    return false;
+}
 
-	for (int capturing_piece = 0; capturing_piece < tb->num_pieces; capturing_piece ++) {
+bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position)
+{
+    if (tb->variant == Variant::Suicide) return false;
+
+    for (int piece = 0; piece < tb->num_pieces; piece++) {
+
+	/* We only want to consider pieces of the side which is to move... */
+
+	if (tb->pieces[piece].color != position->side_to_move) continue;
 
-	    if (futurecaptures[capturing_piece][captured_piece] == NO_FUTUREMOVE) continue;
-	    if (futurecaptures[capturing_piece][captured_piece] == RESIGN_FUTUREMOVE) continue;
+	for (auto &dir : movements(tb->pieces[piece].piece_type,
+				   tb->pieces[piece].color,
+				   position->piece_position[piece],
+				   Movement::Forward, Movement::Capture)) {
 
-	    if (futurecaptures[capturing_piece][captured_piece] < 0) {
-		fatal("futurecaptures (%d) < 0 but not NO_FUTUREMOVE!\n", futurecaptures[capturing_piece][captured_piece]);
-	    }
+	    for (auto &movement : dir) {
 
-	    if (futurebase_cnt == 0) {
+		/* Now check to see if the movement ended because we hit against the king
+		 * of the opposite color.  If so, we're in check.
+		 */
 
-		if (discarded_futuremoves[tb->pieces[capturing_piece].color]
-		    & FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece])) {
-		    futurecaptures[capturing_piece][captured_piece] = DISCARD_FUTUREMOVE;
-		} else if (conceded_futuremoves[tb->pieces[capturing_piece].color]
-			   & FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece])) {
-		    futurecaptures[capturing_piece][captured_piece] = CONCEDE_FUTUREMOVE;
-		} else {
-		    fatal("No futurebase or pruning for %s move %s\n",
-			  colors.at(tb->pieces[capturing_piece].color).c_str(),
-			  movestr[tb->pieces[capturing_piece].color][futurecaptures[capturing_piece][captured_piece]]);
-		    return false;
-		}
+		if ((position->side_to_move == PieceColor::White)
+		    && (movement == position->piece_position[tb->black_king])) return true;
 
-	    } else {
-		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-		    if (tb->futurebase_completely_handles_capture(futurebases[fbnum], capturing_piece, captured_piece)) {
+		if ((position->side_to_move == PieceColor::Black)
+		    && (movement == position->piece_position[tb->white_king])) return true;
 
-			if (futurebase_cnt > 1) {
-			    fatal("Multiple futurebases handle %s move %s\n",
-				  colors.at(tb->pieces[capturing_piece].color).c_str(),
-				  movestr[tb->pieces[capturing_piece].color][futurecaptures[capturing_piece][captured_piece]]);
-			    return false;
-			}
-			if (futurecaptures[capturing_piece][captured_piece] >= 0) {
-			    handled_futuremoves[tb->pieces[capturing_piece].color] |= FUTUREVECTOR(futurecaptures[capturing_piece][captured_piece]);
-			    futurecaptures[capturing_piece][captured_piece] = HANDLED_FUTUREMOVE;
-			}
-			break;
-		    }
-		}
+		if (position->board_vector & BITVECTOR(movement)) break;
 	    }
 	}
     }
 
-    /* Pawns - check for both promotion and promotion capture futurebases here.  Same idea. */
+    return false;
+}
 
-    for (int pawn = 0; pawn < tb->num_pieces; pawn ++) {
+/* initialize_tablebase()
+ *
+ * This is another critical function; don't be deceived by the tame word 'initialize'.
+ *
+ * We determine that a position is won for the player not to move (PNTM) if all possible moves (of
+ * the player to move) lead to a won game for PNTM.  We count down this total during back
+ * propagation, so it stands to reason that we need an accurate count to start with.  Thus the
+ * importance of this function.
+ *
+ * We don't count moves into check at all.
+ *
+ * Basically, there are two types of moves we need to consider in each position:
+ *
+ * 1. non-capture, non-promotion, non-restricted moves
+ *
+ * We just add these up and then count them down during intra-table propagation, depending on the
+ * integrity of the program's algorithm to make sure that every move counted forward gets considered
+ * as a move backward.
+ *
+ * 2. everything else (futuremoves)
+ *
+ * These always lead to a different tablebase (a futurebase).  The only way we handle them is
+ * through inter-table back propagation.  We keep a seperate count of futuremoves because, unlike
+ * intratable moves, we might miss some of these moves if we don't have a complete set of
+ * futurebases.  So we count futuremoves by themselves (as well as part of the standard count), and
+ * count them down normally during a single sweep through our futurebases.  If that takes care of
+ * everything fine.  Otherwise, during our first pass through the current tablebase, we'll find that
+ * some of the futuremoves remain unaccounted for.  If they occur with the "good guys" as PTM, we
+ * just double-check that the restriction is OK, subtract the remaining futuremoves out from the
+ * standard count, and keep going.  But if the "bad guys" are PTM, then the position has to be
+ * assumed won for PTM.
+ *
+ */
 
-	int promotion;
+class move {
 
-	if (tb->pieces[pawn].piece_type != PieceType::Pawn) continue;
+    PieceType piece_type;
+    square_t origin_square;
+    square_t destination_square;
+    PieceType promotion_type;
 
-	if ((! tb->encode_stm) && (tb->pieces[pawn].color == PieceColor::Black)) continue;
+public:
 
-	/* First, we're looking for promotion capture futurebases. */
+    int futuremove;
 
-	for (int captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+    bool is_futuremove;
+    bool is_capture;
+    bool is_promotion;
 
-	    if ((captured_piece == tb->white_king) || (captured_piece == tb->black_king)) continue;
+    move(PieceType piece_type, square_t origin_square, square_t destination_square)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  is_futuremove(false), is_capture(false), is_promotion(false)
+    { }
 
-	    /* Check to see if the pawn can even be on a square where a promotion capture is
-	     * possible.
-	     */
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, int futuremove)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  futuremove(futuremove),
+	  is_futuremove(true), is_capture(false), is_promotion(false)
+    { }
 
-	    if (tb->pieces[pawn].color == PieceColor::White) {
-		if (! (tb->pieces[pawn].legal_squares & 0x00ff000000000000LL)) break;
-	    } else {
-		if (! (tb->pieces[pawn].legal_squares & 0x000000000000ff00LL)) break;
-	    }
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, PieceType promotion_type)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  promotion_type(promotion_type),
+	  is_futuremove(true), is_capture(false), is_promotion(true)
+    { }
 
-	    /* Check to see that the other piece can be on a square where it could be promotion
-	     * captured.  It's still possible that the other piece could be on a back rank, but
-	     * never on a square where it could be captured by the pawn, but we leave that
-	     * possibility unchecked.  It'd probably be best to tie this code in with the code in
-	     * assign_numbers_to_futuremoves() - maybe by flagging which captures it was determined
-	     * that promotion was possible in?
-	     */
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, PieceType promotion_type, int futuremove)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  promotion_type(promotion_type), futuremove(futuremove),
+	  is_futuremove(true), is_capture(false), is_promotion(true)
+    { }
 
-	    if (tb->pieces[pawn].color == PieceColor::White) {
-		if (! (tb->pieces[captured_piece].legal_squares & 0xff00000000000000LL)) continue;
-	    } else {
-		if (! (tb->pieces[captured_piece].legal_squares & 0x00000000000000ffLL)) continue;
-	    }
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  is_futuremove(true), is_capture(is_capture), is_promotion(false)
+    { }
 
-	    /* check all futurebases for a 'promotion capture' with captured_piece missing */
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, int futuremove)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  futuremove(futuremove),
+	  is_futuremove(true), is_capture(is_capture), is_promotion(false)
+    { }
 
-	    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, PieceType promotion_type)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  promotion_type(promotion_type),
+	  is_futuremove(true), is_capture(is_capture), is_promotion(true)
+    { }
 
-		int futurebase_cnt = 0;
+    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, PieceType promotion_type, int futuremove)
+	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
+	  promotion_type(promotion_type), futuremove(futuremove),
+	  is_futuremove(true), is_capture(is_capture), is_promotion(true)
+    { }
 
-		if (promotion_captures[pawn][captured_piece][promotion] < 0) continue;
+    operator std::string() const {
+	return piece_char[piece_type] + algebraic_notation(origin_square)
+	    + (is_capture ? "x" : "") + algebraic_notation(destination_square)
+	    + (is_promotion ? (std::string)"=" + piece_char[promotion_type] : "");
+    }
 
-		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-		    if (tb->futurebase_matches_capture_promotion(futurebases[fbnum], captured_piece, promotion)) {
-			futurebase_cnt ++;
-		    }
-		}
+    const char * c_str() const {
+	return ((std::string)(*this)).c_str();
+    }
+};
 
-		/* If no such futurebase exists, then there must be a prune statement, or it's an
-		 * error.
-		 */
+/* XXX perhaps collapse the next two functions together using templates  */
 
-		if (futurebase_cnt == 0) {
+/* This is a special exception value for PNTM mated positions.
+ *
+ * Since detecting a PNTM mate allows us to break out of the move generator and flag the position
+ * invalid, this exception probably doesn't cost much of a performance penalty vs continuing
+ * to run the loop.
+ */
 
-		    if (discarded_futuremoves[tb->pieces[pawn].color]
-			& FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion])) {
-			promotion_captures[pawn][captured_piece][promotion] = DISCARD_FUTUREMOVE;
-		    } else if (conceded_futuremoves[tb->pieces[pawn].color]
-			       & FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion])) {
-			promotion_captures[pawn][captured_piece][promotion] = CONCEDE_FUTUREMOVE;
-		    } else {
-			fatal("No futurebase or pruning for %s move %s\n",
-			      colors.at(tb->pieces[pawn].color).c_str(),
-			      movestr[tb->pieces[pawn].color][promotion_captures[pawn][captured_piece][promotion]]);
-			return false;
-		    }
+class PNTM_mated : public std::exception { };
 
-		} else {
+void generate_moves(const local_position_t &position, std::vector<move> &result)
+{
+    const tablebase_t *tb = position.tb;
 
-		    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-			if (tb->futurebase_completely_handles_capture_promotion(futurebases[fbnum], pawn, captured_piece, promotion)) {
+    result.clear();
 
-			    if (futurebase_cnt > 1) {
-				fatal("Multiple futurebases handle %s move %s\n",
-				      colors.at(tb->pieces[pawn].color).c_str(),
-				      movestr[tb->pieces[pawn].color][promotion_captures[pawn][captured_piece][promotion]]);
-				return false;
-			    }
-			    if (promotion_captures[pawn][captured_piece][promotion] >= 0) {
-				handled_futuremoves[tb->pieces[pawn].color] |= FUTUREVECTOR(promotion_captures[pawn][captured_piece][promotion]);
-				promotion_captures[pawn][captured_piece][promotion] = HANDLED_FUTUREMOVE;
-			    }
-			    break;
-			}
-		    }
-		}
+    for (int piece = 0; piece < tb->num_pieces; piece++) {
 
-	    }
-	}
+	/* We only want to consider pieces of the side which is to move... */
 
-	/* straight promotion futurebases */
+	if (tb->pieces[piece].color != position.side_to_move) continue;
 
-	for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
+	int origin_square = position.piece_position[piece];
 
-	    if (promotions[pawn][promotion] < 0) continue;
+	for (auto &dir : movements(tb->pieces[piece].piece_type,
+				   tb->pieces[piece].color,
+				   position.piece_position[piece],
+				   Movement::Forward, Movement::AllMoves)) {
 
-	    int futurebase_cnt = 0;
+	    for (auto &movement : dir) {
 
-	    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-		if (tb->futurebase_matches_promotion(futurebases[fbnum], pawn, promotion)) {
-		    futurebase_cnt ++;
-		}
-	    }
+		bool is_promotion = ((tb->pieces[piece].piece_type == PieceType::Pawn)
+				     && ((ROW(movement) == 7) || (ROW(movement) == 0)));
+
+		bool is_pawn_capture = ((tb->pieces[piece].piece_type == PieceType::Pawn)
+					&& (COL(movement) != COL(position.piece_position[piece])));
+
+		bool is_non_capture = ((BITVECTOR(movement) & position.board_vector) == 0) && !is_pawn_capture;
+
+		bool is_normal_capture = ((tb->pieces[piece].piece_type != PieceType::Pawn) || is_pawn_capture)
+		    && ((BITVECTOR(movement) & position.board_vector) != 0)
+		    && ((BITVECTOR(movement) & position.PTM_vector) == 0);
+
+		bool is_en_passant_capture = is_pawn_capture
+		    && (movement == position.en_passant_square);
 
-	    if (futurebase_cnt == 0) {
+		if (is_non_capture) {
 
-		if (discarded_futuremoves[tb->pieces[pawn].color] & FUTUREVECTOR(promotions[pawn][promotion])) {
-		    promotions[pawn][promotion] = DISCARD_FUTUREMOVE;
-		} else if (conceded_futuremoves[tb->pieces[pawn].color] & FUTUREVECTOR(promotions[pawn][promotion])) {
-		    promotions[pawn][promotion] = CONCEDE_FUTUREMOVE;
-		} else {
-		    fatal("No futurebase or pruning for %s move %s\n",
-			  colors.at(tb->pieces[pawn].color).c_str(),
-			  movestr[tb->pieces[pawn].color][promotions[pawn][promotion]]);
-		    return false;
-		}
+		    /* Non-capture case: move the piece, so we can test the new position for check */
 
-	    } else {
+		    local_position_t new_position = position;
 
-		for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-		    if (tb->futurebase_completely_handles_promotion(futurebases[fbnum], pawn, promotion)) {
+		    new_position.move_piece(piece, movement);
 
-			if (futurebase_cnt > 1) {
-			    fatal("Multiple futurebases handle %s move %s\n",
-				  colors.at(tb->pieces[pawn].color).c_str(),
-				  movestr[tb->pieces[pawn].color][promotions[pawn][promotion]]);
-			    return false;
-			}
-			if (promotions[pawn][promotion] >= 0) {
-			    handled_futuremoves[tb->pieces[pawn].color] |= FUTUREVECTOR(promotions[pawn][promotion]);
-			    promotions[pawn][promotion] = HANDLED_FUTUREMOVE;
-			}
-			break;
-		    }
-		}
-	    }
-	}
-    }
+		    /* We don't set en passant square here since it doesn't affect the in-check
+		     * calculation, and we're not using the position for anything else.
+		     */
 
-    /* Check for any futurebases that match our piece types exactly.  It (or they) must correspond
-     * to restricted piece movements.
-     */
+		    if (! PTM_in_check(tb, &new_position)) {
 
-    int futurebase_cnt = 0;
+			/* If the piece is a pawn and we're moving to the last rank, then this has
+			 * to be a promotion move, in fact, promotion_possibilities moves.  (queen,
+			 * knight, maybe rook and bishop, king for suicide).  As such, they will
+			 * require back propagation from futurebases and must therefore be flagged
+			 * as futuremoves.
+			 */
 
-    for (int fbnum = 0; fbnum < num_futurebases; fbnum ++) {
-	if (futurebases[fbnum].futurebase_type == FuturebaseType::Normal) {
-	    futurebase_cnt ++;
-	}
-    }
+			if (is_promotion) {
 
-    /* I'd like to construct a mask of all allowable squares for each color and type of piece, and
-     * verify that the futurebases or pruning actually account for all possible restricted
-     * movements.  This would let me catch early things like forgetting to specify a g4 tablebase
-     * for a pawn frozen on g2.  For now, we only check for missing pruning if there are no "normal"
-     * futurebases at all.
-     */
+			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-    if (futurebase_cnt == 0) {
-	for (int piece = 0; piece < tb->num_pieces; piece ++) {
-	    if ((! tb->encode_stm) && (tb->pieces[piece].color == PieceColor::Black)) continue;
-	    for (int sq = 0; sq < 64; sq ++) {
-		if (futuremoves[piece][sq] >= 0) {
+				result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+						      promoted_pieces[promotion], promotions[piece][promotion]));
 
-		    if (! (pruned_futuremoves[tb->pieces[piece].color] & FUTUREVECTOR(futuremoves[piece][sq]))) {
-			fatal("No futurebase or pruning for %s move %s\n",
-			      colors.at(tb->pieces[piece].color).c_str(),
-			      movestr[tb->pieces[piece].color][futuremoves[piece][sq]]);
-			return false;
-		    }
-		}
-	    }
-	}
-    }
+			    }
 
-    return true;
-}
+			    /* If we're NOT moving into check AND the piece is moving outside its
+			     * legal squares AND we can't permute the pieces into a position where
+			     * everything is legal (local_position_to_index), we regard this as a
+			     * futuremove (since it will require back prop from futurebases).  We
+			     * could just check if local_position_to_index() returns a valid index,
+			     * but checking the legal_squares bitvector first makes this a little
+			     * faster.
+			     */
 
+			} else if (!(tb->pieces[piece].legal_squares & BITVECTOR(movement))
+			    && (local_position_to_index(tb, &new_position) == INVALID_INDEX)) {
 
-/* optimize_futuremoves()
- *
- * Once we've assigned futuremove numbers, then gone and checked pruning, some of those futuremoves
- * might now be completely pruned, and their numbers were changed to DISCARD_FUTUREMOVE,
- * CONCEDE_FUTUREMOVE, RESIGN_FUTUREMOVE or HANDLED_FUTUREMOVE.  Find any unused numbers and
- * collapse the remaining futuremoves down into a smaller set.
- */
+			    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+						  futuremoves[piece][movement]));
 
-void initialize_futuremoves(tablebase_t *tb)
-{
-    for (int piece = 0; piece < tb->num_pieces; piece ++) {
+			} else {
 
-	for (int piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
+			    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement));
 
-	    futurecaptures[piece][piece2] = NO_FUTUREMOVE;
+			}
 
-	    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
-		promotion_captures[piece][piece2][promotion] = NO_FUTUREMOVE;
-	    }
-	}
+		    }
 
-	for (square_t sq = 0; sq < 64; sq ++) {
-	    futuremoves[piece][sq] = NO_FUTUREMOVE;
-	}
+		}
 
-	for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
-	    promotions[piece][promotion] = NO_FUTUREMOVE;
-	}
-    }
-}
+		if (is_normal_capture) {
 
-void remove_futuremove(futurevector_t *fvp, int fm)
-{
-    *fvp = ((*fvp) & (FUTUREVECTOR(fm)-1)) | (((*fvp) & ~(FUTUREVECTOR(fm+1)-1)) >> 1);
-}
+		    /* Capture case.
+		     *
+		     * Check to see if the movement ended because we hit against another piece of
+		     * the opposite color.  If so, add another move for the capture.  As before,
+		     * ignore moves into check.
+		     *
+		     * Actually, we check to see that we DIDN'T hit a piece of our OWN color.  The
+		     * difference is that this way we don't register a capture if we hit the end of
+		     * the list of movements in a given direction.
+		     *
+		     * We also check to see if the capture was against the enemy king! in which case
+		     * this position is a PNTM-mated.
+		     */
 
-void optimize_futuremoves(tablebase_t *tb)
-{
-    int fm, fm2, piece, piece2, sq, promotion;
+		    int captured_piece;
 
-    for (auto color : BothColors) {
+		    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
 
-	for (fm = 0; fm < (int) num_futuremoves[color]; fm++) {
+			if (movement == position.piece_position[captured_piece]) {
 
-	    bool optimize_this_futuremove = true;
+			    if ((captured_piece == tb->black_king) || (captured_piece == tb->white_king)) {
+				throw PNTM_mated();
+			    }
 
-	    /* XXX make this a subroutine */
+			    local_position_t new_position = position;
 
-	    for (piece = 0; piece < tb->num_pieces; piece ++) {
+			    new_position.capture_piece(piece, captured_piece);
 
-		if (tb->pieces[piece].color != color) continue;
+			    if (! PTM_in_check(tb, &new_position)) {
 
-		for (piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
-		    if (futurecaptures[piece][piece2] == fm) {
-			optimize_this_futuremove = false;
-			break;
-		    }
-		    if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-			for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-			    if (promotion_captures[piece][piece2][promotion] == fm) {
-				optimize_this_futuremove = false;
-				break;
-			    }
-			}
-		    }
-		}
-		for (sq = 0; sq < 64; sq ++) {
-		    if (futuremoves[piece][sq] == fm) {
-			optimize_this_futuremove = false;
-			break;
-		    }
-		}
-		if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-		    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-			if (promotions[piece][promotion] == fm) {
-			    optimize_this_futuremove = false;
-			    break;
-			}
-		    }
-		}
-	    }
+				if (! is_promotion) {
 
+				    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+							  true, futurecaptures[piece][captured_piece]));
 
-	    if (optimize_this_futuremove) {
+				} else {
 
-		for (piece = 0; piece < tb->num_pieces; piece ++) {
+				    /* Promotion capture case
+				     *
+				     * In this part of the code, we're just counting forward moves, and
+				     * all captures are futurebase moves, so the only difference to us
+				     * whether this is a promotion move or not is how many futuremoves
+				     * get recorded.
+				     */
 
-		    if (tb->pieces[piece].color == color) {
 
-			for (piece2 = 0; piece2 < tb->num_pieces; piece2 ++) {
-			    if (futurecaptures[piece][piece2] > fm) {
-				futurecaptures[piece][piece2] --;
-			    }
-			    if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-				for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-				    if (promotion_captures[piece][piece2][promotion] > fm) {
-					promotion_captures[piece][piece2][promotion] --;
+				    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+
+					result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+							      true, promoted_pieces[promotion], promotion_captures[piece][captured_piece][promotion]));
 				    }
 				}
 			    }
-			}
 
-			for (sq = 0; sq < 64; sq ++) {
-			    if (futuremoves[piece][sq] > fm) {
-				futuremoves[piece][sq] --;
-			    }
+			    break;
 			}
+		    }
 
-			if (tb->pieces[piece].piece_type == PieceType::Pawn) {
-			    for (promotion = 0; promotion < promotion_possibilities; promotion ++) {
-				if (promotions[piece][promotion] > fm) {
-				    promotions[piece][promotion] --;
-				}
-			    }
-			}
+		    if (captured_piece == tb->num_pieces) {
+			fatal("Couldn't match capture!\n");
 		    }
 		}
 
-		if (pruned_futuremoves[color] & FUTUREVECTOR(fm)) {
-		    info("Pruned %s futuremove %s\n", colors.at(color).c_str(), movestr[color][fm]);
-		} else if (handled_futuremoves[color] & FUTUREVECTOR(fm)) {
-		    info("%s futuremove %s completely handled by futurebases\n", colors.at(color).c_str(), movestr[color][fm]);
-		} else {
-		    info("Optimized %s futuremove %s, but not sure how!\n", colors.at(color).c_str(), movestr[color][fm]);
-		}
+		if (is_en_passant_capture) {
 
-		remove_futuremove(&(pruned_futuremoves[color]), fm);
-		remove_futuremove(&(unpruned_futuremoves[color]), fm);
-		remove_futuremove(&(conceded_futuremoves[color]), fm);
-		remove_futuremove(&(discarded_futuremoves[color]), fm);
-		remove_futuremove(&(handled_futuremoves[color]), fm);
+		    int captured_piece;
 
-		// free(movestr[color][fm]);
+		    /* XXX recording en passant piece in position structure would avoid this loop */
 
-		for (fm2 = fm + 1; fm2 < (int) num_futuremoves[color]; fm2++) {
-		    movestr[color][fm2-1] = movestr[color][fm2];
-		}
+		    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
 
-		num_futuremoves[color] --;
-		fm --;
-	    }
-	}
-    }
-}
+			if (movement ==
+			    (position.piece_position[captured_piece]
+			     + ((position.side_to_move == PieceColor::White) ? 8 : -8))) {
 
-/***** INTRA-TABLE MOVE PROPAGATION *****/
+			    local_position_t new_position = position;
 
-/* We've got a move that needs to be propagated, so we back out one half-move to all of the
- * positions that could have gotten us here and update their counters in various obscure ways.
- */
+			    new_position.move_piece(captured_piece, position.en_passant_square);
 
-void propagate_one_minimove_within_table(tablebase_t *tb, index_t future_index, local_position_t *current_position)
-{
-    index_t current_index;
-    int dtm = entriesTable[future_index].get_DTM();
+			    new_position.capture_piece(piece, captured_piece);
 
-    current_index = local_position_to_index(tb, current_position);
+			    if (! PTM_in_check(tb, &new_position)) {
 
-    if (current_index == INVALID_INDEX) {
+				result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
+						      true, futurecaptures[piece][captured_piece]));
 
-	if (future_index == debug_move) {
-	    info("propagate_one_minimove_within_table:  current_index=INVALID"
-		 "; future_index=%" PRIindex "; dtm=%d\n",
-		 future_index, dtm);
-	}
+			    }
 
-	return;
-    }
+			    break;
+			}
+		    }
 
-    if ((current_index == debug_move) || (future_index == debug_move)) {
-	info("propagate_one_minimove_within_table:  current_index=%"
-	     PRIindex "; future_index=%" PRIindex "; dtm=%d\n",
-	     current_index, future_index, dtm);
-    }
+		    if (captured_piece == tb->num_pieces) {
+			fatal("Couldn't match en passant capture!\n");
+		    }
+		}
 
-    /* Parent position is the FUTURE position.  We now back-propagate to
-     * the current position, which is the PAST position.
-     *
-     * If the player to move in the FUTURE position wins, then we add one to that
-     * player's win count in the PAST position.  On other other hand, if the player not
-     * to move in the FUTURE position wins, then the player to move in the PAST position
-     * has a winning move (the one we're considering).
-     */
+		/* If we hit a piece (either a capture or our own piece), end this direction of movement */
 
-    if (dtm > 0) {
-	commit_update(current_index, -dtm, 1, NO_FUTUREMOVE);
-    } else if (dtm < 0) {
-	commit_update(current_index, -dtm+1, 1, NO_FUTUREMOVE);
-    } else if (entriesTable[future_index].does_PTM_win()) {
-	commit_update(current_index, -2, 1, NO_FUTUREMOVE);
-    } else if (entriesTable[future_index].does_PNTM_win()) {
-	commit_update(current_index, 2, 1, NO_FUTUREMOVE);
-    } else {
-	fatal("Intra-table back prop doesn't match dtm or movecnt\n");
+		if (! is_non_capture) break;
+	    }
+	}
     }
 }
 
-void propagate_one_move_within_table(tablebase_t *tb, index_t future_index, local_position_t *position)
+std::vector<std::pair<move, global_position_t>> generate_moves(const global_position_t &position)
 {
-    int piece;
+    std::vector<std::pair<move, global_position_t>> result;
 
-    propagate_one_minimove_within_table(tb, future_index, position);
+    for (square_t origin_square = 0; origin_square < 64; origin_square ++) {
 
-    /* En passant:
-     *
-     * We should never enter this function with en-passant set.
-     *
-     * However, we may need to consider a bunch of additional positions here that are identical to
-     * the base position except that a single one of the pawns on the fourth or fifth ranks was
-     * capturable en passant.  Those positions are identical to the base position except that one
-     * extra en passant capture is possible.  Since this is intra-table, we don't do captures.  Just
-     * back-prop into any extra en passant positions that might exist.
-     */
+	if (position.board[origin_square] == 0) continue;
 
-    if (position->en_passant_square != ILLEGAL_POSITION) {
-	fatal("position->en_passant_square != ILLEGAL_POSITION in propagate_one_move_within_table()\n");
-    }
+	PieceColor piece_color = global_pieces2.at(position.board[origin_square]).first;
+	PieceType piece_type = global_pieces2.at(position.board[origin_square]).second;
 
-    for (piece = 0; piece < tb->num_pieces; piece ++) {
+	/* We only want to consider pieces of the side which is to move... */
 
-	if (tb->pieces[piece].color == position->side_to_move) continue;
-	if (tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+	if (piece_color != position.side_to_move) continue;
 
-	/* I've taken care to update board_vector in the routine that calls here specifically so we
-	 * can check for en passant legality here.
-	 */
+	for (auto &dir : movements(piece_type, piece_color, origin_square,
+				   Movement::Forward, Movement::AllMoves)) {
 
-	if ((tb->pieces[piece].color == PieceColor::White)
-	    && (ROW(position->piece_position[piece]) == 3)
-	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] - 8))
-	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] - 16))) {
-	    position->set_en_passant_square(position->piece_position[piece] - 8);
-	    propagate_one_minimove_within_table(tb, future_index, position);
-	}
+	    for (auto &movement : dir) {
 
-	if ((tb->pieces[piece].color == PieceColor::Black)
-	    && (ROW(position->piece_position[piece]) == 4)
-	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] + 8))
-	    && !(position->board_vector & BITVECTOR(position->piece_position[piece] + 16))) {
-	    position->set_en_passant_square(position->piece_position[piece] + 8);
-	    propagate_one_minimove_within_table(tb, future_index, position);
-	}
+		bool is_promotion = ((piece_type == PieceType::Pawn)
+				     && ((ROW(movement) == 7) || (ROW(movement) == 0)));
 
-	position->clear_en_passant_square();
-    }
-}
+		bool is_pawn_capture = ((piece_type == PieceType::Pawn)
+					&& (COL(movement) != COL(origin_square)));
 
-/* back_propagate_index_within_table()
- *
- * Once the final status of an index has been determined, this function back propagates all moves
- * (within the tablebase) from the corresponding position.
- */
+		bool is_non_capture = (position.board[movement] == 0) && !is_pawn_capture;
 
-void back_propagate_index_within_table(index_t index, int reflection)
-{
-    local_position_t position(current_tb);
+		bool is_normal_capture = ((piece_type != PieceType::Pawn) || is_pawn_capture)
+		    && (position.board[movement] != 0)
+		    && (global_pieces2.at(position.board[movement]).first != position.side_to_move);
 
-    /* This can fail if the reflection isn't valid for this index */
+		bool is_en_passant_capture = is_pawn_capture
+		    && (movement == position.en_passant_square);
 
-    if (! index_to_local_position(current_tb, index, reflection, &position)) {
+		if (is_non_capture) {
 
-	if (index == debug_move) {
-	    info("back_propagate_index_within_table; index=%" PRIindex "; reflection %d; INVALID\n",
-		 index, reflection);
-	}
+		    /* Non-capture case: move the piece, so we can test the new position for check */
 
-	return;
-    }
+		    global_position_t new_position = position;
 
-    if (index == debug_move) {
-	info("back_propagate_index_within_table; index=%" PRIindex "; reflection %d\n", index, reflection);
-    }
+		    new_position.flip_side_to_move();
 
-    position.flip_side_to_move();
+		    if ((piece_type == PieceType::Pawn) && (movement - origin_square == 16)
+			&& (   ((COL(movement) != 0) && (position.board[movement-1] == 'p'))
+			       || ((COL(movement) != 7) && (position.board[movement+1] == 'p')))) {
+			new_position.set_en_passant_square(origin_square + 8);
+		    } else if ((piece_type == PieceType::Pawn) && (movement - origin_square == -16)
+			&& (   ((COL(movement) != 0) && (position.board[movement-1] == 'P'))
+			       || ((COL(movement) != 7) && (position.board[movement+1] == 'P')))) {
+			new_position.set_en_passant_square(origin_square - 8);
+		    } else {
+			new_position.clear_en_passant_square();
+		    }
 
-    /* If there are any en passant capturable pawns in the position, then the last move had to
-     * have been a pawn move.  In fact, in this case, we already know exactly what the last move
-     * had to have been.
-     */
+		    new_position.move_piece(origin_square, movement);
 
-    if (position.en_passant_square != ILLEGAL_POSITION) {
+		    if (! global_PNTM_in_check(&new_position)) {
 
-	int en_passant_pawn = -1;
+			if (is_promotion) {
 
-	/* XXX let's store en_passant_pawn in the local position structure and avoid this loop */
+			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-	for (int piece = 0; piece < current_tb->num_pieces; piece++) {
+				place_piece_in_global_position(&new_position, movement,
+							       piece_color, promoted_pieces[promotion]);
 
-	    if (current_tb->pieces[piece].color != position.side_to_move) continue;
-	    if (current_tb->pieces[piece].piece_type != PieceType::Pawn) continue;
+				result.push_back(std::make_pair(move(piece_type, origin_square, movement,
+								     promoted_pieces[promotion]),
+								new_position));
 
-	    if (((current_tb->pieces[piece].color == PieceColor::White)
-		 && (position.piece_position[piece] - 8 == position.en_passant_square))
-		|| ((current_tb->pieces[piece].color == PieceColor::Black)
-		    && (position.piece_position[piece] + 8 == position.en_passant_square))) {
-		if (en_passant_pawn != -1) fatal("Two en passant pawns in back prop?!\n");
-		en_passant_pawn = piece;
-	    }
-	}
-	if (en_passant_pawn == -1) {
-	    fatal("No en passant pawn in back prop!?\n");
-	} else {
+			    }
 
-	    int square;
+			} else {
 
-	    if (current_tb->pieces[en_passant_pawn].color == PieceColor::White)
-		square = position.piece_position[en_passant_pawn] - 16;
-	    else
-		square = position.piece_position[en_passant_pawn] + 16;
+			    result.push_back(std::make_pair(move(piece_type, origin_square, movement),
+							    new_position));
 
-	    /* We never back out into a restricted position.  Since we've already decided that this
-	     * is the only legal back-move from this point, well...
-	     */
+			}
 
-	    if (! (current_tb->pieces[en_passant_pawn].semilegal_squares & BITVECTOR(square))) {
-		return;
-	    }
+		    }
 
-	    local_position_t new_position = position;
+		}
 
-	    new_position.clear_en_passant_square();
+		if (is_normal_capture) {
 
-	    new_position.move_piece(en_passant_pawn, square);
+		    /* Capture case.
+		     *
+		     * We also check to see if the capture was against the enemy king in which case
+		     * this position is a PNTM-mated.
+		     */
 
-	    propagate_one_move_within_table(current_tb, index, &new_position);
-	}
+		    // PieceColor captured_piece_color = global_pieces2.at(position.board[movement]).first;
+		    PieceType captured_piece_type = global_pieces2.at(position.board[movement]).second;
 
-	return;
-    }
+		    if (captured_piece_type == PieceType::King) {
+			throw PNTM_mated();
+		    }
 
-    /* foreach (mobile piece of player NOT TO PLAY) { */
+		    global_position_t new_position = position;
 
-    for (int piece = 0; piece < current_tb->num_pieces; piece++) {
+		    new_position.flip_side_to_move();
 
-	/* We've moving BACKWARDS in the game, so we want the pieces of the player who is NOT TO
-	 * PLAY here - this is the LAST move we're considering, not the next move.
-	 */
+		    new_position.clear_en_passant_square();
 
-	if (current_tb->pieces[piece].color != position.side_to_move)
-	    continue;
+		    new_position.capture_piece(origin_square, movement);
 
-	square_t origin_square = position.piece_position[piece];
+		    if (! global_PNTM_in_check(&new_position)) {
 
-	for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-				   current_tb->pieces[piece].color,
-				   origin_square,
-				   Movement::Backward, Movement::NonCapture)) {
+			if (! is_promotion) {
 
-	    /* What about captures?  Well, first of all, there are no captures here!  We're moving
-	     * BACKWARDS in the game... and pieces don't appear out of thin air.  Captures are
-	     * handled by back-propagation from futurebases, not here in the movement code.  The
-	     * piece moving had to come from somewhere, and that somewhere will now be an empty
-	     * square, so once we've hit another piece along a movement vector, there's absolutely
-	     * no need to consider anything further.
-	     */
+			    result.push_back(std::make_pair(move(piece_type, origin_square, movement, true),
+							    new_position));
+
+			} else {
+
+			    /* Promotion capture case
+			     *
+			     * In this part of the code, we're just counting forward moves, and
+			     * all captures are futurebase moves, so the only difference to us
+			     * whether this is a promotion move or not is how many futuremoves
+			     * get recorded.
+			     */
 
-	    for (auto &movement : dir) {
 
-		if ((position.board_vector & BITVECTOR(movement)) != 0) break;
+			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
 
-		/* We never back out into a restricted position (obviously) */
+				place_piece_in_global_position(&new_position, movement,
+							       piece_color, promoted_pieces[promotion]);
 
-		if (! (current_tb->pieces[piece].semilegal_squares & BITVECTOR(movement))) continue;
+				result.push_back(std::make_pair(move(piece_type, origin_square, movement,
+								     true, promoted_pieces[promotion]),
+								new_position));
+			    }
+			}
+		    }
 
-		/* Back stepping a half move here involves several things: flipping the side-to-move
-		 * flag, clearing any en passant pawns into regular pawns, moving the piece
-		 * (backwards), and considering a bunch of additional positions identical to the
-		 * base position except that a single one of the pawns on the fourth or fifth ranks
-		 * was capturable en passant.
-		 *
-		 * En passant.
-		 *
-		 * The only way we could have gotten an en passant pawn is if THIS MOVE created it.
-		 * We handle that as a special case above, so we shouldn't have to worry about
-		 * clearing en passant pawns here - there should be none.
-		 *
-		 * However, we may be considering a position without en passant set, but from which
-		 * a backwards double pawn move is possible.  We want to know if it has a matching
-		 * position with en passant set.  If so, we do nothing here, since the double pawn
-		 * move will be handled by the en passant code above.  If not, we process the double
-		 * pawn move here.
-		 *
-		 * Checking additional en passant positions is taken care of in
-		 * propagate_one_move_within_table()
-		 */
+		    break;
+		}
 
-		if ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
-		    && (abs(movement - origin_square) == 16)) {
+		if (is_en_passant_capture) {
 
-		    local_position_t new_position = position;
+		    global_position_t new_position = position;
+
+		    new_position.clear_en_passant_square();
+
+		    new_position.move_piece(movement + ((position.side_to_move == PieceColor::White) ? -8 : 8), movement);
+
+		    new_position.capture_piece(origin_square, movement);
 
-		    if (new_position.side_to_move == PieceColor::White) {
-			new_position.set_en_passant_square(origin_square - 8);
-		    } else {
-			new_position.set_en_passant_square(origin_square + 8);
-		    }
 		    new_position.flip_side_to_move();
 
-		    bool en_passant_position_exists = (local_position_to_index(current_tb, &new_position) != INVALID_INDEX);
+		    if (! global_PNTM_in_check(&new_position)) {
 
-		    if (en_passant_position_exists) continue;
-		}
+			result.push_back(std::make_pair(move(piece_type, origin_square, movement, true),
+							new_position));
 
-		local_position_t new_position = position;
+		    }
+		}
 
-		new_position.move_piece(piece, movement);
+		/* If we hit a piece (either a capture or our own piece), end this direction of movement */
 
-		propagate_one_move_within_table(current_tb, index, &new_position);
+		if (!is_non_capture) break;
 	    }
+
 	}
 
     }
+
+    return result;
 }
 
-/* In-check tests
- *
- * We use board masks for quickly testing a position to see if we're in check.
- *
- * The test works by indexing an array by piece type, piece square, and king square, which returns a
- * mask that is ANDed with the board mask.  If the result is non-zero, then no capture is possible.
- * If the result is zero, then the king's in check from that piece.  For sliding piece attacks, we
- * use a mask with ones along the path between the two squares.  For positions where capture is
- * always possible, we use a zero mask.  For positions where no capture is possible, we use an
- * all-1s mask.
- *
- * We segregate pawn checks by color; they are a special case.
- *
- * sizeof(board_mask) = 229376, so this array should fit in your average L2 cache (mine is 2 MB)
- *
- * XXX could use this to speed up the routines after PTM_in_check(), but none of them are used
- * during generation, so they're not as important.
+/* There are three different variants of initialize_tablebase_entry(), that differ in their third
+ * argument.  The first one, that does all the work, takes a const local_position_t to protect
+ * against bugs in that code, the second takes a non-const local_position_t and performs an extra
+ * index_to_local_position conversion on it, and the third takes nothing and creates a
+ * local_position_t on the stack.  The third is deprecated since we now like to call
+ * index_to_local_position on an existing position, if possible, because it's often faster
+ * than creating a new position from scratch.
  */
 
-//board_mask[7][64][64];
-
-std::map<PieceType, uint64_t[64][64]> board_mask;
-std::map<PieceColor, bool[64][64]> pawn_board_mask;
-
-void initialize_board_masks(void)
+futurevector_t initialize_tablebase_entry(const tablebase_t *tb, const index_t index, const local_position_t &position)
 {
-    /* Initialize entire array with ALL_ONES_BITVECTOR */
-    for (square_t A = 0; A < 64; A ++) {
-	for (square_t B = 0; B < 64; B ++) {
-	    for (auto piece : AllPieceTypes) {
-		board_mask[piece][A][B] = ALL_ONES_BITVECTOR;
-	    }
-	    for (auto color : BothColors) {
-		pawn_board_mask[color][A][B] = false;
-	    }
-	}
-    }
+    /* Now we need to count moves.  FORWARD moves. */
+    unsigned int movecnt = 0;
+    unsigned int capturecnt = 0;
+    unsigned int futuremovecnt = 0;
+    futurevector_t futurevector = 0;
+    futurevector_t capture_futurevector = 0;
 
-    for (int piece_square = 0; piece_square < 64; piece_square ++) {
+    bool concede_prune = false;
+    bool resign_prune = false;
 
-	for (auto piece : AllPieceTypes) {
+    thread_local std::vector<move> moves;
 
-	    if (piece != PieceType::Pawn) {
+    /* En passant:
+     *
+     * We're just counting moves here.  In particular, we don't compute the indices of the resulting
+     * positions.  If we did, we'd have to worry about clearing en passant status from any of fourth
+     * or fifth rank pawns, but we don't have to worry about it.
+     *
+     * We do have to count one or two possible extra en passant pawn captures, though...
+     */
 
-		for (auto &dir : movements(piece, PieceColor::White,
-					   piece_square,
-					   Movement::Forward, Movement::Capture)) {
+    try {
 
-		    uint64_t mask = 0;
+	generate_moves(position, moves);
 
-		    for (auto &movement : dir) {
+	for (auto &move : moves) {
 
-			board_mask[piece][piece_square][movement] = mask;
+	    if (index == debug_move) {
+		info("%s ", move.c_str());
+	    }
 
-			mask |= BITVECTOR(movement);
+	    movecnt ++;
+
+	    if (move.is_capture) {
+		capturecnt ++;
+	    }
 
+	    if (move.is_futuremove) {
+		if (move.futuremove == DISCARD_FUTUREMOVE) {
+		    /* it's a discard - decrement movecnt so net change is zero */
+		    movecnt --;
+		    /* discard prune - do nothing */
+		} else if (move.futuremove == CONCEDE_FUTUREMOVE) {
+		    concede_prune = true;
+		} else if (move.futuremove == RESIGN_FUTUREMOVE) {
+		    resign_prune = true;
+		} else if (move.futuremove == HANDLED_FUTUREMOVE) {
+		    // move doesn't have to be tracked
+		} else if (move.futuremove < 0) {
+		    global_position_t global;
+		    index_to_global_position(tb, index, &global);
+		    fatal("No futuremove: %" PRIindex " %s %s\n", index, global_position_to_FEN(&global), move.c_str());
+		} else if (futurevector & FUTUREVECTOR(move.futuremove)) {
+		    global_position_t global;
+		    index_to_global_position(tb, index, &global);
+		    // fatal("Duplicate futuremove: %s %s\n", global_position_to_FEN(&global), move.c_str());
+		    fatal("Duplicate futuremove: %" PRIindex " %s %s\n", index, global_position_to_FEN(&global),
+			  movestr[position.side_to_move][move.futuremove]);
+		} else {
+		    futurevector |= FUTUREVECTOR(move.futuremove);
+		    if (move.is_capture) {
+			capture_futurevector |= FUTUREVECTOR(move.futuremove);
 		    }
 		}
+		futuremovecnt ++;
+	    }
+	}
+    } catch (PNTM_mated ex) {
+	entriesTable->initialize_entry_with_PNTM_mated(index);
+	return 0;
+    }
 
-	    } else {
+    if (concede_prune) {
+	entriesTable->initialize_entry_with_concede(index);
+	return 0;
+    }
 
-		for (auto color : BothColors) {
+    if (resign_prune) {
+	entriesTable->initialize_entry_with_resign(index);
+	return 0;
+    }
 
-		    for (auto &dir : movements(piece, color,
-					       piece_square,
-					       Movement::Forward, Movement::Capture)) {
+    /* Finally, if every possible moves leads us into check, we determine if we're in check, being
+     * the difference between this being checkmate or stalemate.  In suicide analysis, a stalemate
+     * is a win for the stalemated player (international rules).
+     */
 
-			for (auto &movement : dir) {
+    if (movecnt == 0) {
 
-			    pawn_board_mask[color][piece_square][movement] = true;
+	if (tb->variant == Variant::Suicide) {
+	    entriesTable->initialize_entry_with_PNTM_mated(index);
+	} else if (PTM_in_check(tb, &position)) {
+	    entriesTable->initialize_entry_with_PTM_mated(index);
+	} else {
+	    entriesTable->initialize_entry_with_stalemate(index);
+	}
+	return 0;
 
-			}
-		    }
-		}
-	    }
+    } else {
+
+	/* In suicide, captures are forced, so if any captures are possible they are our only moves.
+	 * Of course, if we can capture the opponent's last piece, then we win!
+	 */
+
+	if ((tb->variant == Variant::Suicide) && (capturecnt != 0)) {
+	    movecnt = capturecnt;
+	    futuremovecnt = capturecnt;
+	    futurevector = capture_futurevector;
 	}
+
+	/* Symmetry and multiplicity.  If we're using a symmetric index, then there might be more
+	 * than one actual board position that corresponds to a given index value.  The number of
+	 * non-identical board positions for a given index is called its multiplicity.  So here we
+	 * multiply the movecnt by the multiplicity of the position to get the total number of moves
+	 * out of all possible positions that correspond to this index.
+	 *
+	 * Actually, when computing position.multiplicity, we ignore horizontal and vertical
+	 * symmetry because they always result in doubled (or quadrupled) board positions.  Diagonal
+	 * symmetry is more difficult to handle because the pieces along the diagonal don't move
+	 * when you reflect the board.  So we need to use position.multiplicity to distinguish
+	 * between the two kings being on the a1/h8 diagonal (multiplicity 1), and one of them being
+	 * off the diagonal (multiplicity 2).
+	 */
+
+	entriesTable->initialize_entry_with_movecnt(index, movecnt * position.multiplicity, (capturecnt != 0));
+
+	if (index == debug_move) {
+	    /* other fields were printed by debug_move statement in initialize_entry() */
+	    info("   futurevector " FUTUREVECTOR_HEX_FORMAT "\n", futurevector);
+	}
+
+	total_moves += movecnt;
+	total_futuremoves += futuremovecnt;
+
+	return futurevector;
     }
 }
 
-bool PTM_in_check(const tablebase_t *tb, const local_position_t *position)
+futurevector_t initialize_tablebase_entry(const tablebase_t *tb, const index_t index, local_position_t &position)
 {
-    /* The concept of check doesn't exist in suicide - kings are normal pieces */
+    if (index == debug_move) {
+	info("Initializing %" PRIindex "\n", index);
+    }
 
-    if (tb->variant == Variant::Suicide) return false;
+    mark_progress();
 
-    const int king = (position->side_to_move == PieceColor::White) ? tb->white_king : tb->black_king;
-    const int king_position = position->piece_position[king];
+    if (! index_to_local_position(tb, index, REFLECTION_NONE, &position)) {
 
-    for (int piece = 0; piece < tb->num_pieces; piece++) {
+	entriesTable->initialize_entry_as_illegal(index);
+	return 0;
 
-	/* We only want to consider pieces of the side which is NOT to move... */
+    } else {
 
-	if (tb->pieces[piece].color == position->side_to_move) continue;
+	return initialize_tablebase_entry(tb, index, (const local_position_t) position);
 
-	/* We might have removed the piece from the position... */
+    }
+}
 
-	if (position->piece_position[piece] == ILLEGAL_POSITION) continue;
+futurevector_t initialize_tablebase_entry(tablebase_t *tb, index_t index)
+{
+    local_position_t position(tb);
 
-	if (tb->pieces[piece].piece_type != PieceType::Pawn) {
+    return initialize_tablebase_entry(tb, index, position);
+}
 
-	    if ((board_mask[tb->pieces[piece].piece_type][position->piece_position[piece]][king_position]
-		 & position->board_vector) == 0) return true;
+/* Tablebase initialization is the first important place where we can use threads to speed things up
+ * on a multi-processor machine, though my experience is that actual gains are highly architecture
+ * specific.  Since initialization only touches single entries in the tablebase (no propagation at
+ * this point), thread synchronization is fairly trivial.  We do initialize entire sections instead
+ * of individual entries to avoid processors fighting over cache lines.
+ */
 
-	} else {
+void initialize_tablebase_section(index_t start_index, index_t end_index)
+{
+    index_t index;
+    local_position_t position(current_tb);
+    futurevector_t futurevectors[SparseFuturevectors::block_size];
 
-	    if (pawn_board_mask[tb->pieces[piece].color][position->piece_position[piece]][king_position])
-		return true;
+    for (index=start_index; index <= end_index; index++) {
+	if (current_tb->futurevectors) {
+	    futurevectors[index % SparseFuturevectors::block_size] = initialize_tablebase_entry(current_tb, index, position);
 
+	    if ((index == end_index) || ((index + 1) % SparseFuturevectors::block_size == 0)) {
+		current_tb->futurevectors->set_block(index - index % SparseFuturevectors::block_size, futurevectors);
+	    }
+	} else {
+	    initialize_tablebase_entry(current_tb, index, position);
 	}
     }
-
-    return false;
 }
 
-bool global_PTM_in_check(global_position_t *position)
+void initialize_tablebase(void)
 {
-    if (position->variant == Variant::Suicide) return false;
-
-    for (square_t square = 0; square < 64; square ++) {
+    std::thread t[num_threads];
+    unsigned int thread;
+    index_t block_size = current_tb->num_indices /num_threads;
 
-	if (position->board[square] == 0) continue;
+    /* Each thread gets whole blocks of the sparse futurevectors array */
 
-	auto const pair = global_pieces2.at(position->board[square]);
+    block_size -= block_size % SparseFuturevectors::block_size;
 
-	/* We only want to consider pieces of the side which is NOT to move... */
+    reset_progress_indicator("Initializing tablebase", current_tb->num_indices);
 
-	if (position->side_to_move == pair.first) continue;
+    for (thread = 0; thread < num_threads; thread ++) {
+	index_t start_index = thread*block_size;
+	index_t end_index;
 
-	const PieceType piece_type = pair.second;
+	if (thread != num_threads-1) {
+	    end_index = (thread+1)*block_size - 1;
+	} else {
+	    end_index = current_tb->num_indices - 1;
+	}
 
-	for (auto &dir : movements(piece_type, pair.first, square,
-				   Movement::Forward, Movement::Capture)) {
+	/* With a small tablebase, some threads might not get any blocks */
 
-	    for (auto &movement : dir) {
+	if (end_index + 1 > start_index) {
+	    t[thread] = std::thread(initialize_tablebase_section, start_index, end_index);
+	}
+    }
 
-		/* Now check to see if the movement ended because we hit against the king
-		 * of the opposite color.  If so, we're in check.
-		 */
+    for (thread = 0; thread < num_threads; thread ++) {
+	if (t[thread].joinable()) t[thread].join();
+    }
 
-		if ((position->side_to_move == PieceColor::White) && (position->board[movement] == 'K'))
-		    return true;
-		if ((position->side_to_move == PieceColor::Black) && (position->board[movement] == 'k'))
-		    return true;
-		
-		/* Otherwise, if we hit a piece, end this movement and go on to the next one */
+    end_progress_indicator();
+}
 
-		if (position->board[movement] != 0) break;
+/* Run an intra-table pass, unless it was already fused into the initialization pass, in which case
+ * just return the number of positions it finalized.
+ */
 
-	    }
-	}
+uint64_t intratable_propagation_pass(int target_dtm)
+{
+    if ((fused_pass_dtm != 0) && (target_dtm == fused_pass_dtm)) {
+	fused_pass_dtm = 0;
+	return fused_pass_positions_finalized;
     }
 
-    return false;
+    return propagation_pass(target_dtm);
 }
 
-/* XXX very similar to global_PTM_in_check */
+/* Intra-table propagation is (almost) trivial.  Keep making passes over the tablebase first until
+ * we've processed everything from the futurebases, then until no more progress can be made.  We
+ * don't even have to make every pass, just the ones that have mates in the entries table (and we
+ * track that as we finalize the mates).  Once we're past all the mates that came in from the
+ * futurebases (that's what max_tracked_dtm and min_tracked_dtm show), the only way we can have new
+ * mates is by following a line that's completely within this tablebase, so we keep going until one
+ * of the passes didn't finalize any positions.
+ *
+ * We have to be a little bit careful when we're using proptables, since we can have stuff queued up
+ * in the current proptable that hasn't be reflected in the positive_passes_needed[] and
+ * negative_passes_needed[] arrays, so if we're using proptables, then we ALWAYS run the next pass
+ * after a pass that finalized some positions.  We also never skip a pass that was fused into the
+ * initialization pass (see fused_pass_dtm), since it's already been run.
+ */
 
-bool global_PNTM_in_check(global_position_t *position)
+void propagate_all_moves_within_tablebase(tablebase_t *tb)
 {
-    if (position->variant == Variant::Suicide) return false;
-
-    for (square_t square = 0; square < 64; square ++) {
-
-	if (position->board[square] == 0) continue;
+    int dtm = 1;
+    bool resuming_PNTM_pass = false;
 
-	auto const pair = global_pieces2.at(position->board[square]);
+    positions_finalized_on_last_pass = 0;
 
-	/* We only want to consider pieces of the side which is to move... */
+    doing_capture_backprop = false;
 
-	if (position->side_to_move != pair.first) continue;
+    /* DTM 1 positions are illegal (PNTM is in check), so back prop from these positions is not
+     * needed or desired because we don't count moves into check as part of movecnt.
+     */
 
-	const PieceType piece_type = pair.second;
+    positive_passes_needed[1] = false;
 
-	for (auto &dir : movements(piece_type, pair.first, square,
-				   Movement::Forward, Movement::Capture)) {
+    /* If we're resuming from a checkpoint, then resume_checkpoint() restored the passes_needed
+     * arrays, so we just pick up the loop at the checkpointed pass.  If that was a PNTM pass, skip
+     * the PTM pass in front of it.
+     */
 
-	    for (auto &movement : dir) {
+    if (resume_from_checkpoint && (resume_target_dtm != 0)) {
+	positions_finalized_on_last_pass = resume_positions_finalized;
+	dtm = abs(resume_target_dtm);
+	resuming_PNTM_pass = (resume_target_dtm < 0);
+    }
 
-		/* Now check to see if the movement ended because we hit against the king
-		 * of the opposite color.  If so, we're in check.
-		 */
+    /* If we're tracking DTM, then run at least until we've looked at all the DTM values that came
+     * in from the futurebases.
+     */
 
-		if ((position->side_to_move == PieceColor::White) && (position->board[movement] == 'k'))
-		    return true;
-		if ((position->side_to_move == PieceColor::Black) && (position->board[movement] == 'K'))
-		    return true;
+    if (tracking_dtm) {
 
-		/* Otherwise, if we hit a piece, end this movement and go on to the next one */
+	while ((dtm <= max_tracked_dtm) || (-dtm >= min_tracked_dtm)) {
 
-		if (position->board[movement] != 0) break;
-	    }
+	    /* PTM wins */
+	    if (resuming_PNTM_pass)
+		resuming_PNTM_pass = false;
+	    else if (((dtm <= max_tracked_dtm) && positive_passes_needed[dtm])
+		|| (positions_finalized_on_last_pass > 0))
+		positions_finalized_on_last_pass = intratable_propagation_pass(dtm);
+	    else
+		positions_finalized_on_last_pass = 0;
 
-	}
-    }
+	    if (dtm <= max_tracked_dtm) positive_passes_needed[dtm] = false;
 
-    return false;
-}
+	    /* PNTM wins */
+	    if (((-dtm >= min_tracked_dtm) && negative_passes_needed[dtm])
+		|| (positions_finalized_on_last_pass > 0) || (fused_pass_dtm == -dtm))
+		positions_finalized_on_last_pass = intratable_propagation_pass(-dtm);
+	    else
+		positions_finalized_on_last_pass = 0;
 
-bool PNTM_in_check(const tablebase_t *tb, const local_position_t *position)
-{
-    if (tb->variant == Variant::Suicide) return false;
+	    if (-dtm >= min_tracked_dtm) negative_passes_needed[dtm] = false;
 
-    for (int piece = 0; piece < tb->num_pieces; piece++) {
+	    dtm ++;
+	}
 
-	/* We only want to consider pieces of the side which is to move... */
+    } else if (! resume_from_checkpoint) {
 
-	if (tb->pieces[piece].color != position->side_to_move) continue;
+	positions_finalized_on_last_pass = 1;
 
-	for (auto &dir : movements(tb->pieces[piece].piece_type,
-				   tb->pieces[piece].color,
-				   position->piece_position[piece],
-				   Movement::Forward, Movement::Capture)) {
+    }
 
-	    for (auto &movement : dir) {
+    /* Now keep running until there's nothing left to process */
 
-		/* Now check to see if the movement ended because we hit against the king
-		 * of the opposite color.  If so, we're in check.
-		 */
+    while (1) {
 
-		if ((position->side_to_move == PieceColor::White)
-		    && (movement == position->piece_position[tb->black_king])) return true;
+	/* PTM wins */
+	if (resuming_PNTM_pass)
+	    resuming_PNTM_pass = false;
+	else if ((positions_finalized_on_last_pass > 0) || (fused_pass_dtm == dtm))
+	    positions_finalized_on_last_pass = intratable_propagation_pass(dtm);
+	else break;
 
-		if ((position->side_to_move == PieceColor::Black)
-		    && (movement == position->piece_position[tb->white_king])) return true;
+	/* PNTM wins */
+	if (positions_finalized_on_last_pass > 0)
+	    positions_finalized_on_last_pass = intratable_propagation_pass(-dtm);
+	else break;
 
-		if (position->board_vector & BITVECTOR(movement)) break;
-	    }
-	}
+	dtm ++;
     }
 
-    return false;
+    /* Nothing should skip the fused pass (it's already been run, so its positions have to be
+     * counted), but if something did, don't let it swallow some later pass with the same DTM.
+     */
+
+    assert(fused_pass_dtm == 0);
+    fused_pass_dtm = 0;
 }
 
-/* initialize_tablebase()
- *
- * This is another critical function; don't be deceived by the tame word 'initialize'.
- *
- * We determine that a position is won for the player not to move (PNTM) if all possible moves (of
- * the player to move) lead to a won game for PNTM.  We count down this total during back
- * propagation, so it stands to reason that we need an accurate count to start with.  Thus the
- * importance of this function.
- *
- * We don't count moves into check at all.
- *
- * Basically, there are two types of moves we need to consider in each position:
- *
- * 1. non-capture, non-promotion, non-restricted moves
- *
- * We just add these up and then count them down during intra-table propagation, depending on the
- * integrity of the program's algorithm to make sure that every move counted forward gets considered
- * as a move backward.
- *
- * 2. everything else (futuremoves)
- *
- * These always lead to a different tablebase (a futurebase).  The only way we handle them is
- * through inter-table back propagation.  We keep a seperate count of futuremoves because, unlike
- * intratable moves, we might miss some of these moves if we don't have a complete set of
- * futurebases.  So we count futuremoves by themselves (as well as part of the standard count), and
- * count them down normally during a single sweep through our futurebases.  If that takes care of
- * everything fine.  Otherwise, during our first pass through the current tablebase, we'll find that
- * some of the futuremoves remain unaccounted for.  If they occur with the "good guys" as PTM, we
- * just double-check that the restriction is OK, subtract the remaining futuremoves out from the
- * standard count, and keep going.  But if the "bad guys" are PTM, then the position has to be
- * assumed won for PTM.
+/* Seekable tablebases
  *
+ * Normally the entire file is a single gzip stream, which is fine for reading it sequentially
+ * during back propagation, but any backwards seek means decompressing again from the beginning of
+ * the file.  With --seekable-output, the XML header and pawngen data are written as one gzip
+ * member, then comes a table of little-endian 64-bit file offsets (one per block, plus one for the
+ * end of the file), then the entries in blocks of futurebase_stride indices, each compressed separately by
+ * zlib.  A 'block-size' attribute on the root element marks the format.  Reading any index then
+ * costs a single block decompress.
  */
 
-class move {
-
-    PieceType piece_type;
-    square_t origin_square;
-    square_t destination_square;
-    PieceType promotion_type;
+bool seekable_output = false;
 
-public:
+/* Write entries 'start' through 'end'-1 in the tablebase's output format.  'start' has to be a
+ * multiple of eight.
+ */
 
-    int futuremove;
+void write_entries(tablebase_t *tb, std::ostream & outstream, index_t start, index_t end)
+{
+    char entrybuf[MAX_FORMAT_BYTES];
 
-    bool is_futuremove;
-    bool is_capture;
-    bool is_promotion;
+    for (index_t index = start; index < end; index ++) {
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  is_futuremove(false), is_capture(false), is_promotion(false)
-    { }
+	if (index == debug_move) {
+	    info("Writing %" PRIindex ": DTM %d; movecnt %d\n", index,
+		 entriesTable[index].get_DTM(), entriesTable[index].get_movecnt());
+	}
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, int futuremove)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  futuremove(futuremove),
-	  is_futuremove(true), is_capture(false), is_promotion(false)
-    { }
+	/* Right now, there's four possible fields in the tablebase format itself (as opposed to the
+	 * intermediate entries and proptable formats) - dtm, dtc, basic, and flag.
+	 */
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, PieceType promotion_type)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  promotion_type(promotion_type),
-	  is_futuremove(true), is_capture(false), is_promotion(true)
-    { }
+	if (tb->format.dtm_bits > 0) {
+	    set_int_field(entrybuf,
+			  tb->format.dtm_offset + ((index % 8) * tb->format.bits),
+			  tb->format.dtm_bits,
+			  entriesTable[index].get_DTM());
+	}
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, PieceType promotion_type, int futuremove)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  promotion_type(promotion_type), futuremove(futuremove),
-	  is_futuremove(true), is_capture(false), is_promotion(true)
-    { }
+	if (tb->format.dtc_bits > 0) {
+	    set_int_field(entrybuf,
+			  tb->format.dtc_offset + ((index % 8) * tb->format.bits),
+			  tb->format.dtc_bits,
+			  entriesTable[index].get_DTM());
+	}
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  is_futuremove(true), is_capture(is_capture), is_promotion(false)
-    { }
+	if (tb->format.basic_offset != -1) {
+	    Basic basic;
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, int futuremove)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  futuremove(futuremove),
-	  is_futuremove(true), is_capture(is_capture), is_promotion(false)
-    { }
+	    /* 2-bit BASIC format
+	     *
+	     * 0 - draw
+	     * 1 - PTM wins
+	     * 2 - PNTM wins
+	     * 3 - illegal position (PNTM in check)
+	     *
+	     * Indices that generate illegal positions, not in the above sense, but in the sense of
+	     * multiple pieces mapping to the same square, will get recorded as draws, but these can
+	     * be easily identified by the index-to-position function, so their values in the
+	     * tablebase are largely irrelevant.  Type 3 illegal positions (PNTM in check) are not
+	     * so obvious and need to be flagged as such to avoid using them during backprop.
+	     */
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, PieceType promotion_type)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  promotion_type(promotion_type),
-	  is_futuremove(true), is_capture(is_capture), is_promotion(true)
-    { }
+	    if (entriesTable[index].get_DTM() == 1) {
+		basic = Basic::Illegal;
+	    } else if (entriesTable[index].does_PTM_win()) {
+		basic = Basic::PTMwins;
+	    } else if (entriesTable[index].does_PNTM_win()) {
+		basic = Basic::PNTMwins;
+	    } else {
+		basic = Basic::Draw;
+	    }
+	    set_unsigned_int_field(entrybuf,
+				   tb->format.basic_offset + ((index % 8) * tb->format.bits), 2,
+				   static_cast<int>(basic));
+	}
 
-    move(PieceType piece_type, square_t origin_square, square_t destination_square, bool is_capture, PieceType promotion_type, int futuremove)
-	: piece_type(piece_type), origin_square(origin_square), destination_square(destination_square),
-	  promotion_type(promotion_type), futuremove(futuremove),
-	  is_futuremove(true), is_capture(is_capture), is_promotion(true)
-    { }
+	switch (tb->format.flag_type) {
+	case FormatFlag::WhiteWins:
+	    set_bit_field(entrybuf,
+			  tb->format.flag_offset + ((index % 8) * tb->format.bits),
+			  (index_to_side_to_move(tb, index) == PieceColor::White)
+			  ? entriesTable[index].does_PTM_win() : entriesTable[index].does_PNTM_win());
+	    break;
+	case FormatFlag::WhiteDraws:
+	    set_bit_field(entrybuf,
+			  tb->format.flag_offset + ((index % 8) * tb->format.bits),
+			  (index_to_side_to_move(tb, index) == PieceColor::White)
+			  ? ! entriesTable[index].does_PNTM_win() : ! entriesTable[index].does_PTM_win());
+	    break;
+	case FormatFlag::None:
+	    break;
+	}
 
-    operator std::string() const {
-	return piece_char[piece_type] + algebraic_notation(origin_square)
-	    + (is_capture ? "x" : "") + algebraic_notation(destination_square)
-	    + (is_promotion ? (std::string)"=" + piece_char[promotion_type] : "");
-    }
+	/* If the next index will be aligned on a byte boundary, write out what we've buffered.  The
+	 * logic here is that if each index requires 'bits' bits, we write eight indices at a time
+	 * and that requires exactly 'bits' bytes.
+	 */
 
-    const char * c_str() const {
-	return ((std::string)(*this)).c_str();
+	if ((index % 8 == 7) || (index == end - 1)) {
+	    outstream.write(entrybuf, tb->format.bits);
+	}
     }
-};
-
-/* XXX perhaps collapse the next two functions together using templates  */
+}
 
-/* This is a special exception value for PNTM mated positions.
+/* Parallel compression of the output
  *
- * Since detecting a PNTM mate allows us to break out of the move generator and flag the position
- * invalid, this exception probably doesn't cost much of a performance penalty vs continuing
- * to run the loop.
+ * Packing the entries into the output format and compressing them is the slowest part of writing
+ * out a big tablebase, and zlib only ever uses one core.  So we split the entries into chunks, which
+ * num_threads worker threads claim in order, pack (usually with write_entries()) and compress,
+ * while the calling thread writes the finished chunks to the file in order.  No more than
+ * output_chunks_per_thread chunks per thread are ever waiting to be written, which bounds the
+ * memory we use.  Some sources of entries, like a DiskEntriesTable, can only be read in order, one
+ * thread at a time.  For them, 'pack_in_order' is set, the packing gets done while holding the
+ * lock, and only the compression runs in parallel.
  */
 
-class PNTM_mated : public std::exception { };
+const unsigned int output_chunks_per_thread = 2;
+const index_t output_chunk_size = 64 * futurebase_stride;
 
-void generate_moves(const local_position_t &position, std::vector<move> &result)
+struct compressed_chunk {
+    std::string data;
+    size_t length;		/* uncompressed length */
+    uLong crc;			/* crc32 of the uncompressed data */
+};
+
+template <typename Packer, typename Compressor, typename Writer>
+void compress_entries(tablebase_t *tb, index_t chunk_indices, Packer pack, bool pack_in_order,
+		      Compressor compress, Writer write)
 {
-    const tablebase_t *tb = position.tb;
+    index_t num_chunks = (tb->num_indices + chunk_indices - 1) / chunk_indices;
+    index_t capacity = output_chunks_per_thread * num_threads;
+    std::vector<compressed_chunk> chunks(capacity);
+    std::vector<bool> ready(capacity, false);
+    index_t next_chunk = 0;
+    index_t next_write = 0;
+    bool stopping = false;
+    std::mutex lock;
+    std::condition_variable chunk_ready;
+    std::condition_variable space_ready;
+    std::vector<std::thread> workers;
 
-    result.clear();
+    auto worker = [&] () {
 
-    for (int piece = 0; piece < tb->num_pieces; piece++) {
+	while (1) {
+	    std::ostringstream entries;
+	    compressed_chunk output;
+	    index_t chunk;
 
-	/* We only want to consider pieces of the side which is to move... */
+	    {
+		std::unique_lock<std::mutex> l(lock);
 
-	if (tb->pieces[piece].color != position.side_to_move) continue;
+		space_ready.wait(l, [&] { return stopping || (next_chunk >= num_chunks)
+					  || (next_chunk < next_write + capacity); });
 
-	int origin_square = position.piece_position[piece];
+		if (stopping || (next_chunk >= num_chunks)) return;
 
-	for (auto &dir : movements(tb->pieces[piece].piece_type,
-				   tb->pieces[piece].color,
-				   position.piece_position[piece],
-				   Movement::Forward, Movement::AllMoves)) {
+		chunk = next_chunk ++;
 
-	    for (auto &movement : dir) {
+		if (pack_in_order) {
+		    pack(entries, chunk * chunk_indices, std::min((chunk + 1) * chunk_indices, tb->num_indices));
+		}
+	    }
 
-		bool is_promotion = ((tb->pieces[piece].piece_type == PieceType::Pawn)
-				     && ((ROW(movement) == 7) || (ROW(movement) == 0)));
+	    if (! pack_in_order) {
+		pack(entries, chunk * chunk_indices, std::min((chunk + 1) * chunk_indices, tb->num_indices));
+	    }
 
-		bool is_pawn_capture = ((tb->pieces[piece].piece_type == PieceType::Pawn)
-					&& (COL(movement) != COL(position.piece_position[piece])));
+	    compress(entries.str(), output);
 
-		bool is_non_capture = ((BITVECTOR(movement) & position.board_vector) == 0) && !is_pawn_capture;
+	    {
+		std::lock_guard<std::mutex> _(lock);
+		chunks[chunk % capacity] = std::move(output);
+		ready[chunk % capacity] = true;
+	    }
 
-		bool is_normal_capture = ((tb->pieces[piece].piece_type != PieceType::Pawn) || is_pawn_capture)
-		    && ((BITVECTOR(movement) & position.board_vector) != 0)
-		    && ((BITVECTOR(movement) & position.PTM_vector) == 0);
+	    chunk_ready.notify_one();
+	}
+    };
 
-		bool is_en_passant_capture = is_pawn_capture
-		    && (movement == position.en_passant_square);
+    for (unsigned int thread = 0; thread < num_threads; thread ++) {
+	workers.emplace_back(worker);
+    }
 
-		if (is_non_capture) {
+    try {
+	for (index_t chunk = 0; chunk < num_chunks; chunk ++) {
+	    compressed_chunk output;
 
-		    /* Non-capture case: move the piece, so we can test the new position for check */
+	    {
+		std::unique_lock<std::mutex> l(lock);
 
-		    local_position_t new_position = position;
+		chunk_ready.wait(l, [&] { return ready[chunk % capacity]; });
 
-		    new_position.move_piece(piece, movement);
+		output = std::move(chunks[chunk % capacity]);
+		ready[chunk % capacity] = false;
+		next_write ++;
+	    }
 
-		    /* We don't set en passant square here since it doesn't affect the in-check
-		     * calculation, and we're not using the position for anything else.
-		     */
+	    space_ready.notify_all();
 
-		    if (! PTM_in_check(tb, &new_position)) {
+	    write(chunk, output);
+	}
+    } catch (...) {
+	{
+	    std::lock_guard<std::mutex> _(lock);
+	    stopping = true;
+	}
+	space_ready.notify_all();
+	for (auto & thread : workers) thread.join();
+	throw;
+    }
 
-			/* If the piece is a pawn and we're moving to the last rank, then this has
-			 * to be a promotion move, in fact, promotion_possibilities moves.  (queen,
-			 * knight, maybe rook and bishop, king for suicide).  As such, they will
-			 * require back propagation from futurebases and must therefore be flagged
-			 * as futuremoves.
-			 */
+    for (auto & thread : workers) thread.join();
+}
 
-			if (is_promotion) {
+/* A gzip stream doesn't have to be compressed all in one go.  If we compress each chunk as a raw
+ * deflate stream ending with a sync flush (which ends on a byte boundary without marking the final
+ * block), the chunks can be concatenated, and only the last one gets finished.  Put a gzip header
+ * in front and a trailer with the combined crc32 and length behind, and we've got a single gzip
+ * member that any gzip reader will accept - including our own gzip_decompressor, which stops at
+ * the end of the first member.  Each chunk starts with an empty dictionary, which costs a little
+ * compression at the chunk boundaries.
+ */
 
-			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+void deflate_chunk(const std::string & data, bool last, compressed_chunk & output)
+{
+    z_stream stream;
 
-				result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-						      promoted_pieces[promotion], promotions[piece][promotion]));
+    memset(&stream, 0, sizeof(stream));
 
-			    }
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	fatal("Can't initialize zlib\n");
+	terminate();
+    }
 
-			    /* If we're NOT moving into check AND the piece is moving outside its
-			     * legal squares AND we can't permute the pieces into a position where
-			     * everything is legal (local_position_to_index), we regard this as a
-			     * futuremove (since it will require back prop from futurebases).  We
-			     * could just check if local_position_to_index() returns a valid index,
-			     * but checking the legal_squares bitvector first makes this a little
-			     * faster.
-			     */
+    /* deflateBound() doesn't count the sync flush marker */
 
-			} else if (!(tb->pieces[piece].legal_squares & BITVECTOR(movement))
-			    && (local_position_to_index(tb, &new_position) == INVALID_INDEX)) {
+    output.data.resize(deflateBound(&stream, data.size()) + 16);
 
-			    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-						  futuremoves[piece][movement]));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef *>(&output.data[0]);
+    stream.avail_out = output.data.size();
 
-			} else {
+    int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
 
-			    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement));
+    if ((last && (result != Z_STREAM_END))
+	|| (! last && ((result != Z_OK) || (stream.avail_in != 0) || (stream.avail_out == 0)))) {
+	fatal("Can't compress tablebase data: %s\n", stream.msg ? stream.msg : "output buffer too small");
+	terminate();
+    }
 
-			}
+    output.data.resize(stream.total_out);
+    output.length = data.size();
+    output.crc = crc32(crc32(0, nullptr, 0), reinterpret_cast<const Bytef *>(data.data()), data.size());
 
-		    }
+    deflateEnd(&stream);
+}
 
-		}
+void write_little_endian_uint32(std::ostream & outstream, uint32_t value)
+{
+    for (int byte = 0; byte < 4; byte ++) {
+	outstream.put(static_cast<char>((value >> (8 * byte)) & 0xff));
+    }
+}
 
-		if (is_normal_capture) {
+void write_little_endian_uint64(std::ostream & outstream, uint64_t value)
+{
+    for (int byte = 0; byte < 8; byte ++) {
+	outstream.put(static_cast<char>((value >> (8 * byte)) & 0xff));
+    }
+}
 
-		    /* Capture case.
-		     *
-		     * Check to see if the movement ended because we hit against another piece of
-		     * the opposite color.  If so, add another move for the capture.  As before,
-		     * ignore moves into check.
-		     *
-		     * Actually, we check to see that we DIDN'T hit a piece of our OWN color.  The
-		     * difference is that this way we don't register a capture if we hit the end of
-		     * the list of movements in a given direction.
-		     *
-		     * We also check to see if the capture was against the enemy king! in which case
-		     * this position is a PNTM-mated.
-		     */
+/* Write out tablebase 'tb' with XML header 'doc'.  The entries come from 'pack', which writes the
+ * entries for a range of indices to an output stream, like write_entries() does, and only gets
+ * called on one range at a time, in order, if 'pack_in_order' is set.
+ */
 
-		    int captured_piece;
+template <typename Packer>
+void write_tablebase_file(tablebase_t *tb, xmlpp::Document * doc, Glib::ustring filename,
+			  Packer pack, bool pack_in_order)
+{
+    int size;
+    int padded_size;
+    int offset;
 
-		    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+    if (seekable_output) {
+	doc->get_root_node()->set_attribute("block-size", boost::lexical_cast<std::string>(futurebase_stride));
+    } else {
+	doc->get_root_node()->remove_attribute("block-size");
+    }
 
-			if (movement == position.piece_position[captured_piece]) {
+    /* We want at least one zero byte after the XML header, because that's how we figure out where
+     * it ends when we read it back in, and I also want to align the tablebase on a four-byte
+     * boundary for the hell of it.  (size+5)&(~3) achieves these goals.  I then modify the XML
+     * header with the updated string that gives the offset to the tablebase, and make sure that its
+     * size hasn't changed.
+     */
 
-			    if ((captured_piece == tb->black_king) || (captured_piece == tb->white_king)) {
-				throw PNTM_mated();
-			    }
+    size = doc->write_to_string().length();
 
-			    local_position_t new_position = position;
+    do {
 
-			    new_position.capture_piece(piece, captured_piece);
+	padded_size = (size+5)&(~3);
 
-			    if (! PTM_in_check(tb, &new_position)) {
+	offset = padded_size;
+	if (tb->pawngen) {
+	    dynamic_cast<xmlpp::Element *>(doc->get_root_node()->find("//pawngen")[0])->set_attribute("offset", boost::lexical_cast<std::string>(offset));
+	    offset += pawn_position::binary_size * tb->pawngen->pawn_positions_by_index.size();
+	}
 
-				if (! is_promotion) {
+	doc->get_root_node()->set_attribute("offset", boost::lexical_cast<std::string>(offset));
 
-				    result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-							  true, futurecaptures[piece][captured_piece]));
+	size = doc->write_to_string().length();
 
-				} else {
+    } while (padded_size != ((size+5)&(~3)));
 
-				    /* Promotion capture case
-				     *
-				     * In this part of the code, we're just counting forward moves, and
-				     * all captures are futurebase moves, so the only difference to us
-				     * whether this is a promotion move or not is how many futuremoves
-				     * get recorded.
-				     */
+    info("Writing '%s'\n", filename.c_str());
+
+    std::ofstream output_file;
+    output_file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+    output_file.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+
+    /* First we write an XML header, then any pawngen data */
+
+    auto write_header = [&] (std::ostream & outstream) {
+
+	doc->write_to_stream(outstream);
+
+	for (; size < padded_size; size ++) outstream << '\0';
 
+	if (tb->pawngen) {
+	    for (auto & pp : tb->pawngen->pawn_positions_by_index) {
+		pp >> outstream;
+	    }
+	}
+    };
 
-				    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+    /* Then we write the tablebase data */
 
-					result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-							      true, promoted_pieces[promotion], promotion_captures[piece][captured_piece][promotion]));
-				    }
-				}
-			    }
+    if (! seekable_output) {
 
-			    break;
-			}
-		    }
+	/* Gzip header: magic, deflate, no flags, no timestamp, no extra flags, Unix */
 
-		    if (captured_piece == tb->num_pieces) {
-			fatal("Couldn't match capture!\n");
-		    }
-		}
+	static const char gzip_header[] = { '\037', '\213', 8, 0, 0, 0, 0, 0, 0, 3 };
 
-		if (is_en_passant_capture) {
+	output_file.write(gzip_header, sizeof(gzip_header));
 
-		    int captured_piece;
+	std::ostringstream header;
+	compressed_chunk header_chunk;
 
-		    /* XXX recording en passant piece in position structure would avoid this loop */
+	write_header(header);
+	deflate_chunk(header.str(), false, header_chunk);
+	output_file.write(header_chunk.data.data(), header_chunk.data.size());
 
-		    for (captured_piece = 0; captured_piece < tb->num_pieces; captured_piece ++) {
+	uLong crc = header_chunk.crc;
+	uint64_t length = header_chunk.length;
 
-			if (movement ==
-			    (position.piece_position[captured_piece]
-			     + ((position.side_to_move == PieceColor::White) ? 8 : -8))) {
+	compress_entries(tb, output_chunk_size, pack, pack_in_order,
+			 [] (const std::string & entries, compressed_chunk & output) {
+			     deflate_chunk(entries, false, output);
+			 },
+			 [&] (index_t chunk, const compressed_chunk & output) {
+			     output_file.write(output.data.data(), output.data.size());
+			     crc = crc32_combine(crc, output.crc, output.length);
+			     length += output.length;
+			 });
 
-			    local_position_t new_position = position;
+	/* An empty final block ends the deflate stream, then the trailer's length is mod 2^32 */
 
-			    new_position.move_piece(captured_piece, position.en_passant_square);
+	compressed_chunk last_block;
 
-			    new_position.capture_piece(piece, captured_piece);
+	deflate_chunk(std::string(), true, last_block);
+	output_file.write(last_block.data.data(), last_block.data.size());
 
-			    if (! PTM_in_check(tb, &new_position)) {
+	write_little_endian_uint32(output_file, crc);
+	write_little_endian_uint32(output_file, static_cast<uint32_t>(length));
 
-				result.push_back(move(tb->pieces[piece].piece_type, origin_square, movement,
-						      true, futurecaptures[piece][captured_piece]));
+    } else {
 
-			    }
+	/* The header has to be a complete gzip member before the block table goes after it */
 
-			    break;
-			}
-		    }
+	std::string header;
 
-		    if (captured_piece == tb->num_pieces) {
-			fatal("Couldn't match en passant capture!\n");
-		    }
-		}
+	{
+	    io::filtering_ostream headerstream;
 
-		/* If we hit a piece (either a capture or our own piece), end this direction of movement */
+	    headerstream.push(io::gzip_compressor());
+	    headerstream.push(io::back_inserter(header));
 
-		if (! is_non_capture) break;
-	    }
+	    write_header(headerstream);
 	}
-    }
-}
 
-std::vector<std::pair<move, global_position_t>> generate_moves(const global_position_t &position)
-{
-    std::vector<std::pair<move, global_position_t>> result;
+	output_file.write(header.data(), header.size());
 
-    for (square_t origin_square = 0; origin_square < 64; origin_square ++) {
+	index_t num_blocks = (tb->num_indices + futurebase_stride - 1) / futurebase_stride;
+	std::vector<uint64_t> block_offsets(num_blocks + 1);
 
-	if (position.board[origin_square] == 0) continue;
+	output_file.seekp(header.size() + block_offsets.size() * 8);
 
-	PieceColor piece_color = global_pieces2.at(position.board[origin_square]).first;
-	PieceType piece_type = global_pieces2.at(position.board[origin_square]).second;
+	compress_entries(tb, futurebase_stride, pack, pack_in_order,
+			 [&filename] (const std::string & entries, compressed_chunk & output) {
+			     uLongf compressed_size = compressBound(entries.size());
 
-	/* We only want to consider pieces of the side which is to move... */
+			     output.data.resize(compressed_size);
 
-	if (piece_color != position.side_to_move) continue;
+			     if (compress2(reinterpret_cast<Bytef *>(&output.data[0]), &compressed_size,
+					   reinterpret_cast<const Bytef *>(entries.data()), entries.size(),
+					   Z_DEFAULT_COMPRESSION) != Z_OK) {
+				 fatal("Can't compress block of '%s'\n", filename.c_str());
+				 terminate();
+			     }
 
-	for (auto &dir : movements(piece_type, piece_color, origin_square,
-				   Movement::Forward, Movement::AllMoves)) {
+			     output.data.resize(compressed_size);
+			     output.length = entries.size();
+			 },
+			 [&] (index_t block, const compressed_chunk & output) {
+			     block_offsets[block] = output_file.tellp();
+			     output_file.write(output.data.data(), output.data.size());
+			 });
 
-	    for (auto &movement : dir) {
+	block_offsets[num_blocks] = output_file.tellp();
 
-		bool is_promotion = ((piece_type == PieceType::Pawn)
-				     && ((ROW(movement) == 7) || (ROW(movement) == 0)));
+	output_file.seekp(header.size());
+	for (auto offset : block_offsets) {
+	    write_little_endian_uint64(output_file, offset);
+	}
+    }
 
-		bool is_pawn_capture = ((piece_type == PieceType::Pawn)
-					&& (COL(movement) != COL(origin_square)));
+    /* File close is done implicitly by the destructor. */
+}
 
-		bool is_non_capture = (position.board[movement] == 0) && !is_pawn_capture;
+/* The 'filename' argument passed in here can either be a filename or a URL.  We don't distinguish
+ * between them except by looking at their prefix (though it would be easy to add an extra flag
+ * argument to do so), so hopefully nobody will try to create tablebases starting with 'ftp:'.  Much
+ * of the error checking on 'filename' is done by the caller, since we'd like that error checking to
+ * occur prior to a time consuming generation run, rather than when we're ready to write the
+ * finished product out.
+ *
+ * XXX put URL support back in
+ *
+ * XXX figure out boost iostreams error handling
+ */
 
-		bool is_normal_capture = ((piece_type != PieceType::Pawn) || is_pawn_capture)
-		    && (position.board[movement] != 0)
-		    && (global_pieces2.at(position.board[movement]).first != position.side_to_move);
+void write_tablebase_to_file(tablebase_t *tb, Glib::ustring filename)
+{
+    xmlpp::Document * doc;
+    int dtm_bits;
 
-		bool is_en_passant_capture = is_pawn_capture
-		    && (movement == position.en_passant_square);
+    for (dtm_bits = 1; (1 << (dtm_bits - 1) <= max_dtm) || (1 << (dtm_bits - 1) < -min_dtm); dtm_bits ++);
 
-		if (is_non_capture) {
+    if ((tb->format.dtm_offset != -1) && (tb->format.dtm_bits == 0)) {
+	tb->format.dtm_bits = dtm_bits;
+	tb->format.bits += dtm_bits;
+    } else if (tb->format.dtm_bits > 0) {
+	if (tb->format.dtm_bits < dtm_bits) {
+	    fatal("Requested DTM field size too small\n");
+	    terminate();
+	}
+    }
 
-		    /* Non-capture case: move the piece, so we can test the new position for check */
+    if ((tb->format.dtc_offset != -1) && (tb->format.dtc_bits == 0)) {
+	tb->format.dtc_bits = dtm_bits;
+	tb->format.bits += dtm_bits;
+    } else if (tb->format.dtc_bits > 0) {
+	if (tb->format.dtc_bits < dtm_bits) {
+	    fatal("Requested DTC field size too small\n");
+	    terminate();
+	}
+    }
 
-		    global_position_t new_position = position;
+    doc = finalize_XML_header(tb);
 
-		    new_position.flip_side_to_move();
+    write_tablebase_file(tb, doc, filename,
+			 [tb] (std::ostream & outstream, index_t start, index_t end) {
+			     write_entries(tb, outstream, start, end);
+			 },
+			 using_proptables);
+}
 
-		    if ((piece_type == PieceType::Pawn) && (movement - origin_square == 16)
-			&& (   ((COL(movement) != 0) && (position.board[movement-1] == 'p'))
-			       || ((COL(movement) != 7) && (position.board[movement+1] == 'p')))) {
-			new_position.set_en_passant_square(origin_square + 8);
-		    } else if ((piece_type == PieceType::Pawn) && (movement - origin_square == -16)
-			&& (   ((COL(movement) != 0) && (position.board[movement-1] == 'P'))
-			       || ((COL(movement) != 7) && (position.board[movement+1] == 'P')))) {
-			new_position.set_en_passant_square(origin_square - 8);
-		    } else {
-			new_position.clear_en_passant_square();
-		    }
+/* Memory budgeting
+ *
+ * With --memory-budget, we estimate how much memory our big data structures will need and pick the
+ * fastest configuration that fits, so that nobody has to hand tune -P and -U.  In-memory generation
+ * is much faster than proptables, so we use it if the entries table, the futurevectors array and
+ * the futurebase caches all fit.  If we're not tracking DTM, whatever's left over goes to the
+ * unpropagated index table, up to the point where it could hold an eighth of the indices (past
+ * that, sweeping the whole entries table is just as fast).  If in-memory won't fit, we switch to
+ * proptables and give them everything that the futurebase caches don't need.
+ *
+ * These are only estimates, so we hold back memory_budget_reserve_percent of the budget for
+ * everything we don't account for - the program itself, the XML, stream buffers, and so on.
+ */
 
-		    new_position.move_piece(origin_square, movement);
+size_t memory_budget_MBs = 0;
 
-		    if (! global_PNTM_in_check(&new_position)) {
+const size_t memory_budget_reserve_percent = 10;
+const size_t futurebase_stream_overhead = 64 << 10;	/* zlib and iostreams state per futurebase */
+const size_t minimum_proptable_MBs = 16;
 
-			if (is_promotion) {
+bool choose_memory_configuration(tablebase_t *tb)
+{
+    size_t budget = (memory_budget_MBs << 20) / 100 * (100 - memory_budget_reserve_percent);
+    size_t entries_bytes;
+    size_t futurevector_bytes = 0;
+    size_t futurebase_bytes;
+    int max_futurebase_bits = 0;
 
-			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+    if (tracking_dtm) {
+	entries_bytes = tb->num_indices * sizeof(atomic_entry);
+    } else {
+	unsigned int compact_bits = ((tb->variant == Variant::Normal) ? 0 : 1) + EntriesTable::movecnt_bits_needed(false);
+	entries_bytes = (tb->num_indices * compact_bits + 7) / 8 + 1;
+    }
 
-				place_piece_in_global_position(&new_position, movement,
-							       piece_color, promoted_pieces[promotion]);
+    /* We don't know how many positions will have futuremoves until we've initialized the
+     * tablebase, so assume the worst.
+     */
 
-				result.push_back(std::make_pair(move(piece_type, origin_square, movement,
-								     promoted_pieces[promotion]),
-								new_position));
+    if ((num_futuremoves[PieceColor::White] > 0) || (num_futuremoves[PieceColor::Black] > 0)) {
+	futurevector_bytes = SparseFuturevectors::max_size(tb->num_indices, num_futuremoves[PieceColor::White],
+							   num_futuremoves[PieceColor::Black], tb->encode_stm);
+    }
 
-			    }
+    /* Each thread caches a block of whichever futurebase it's reading (see fetch_entry()), and
+     * each of the futurebases we're back propagating at once has a read-ahead queue holding a few
+     * more per thread, with its decompressors having one apiece in progress.  Every preloaded
+     * futurebase keeps its decompressor open.  Back propagation reads sequentially, so the shared
+     * block cache stays empty while we're generating.
+     */
 
-			} else {
+    for (auto & futurebase : futurebases) {
+	if (futurebase.format.bits > max_futurebase_bits) max_futurebase_bits = futurebase.format.bits;
+    }
 
-			    result.push_back(std::make_pair(move(piece_type, origin_square, movement),
-							    new_position));
+    size_t read_ahead_queues = std::max<size_t>(1, std::min<size_t>({concurrent_futurebases, num_threads, futurebases.size()}));
 
-			}
+    futurebase_bytes = (num_threads * (1 + read_ahead_queues * (1 + read_ahead_chunks_per_thread)))
+	* max_futurebase_bits * futurebase_stride / 8
+	+ futurebases.size() * futurebase_stream_overhead;
 
-		    }
+    size_t in_memory_bytes = entries_bytes + futurevector_bytes + futurebase_bytes;
 
-		}
+    info("Memory estimate: %zdMB entries; %zdMB futurevectors; %zdMB futurebase caches; %zdMB usable budget\n",
+	 entries_bytes >> 20, futurevector_bytes >> 20, futurebase_bytes >> 20, budget >> 20);
 
-		if (is_normal_capture) {
+    if (in_memory_bytes <= budget) {
 
-		    /* Capture case.
-		     *
-		     * We also check to see if the capture was against the enemy king in which case
-		     * this position is a PNTM-mated.
-		     */
+	if (using_proptables) {
+	    warning("Memory budget overrides proptables; generating in memory\n");
+	    using_proptables = false;
+	}
 
-		    // PieceColor captured_piece_color = global_pieces2.at(position.board[movement]).first;
-		    PieceType captured_piece_type = global_pieces2.at(position.board[movement]).second;
+	if (tracking_dtm) {
+	    info("Memory budget: in-memory generation\n");
+	} else {
+	    size_t useful_MBs = std::max<size_t>((tb->num_indices / 8 * sizeof(index_t)) >> 20, 1);
+	    unpropagated_index_table_MBs = std::min((budget - in_memory_bytes) >> 20, useful_MBs);
+	    info("Memory budget: in-memory generation; %zdMB unpropagated index table\n", unpropagated_index_table_MBs);
+	}
 
-		    if (captured_piece_type == PieceType::King) {
-			throw PNTM_mated();
-		    }
+    } else {
 
-		    global_position_t new_position = position;
+	size_t available_MBs = (budget > futurebase_bytes) ? ((budget - futurebase_bytes) >> 20) : 0;
 
-		    new_position.flip_side_to_move();
+	if (available_MBs < minimum_proptable_MBs) {
+	    fatal("Memory budget of %zdMB is too small even for proptables\n", memory_budget_MBs);
+	    return false;
+	}
 
-		    new_position.clear_en_passant_square();
+	if (using_proptables && (proptable_MBs != available_MBs)) {
+	    warning("Memory budget overrides proptable size of %zdMB\n", proptable_MBs);
+	}
 
-		    new_position.capture_piece(origin_square, movement);
+	using_proptables = true;
+	proptable_MBs = available_MBs;
 
-		    if (! global_PNTM_in_check(&new_position)) {
+	info("Memory budget: proptable generation; %zdMB proptables\n", proptable_MBs);
+    }
 
-			if (! is_promotion) {
+    return true;
+}
 
-			    result.push_back(std::make_pair(move(piece_type, origin_square, movement, true),
-							    new_position));
+/* The "master routine" for tablebase generation.
+ *
+ * Many of these subroutines have already printed error messages of their own if they return
+ * an error indication, which is why we just silently return in many cases.
+ */
 
-			} else {
+bool generate_tablebase_from_control_file(char *control_filename, Glib::ustring output_filename)
+{
+    tablebase_t *tb;
+    xmlpp::NodeSet result;
+    size_t futurevector_bytes;
 
-			    /* Promotion capture case
-			     *
-			     * In this part of the code, we're just counting forward moves, and
-			     * all captures are futurebase moves, so the only difference to us
-			     * whether this is a promotion move or not is how many futuremoves
-			     * get recorded.
-			     */
+#if defined(RLIMIT_MEMLOCK) && LOCK_MEMORY
+    struct rlimit rlimit;
+#endif
 
+    tb = parse_XML_control_file(control_filename);
+    if (tb == nullptr) return false;
 
-			    for (int promotion = 0; promotion < promotion_possibilities; promotion ++) {
+    /* Need this no matter what.  I want to replace it with a global static tablebase for everything. */
+    current_tb = tb;
+    info("Total indices: %" PRIindex "\n", tb->num_indices);
 
-				place_piece_in_global_position(&new_position, movement,
-							       piece_color, promoted_pieces[promotion]);
+    if ((tb->format.dtm_offset == -1) && (tb->format.dtc_offset == -1)) {
+	tracking_dtm = false;
+    }
 
-				result.push_back(std::make_pair(move(piece_type, origin_square, movement,
-								     true, promoted_pieces[promotion]),
-								new_position));
-			    }
-			}
-		    }
+    /* Figure out where we want to write the finished product. */
 
-		    break;
-		}
+    result = tb->xml->get_root_node()->find("//output");
+    if (result.empty() && output_filename.empty()) {
+	fatal("Output filename must be specified either on command line or with <output> tag\n");
+	return false;
+    }
+    if (! result.empty()) {
+	if (! output_filename.empty()) {
+	    warning("Output filename specified on command line overrides <output> tag\n");
+	} else {
+	    // XXX use C++ casts
+	    output_filename = ((xmlpp::Element *) result[0])->get_attribute_value("filename");
+	    if (output_filename.empty()) {
+		output_filename = ((xmlpp::Element *) result[0])->get_attribute_value("url");
+	    }
+	}
+    }
 
-		if (is_en_passant_capture) {
+    if (output_filename.empty()) {
+	fatal("No output filename or URL specified\n");
+	return false;
+    }
 
-		    global_position_t new_position = position;
+    // XXX make case insensitive
+
+    if (output_filename.substr(0,5) == "http:") {
+	fatal("http URLs currently unsupported for tablebase I/O\n");
+	return false;
+    }
+
+    if (output_filename.substr(0,4) == "ftp:") {
+	fatal("ftp URLs currently unsupported for tablebase I/O\n");
+	return false;
+    }
+
+    int proptable_size_in_XML = eval_to_number_or_zero(tb->xml->get_root_node(), "//enable-proptables/@MB");
+    if (proptable_size_in_XML > 0) {
+	if (using_proptables) {
+	    warning("Proptable size specified on command line (%zd MB) overrides <enable-proptables> tag\n", proptable_MBs);
+	} else {
+	    using_proptables = true;
+	    proptable_MBs = proptable_size_in_XML;
+	}
+    }
 
-		    new_position.clear_en_passant_square();
+    if (! preload_all_futurebases(tb)) return false;
+    initialize_futuremoves(tb);
+    assign_numbers_to_futuremoves(tb);
+    if (! compute_pruned_futuremoves(tb)) return false;
+    if (! check_pruning(tb)) return false;
+    optimize_futuremoves(tb);
+    print_futuremoves();
 
-		    new_position.move_piece(movement + ((position.side_to_move == PieceColor::White) ? -8 : 8), movement);
+    if (! check_1000_indices(tb)) return false;
+    if (! check_1000_positions(tb)) return false;
 
-		    new_position.capture_piece(origin_square, movement);
+    if ((memory_budget_MBs > 0) && ! choose_memory_configuration(tb)) return false;
 
-		    new_position.flip_side_to_move();
+    if (resume_from_checkpoint && ! using_proptables) {
+	fatal("Can only resume from a checkpoint when using proptables\n");
+	return false;
+    }
 
-		    if (! global_PNTM_in_check(&new_position)) {
+    /* This actually initializes the statistics arrays the first time it's called, and it
+     * initializes for 100 passes, so these first few passes below here don't need any extra checks
+     * to see if they would overflow the arrays.
+     */
+    expand_per_pass_statistics();
 
-			result.push_back(std::make_pair(move(piece_type, origin_square, movement, true),
-							new_position));
+    /* Part of preloading the futurebases was to compute the smallest and largest DTMs in them, so
+     * we now know what the sizes of these two arrays have to be.
+     */
+    positive_passes_needed = new bool[max_tracked_dtm + 1] ();
+    negative_passes_needed = new bool[-min_tracked_dtm + 1] ();
 
-		    }
-		}
+    if (!using_proptables) {
 
-		/* If we hit a piece (either a capture or our own piece), end this direction of movement */
+	/* No proptables.  Allocate an in-memory tablebase (byte-aligned if we're tracking DTMs;
+	 * bit-aligned if not), a futurevectors array, initialize the tablebase, back propagate the
+	 * futurebases (noting which futuremoves have been handled in the futurevectors array), and
+	 * run through the futurevectors array checking for unhandled futuremoves.
+	 */
 
-		if (!is_non_capture) break;
+	if (tracking_dtm) {
+	    entriesTable = new MemoryEntriesTable;
+	} else {
+	    entriesTable = new CompactMemoryEntriesTable;
+	    if (unpropagated_index_table_MBs > 0) {
+		size_t size = unpropagated_index_table_MBs * 1024*1024 / sizeof(index_t);
+		unpropagated_index_table = new UnpropagatedIndexTable(size);
 	    }
-
 	}
 
-    }
-
-    return result;
-}
+	/* tb->futurevectors = (futurevector_t *) calloc(tb->num_indices + 1, sizeof(futurevector_t)); */
+        if (num_futuremoves[PieceColor::White] > num_futuremoves[PieceColor::Black])
+	    tb->futurevector_bits = num_futuremoves[PieceColor::White];
+	else
+	    tb->futurevector_bits = num_futuremoves[PieceColor::Black];
 
-/* There are three different variants of initialize_tablebase_entry(), that differ in their third
- * argument.  The first one, that does all the work, takes a const local_position_t to protect
- * against bugs in that code, the second takes a non-const local_position_t and performs an extra
- * index_to_local_position conversion on it, and the third takes nothing and creates a
- * local_position_t on the stack.  The third is deprecated since we now like to call
- * index_to_local_position on an existing position, if possible, because it's often faster
- * than creating a new position from scratch.
- */
+	tb->white_futurevector_bits = num_futuremoves[PieceColor::White];
+	tb->black_futurevector_bits = num_futuremoves[PieceColor::Black];
 
-futurevector_t initialize_tablebase_entry(const tablebase_t *tb, const index_t index, const local_position_t &position)
-{
-    /* Now we need to count moves.  FORWARD moves. */
-    unsigned int movecnt = 0;
-    unsigned int capturecnt = 0;
-    unsigned int futuremovecnt = 0;
-    futurevector_t futurevector = 0;
-    futurevector_t capture_futurevector = 0;
+	/* The futurevectors themselves get allocated as the tablebase is initialized */
 
-    bool concede_prune = false;
-    bool resign_prune = false;
+	if (tb->futurevector_bits > 0) {
+	    tb->futurevectors = new SparseFuturevectors(tb);
+	} else {
+	    tb->futurevectors = nullptr;
+	}
 
-    thread_local std::vector<move> moves;
+	/* Due to the heavily random access pattern of memory during back propagation, this
+	 * application performs horribly if required to swap.  Attempt to lock all of its pages into
+	 * memory, and die with a fatal error if we couldn't.  It seems better to die here, so we
+	 * can detect this condition and rerun with either simpler tablebases (if there are pawns
+	 * that can be factored) or using proptables.
+	 *
+	 * I'm finding that this system call is dangerous on Linux.  If you haven't set a resource
+	 * limit, it can hang the machine if you try to lock more memory than the system physically
+	 * possesses.  So I check first to make sure that a limit has been set before attempting the
+	 * lock.
+	 *
+	 * The #ifdef keeps this from even being attempted on a Windows system.
+	 */
 
-    /* En passant:
-     *
-     * We're just counting moves here.  In particular, we don't compute the indices of the resulting
-     * positions.  If we did, we'd have to worry about clearing en passant status from any of fourth
-     * or fifth rank pawns, but we don't have to worry about it.
-     *
-     * We do have to count one or two possible extra en passant pawn captures, though...
-     */
+#if defined(RLIMIT_MEMLOCK) && LOCK_MEMORY
 
-    try {
+	if (getrlimit(RLIMIT_MEMLOCK, &rlimit) == -1) {
+	    warning("Can't getrlimit RLIMIT_MEMLOCK: %s\n", strerror(errno));
+	} else if (rlimit.rlim_cur != 0) {
+	    if ((mlockall(MCL_CURRENT) == -1) && (errno != EPERM)) {
+		fatal("Can't mlockall memory: %s\n", strerror(errno));
+		return false;
+	    }
+	}
 
-	generate_moves(position, moves);
+#endif
 
-	for (auto &move : moves) {
+	pass_type[total_passes] = "initialization";
 
-	    if (index == debug_move) {
-		info("%s ", move.c_str());
-	    }
+	initialize_tablebase();
 
-	    movecnt ++;
+	finalize_pass_statistics();
+	total_passes ++;
 
-	    if (move.is_capture) {
-		capturecnt ++;
-	    }
+	info("Total legal positions: %" PRIu64 "\n", (uint64_t) total_legal_positions);
+	info("Total moves: %" PRIu64 "\n", (uint64_t) total_moves);
 
-	    if (move.is_futuremove) {
-		if (move.futuremove == DISCARD_FUTUREMOVE) {
-		    /* it's a discard - decrement movecnt so net change is zero */
-		    movecnt --;
-		    /* discard prune - do nothing */
-		} else if (move.futuremove == CONCEDE_FUTUREMOVE) {
-		    concede_prune = true;
-		} else if (move.futuremove == RESIGN_FUTUREMOVE) {
-		    resign_prune = true;
-		} else if (move.futuremove == HANDLED_FUTUREMOVE) {
-		    // move doesn't have to be tracked
-		} else if (move.futuremove < 0) {
-		    global_position_t global;
-		    index_to_global_position(tb, index, &global);
-		    fatal("No futuremove: %" PRIindex " %s %s\n", index, global_position_to_FEN(&global), move.c_str());
-		} else if (futurevector & FUTUREVECTOR(move.futuremove)) {
-		    global_position_t global;
-		    index_to_global_position(tb, index, &global);
-		    // fatal("Duplicate futuremove: %s %s\n", global_position_to_FEN(&global), move.c_str());
-		    fatal("Duplicate futuremove: %" PRIindex " %s %s\n", index, global_position_to_FEN(&global),
-			  movestr[position.side_to_move][move.futuremove]);
-		} else {
-		    futurevector |= FUTUREVECTOR(move.futuremove);
-		    if (move.is_capture) {
-			capture_futurevector |= FUTUREVECTOR(move.futuremove);
-		    }
-		}
-		futuremovecnt ++;
+	if (tb->futurevectors) {
+	    futurevector_bytes = tb->futurevectors->size();
+	    if (futurevector_bytes < 1024*1024) {
+		info("%zdKB of futurevectors for %" PRIu64 " positions with futuremoves\n",
+		     futurevector_bytes/1024, tb->futurevectors->num_positions());
+	    } else {
+		info("%zdMB of futurevectors for %" PRIu64 " positions with futuremoves\n",
+		     futurevector_bytes/(1024*1024), tb->futurevectors->num_positions());
 	    }
 	}
-    } catch (PNTM_mated ex) {
-	entriesTable->initialize_entry_with_PNTM_mated(index);
-	return 0;
-    }
 
-    if (concede_prune) {
-	entriesTable->initialize_entry_with_concede(index);
-	return 0;
-    }
+	pass_type[total_passes] = "futurebase backprop";
 
-    if (resign_prune) {
-	entriesTable->initialize_entry_with_resign(index);
-	return 0;
-    }
+	if (! back_propagate_all_futurebases(tb)) return false;
 
-    /* Finally, if every possible moves leads us into check, we determine if we're in check, being
-     * the difference between this being checkmate or stalemate.  In suicide analysis, a stalemate
-     * is a win for the stalemated player (international rules).
-     */
+	finalize_pass_statistics();
+	total_passes ++;
 
-    if (movecnt == 0) {
+	pass_type[total_passes] = "futuremove check";
 
-	if (tb->variant == Variant::Suicide) {
-	    entriesTable->initialize_entry_with_PNTM_mated(index);
-	} else if (PTM_in_check(tb, &position)) {
-	    entriesTable->initialize_entry_with_PTM_mated(index);
-	} else {
-	    entriesTable->initialize_entry_with_stalemate(index);
-	}
-	return 0;
+	info("Checking futuremoves...\n");
+	/* propagation_pass(0); */
+	if (! have_all_futuremoves_been_handled(tb)) return false;
+	info("All futuremoves handled under move restrictions\n");
 
-    } else {
+	finalize_pass_statistics();
+	total_passes ++;
 
-	/* In suicide, captures are forced, so if any captures are possible they are our only moves.
-	 * Of course, if we can capture the opponent's last piece, then we win!
-	 */
+	delete tb->futurevectors;
+	tb->futurevectors=nullptr;
 
-	if ((tb->variant == Variant::Suicide) && (capturecnt != 0)) {
-	    movecnt = capturecnt;
-	    futuremovecnt = capturecnt;
-	    futurevector = capture_futurevector;
-	}
+    } else {
 
-	/* Symmetry and multiplicity.  If we're using a symmetric index, then there might be more
-	 * than one actual board position that corresponds to a given index value.  The number of
-	 * non-identical board positions for a given index is called its multiplicity.  So here we
-	 * multiply the movecnt by the multiplicity of the position to get the total number of moves
-	 * out of all possible positions that correspond to this index.
+	/* Using proptables.  No futurevectors array.  We back propagate the futurebases into the
+	 * proptable, then in a single pass initialize the entries array and commit the proptable
+	 * into it, checking each position move as we go to make sure its futuremoves are handled,
+	 * and running the first intra-table pass on each entry once it's done (see fused_pass_dtm).
 	 *
-	 * Actually, when computing position.multiplicity, we ignore horizontal and vertical
-	 * symmetry because they always result in doubled (or quadrupled) board positions.  Diagonal
-	 * symmetry is more difficult to handle because the pieces along the diagonal don't move
-	 * when you reflect the board.  So we need to use position.multiplicity to distinguish
-	 * between the two kings being on the a1/h8 diagonal (multiplicity 1), and one of them being
-	 * off the diagonal (multiplicity 2).
+	 * Required field sizes for futurebase back-propagation:
+	 *
+	 *   index - figure out from num_indices
+	 *   dtm - figure out from futurebase preload, unless it isn't being tracked
+	 *   movecnt - 0 (DTM 0 only), 1, or 2 for 8-way symmetry conversion
+	 *   futuremove - figure out from total_futuremoves
+	 *
+	 * We add one to max(num_futuremoves) to ensure that we've got enough room to store
+	 * NO_FUTUREMOVE (futuremove -1).
+	 *
+	 * Note: movecnt 0 / DTM 0 is handled as a special case in proptable_pass_thread()
+	 *
+	 * XXX turn off movecnt if we don't have 8-way symmetry
 	 */
 
-	entriesTable->initialize_entry_with_movecnt(index, movecnt * position.multiplicity, (capturecnt != 0));
-
-	if (index == debug_move) {
-	    /* other fields were printed by debug_move statement in initialize_entry() */
-	    info("   futurevector " FUTUREVECTOR_HEX_FORMAT "\n", futurevector);
-	}
+	proptable_format format(tb->num_indices, min_tracked_dtm, max_tracked_dtm,
+				1, std::max(num_futuremoves[PieceColor::White], num_futuremoves[PieceColor::Black]) + 1);
 
-	total_moves += movecnt;
-	total_futuremoves += futuremovecnt;
+	info("Initial proptable format: %d bits index; %d bits dtm; %d bit movecnt; %d bits futuremove\n",
+	     format.index_bits, format.dtm_bits, format.movecnt_bits, format.futuremove_bits);
 
-	return futurevector;
-    }
-}
+	if (resume_from_checkpoint) {
 
-futurevector_t initialize_tablebase_entry(const tablebase_t *tb, const index_t index, local_position_t &position)
-{
-    if (index == debug_move) {
-	info("Initializing %" PRIindex "\n", index);
-    }
+	    /* Resuming skips futurebase back propagation, and maybe initialization, too */
 
-    mark_progress();
+	    if (! resume_checkpoint(format)) return false;
 
-    if (! index_to_local_position(tb, index, REFLECTION_NONE, &position)) {
+	} else {
 
-	entriesTable->initialize_entry_as_illegal(index);
-	return 0;
+	    try {
+		entriesTable = new DiskEntriesTable;
+	    } catch (std::exception &ex) {
+		throw nested_exception("Constructing initial disk entries table", ex);
+	    }
 
-    } else {
+	    try {
+		output_proptable = new proptable(format, proptable_MBs << 20);
+	    } catch (std::exception& ex) {
+		throw nested_exception("Constructing initial proptable", ex);
+	    }
 
-	return initialize_tablebase_entry(tb, index, (const local_position_t) position);
+	    pass_type[total_passes] = "futurebase backprop";
 
-    }
-}
+	    if (! back_propagate_all_futurebases(tb)) return false;
 
-futurevector_t initialize_tablebase_entry(tablebase_t *tb, index_t index)
-{
-    local_position_t position(tb);
+	    finalize_pass_statistics();
+	    total_passes ++;
+	}
 
-    return initialize_tablebase_entry(tb, index, position);
-}
+	/* The first intra-table pass is -1 (PTM mated) if we're tracking DTM, otherwise it's the pass
+	 * that picks up everything left unpropagated, which is labeled 1.  See
+	 * propagate_all_moves_within_tablebase().
+	 */
 
-/* Tablebase initialization is the first important place where we can use threads to speed things up
- * on a multi-processor machine, though my experience is that actual gains are highly architecture
- * specific.  Since initialization only touches single entries in the tablebase (no propagation at
- * this point), thread synchronization is fairly trivial.  We do initialize entire sections instead
- * of individual entries to avoid processors fighting over cache lines.
- */
+	if (! resume_from_checkpoint || (resume_target_dtm == 0)) {
 
-void initialize_tablebase_section(index_t start_index, index_t end_index)
-{
-    index_t index;
-    local_position_t position(current_tb);
+	    pass_type[total_passes] = "initialization";
+	    fused_pass_dtm = tracking_dtm ? -1 : 1;
+	    fused_pass_positions_finalized = propagation_pass(0);
 
-    for (index=start_index; index <= end_index; index++) {
-	long long bit_offset = ((long long)index * current_tb->futurevector_bits);
+	    info("Total legal positions: %" PRIu64 "\n", (uint64_t) total_legal_positions);
+	    info("Total moves: %" PRIu64 "\n", (uint64_t) total_moves);
 
-	if (current_tb->futurevector_bits > 0) {
-	    set_unsigned_int_field(current_tb->futurevectors, bit_offset, current_tb->futurevector_bits,
-				   initialize_tablebase_entry(current_tb, index, position));
-	} else {
-	    initialize_tablebase_entry(current_tb, index, position);
+	    info("All futuremoves handled under move restrictions\n");
 	}
     }
-}
 
-void initialize_tablebase(void)
-{
-    std::thread t[num_threads];
-    unsigned int thread;
-    index_t block_size = current_tb->num_indices /num_threads;
+    futurebases.clear();
 
-    reset_progress_indicator("Initializing tablebase", current_tb->num_indices);
+    info("Intra-table propagating\n");
+    propagate_all_moves_within_tablebase(tb);
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	index_t start_index = thread*block_size;
-	index_t end_index;
+    write_tablebase_to_file(tb, output_filename);
 
-	if (thread != num_threads-1) {
-	    end_index = (thread+1)*block_size - 1;
-	} else {
-	    end_index = current_tb->num_indices - 1;
-	}
+    /* We alloced entriesTable in this routine, but we might still use it to verify itself
+     * internally.  That will only happen if we've got a MemoryEntriesTable, since a
+     * DiskEntriesTable can't be accessed randomly.  Furthermore, a DiskEntriesTable will leave
+     * temporary files lying around if it isn't destroyed properly.
+     */
 
-	t[thread] = std::thread(initialize_tablebase_section, start_index, end_index);
-    }
+    if (using_proptables) {
+	delete entriesTable;
+	entriesTable = nullptr;
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
+	delete output_proptable;
+	output_proptable = nullptr;
+	proptable_arena.release();
+
+	remove_checkpoint();
     }
 
-    end_progress_indicator();
+    return true;
 }
 
-/* Intra-table propagation is (almost) trivial.  Keep making passes over the tablebase first until
- * we've processed everything from the futurebases, then until no more progress can be made.  We
- * don't even have to make every pass, just the ones that have mates in the entries table (and we
- * track that as we finalize the mates).  Once we're past all the mates that came in from the
- * futurebases (that's what max_tracked_dtm and min_tracked_dtm show), the only way we can have new
- * mates is by following a line that's completely within this tablebase, so we keep going until one
- * of the passes didn't finalize any positions.
+/***** VERIFYING TABLEBASES *****/
+
+/* A tablebase can be checked for internal consistency to see if all moves from PNTM won positions
+ * lead to PTM won positions.  We can also check drawn positions, to make sure that none of their
+ * moves lead to PNTM won positions.  We can't make a similar check for PTM won positions, because
+ * these only require a single move to win, and that move might be in a futurebase.
  *
- * We have to be a little bit careful when we're using proptables, since we can have stuff queued up
- * in the current proptable that hasn't be reflected in the positive_passes_needed[] and
- * negative_passes_needed[] arrays, so if we're using proptables, then we ALWAYS run the next pass
- * after a pass that finalized some positions.
+ * This test will be run at the end of a generation run if the '-v' flag is specified in addition to
+ * the '-g' flag.  Doesn't work on proptable runs; the tablebase has to be in memory.  This is only
+ * used for software testing, since properly generated tablebases are always internally consistent!
  */
 
-void propagate_all_moves_within_tablebase(tablebase_t *tb)
-{
-    int dtm = 1;
-    uint64_t positions_finalized_on_last_pass = 0;
-
-    doing_capture_backprop = false;
-
-    /* DTM 1 positions are illegal (PNTM is in check), so back prop from these positions is not
-     * needed or desired because we don't count moves into check as part of movecnt.
-     */
+std::atomic<index_t> next_verify_index;
 
-    positive_passes_needed[1] = false;
+void verify_tablebase_internally_thread(void)
+{
+    while (1) {
+	index_t index = (next_verify_index ++);
+	index_t next_index;
+	local_position_t position(current_tb);
+	int piece;
+	int origin_square;
 
-    /* If we're tracking DTM, then run at least until we've looked at all the DTM values that came
-     * in from the futurebases.
-     */
+	if (index >= current_tb->num_indices) break;
 
-    if (tracking_dtm) {
+	mark_progress();
 
-	while ((dtm <= max_tracked_dtm) || (-dtm >= min_tracked_dtm)) {
+	if (!index_to_local_position(current_tb, index, REFLECTION_NONE, &position)) continue;
 
-	    /* PTM wins */
-	    if (((dtm <= max_tracked_dtm) && positive_passes_needed[dtm])
-		|| (positions_finalized_on_last_pass > 0))
-		positions_finalized_on_last_pass = propagation_pass(dtm);
-	    else
-		positions_finalized_on_last_pass = 0;
+	position.flip_side_to_move();
+	position.clear_en_passant_square();
 
-	    if (dtm <= max_tracked_dtm) positive_passes_needed[dtm] = false;
+	for (piece = 0; piece < current_tb->num_pieces; piece++) {
 
-	    /* PNTM wins */
-	    if (((-dtm >= min_tracked_dtm) && negative_passes_needed[dtm])
-		|| (positions_finalized_on_last_pass > 0))
-		positions_finalized_on_last_pass = propagation_pass(-dtm);
-	    else
-		positions_finalized_on_last_pass = 0;
+	    /* We only want to consider pieces of the side which is to move, but we flipped it... */
 
-	    if (-dtm >= min_tracked_dtm) negative_passes_needed[dtm] = false;
+	    if (current_tb->pieces[piece].color == position.side_to_move) continue;
 
-	    dtm ++;
-	}
+	    origin_square = position.piece_position[piece];
 
-    } else {
+	    for (auto &dir : movements(current_tb->pieces[piece].piece_type,
+				       current_tb->pieces[piece].color,
+				       position.piece_position[piece],
+				       Movement::Forward, Movement::NonCapture)) {
 
-	positions_finalized_on_last_pass = 1;
+		for (auto &movement : dir) {
 
-    }
+		    if (position.board_vector & BITVECTOR(movement)) break;
 
-    /* Now keep running until there's nothing left to process */
+		    /* Move the piece, so we can test the new position for check */
 
-    while (1) {
+		    local_position_t new_position = position;
 
-	/* PTM wins */
-	if (positions_finalized_on_last_pass > 0)
-	    positions_finalized_on_last_pass = propagation_pass(dtm);
-	else break;
+		    new_position.move_piece(piece, movement);
 
-	/* PNTM wins */
-	if (positions_finalized_on_last_pass > 0)
-	    positions_finalized_on_last_pass = propagation_pass(-dtm);
-	else break;
+		    /* XXX wrap this into move_piece */
+		    if ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
+			&& (abs(movement - origin_square) == 16)) {
+			new_position.set_en_passant_square((movement + origin_square) / 2);
+		    }
 
-	dtm ++;
-    }
+		    bool is_promotion = ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
+					 && ((ROW(movement) == 7) || (ROW(movement) == 0)));
 
-}
+		    /* We could just check if local_position_to_index() returns a valid index, but
+		     * checking the legal_squares bitvector first makes this a little faster.
+		     *
+		     * XXX what really should we use here?
+		     */
 
-/* The 'filename' argument passed in here can either be a filename or a URL.  We don't distinguish
- * between them except by looking at their prefix (though it would be easy to add an extra flag
- * argument to do so), so hopefully nobody will try to create tablebases starting with 'ftp:'.  Much
- * of the error checking on 'filename' is done by the caller, since we'd like that error checking to
- * occur prior to a time consuming generation run, rather than when we're ready to write the
- * finished product out.
- *
- * XXX put URL support back in
- *
- * XXX figure out boost iostreams error handling
- */
+		    if (! PNTM_in_check(current_tb, &new_position) && ! is_promotion
+			&& (current_tb->pieces[piece].legal_squares & BITVECTOR(movement))
+			&& ((next_index = local_position_to_index(current_tb, &new_position)) != INVALID_INDEX)) {
 
-void write_tablebase_to_file(tablebase_t *tb, Glib::ustring filename)
-{
-    xmlpp::Document * doc;
-    int dtm_bits;
-    int size;
-    int padded_size;
-    int offset;
-    char entrybuf[MAX_FORMAT_BYTES];
+			/* check this position */
+			int n = entriesTable[index].get_DTM();
+			if (n < 0) {
+			    /* PNTM mates in (-n)-1 after this move, so next_index must be a PTM wins
+			     * in -n moves or less.
+			     */
+			    if ((entriesTable[next_index].get_DTM() <= 0)
+				|| (entriesTable[next_index].get_DTM() > -n)) {
 
-    for (dtm_bits = 1; (1 << (dtm_bits - 1) <= max_dtm) || (1 << (dtm_bits - 1) < -min_dtm); dtm_bits ++);
+				fatal("index %" PRIindex " DTM %d inconsistent with %" PRIindex " DTM %d\n",
+				      index, n, next_index, entriesTable[next_index].get_DTM());
+			    }
+			} else if (n == 0) {
+			    if (entriesTable[next_index].get_DTM() < 0) {
 
-    if ((tb->format.dtm_offset != -1) && (tb->format.dtm_bits == 0)) {
-	tb->format.dtm_bits = dtm_bits;
-	tb->format.bits += dtm_bits;
-    } else if (tb->format.dtm_bits > 0) {
-	if (tb->format.dtm_bits < dtm_bits) {
-	    fatal("Requested DTM field size too small\n");
-	    terminate();
+				fatal("index %" PRIindex " DTM %d inconsistent with %" PRIindex " DTM %d\n",
+				      index, n, next_index, entriesTable[next_index].get_DTM());
+			    }
+			}
+		    }
+		}
+	    }
 	}
     }
+}
 
-    if ((tb->format.dtc_offset != -1) && (tb->format.dtc_bits == 0)) {
-	tb->format.dtc_bits = dtm_bits;
-	tb->format.bits += dtm_bits;
-    } else if (tb->format.dtc_bits > 0) {
-	if (tb->format.dtc_bits < dtm_bits) {
-	    fatal("Requested DTC field size too small\n");
-	    terminate();
-	}
-    }
+bool verify_tablebase_internally(void)
+{
+    std::thread t[num_threads];
+    unsigned int thread;
 
-    doc = finalize_XML_header(tb);
+    /* XXX this routine doesn't work on suicide */
+    if (current_tb->variant != Variant::Normal) return false;
 
-    /* We want at least one zero byte after the XML header, because that's how we figure out where
-     * it ends when we read it back in, and I also want to align the tablebase on a four-byte
-     * boundary for the hell of it.  (size+5)&(~3) achieves these goals.  I then modify the XML
-     * header with the updated string that gives the offset to the tablebase, and make sure that its
-     * size hasn't changed.
-     */
+    reset_progress_indicator("Verifying internal consistency of tablebase", current_tb->num_indices);
 
-    size = doc->write_to_string().length();
+    entriesTable->set_threads(num_threads);
+    next_verify_index = 0;
 
-    do {
+    for (thread = 0; thread < num_threads; thread ++) {
+	t[thread] = std::thread(verify_tablebase_internally_thread);
+    }
 
-	padded_size = (size+5)&(~3);
+    for (thread = 0; thread < num_threads; thread ++) {
+	t[thread].join();
+    }
 
-	offset = padded_size;
-	if (tb->pawngen) {
-	    dynamic_cast<xmlpp::Element *>(doc->get_root_node()->find("//pawngen")[0])->set_attribute("offset", boost::lexical_cast<std::string>(offset));
-	    offset += pawn_position::binary_size * tb->pawngen->pawn_positions_by_index.size();
-	}
+    entriesTable->set_threads(1);
 
-	doc->get_root_node()->set_attribute("offset", boost::lexical_cast<std::string>(offset));
+    end_progress_indicator();
+    
+    return (fatal_errors == 0);
+}
 
-	size = doc->write_to_string().length();
 
-    } while (padded_size != ((size+5)&(~3)));
+/***** SLAB-BY-SLAB GENERATION *****/
+
+/* Pawngen orders its pawn positions so that pawn moves only lead to lower pawngen indices (pawn
+ * captures change the material and lead out of the tablebase altogether), so a big pawngen
+ * tablebase can be generated a slab of pawngen indices at a time, working up from the lowest.
+ * Each slab is a tablebase in its own right, with its <pawngen> element's start and count set to
+ * cover just that slab.  Along with the control file's own futurebases, it uses the slabs that its
+ * pawn moves lead to as pawngen futurebases, and they've all been finished by the time we get to
+ * it.  Only one slab is ever being generated, so peak memory is proportional to the slab size, not
+ * the size of the whole tablebase.
+ *
+ * The generation code keeps its state in global variables, so each slab gets generated in a child
+ * process.  The parent writes a control file for the slab next to the output, waits for the child
+ * to finish, and then renames the slab's tablebase into place as OUTPUT-START.htb, where START is
+ * the first pawngen index in the slab.  With --resume, slabs that already exist are skipped, and
+ * the first one that doesn't picks up from its checkpoint, if it has one.
+ *
+ * Once the last slab is done, merge_pawngen_slabs() copies them all into OUTPUT.htb and removes
+ * them.  The pawngen index is the most significant digit of the index (other than side-to-move, if
+ * it's in the MSB), so each slab's entries land in a contiguous range of the output, or two ranges,
+ * one for each side to move.  Each slab picked the size of its DTM field to fit its own DTMs, so
+ * the output uses the widest of them, and entries from the narrower slabs get re-encoded.
+ */
 
-    info("Writing '%s'\n", filename.c_str());
+int pawngen_slab_size = 0;
 
-    std::ofstream output_file;
-    output_file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    output_file.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+std::string slab_filename(std::string output_filename, int start, std::string suffix)
+{
+    if ((output_filename.length() > 4) && (output_filename.substr(output_filename.length() - 4) == ".htb")) {
+	output_filename.erase(output_filename.length() - 4);
+    }
 
-    io::filtering_ostream outstream;
+    return output_filename + "-" + boost::lexical_cast<std::string>(start) + suffix;
+}
 
-    outstream.push(io::gzip_compressor());
-    outstream.push(output_file);
+bool merge_pawngen_slabs(tablebase_t *tb, Glib::ustring output_filename, std::vector<std::string> slab_filenames)
+{
+    std::vector<std::unique_ptr<tablebase_t>> slabs;
 
-    /* First we write an XML header */
+    for (auto & filename : slab_filenames) {
+	try {
+	    slabs.emplace_back(new tablebase_t(filename));
+	} catch (std::exception &ex) {
+	    fatal("Error loading slab '%s': %s\n", filename.c_str(), ex.what());
+	    return false;
+	}
+    }
 
-    doc->write_to_stream(outstream);
+    /* The first slab's header has everything except the slab's own pawngen range, DTM field size,
+     * and statistics.  It's also the only slab without other slabs as futurebases.
+     */
 
-    for (; size < padded_size; size ++) outstream << '\0';
+    xmlpp::Document * doc = slabs[0]->xml;
+    xmlpp::Element * root = doc->get_root_node();
 
-    /* Then we write any pawngen data */
+    tb->format = slabs[0]->format;
 
-    if (tb->pawngen) {
-	for (auto & pp : tb->pawngen->pawn_positions_by_index) {
-	    pp >> outstream;
-	}
+    for (auto & slab : slabs) {
+	tb->format.bits = std::max(tb->format.bits, slab->format.bits);
+	tb->format.dtm_bits = std::max(tb->format.dtm_bits, slab->format.dtm_bits);
+	tb->format.dtc_bits = std::max(tb->format.dtc_bits, slab->format.dtc_bits);
     }
 
-    /* Then we write the tablebase data */
+    if (tb->format.dtm_bits > 0) {
+	exception_cast<xmlpp::Element *>(root->find("//dtm")[0])->set_attribute("bits", boost::lexical_cast<std::string>(tb->format.dtm_bits));
+    }
+    if (tb->format.dtc_bits > 0) {
+	exception_cast<xmlpp::Element *>(root->find("//dtc")[0])->set_attribute("bits", boost::lexical_cast<std::string>(tb->format.dtc_bits));
+    }
 
-    for (index_t index = 0; index < tb->num_indices; index ++) {
+    xmlpp::Element * pawngen_element = exception_cast<xmlpp::Element *>(root->find("//pawngen")[0]);
+    pawngen_element->set_attribute("start", boost::lexical_cast<std::string>(tb->pawngen->start));
+    pawngen_element->set_attribute("count", boost::lexical_cast<std::string>(tb->pawngen->count));
 
-	if (index == debug_move) {
-	    info("Writing %" PRIindex ": DTM %d; movecnt %d\n", index,
-		 entriesTable[index].get_DTM(), entriesTable[index].get_movecnt());
-	}
+    /* Add up the statistics, and keep every slab's generation-statistics */
 
-	/* Right now, there's four possible fields in the tablebase format itself (as opposed to the
-	 * intermediate entries and proptable formats) - dtm, dtc, basic, and flag.
-	 */
+    for (auto node : root->find("//tablebase-statistics/*")) {
+	xmlpp::Element * element = exception_cast<xmlpp::Element *>(node);
+	std::string name = element->get_name();
+	std::string xpath = "//tablebase-statistics/" + name;
 
-	if (tb->format.dtm_bits > 0) {
-	    set_int_field(entrybuf,
-			  tb->format.dtm_offset + ((index % 8) * tb->format.bits),
-			  tb->format.dtm_bits,
-			  entriesTable[index].get_DTM());
+	if (name == "indices") {
+	    element->set_child_text(boost::lexical_cast<std::string>(tb->num_indices));
+	} else if (name == "max-dtm") {
+	    int dtm = slabs[0]->max_dtm;
+	    for (auto & slab : slabs) dtm = std::max(dtm, slab->max_dtm);
+	    element->set_child_text(boost::lexical_cast<std::string>(dtm));
+	} else if (name == "min-dtm") {
+	    int dtm = slabs[0]->min_dtm;
+	    for (auto & slab : slabs) dtm = std::min(dtm, slab->min_dtm);
+	    element->set_child_text(boost::lexical_cast<std::string>(dtm));
+	} else {
+	    uint64_t total = 0;
+	    for (auto & slab : slabs) total += eval_to_uint64(slab->xml->get_root_node(), xpath);
+	    element->set_child_text(boost::lexical_cast<std::string>(total));
 	}
+    }
 
-	if (tb->format.dtc_bits > 0) {
-	    set_int_field(entrybuf,
-			  tb->format.dtc_offset + ((index % 8) * tb->format.bits),
-			  tb->format.dtc_bits,
-			  entriesTable[index].get_DTM());
+    for (unsigned int slab = 1; slab < slabs.size(); slab ++) {
+	for (auto node : slabs[slab]->xml->get_root_node()->find("//generation-statistics")) {
+	    root->add_child_text("   ");
+	    root->import_node(node);
+	    root->add_child_text("\n");
 	}
+    }
 
-	if (tb->format.basic_offset != -1) {
-	    Basic basic;
+    info("Merging %zd slabs\n", slabs.size());
 
-	    /* 2-bit BASIC format
-	     *
-	     * 0 - draw
-	     * 1 - PTM wins
-	     * 2 - PNTM wins
-	     * 3 - illegal position (PNTM in check)
-	     *
-	     * Indices that generate illegal positions, not in the above sense, but in the sense of
-	     * multiple pieces mapping to the same square, will get recorded as draws, but these can
-	     * be easily identified by the index-to-position function, so their values in the
-	     * tablebase are largely irrelevant.  Type 3 illegal positions (PNTM in check) are not
-	     * so obvious and need to be flagged as such to avoid using them during backprop.
-	     */
+    /* Each slab gets read in order, so a gzip'ed slab never has to seek backwards */
 
-	    if (entriesTable[index].get_DTM() == 1) {
-		basic = Basic::Illegal;
-	    } else if (entriesTable[index].does_PTM_win()) {
-		basic = Basic::PTMwins;
-	    } else if (entriesTable[index].does_PNTM_win()) {
-		basic = Basic::PNTMwins;
-	    } else {
-		basic = Basic::Draw;
-	    }
-	    set_unsigned_int_field(entrybuf,
-				   tb->format.basic_offset + ((index % 8) * tb->format.bits), 2,
-				   static_cast<int>(basic));
-	}
+    index_t slab_indices = pawngen_slab_size * tb->encoding->size;
 
-	switch (tb->format.flag_type) {
-	case FormatFlag::WhiteWins:
-	    set_bit_field(entrybuf,
-			  tb->format.flag_offset + ((index % 8) * tb->format.bits),
-			  (index_to_side_to_move(tb, index) == PieceColor::White)
-			  ? entriesTable[index].does_PTM_win() : entriesTable[index].does_PNTM_win());
-	    break;
-	case FormatFlag::WhiteDraws:
-	    set_bit_field(entrybuf,
-			  tb->format.flag_offset + ((index % 8) * tb->format.bits),
-			  (index_to_side_to_move(tb, index) == PieceColor::White)
-			  ? ! entriesTable[index].does_PNTM_win() : ! entriesTable[index].does_PTM_win());
-	    break;
-	case FormatFlag::None:
-	    break;
-	}
+    write_tablebase_file(tb, doc, output_filename,
+			 [&] (std::ostream & outstream, index_t start, index_t end) {
+			     std::vector<char> chunk((end - start) * tb->format.bits / 8 + 2 * sizeof(uint64_t));
 
-	/* If the next index will be aligned on a byte boundary, write out what we've buffered.  The
-	 * logic here is that if each index requires 'bits' bits, we write eight indices at a time
-	 * and that requires exactly 'bits' bytes.
-	 */
+			     for (index_t index = start; index < end; index ++) {
+				 PieceColor side_to_move = tb->index_stm(index);
+				 index_t base = tb->remove_stm(index);
+				 tablebase_t * slab = slabs[base / slab_indices].get();
+				 index_t slab_index = slab->add_stm(base % slab_indices, side_to_move);
+				 int offset = (index - start) * tb->format.bits;
 
-	if ((index % 8 == 7) || (index == tb->num_indices - 1)) {
-	    outstream.write(entrybuf, tb->format.bits);
-	}
+				 if (tb->format.dtm_bits > 0) {
+				     set_int_field(chunk.data(), tb->format.dtm_offset + offset, tb->format.dtm_bits,
+						   slab->get_DTM(slab_index));
+				 } else if (tb->format.dtc_bits > 0) {
+				     set_int_field(chunk.data(), tb->format.dtc_offset + offset, tb->format.dtc_bits,
+						   slab->get_DTC(slab_index));
+				 } else {
+				     index_t slab_offset = slab_index - slab->fetch_entry(slab_index);
+				     set_uint64_t_field(chunk.data(), offset, tb->format.bits,
+							get_uint64_t_field(current_entries, slab_offset * slab->format.bits,
+									   slab->format.bits));
+				 }
+			     }
+
+			     outstream.write(chunk.data(), ((end - start) * tb->format.bits + 7) / 8);
+			 },
+			 true);
+
+    for (auto & filename : slab_filenames) {
+	unlink(filename.c_str());
     }
 
-    /* File close is done implicitly by the destructor. */
+    return true;
 }
 
-/* The "master routine" for tablebase generation.
- *
- * Many of these subroutines have already printed error messages of their own if they return
- * an error indication, which is why we just silently return in many cases.
- */
-
-bool generate_tablebase_from_control_file(char *control_filename, Glib::ustring output_filename)
+bool generate_tablebase_by_slabs(char *control_filename, Glib::ustring output_filename, bool verify)
 {
     tablebase_t *tb;
-    xmlpp::NodeSet result;
-    size_t futurevector_bytes;
-
-#if defined(RLIMIT_MEMLOCK) && LOCK_MEMORY
-    struct rlimit rlimit;
-#endif
+    xmlpp::DomParser parser;
+    xmlpp::Element * root;
+    xmlpp::Element * pawngen_element;
+    std::vector<xmlpp::Node *> slab_futurebases;
 
     tb = parse_XML_control_file(control_filename);
     if (tb == nullptr) return false;
 
-    /* Need this no matter what.  I want to replace it with a global static tablebase for everything. */
-    current_tb = tb;
-    info("Total indices: %" PRIindex "\n", tb->num_indices);
-
-    if ((tb->format.dtm_offset == -1) && (tb->format.dtc_offset == -1)) {
-	tracking_dtm = false;
-    }
-
-    /* Figure out where we want to write the finished product. */
-
-    result = tb->xml->get_root_node()->find("//output");
-    if (result.empty() && output_filename.empty()) {
-	fatal("Output filename must be specified either on command line or with <output> tag\n");
+    if (tb->pawngen == nullptr) {
+	fatal("Slab-by-slab generation only works on pawngen tablebases\n");
 	return false;
     }
-    if (! result.empty()) {
-	if (! output_filename.empty()) {
-	    warning("Output filename specified on command line overrides <output> tag\n");
-	} else {
-	    // XXX use C++ casts
-	    output_filename = ((xmlpp::Element *) result[0])->get_attribute_value("filename");
-	    if (output_filename.empty()) {
-		output_filename = ((xmlpp::Element *) result[0])->get_attribute_value("url");
-	    }
+
+    if (output_filename.empty()) {
+	xmlpp::NodeSet result = tb->xml->get_root_node()->find("//output");
+	if (! result.empty()) {
+	    output_filename = dynamic_cast<xmlpp::Element *>(result[0])->get_attribute_value("filename");
 	}
     }
 
     if (output_filename.empty()) {
-	fatal("No output filename or URL specified\n");
+	fatal("No output filename specified\n");
 	return false;
     }
 
-    // XXX make case insensitive
+    /* Figure out which slabs each slab's pawn moves lead to.  The prev_position arrays record, for
+     * each pawn position, the positions that lead to it by a pawn move.
+     */
 
-    if (output_filename.substr(0,5) == "http:") {
-	fatal("http URLs currently unsupported for tablebase I/O\n");
-	return false;
+    int start = tb->pawngen->start;
+    int count = tb->pawngen->count;
+    int num_slabs = (count + pawngen_slab_size - 1) / pawngen_slab_size;
+
+    std::vector<std::set<int>> slab_dependencies(num_slabs);
+
+    auto in_slabs = [start, count] (int pawngen_index) {
+	return (pawngen_index >= start) && (pawngen_index < start + count);
+    };
+
+    for (int index = start; index < start + count; index ++) {
+	const pawn_position & pp = tb->pawngen->pawn_positions_by_index[index];
+	int slab = (index - start) / pawngen_slab_size;
+
+	for (int piece = 0; piece < tb->num_pieces; piece ++) {
+	    int prev_indices[2] = {-1, -1};
+
+	    if (pp.prev_position[piece] != ILLEGAL_POSITION) {
+		prev_indices[0] = index + pp.delta_pawngen_index[piece];
+	    }
+	    if (pp.prev_position2[piece] != ILLEGAL_POSITION) {
+		prev_indices[1] = index + pp.delta_pawngen_index2[piece];
+	    }
+
+	    for (auto prev_index : prev_indices) {
+		if ((prev_index == -1) || ! in_slabs(prev_index)) continue;
+		int prev_slab = (prev_index - start) / pawngen_slab_size;
+		if (prev_slab < slab) {
+		    fatal("Pawn move leads from pawngen index %d to higher pawngen index %d\n", prev_index, index);
+		    return false;
+		} else if (prev_slab > slab) {
+		    slab_dependencies[prev_slab].insert(slab);
+		}
+	    }
+	}
     }
 
-    if (output_filename.substr(0,4) == "ftp:") {
-	fatal("ftp URLs currently unsupported for tablebase I/O\n");
+    /* Now we need an unmodified copy of the control file to write the slab control files from */
+
+    try {
+	parser.parse_file(control_filename);
+	root = parser.get_document()->get_root_node();
+	pawngen_element = dynamic_cast<xmlpp::Element *>(root->find("//pawngen")[0]);
+	for (auto node : root->find("//output")) {
+	    root->remove_child(node);
+	}
+    } catch (const xmlpp::exception &ex) {
+	fatal("Can't load control file '%s': %s\n", control_filename, ex.what());
 	return false;
     }
 
-    int proptable_size_in_XML = eval_to_number_or_zero(tb->xml->get_root_node(), "//enable-proptables/@MB");
-    if (proptable_size_in_XML > 0) {
-	if (using_proptables) {
-	    warning("Proptable size specified on command line (%zd MB) overrides <enable-proptables> tag\n", proptable_MBs);
-	} else {
-	    using_proptables = true;
-	    proptable_MBs = proptable_size_in_XML;
-	}
-    }
+    info("Generating %d pawngen positions in %d slabs\n", count, num_slabs);
 
-    if (! preload_all_futurebases(tb)) return false;
-    initialize_futuremoves(tb);
-    assign_numbers_to_futuremoves(tb);
-    if (! compute_pruned_futuremoves(tb)) return false;
-    if (! check_pruning(tb)) return false;
-    optimize_futuremoves(tb);
-    print_futuremoves();
+    for (int slab = 0; slab < num_slabs; slab ++) {
+	int slab_start = start + slab * pawngen_slab_size;
+	int slab_count = std::min(pawngen_slab_size, start + count - slab_start);
+	std::string slab_output = slab_filename(output_filename, slab_start, ".htb");
+	std::string slab_new_output = slab_output + ".new";
+	std::string slab_control = slab_filename(output_filename, slab_start, ".xml");
+	struct stat stat_buffer;
 
-    if (! check_1000_indices(tb)) return false;
-    if (! check_1000_positions(tb)) return false;
+	if (resume_from_checkpoint && (stat(slab_output.c_str(), &stat_buffer) == 0)) {
+	    info("Slab %d already generated as '%s'\n", slab, slab_output.c_str());
+	    continue;
+	}
 
-    /* This actually initializes the statistics arrays the first time it's called, and it
-     * initializes for 100 passes, so these first few passes below here don't need any extra checks
-     * to see if they would overflow the arrays.
-     */
-    expand_per_pass_statistics();
+	info("Generating slab %d of %d (pawngen indices %d-%d)\n", slab + 1, num_slabs, slab_start, slab_start + slab_count - 1);
 
-    /* Part of preloading the futurebases was to compute the smallest and largest DTMs in them, so
-     * we now know what the sizes of these two arrays have to be.
-     */
-    positive_passes_needed = new bool[max_tracked_dtm + 1] ();
-    negative_passes_needed = new bool[-min_tracked_dtm + 1] ();
+	for (auto node : slab_futurebases) {
+	    root->remove_child(node);
+	}
+	slab_futurebases.clear();
 
-    if (!using_proptables) {
+	pawngen_element->set_attribute("start", boost::lexical_cast<std::string>(slab_start));
+	pawngen_element->set_attribute("count", boost::lexical_cast<std::string>(slab_count));
 
-	/* No proptables.  Allocate an in-memory tablebase (byte-aligned if we're tracking DTMs;
-	 * bit-aligned if not), a futurevectors array, initialize the tablebase, back propagate the
-	 * futurebases (noting which futuremoves have been handled in the futurevectors array), and
-	 * run through the futurevectors array checking for unhandled futuremoves.
-	 */
+	for (auto dependency : slab_dependencies[slab]) {
+	    xmlpp::Element * futurebase_element = root->add_child("futurebase");
+	    futurebase_element->set_attribute("filename", slab_filename(output_filename, start + dependency * pawngen_slab_size, ".htb"));
+	    slab_futurebases.push_back(futurebase_element);
+	}
 
-	if (tracking_dtm) {
-	    entriesTable = new MemoryEntriesTable;
-	} else {
-	    entriesTable = new CompactMemoryEntriesTable;
-	    if (unpropagated_index_table_MBs > 0) {
-		size_t size = unpropagated_index_table_MBs * 1024*1024 / sizeof(index_t);
-		unpropagated_index_table = new UnpropagatedIndexTable(size);
-	    }
+	try {
+	    parser.get_document()->write_to_file(slab_control);
+	} catch (const xmlpp::exception &ex) {
+	    fatal("Can't write slab control file '%s': %s\n", slab_control.c_str(), ex.what());
+	    return false;
 	}
 
-	/* tb->futurevectors = (futurevector_t *) calloc(tb->num_indices + 1, sizeof(futurevector_t)); */
-        if (num_futuremoves[PieceColor::White] > num_futuremoves[PieceColor::Black])
-	    tb->futurevector_bits = num_futuremoves[PieceColor::White];
-	else
-	    tb->futurevector_bits = num_futuremoves[PieceColor::Black];
+	fflush(stdout);
+	fflush(stderr);
 
-	if (tb->futurevector_bits > 0) {
-	    futurevector_bytes = (((tb->num_indices * tb->futurevector_bits) + 7) >> 3) + 2*sizeof(int);
-	    tb->futurevectors = (char *) malloc(futurevector_bytes);
-	    if (tb->futurevectors == nullptr) {
-		fatal("Can't malloc %zdMB for tablebase futurevectors: %s\n", futurevector_bytes/(1024*1024),
-		      strerror(errno));
-		return false;
-	    } else {
-		if (futurevector_bytes < 1024*1024) {
-		    info("Malloced %zdKB for tablebase futurevectors\n", futurevector_bytes/1024);
-		} else {
-		    info("Malloced %zdMB for tablebase futurevectors\n", futurevector_bytes/(1024*1024));
-		}
-	    }
-	    /* Don't really need this, since they will all get initialized anyway */
-	    // memset(tb->futurevectors, 0, futurevector_bytes);
-	} else {
-	    tb->futurevectors = NULL;
+	pid_t pid = fork();
+
+	if (pid == -1) {
+	    fatal("Can't fork to generate slab: %s\n", strerror(errno));
+	    return false;
 	}
 
-	/* Due to the heavily random access pattern of memory during back propagation, this
-	 * application performs horribly if required to swap.  Attempt to lock all of its pages into
-	 * memory, and die with a fatal error if we couldn't.  It seems better to die here, so we
-	 * can detect this condition and rerun with either simpler tablebases (if there are pawns
-	 * that can be factored) or using proptables.
-	 *
-	 * I'm finding that this system call is dangerous on Linux.  If you haven't set a resource
-	 * limit, it can hang the machine if you try to lock more memory than the system physically
-	 * possesses.  So I check first to make sure that a limit has been set before attempting the
-	 * lock.
-	 *
-	 * The #ifdef keeps this from even being attempted on a Windows system.
-	 */
+	if (pid == 0) {
 
-#if defined(RLIMIT_MEMLOCK) && LOCK_MEMORY
+	    /* Only the first slab we generate can have a checkpoint to resume from, and only if
+	     * the last run got far enough to write one.
+	     */
 
-	if (getrlimit(RLIMIT_MEMLOCK, &rlimit) == -1) {
-	    warning("Can't getrlimit RLIMIT_MEMLOCK: %s\n", strerror(errno));
-	} else if (rlimit.rlim_cur != 0) {
-	    if ((mlockall(MCL_CURRENT) == -1) && (errno != EPERM)) {
-		fatal("Can't mlockall memory: %s\n", strerror(errno));
-		return false;
+	    resume_from_checkpoint = resume_from_checkpoint && (stat(checkpoint_filename.c_str(), &stat_buffer) == 0);
+
+	    bool success;
+
+	    try {
+		success = generate_tablebase_from_control_file(const_cast<char *>(slab_control.c_str()), slab_new_output);
+		if (success && verify && !using_proptables) verify_tablebase_internally();
+	    } catch (std::exception &ex) {
+		fatal("%s\n", ex.what());
+		success = false;
+	    }
+
+	    if (entriesTable != nullptr) {
+		delete entriesTable;
+		entriesTable = nullptr;
 	    }
-	}
 
-#endif
+	    exit((success && (fatal_errors == 0)) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
 
-	pass_type[total_passes] = "initialization";
+	int status;
 
-	initialize_tablebase();
+	if (waitpid(pid, &status, 0) == -1) {
+	    fatal("Can't wait for slab generation: %s\n", strerror(errno));
+	    return false;
+	}
 
-	finalize_pass_statistics();
-	total_passes ++;
+	if (! WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS)) {
+	    fatal("Generation of slab %d failed\n", slab);
+	    return false;
+	}
 
-	info("Total legal positions: %" PRIu64 "\n", (uint64_t) total_legal_positions);
-	info("Total moves: %" PRIu64 "\n", (uint64_t) total_moves);
+	if (rename(slab_new_output.c_str(), slab_output.c_str()) == -1) {
+	    fatal("Can't rename '%s' to '%s': %s\n", slab_new_output.c_str(), slab_output.c_str(), strerror(errno));
+	    return false;
+	}
 
-	pass_type[total_passes] = "futurebase backprop";
+	unlink(slab_control.c_str());
 
-	if (! back_propagate_all_futurebases(tb)) return false;
+	resume_from_checkpoint = false;
+    }
 
-	finalize_pass_statistics();
-	total_passes ++;
+    std::vector<std::string> slab_filenames;
 
-	pass_type[total_passes] = "futuremove check";
+    for (int slab = 0; slab < num_slabs; slab ++) {
+	slab_filenames.push_back(slab_filename(output_filename, start + slab * pawngen_slab_size, ".htb"));
+    }
 
-	info("Checking futuremoves...\n");
-	/* propagation_pass(0); */
-	if (! have_all_futuremoves_been_handled(tb)) return false;
-	info("All futuremoves handled under move restrictions\n");
+    return merge_pawngen_slabs(tb, output_filename, slab_filenames);
+}
 
-	finalize_pass_statistics();
-	total_passes ++;
 
-	free(tb->futurevectors);
-	tb->futurevectors=nullptr;
+/***** REFORMATTING *****/
 
-    } else {
+/* A tablebase's entries don't depend on how its positions are indexed, so we can switch a finished
+ * tablebase to a different index type or piece ordering without generating it all over again.  The
+ * control file supplies the new <index> and <piece> elements; everything else in the header (the
+ * format, prunes, and statistics) comes from the old tablebase.  We run through the old
+ * tablebase's positions, translate each of them into the new tablebase just like a futurebase
+ * position, and copy its entry, bit for bit, to the new index.
+ *
+ * If the new tablebase fits in memory, we scatter the entries into a bit-packed array and write it
+ * out like any other.  If it doesn't (or if -P was given), the entries go into a priority_queue,
+ * tagged with their new indices, and come back out in index order as the output is written, so we
+ * never need more memory than the priority_queue's buffers.
+ */
 
-	/* Using proptables.  No futurevectors array.  We back propagate the futurebases into the
-	 * proptable, then in a single pass initialize the entries array and commit the proptable
-	 * into it, checking each position move as we go to make sure its futuremoves are handled.
-	 *
-	 * Required field sizes for futurebase back-propagation:
-	 *
-	 *   index - figure out from num_indices
-	 *   dtm - figure out from futurebase preload, unless it isn't being tracked
-	 *   movecnt - 0 (DTM 0 only), 1, or 2 for 8-way symmetry conversion
-	 *   futuremove - figure out from total_futuremoves
-	 *
-	 * We add one to max(num_futuremoves) to ensure that we've got enough room to store
-	 * NO_FUTUREMOVE (futuremove -1).
-	 *
-	 * Note: movecnt 0 / DTM 0 is handled as a special case in proptable_pass_thread()
-	 *
-	 * XXX turn off movecnt if we don't have 8-way symmetry
-	 */
+bool reformat_tablebase(char *source_filename, char *control_filename, Glib::ustring output_filename)
+{
+    tablebase_t *source;
+    tablebase_t *tb;
+    xmlpp::DomParser parser;
+    xmlpp::Element * root;
 
-	proptable_format format(tb->num_indices, min_tracked_dtm, max_tracked_dtm,
-				1, std::max(num_futuremoves[PieceColor::White], num_futuremoves[PieceColor::Black]) + 1);
+    info("Loading '%s'\n", source_filename);
 
-	info("Initial proptable format: %d bits index; %d bits dtm; %d bit movecnt; %d bits futuremove\n",
-	     format.index_bits, format.dtm_bits, format.movecnt_bits, format.futuremove_bits);
+    try {
+	source = new tablebase_t(source_filename);
+    } catch (std::exception &ex) {
+	fatal("Error loading tablebase '%s': %s\n", source_filename, ex.what());
+	return false;
+    }
 
-	try {
-	    entriesTable = new DiskEntriesTable;
-	} catch (std::exception &ex) {
-	    throw nested_exception("Constructing initial disk entries table", ex);
-	}
+    if ((source->format.bits <= 0) || (source->pawngen != nullptr)) {
+	fatal("Only Hoffman tablebases without pawngen can be reformatted\n");
+	return false;
+    }
 
-	try {
-	    output_proptable = new proptable(format, proptable_MBs << 20);
-	} catch (std::exception& ex) {
-	    throw nested_exception("Constructing initial proptable", ex);
-	}
+    /* Splice the control file's <index> and <piece> elements into the old tablebase's header */
 
-	pass_type[total_passes] = "futurebase backprop";
+    try {
+	parser.parse_file(control_filename);
+	xmlpp::Element * control = parser.get_document()->get_root_node();
 
-	if (! back_propagate_all_futurebases(tb)) return false;
+	root = source->xml->get_root_node();
 
-	finalize_pass_statistics();
-	total_passes ++;
+	for (auto node : root->find("/tablebase/index | /tablebase/piece")) {
+	    root->remove_child(node);
+	}
+	for (auto node : control->find("/tablebase/index | /tablebase/piece")) {
+	    root->import_node(node);
+	}
 
-	pass_type[total_passes] = "initialization";
-	propagation_pass(0);
+	if (output_filename.empty()) {
+	    xmlpp::NodeSet result = control->find("//output");
+	    if (! result.empty()) {
+		output_filename = dynamic_cast<xmlpp::Element *>(result[0])->get_attribute_value("filename");
+	    }
+	}
 
-	info("Total legal positions: %" PRIu64 "\n", (uint64_t) total_legal_positions);
-	info("Total moves: %" PRIu64 "\n", (uint64_t) total_moves);
+	std::istringstream header(source->xml->write_to_string());
+	tb = new tablebase_t(&header);
 
-	info("All futuremoves handled under move restrictions\n");
+    } catch (const xmlpp::exception &ex) {
+	fatal("Can't load control file '%s': %s\n", control_filename, ex.what());
+	return false;
+    } catch (std::exception &ex) {
+	fatal("Can't reformat with control file '%s': %s\n", control_filename, ex.what());
+	return false;
     }
 
-    futurebases.clear();
-
-    info("Intra-table propagating\n");
-    propagate_all_moves_within_tablebase(tb);
-
-    write_tablebase_to_file(tb, output_filename);
+    if (output_filename.empty()) {
+	fatal("No output filename specified\n");
+	return false;
+    }
 
-    /* We alloced entriesTable in this routine, but we might still use it to verify itself
-     * internally.  That will only happen if we've got a MemoryEntriesTable, since a
-     * DiskEntriesTable can't be accessed randomly.  Furthermore, a DiskEntriesTable will leave
-     * temporary files lying around if it isn't destroyed properly.
-     */
+    if ((tb->variant != source->variant) || (tb->format.bits != source->format.bits) || (tb->pawngen != nullptr)) {
+	fatal("Control file '%s' changes more than the index and piece order\n", control_filename);
+	return false;
+    }
 
-    if (using_proptables) {
-	delete entriesTable;
-	entriesTable = nullptr;
+    try {
+	compute_extra_and_missing_pieces(tb, *source);
+    } catch (std::exception &ex) {
+	fatal("Control file '%s' has different pieces than '%s'\n", control_filename, source_filename);
+	return false;
     }
 
-    return true;
-}
+    if ((source->extra_piece != -1) || (source->missing_pawn != -1) || (source->missing_non_pawn != -1)) {
+	fatal("Control file '%s' has different pieces than '%s'\n", control_filename, source_filename);
+	return false;
+    }
 
-/***** VERIFYING TABLEBASES *****/
+    dynamic_cast<xmlpp::Element *>(tb->xml->get_root_node()->find("//tablebase-statistics/indices")[0])
+	->set_child_text(boost::lexical_cast<std::string>(tb->num_indices));
 
-/* A tablebase can be checked for internal consistency to see if all moves from PNTM won positions
- * lead to PTM won positions.  We can also check drawn positions, to make sure that none of their
- * moves lead to PNTM won positions.  We can't make a similar check for PTM won positions, because
- * these only require a single move to win, and that move might be in a futurebase.
- *
- * This test will be run at the end of a generation run if the '-v' flag is specified in addition to
- * the '-g' flag.  Doesn't work on proptable runs; the tablebase has to be in memory.  This is only
- * used for software testing, since properly generated tablebases are always internally consistent!
- */
+    info("Reformatting %" PRIindex " indices into %" PRIindex " indices\n", source->num_indices, tb->num_indices);
 
-std::atomic<index_t> next_verify_index;
+    /* If the new tablebase has less symmetry than the old one, each old position turns into several
+     * new ones.  If it has more, several old positions turn into the same new one, and they've
+     * all got the same entry.  The same goes for color symmetry, since whether a tablebase with
+     * identical white and black pieces can leave out the black-to-move positions depends on the
+     * index type and piece order.
+     */
 
-void verify_tablebase_internally_thread(void)
-{
-    while (1) {
-	index_t index = (next_verify_index ++);
-	index_t next_index;
-	local_position_t position(current_tb);
-	int piece;
-	int origin_square;
+    int reflections[16];
+    int max_reflection = 1;
 
-	if (index >= current_tb->num_indices) break;
+    reflections[0] = REFLECTION_NONE;
 
-	mark_progress();
+    if (source->symmetry > tb->symmetry) {
+	max_reflection = compute_reflections(tb, source, reflections);
+	if (! source->encode_stm) max_reflection /= 2;
+    }
 
-	if (!index_to_local_position(current_tb, index, REFLECTION_NONE, &position)) continue;
+    /* A color reflection swaps the side to move, which is fine for DTM and basic entries, since
+     * they're relative to the player to move, but not for flag entries, which are relative to
+     * white.  Tablebases with flags always encode side-to-move now, so this shouldn't happen.
+     */
 
-	position.flip_side_to_move();
-	position.clear_en_passant_square();
+    if (! source->encode_stm && tb->encode_stm && (tb->format.flag_type != FormatFlag::None)) {
+	fatal("Can't add side-to-move to a tablebase with a flag format\n");
+	return false;
+    }
 
-	for (piece = 0; piece < current_tb->num_pieces; piece++) {
+    if (! source->encode_stm && tb->encode_stm) {
+	for (int reflection = 0; reflection < max_reflection; reflection ++) {
+	    reflections[max_reflection + reflection] = reflections[reflection] | REFLECTION_COLOR;
+	}
+	max_reflection *= 2;
+    }
 
-	    /* We only want to consider pieces of the side which is to move, but we flipped it... */
+    int bits = source->format.bits;
+    int index_bits = 0;
 
-	    if (current_tb->pieces[piece].color == position.side_to_move) continue;
+    while ((index_bits < 64) && ((1ULL << index_bits) < tb->num_indices)) index_bits ++;
 
-	    origin_square = position.piece_position[piece];
+    size_t entries_bytes = (tb->num_indices * bits + 7) / 8;
+    size_t budget_MBs = using_proptables ? proptable_MBs : memory_budget_MBs;
+    bool external = using_proptables || ((memory_budget_MBs != 0) && (entries_bytes > (memory_budget_MBs << 20)));
 
-	    for (auto &dir : movements(current_tb->pieces[piece].piece_type,
-				       current_tb->pieces[piece].color,
-				       position.piece_position[piece],
-				       Movement::Forward, Movement::NonCapture)) {
+    if (external && (index_bits + bits > 64)) {
+	fatal("Tablebase too large to reformat through a priority queue\n");
+	return false;
+    }
 
-		for (auto &movement : dir) {
+    std::unique_ptr<char []> entries;
+    std::unique_ptr<priority_queue<uint64_t>> queue;
 
-		    if (position.board_vector & BITVECTOR(movement)) break;
+    if (external) {
+	info("Reformatting through a %zdMB priority queue\n", budget_MBs);
+	queue.reset(new priority_queue<uint64_t>((budget_MBs << 20) / sizeof(uint64_t) / 2));
+    } else {
+	/* Some extra space at the end, since the bitlib routines work on whole words */
+	entries.reset(new char[entries_bytes + sizeof(uint64_t)]());
+    }
 
-		    /* Move the piece, so we can test the new position for check */
+    std::atomic<uint64_t> lost_positions(0);
 
-		    local_position_t new_position = position;
+    auto translator = [&] () {
+	std::vector<char> chunk(bits * futurebase_stride / 8 + sizeof(uint64_t));
+	local_position_t source_position(source);
+	local_position_t position(tb);
 
-		    new_position.move_piece(piece, movement);
+	while (1) {
+	    index_t start = source->read_chunk(INVALID_INDEX, chunk.data());
+	    if (start >= source->num_indices) break;
 
-		    /* XXX wrap this into move_piece */
-		    if ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
-			&& (abs(movement - origin_square) == 16)) {
-			new_position.set_en_passant_square((movement + origin_square) / 2);
-		    }
+	    index_t end = std::min(start + futurebase_stride, source->num_indices);
 
-		    bool is_promotion = ((current_tb->pieces[piece].piece_type == PieceType::Pawn)
-					 && ((ROW(movement) == 7) || (ROW(movement) == 0)));
+	    for (index_t index = start; index < end; index ++) {
+		uint64_t entry = get_uint64_t_field(chunk.data(), (index - start) * bits, bits);
 
-		    /* We could just check if local_position_to_index() returns a valid index, but
-		     * checking the legal_squares bitvector first makes this a little faster.
-		     *
-		     * XXX what really should we use here?
-		     */
+		for (int reflection = 0; reflection < max_reflection; reflection ++) {
 
-		    if (! PNTM_in_check(current_tb, &new_position) && ! is_promotion
-			&& (current_tb->pieces[piece].legal_squares & BITVECTOR(movement))
-			&& ((next_index = local_position_to_index(current_tb, &new_position)) != INVALID_INDEX)) {
+		    if (! index_to_local_position(source, index, reflections[reflection], &source_position)) continue;
 
-			/* check this position */
-			int n = entriesTable[index].get_DTM();
-			if (n < 0) {
-			    /* PNTM mates in (-n)-1 after this move, so next_index must be a PTM wins
-			     * in -n moves or less.
-			     */
-			    if ((entriesTable[next_index].get_DTM() <= 0)
-				|| (entriesTable[next_index].get_DTM() > -n)) {
+		    if (translate_foreign_position_to_local_position(source, &source_position, tb, &position, false)
+			!= trivial_translation) {
+			lost_positions ++;
+			continue;
+		    }
 
-				fatal("index %" PRIindex " DTM %d inconsistent with %" PRIindex " DTM %d\n",
-				      index, n, next_index, entriesTable[next_index].get_DTM());
-			    }
-			} else if (n == 0) {
-			    if (entriesTable[next_index].get_DTM() < 0) {
+		    index_t new_index = local_position_to_index(tb, &position);
 
-				fatal("index %" PRIindex " DTM %d inconsistent with %" PRIindex " DTM %d\n",
-				      index, n, next_index, entriesTable[next_index].get_DTM());
-			    }
-			}
+		    if (new_index == INVALID_INDEX) {
+			lost_positions ++;
+		    } else if (external) {
+			queue->push((static_cast<uint64_t>(new_index) << bits) | entry);
+		    } else {
+			set_uint64_t_field(entries.get(), new_index * bits, bits, entry);
 		    }
 		}
 	    }
 	}
-    }
-}
+    };
 
-bool verify_tablebase_internally(void)
-{
-    std::thread t[num_threads];
-    unsigned int thread;
+    std::vector<std::thread> threads;
 
-    /* XXX this routine doesn't work on suicide */
-    if (current_tb->variant != Variant::Normal) return false;
+    for (unsigned int thread = 0; thread < num_threads; thread ++) {
+	threads.emplace_back(translator);
+    }
+    for (auto & thread : threads) {
+	thread.join();
+    }
 
-    reset_progress_indicator("Verifying internal consistency of tablebase", current_tb->num_indices);
+    if (lost_positions > 0) {
+	fatal("%" PRIu64 " positions in '%s' have no place in the new tablebase\n", lost_positions.load(), source_filename);
+	return false;
+    }
 
-    entriesTable->set_threads(num_threads);
-    next_verify_index = 0;
+    if (external) {
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread] = std::thread(verify_tablebase_internally_thread);
-    }
+	/* All the insertions are done, so flush everything to disk and switch the queue over to
+	 * retrieving before the packer looks at it, like proptable_pass() does.  Until then, the spill
+	 * thread can still be adding runs, and empty() doesn't see the buffer it's working on.
+	 */
 
-    for (thread = 0; thread < num_threads; thread ++) {
-	t[thread].join();
+	queue->prepare_to_retrieve();
+
+	write_tablebase_file(tb, tb->xml, output_filename,
+			     [&] (std::ostream & outstream, index_t start, index_t end) {
+				 std::vector<char> chunk((end - start) * bits / 8 + 2 * sizeof(uint64_t));
+				 std::lock_guard<std::mutex> _(*queue);
+				 while (! queue->empty() && ((queue->front() >> bits) < end)) {
+				     uint64_t item = queue->pop_front();
+				     set_uint64_t_field(chunk.data(), ((item >> bits) - start) * bits, bits,
+							item & ((1ULL << bits) - 1));
+				 }
+				 outstream.write(chunk.data(), ((end - start) * bits + 7) / 8);
+			     },
+			     true);
+    } else {
+	write_tablebase_file(tb, tb->xml, output_filename,
+			     [&] (std::ostream & outstream, index_t start, index_t end) {
+				 outstream.write(entries.get() + start * bits / 8,
+						 (end * bits + 7) / 8 - start * bits / 8);
+			     },
+			     false);
     }
 
-    entriesTable->set_threads(1);
-
-    end_progress_indicator();
-    
-    return (fatal_errors == 0);
+    return true;
 }
 
 
@@ -16014,6 +19846,8 @@ void usage(char *program_name)
     fprintf(stderr, "Usage: %s -g [GENERATING-OPTIONS] XML-CONTROL-FILE   (generate)\n", program_name);
     fprintf(stderr, "   or: %s -p TABLEBASE                               (probe)\n", program_name);
     fprintf(stderr, "   or: %s -i TABLEBASE                               (info)\n", program_name);
+    fprintf(stderr, "   or: %s --reformat TABLEBASE [-o OUTPUT-FILENAME] XML-CONTROL-FILE\n", program_name);
+    fprintf(stderr, "                                                        (reformat)\n");
 #ifdef USE_NALIMOV
     fprintf(stderr, "   or: %s -v [-n NALIMOV-PATH] TABLEBASE             (verify)\n", program_name);
 #endif
@@ -16024,7 +19858,25 @@ void usage(char *program_name)
     fprintf(stderr, "   -U UNPROP-TBL-SIZE    set size of unpropagated index table in MBs (default 1)\n");
     fprintf(stderr, "   -t NUM-THREADS        sets number of threads to use (default 1)\n");
     fprintf(stderr, "   -q                    quiet mode; suppress informational messages\n");
+    fprintf(stderr, "   --memory-budget MB    choose in-memory or proptable generation, and the sizes\n");
+    fprintf(stderr, "                         of -P and -U, to fit in MB megabytes\n");
     fprintf(stderr, "   --compress-files      compress intermediate files in proptable mode\n");
+    fprintf(stderr, "   --temp-dir DIR[:WEIGHT[:MB]]\n");
+    fprintf(stderr, "                         put intermediate files in DIR; can be repeated, in which\n");
+    fprintf(stderr, "                         case the first DIR gets the entries file and proptables\n");
+    fprintf(stderr, "                         are striped across the rest in proportion to WEIGHT,\n");
+    fprintf(stderr, "                         skipping any DIR whose open files already total MB\n");
+    fprintf(stderr, "                         megabytes (unless they all do)\n");
+    fprintf(stderr, "   --direct-io           bypass the page cache when using intermediate files\n");
+    fprintf(stderr, "   --checkpoint[=DIR]    in proptable mode, keep a checkpoint.xml in DIR (default\n");
+    fprintf(stderr, "                         the current directory) that can restart the current pass\n");
+    fprintf(stderr, "   --resume              restart an interrupted proptable run from its checkpoint\n");
+    fprintf(stderr, "   --pawngen-slabs N     generate a pawngen tablebase as a series of tablebases,\n");
+    fprintf(stderr, "                         each covering N pawngen indices, then merge them\n");
+    fprintf(stderr, "   --seekable-output     compress the output in blocks that can be read at random\n");
+    fprintf(stderr, "   --concurrent-futurebases N\n");
+    fprintf(stderr, "                         back propagate from up to N futurebases at once\n");
+    fprintf(stderr, "                         (default 4)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Additional GENERATING-OPTIONS for debugging are:\n");
     fprintf(stderr, "   -d INDEX              trace calculation of specified tablebase index\n");
@@ -16036,10 +19888,22 @@ void usage(char *program_name)
     fprintf(stderr, "   -n NALIMOV-PATH       sets path to find Nalimov tablebases\n");
 #endif
     fprintf(stderr, "   -S SYZYGY-PATH        sets path to find Syzygy tablebases\n");
+    fprintf(stderr, "   --block-cache MB      size of the cache of decompressed tablebase blocks\n");
+    fprintf(stderr, "                         shared by all threads (default 256; 0 disables)\n");
     fprintf(stderr, "   -h                    display this help message and exit\n");
 }
 
 struct option options[] = {{"compress-files", no_argument, NULL, 1},
+			   {"temp-dir", required_argument, NULL, 2},
+			   {"direct-io", no_argument, NULL, 3},
+			   {"resume", no_argument, NULL, 4},
+			   {"memory-budget", required_argument, NULL, 5},
+			   {"pawngen-slabs", required_argument, NULL, 6},
+			   {"seekable-output", no_argument, NULL, 7},
+			   {"block-cache", required_argument, NULL, 8},
+			   {"concurrent-futurebases", required_argument, NULL, 9},
+			   {"reformat", required_argument, NULL, 10},
+			   {"checkpoint", optional_argument, NULL, 11},
 			   {NULL, 0, NULL, 0}};
 
 int main(int argc, char *argv[])
@@ -16055,6 +19919,7 @@ int main(int argc, char *argv[])
     int summarize=0;
     int dump_info=0;
     std::string output_filename;
+    char *reformat_filename = nullptr;
     extern char *optarg;
     extern int optind;
     char *options_string_ptr = options_string;
@@ -16176,6 +20041,51 @@ int main(int argc, char *argv[])
 	    compress_proptables = true;
 	    compress_entries_table = true;
 	    break;
+	case 2:
+	    if (! parse_temporary_directory(optarg)) {
+		fatal("can't parse temporary directory %s\n", optarg);
+		terminate();
+	    }
+	    break;
+	case 3:
+	    use_direct_io = true;
+	    break;
+	case 4:
+	    resume_from_checkpoint = true;
+	    checkpointing = true;
+	    break;
+	case 5:
+	    memory_budget_MBs = strtol(optarg, nullptr, 0);
+	    break;
+	case 6:
+	    pawngen_slab_size = strtol(optarg, nullptr, 0);
+	    if (pawngen_slab_size <= 0) {
+		fatal("can't parse pawngen slab size %s\n", optarg);
+		terminate();
+	    }
+	    break;
+	case 7:
+	    seekable_output = true;
+	    break;
+	case 8:
+	    block_cache_MBs = strtol(optarg, nullptr, 0);
+	    break;
+	case 9:
+	    if (strtol(optarg, nullptr, 0) <= 0) {
+		fatal("can't parse number of concurrent futurebases %s\n", optarg);
+		terminate();
+	    }
+	    concurrent_futurebases = strtol(optarg, nullptr, 0);
+	    break;
+	case 10:
+	    reformat_filename = optarg;
+	    break;
+	case 11:
+	    checkpointing = true;
+	    if (optarg != nullptr) {
+		checkpoint_filename = std::string(optarg) + "/checkpoint.xml";
+	    }
+	    break;
 	case '?':
 	    terminate();
 	    break;
@@ -16189,7 +20099,18 @@ int main(int argc, char *argv[])
 	terminate();
     }
 
-    if (!generating && !probing && !verify && !dump_info && !summarize) {
+    if (! temporary_directories.empty()
+	&& ((temporary_directories[0].weight != 1) || (temporary_directories[0].capacity != 0))) {
+	warning("WEIGHT and MB are ignored for the first --temp-dir (%s)\n", temporary_directories[0].path.c_str());
+    }
+
+    if ((reformat_filename != nullptr) && (generating || probing)) {
+	fatal("Reformatting (--reformat) can't be combined with generating or probing\n");
+	usage(argv[0]);
+	terminate();
+    }
+
+    if (!generating && !probing && !verify && !dump_info && !summarize && (reformat_filename == nullptr)) {
 #if USE_NALIMOV
 	fatal("At least one of -g, -p, -i, -s, or -v must be specified\n");
 #else
@@ -16199,7 +20120,7 @@ int main(int argc, char *argv[])
 	terminate();
     }
 
-    if (!generating && ! output_filename.empty()) {
+    if (!generating && (reformat_filename == nullptr) && ! output_filename.empty()) {
 	fatal("An output filename can not be specified when probing or verifying\n");
 	usage(argv[0]);
 	terminate();
@@ -16230,6 +20151,13 @@ int main(int argc, char *argv[])
     init_nalimov_code();
 #endif
 
+    /* Reformatting */
+
+    if (reformat_filename != nullptr) {
+	reformat_tablebase(reformat_filename, argv[optind], output_filename);
+	terminate();
+    }
+
     /* Generating.
      *
      * We want to make sure we destroy any intermediate files instead of leaving them lying around
@@ -16240,6 +20168,11 @@ int main(int argc, char *argv[])
      * XXX verify_tablebase_internally needs to work with proptables
      */
 
+    if (generating && (pawngen_slab_size > 0)) {
+	generate_tablebase_by_slabs(argv[optind], output_filename, verify);
+	terminate();
+    }
+
     if (generating) {
 	try {
 	    bool success = generate_tablebase_from_control_file(argv[optind], output_filename);
@@ -79,14 +79,22 @@ extern int TB_FASTCALL L_TbtProbeTable(int, color, INDEX);
 #  define PfnIndCalc PfnIndCalcFun
 #  define FRegistered FRegisteredFun
 
-int EGTBProbe(int wtm, unsigned char board[64], int sqEnP, int *score)
+/*
+ *******************************************************************************
+ *                                                                             *
+ *  EGTBProbe() is split in two, so that a caller with many positions to look  *
+ *  up can compute all of their indices with EGTBIndex(), sort them, and then  *
+ *  probe them with EGTBProbeIndex() in the order they appear in the files.    *
+ *                                                                             *
+ *******************************************************************************
+ */
+
+int EGTBIndex(int wtm, unsigned char board[64], int sqEnP, int *pTb, int *pSide, INDEX *pInd)
 {
   int rgiCounters[10], iTb, fInvert;
   color side;
   squaret rgsqWhite[C_PIECES * 5 + 1], rgsqBlack[C_PIECES * 5 + 1];
   squaret *psqW, *psqB;
-  INDEX ind;
-  int tbValue;
   int square;
 
 /*
@@ -232,13 +240,22 @@ int EGTBProbe(int wtm, unsigned char board[64], int sqEnP, int *score)
   }
   if (sqEnP == -1) sqEnP = XX;
 
-  ind = PfnIndCalc(iTb, side) (psqW, psqB, sqEnP, fInvert);
+  *pTb = iTb;
+  *pSide = side;
+  *pInd = PfnIndCalc(iTb, side) (psqW, psqB, sqEnP, fInvert);
 #if 0
-  if (ind > 4) {
-    fprintf(stderr, "ind(%d) > 4\n",ind);
+  if (*pInd > 4) {
+    fprintf(stderr, "ind(%d) > 4\n",*pInd);
     return (0);
   }
 #endif
+  return (1);
+}
+
+int EGTBProbeIndex(int iTb, int side, INDEX ind, int *score)
+{
+  int tbValue;
+
   tbValue = L_TbtProbeTable(iTb, side, ind);
   if (bev_broken == tbValue) {
     /* fprintf(stderr, "bev_broken\n"); */
@@ -264,4 +281,15 @@ int EGTBProbe(int wtm, unsigned char board[64], int sqEnP, int *score)
 #endif
   return (1);
 }
+
+int EGTBProbe(int wtm, unsigned char board[64], int sqEnP, int *score)
+{
+  int iTb, side;
+  INDEX ind;
+
+  if (!EGTBIndex(wtm, board, sqEnP, &iTb, &side, &ind))
+    return (0);
+
+  return EGTBProbeIndex(iTb, side, ind, score);
+}
 #endif